@@ -26,7 +26,11 @@
 #include <math.h>
 
 #include "common/debug.h"
-#include "common/ringbuffer.h"
+#include "common/spscbuffer.h"
+#include "resampler.h"
+
+// capture in small quanta to keep the microphone latency down
+#define RECORD_QUANTUM_MS 5
 
 struct PipeWire
 {
@@ -37,8 +41,19 @@ struct PipeWire
   int    sampleRate;
   int    stride;
 
-  RingBuffer buffer;
-  bool       active;
+  SPSCBuffer  buffer;
+  Resampler * resampler;
+  bool        active;
+
+  struct
+  {
+    struct pw_stream * stream;
+    int                channels;
+    int                sampleRate;
+    int                stride;
+    LG_AudioPushFn     pushFn;
+  }
+  record;
 };
 
 static struct PipeWire pw = {0};
@@ -47,7 +62,9 @@ static void pipewire_on_process(void * userdata)
 {
   struct pw_buffer * pbuf;
 
-  if (!ringbuffer_getCount(pw.buffer))
+  SPSCBufferSpan span[2];
+  int frames = spscbuffer_peekRead(pw.buffer, span);
+  if (!frames)
     return;
 
   if (!(pbuf = pw_stream_dequeue_buffer(pw.stream))) {
@@ -61,9 +78,20 @@ static void pipewire_on_process(void * userdata)
   if (!(dst = sbuf->datas[0].data))
     return;
 
-  int frames = sbuf->datas[0].maxsize / pw.stride;
-  void * values = ringbuffer_consume(pw.buffer, &frames);
-  memcpy(dst, values, frames * pw.stride);
+  const int maxFrames = sbuf->datas[0].maxsize / pw.stride;
+  if (frames > maxFrames)
+    frames = maxFrames;
+
+  // copy straight out of the ring, it may wrap so there can be two runs
+  const int first = frames < span[0].count ? frames : span[0].count;
+  memcpy(dst, span[0].values, first * pw.stride);
+  if (frames > first)
+    memcpy(dst + first * pw.stride, span[1].values,
+        (frames - first) * pw.stride);
+  spscbuffer_commitRead(pw.buffer, frames);
+
+  // what was just handed over plays out over the next period
+  resampler_setDeviceLatency(pw.resampler, frames * 1000.0 / pw.sampleRate);
 
   sbuf->datas[0].chunk->offset = 0;
   sbuf->datas[0].chunk->stride = pw.stride;
@@ -123,9 +151,21 @@ static void pipewire_stop_stream(void)
   pw_thread_loop_unlock(pw.thread);
 }
 
+static void pipewire_recordStopStream(void)
+{
+  if (!pw.record.stream)
+    return;
+
+  pw_thread_loop_lock(pw.thread);
+  pw_stream_destroy(pw.record.stream);
+  pw.record.stream = NULL;
+  pw_thread_loop_unlock(pw.thread);
+}
+
 static void pipewire_free(void)
 {
   pipewire_stop_stream();
+  pipewire_recordStopStream();
   pw_thread_loop_stop(pw.thread);
   pw_thread_loop_destroy(pw.thread);
   pw_loop_destroy(pw.loop);
@@ -133,7 +173,8 @@ static void pipewire_free(void)
   pw.loop   = NULL;
   pw.thread = NULL;
 
-  ringbuffer_free(&pw.buffer);
+  spscbuffer_free(&pw.buffer);
+  resampler_free(&pw.resampler);
   pw_deinit();
 }
 
@@ -156,7 +197,19 @@ static void pipewire_start(int channels, int sampleRate)
   pw.channels   = channels;
   pw.sampleRate = sampleRate;
   pw.stride     = sizeof(uint16_t) * channels;
-  pw.buffer     = ringbuffer_new(sampleRate / 10, channels * sizeof(uint16_t));
+
+  resampler_free(&pw.resampler);
+  if (!resampler_new(&pw.resampler, channels, sampleRate))
+    return;
+
+  // leave room for the target latency plus a few periods on top of it
+  int bufferLen = resampler_getMaxTarget(pw.resampler) * 2;
+  if (bufferLen < sampleRate / 10)
+    bufferLen = sampleRate / 10;
+
+  // the stream is gone so the realtime thread no longer holds the buffer
+  spscbuffer_free(&pw.buffer);
+  pw.buffer     = spscbuffer_new(bufferLen, channels * sizeof(uint16_t));
 
   pw_thread_loop_lock(pw.thread);
   pw.stream = pw_stream_new_simple(
@@ -205,21 +258,12 @@ static void pipewire_play(uint8_t * data, int size)
   if (!pw.stream)
     return;
 
-  // if the buffer fill is higher then the average skip the update to reduce lag
-  static unsigned int ttlSize = 0;
-  static unsigned int count   = 0;
-  ttlSize += size;
-  if (++count > 100 && ringbuffer_getCount(pw.buffer) > ttlSize / count)
-  {
-    count   = 0;
-    ttlSize = 0;
-    return;
-  }
-
-  ringbuffer_append(pw.buffer, data, size / pw.stride);
+  resampler_write(pw.resampler, pw.buffer, (const int16_t *)data,
+      size / pw.stride);
 
   if (!pw.active)
   {
+    resampler_reset(pw.resampler);
     pw_thread_loop_lock(pw.thread);
     pw_stream_set_active(pw.stream, true);
     pw.active = true;
@@ -238,6 +282,11 @@ static void pipewire_stop(void)
   pw_thread_loop_unlock(pw.thread);
 }
 
+static float pipewire_linearVolume(uint16_t volume)
+{
+  return 9.3234e-7 * pow(1.000211902, volume) - 0.000172787;
+}
+
 static void pipewire_volume(int channels, const uint16_t volume[])
 {
   if (channels != pw.channels)
@@ -245,7 +294,7 @@ static void pipewire_volume(int channels, const uint16_t volume[])
 
   float param[channels];
   for(int i = 0; i < channels; ++i)
-    param[i] = 9.3234e-7 * pow(1.000211902, volume[i]) - 0.000172787;
+    param[i] = pipewire_linearVolume(volume[i]);
 
   pw_thread_loop_lock(pw.thread);
   pw_stream_set_control(pw.stream, SPA_PROP_channelVolumes, channels, param, 0);
@@ -259,14 +308,147 @@ static void pipewire_mute(bool mute)
   pw_thread_loop_unlock(pw.thread);
 }
 
+static void pipewire_on_record_process(void * userdata)
+{
+  struct pw_buffer * pbuf;
+
+  if (!(pbuf = pw_stream_dequeue_buffer(pw.record.stream)))
+  {
+    DEBUG_WARN("out of buffers");
+    return;
+  }
+
+  struct spa_buffer * sbuf = pbuf->buffer;
+  uint8_t * data = sbuf->datas[0].data;
+  if (data)
+  {
+    const uint32_t offset = SPA_MIN(sbuf->datas[0].chunk->offset,
+        sbuf->datas[0].maxsize);
+    const uint32_t size   = SPA_MIN(sbuf->datas[0].chunk->size,
+        sbuf->datas[0].maxsize - offset);
+
+    pw.record.pushFn(data + offset, size / pw.record.stride);
+  }
+
+  pw_stream_queue_buffer(pw.record.stream, pbuf);
+}
+
+static void pipewire_recordStart(int channels, int sampleRate,
+    LG_AudioPushFn pushFn)
+{
+  const struct spa_pod * params[1];
+  uint8_t buffer[1024];
+  struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+  static const struct pw_stream_events events =
+  {
+    .version = PW_VERSION_STREAM_EVENTS,
+    .process = pipewire_on_record_process
+  };
+
+  if (pw.record.stream &&
+      pw.record.channels   == channels   &&
+      pw.record.sampleRate == sampleRate &&
+      pw.record.pushFn     == pushFn)
+    return;
+
+  pipewire_recordStopStream();
+
+  pw.record.channels   = channels;
+  pw.record.sampleRate = sampleRate;
+  pw.record.stride     = sizeof(uint16_t) * channels;
+  pw.record.pushFn     = pushFn;
+
+  struct pw_properties * props =
+    pw_properties_new(
+      PW_KEY_NODE_NAME     , "Looking Glass",
+      PW_KEY_MEDIA_TYPE    , "Audio",
+      PW_KEY_MEDIA_CATEGORY, "Capture",
+      PW_KEY_MEDIA_ROLE    , "Communication",
+      NULL
+    );
+
+  // ask for a small fixed quantum rather than the graph's default
+  pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%d",
+      sampleRate * RECORD_QUANTUM_MS / 1000, sampleRate);
+
+  pw_thread_loop_lock(pw.thread);
+  pw.record.stream = pw_stream_new_simple(
+    pw.loop,
+    "Looking Glass",
+    props,
+    &events,
+    NULL
+  );
+
+  if (!pw.record.stream)
+  {
+    pw_thread_loop_unlock(pw.thread);
+    DEBUG_ERROR("Failed to create the record stream");
+    return;
+  }
+
+  params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
+      &SPA_AUDIO_INFO_RAW_INIT(
+        .format   = SPA_AUDIO_FORMAT_S16,
+        .channels = channels,
+        .rate     = sampleRate
+        ));
+
+  pw_stream_connect(
+      pw.record.stream,
+      PW_DIRECTION_INPUT,
+      PW_ID_ANY,
+      PW_STREAM_FLAG_AUTOCONNECT |
+      PW_STREAM_FLAG_MAP_BUFFERS |
+      PW_STREAM_FLAG_RT_PROCESS,
+      params, 1);
+
+  pw_thread_loop_unlock(pw.thread);
+}
+
+static void pipewire_recordStop(void)
+{
+  pipewire_recordStopStream();
+}
+
+static void pipewire_recordVolume(int channels, const uint16_t volume[])
+{
+  if (!pw.record.stream || channels != pw.record.channels)
+    return;
+
+  float param[channels];
+  for(int i = 0; i < channels; ++i)
+    param[i] = pipewire_linearVolume(volume[i]);
+
+  pw_thread_loop_lock(pw.thread);
+  pw_stream_set_control(pw.record.stream, SPA_PROP_channelVolumes, channels,
+      param, 0);
+  pw_thread_loop_unlock(pw.thread);
+}
+
+static void pipewire_recordMute(bool mute)
+{
+  if (!pw.record.stream)
+    return;
+
+  const float val = mute ? 1.0f : 0.0f;
+  pw_thread_loop_lock(pw.thread);
+  pw_stream_set_control(pw.record.stream, SPA_PROP_mute, 1, (void *)&val, 0);
+  pw_thread_loop_unlock(pw.thread);
+}
+
 struct LG_AudioDevOps LGAD_PipeWire =
 {
-  .name   = "PipeWire",
-  .init   = pipewire_init,
-  .free   = pipewire_free,
-  .start  = pipewire_start,
-  .play   = pipewire_play,
-  .stop   = pipewire_stop,
-  .volume = pipewire_volume,
-  .mute   = pipewire_mute
+  .name         = "PipeWire",
+  .init         = pipewire_init,
+  .free         = pipewire_free,
+  .start        = pipewire_start,
+  .play         = pipewire_play,
+  .stop         = pipewire_stop,
+  .volume       = pipewire_volume,
+  .mute         = pipewire_mute,
+  .recordStart  = pipewire_recordStart,
+  .recordStop   = pipewire_recordStop,
+  .recordVolume = pipewire_recordVolume,
+  .recordMute   = pipewire_recordMute
 };
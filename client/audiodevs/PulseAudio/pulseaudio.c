@@ -25,7 +25,11 @@
 #include <math.h>
 
 #include "common/debug.h"
-#include "common/ringbuffer.h"
+#include "common/spscbuffer.h"
+#include "resampler.h"
+
+// capture in small fragments to keep the microphone latency down
+#define RECORD_QUANTUM_MS 5
 
 struct PulseAudio
 {
@@ -42,7 +46,14 @@ struct PulseAudio
   int                    sinkSampleRate;
   int                    sinkChannels;
   int                    sinkStride;
-  RingBuffer             sinkBuffer;
+  SPSCBuffer             sinkBuffer;
+  Resampler            * resampler;
+
+  pa_stream            * source;
+  int                    sourceChannels;
+  int                    sourceSampleRate;
+  int                    sourceStride;
+  LG_AudioPushFn         sourcePush;
 };
 
 static struct PulseAudio pa = {0};
@@ -199,11 +210,25 @@ static void pulseaudio_sink_close_nl()
   pa.sink = NULL;
 }
 
+static void pulseaudio_source_close_nl(void)
+{
+  if (!pa.source)
+    return;
+
+  pa_stream_set_read_callback(pa.source, NULL, NULL);
+  pa_stream_disconnect(pa.source);
+  pa_stream_unref(pa.source);
+  pa.source = NULL;
+}
+
 static void pulseaudio_free(void)
 {
   pa_threaded_mainloop_lock(pa.loop);
 
   pulseaudio_sink_close_nl();
+  pulseaudio_source_close_nl();
+  spscbuffer_free(&pa.sinkBuffer);
+  resampler_free(&pa.resampler);
 
   pa_context_set_state_callback(pa.context, NULL, NULL);
   pa_context_set_subscribe_callback(pa.context, NULL, NULL);
@@ -225,10 +250,19 @@ static void pulseaudio_write_cb(pa_stream * p, size_t nbytes, void * userdata)
 
   pa_stream_begin_write(p, (void **)&dst, &nbytes);
 
-  int frames    = nbytes / pa.sinkStride;
-  void * values = ringbuffer_consume(pa.sinkBuffer, &frames);
+  SPSCBufferSpan span[2];
+  int frames = spscbuffer_peekRead(pa.sinkBuffer, span);
+  if (frames > (int)(nbytes / pa.sinkStride))
+    frames = nbytes / pa.sinkStride;
+
+  // copy straight out of the ring, it may wrap so there can be two runs
+  const int first = frames < span[0].count ? frames : span[0].count;
+  memcpy(dst, span[0].values, first * pa.sinkStride);
+  if (frames > first)
+    memcpy(dst + first * pa.sinkStride, span[1].values,
+        (frames - first) * pa.sinkStride);
+  spscbuffer_commitRead(pa.sinkBuffer, frames);
 
-  memcpy(dst, values, frames * pa.sinkStride);
   pa_stream_write(p, dst, frames * pa.sinkStride, NULL, 0, PA_SEEK_RELATIVE);
 }
 
@@ -282,7 +316,23 @@ static void pulseaudio_start(int channels, int sampleRate)
 
   pa.sinkStride = channels * sizeof(uint16_t);
   pa.sinkStart  = attribs.tlength / pa.sinkStride;
-  pa.sinkBuffer = ringbuffer_new(pa.sinkStart * 2, pa.sinkStride);
+
+  resampler_free(&pa.resampler);
+  resampler_new(&pa.resampler, channels, sampleRate);
+
+  // leave room for the target latency plus a few periods on top of it
+  int bufferLen = pa.sinkStart * 2;
+  if (pa.resampler)
+  {
+    if (bufferLen < resampler_getMaxTarget(pa.resampler) * 2)
+      bufferLen = resampler_getMaxTarget(pa.resampler) * 2;
+
+    // the server holds on to tlength before it is played
+    resampler_setDeviceLatency(pa.resampler, PERIOD_LEN);
+  }
+
+  spscbuffer_free(&pa.sinkBuffer);
+  pa.sinkBuffer = spscbuffer_new(bufferLen, pa.sinkStride);
   pa.sinkCorked = true;
 
   pa_threaded_mainloop_unlock(pa.loop);
@@ -290,13 +340,15 @@ static void pulseaudio_start(int channels, int sampleRate)
 
 static void pulseaudio_play(uint8_t * data, int size)
 {
-  if (!pa.sink)
+  if (!pa.sink || !pa.resampler)
     return;
 
-  ringbuffer_append(pa.sinkBuffer, data, size / pa.sinkStride);
+  resampler_write(pa.resampler, pa.sinkBuffer, (const int16_t *)data,
+      size / pa.sinkStride);
 
-  if (pa.sinkCorked && ringbuffer_getCount(pa.sinkBuffer) >= pa.sinkStart)
+  if (pa.sinkCorked && spscbuffer_getCount(pa.sinkBuffer) >= pa.sinkStart)
   {
+    resampler_reset(pa.resampler);
     pa_threaded_mainloop_lock(pa.loop);
     pa_stream_cork(pa.sink, 0, NULL, NULL);
     pa.sinkCorked = false;
@@ -315,15 +367,22 @@ static void pulseaudio_stop(void)
   pa_threaded_mainloop_unlock(pa.loop);
 }
 
+static void pulseaudio_makeVolume(struct pa_cvolume * v, int channels,
+    const uint16_t volume[])
+{
+  v->channels = channels;
+  for(int i = 0; i < channels; ++i)
+    v->values[i] = pa_sw_volume_from_linear(
+      9.3234e-7 * pow(1.000211902, volume[i]) - 0.000172787);
+}
+
 static void pulseaudio_volume(int channels, const uint16_t volume[])
 {
   if (!pa.sink || !pa.sinkIndex)
     return;
 
-  struct pa_cvolume v = { .channels = channels };
-  for(int i = 0; i < channels; ++i)
-    v.values[i] = pa_sw_volume_from_linear(
-      9.3234e-7 * pow(1.000211902, volume[i]) - 0.000172787);
+  struct pa_cvolume v;
+  pulseaudio_makeVolume(&v, channels, volume);
 
   pa_threaded_mainloop_lock(pa.loop);
   pa_context_set_sink_input_volume(pa.context, pa.sinkIndex, &v, NULL, NULL);
@@ -341,14 +400,106 @@ static void pulseaudio_mute(bool mute)
   pa_threaded_mainloop_unlock(pa.loop);
 }
 
+static void pulseaudio_read_cb(pa_stream * p, size_t nbytes, void * userdata)
+{
+  const void * data;
+  while(pa_stream_readable_size(p) > 0)
+  {
+    if (pa_stream_peek(p, &data, &nbytes) < 0 || !nbytes)
+      return;
+
+    // a NULL pointer with a size is a hole in the stream
+    if (data)
+      pa.sourcePush((uint8_t *)data, nbytes / pa.sourceStride);
+
+    pa_stream_drop(p);
+  }
+}
+
+static void pulseaudio_recordStart(int channels, int sampleRate,
+    LG_AudioPushFn pushFn)
+{
+  if (pa.source && pa.sourceChannels == channels &&
+      pa.sourceSampleRate == sampleRate && pa.sourcePush == pushFn)
+    return;
+
+  pa_sample_spec spec = {
+    .format   = PA_SAMPLE_S16LE,
+    .rate     = sampleRate,
+    .channels = channels
+  };
+
+  pa_buffer_attr attribs =
+  {
+    .maxlength = (uint32_t)-1,
+    .tlength   = (uint32_t)-1,
+    .prebuf    = (uint32_t)-1,
+    .minreq    = (uint32_t)-1,
+    .fragsize  = pa_usec_to_bytes(RECORD_QUANTUM_MS * PA_USEC_PER_MSEC, &spec)
+  };
+
+  pa_threaded_mainloop_lock(pa.loop);
+  pulseaudio_source_close_nl();
+
+  pa.sourceChannels   = channels;
+  pa.sourceSampleRate = sampleRate;
+  pa.sourceStride     = channels * sizeof(uint16_t);
+  pa.sourcePush       = pushFn;
+
+  pa.source = pa_stream_new(pa.context, "Looking Glass", &spec, NULL);
+  pa_stream_set_read_callback(pa.source, pulseaudio_read_cb, NULL);
+  pa_stream_connect_record(pa.source, NULL, &attribs,
+      PA_STREAM_ADJUST_LATENCY);
+
+  pa_threaded_mainloop_unlock(pa.loop);
+}
+
+static void pulseaudio_recordStop(void)
+{
+  pa_threaded_mainloop_lock(pa.loop);
+  pulseaudio_source_close_nl();
+  pa_threaded_mainloop_unlock(pa.loop);
+}
+
+static void pulseaudio_recordVolume(int channels, const uint16_t volume[])
+{
+  if (!pa.source)
+    return;
+
+  struct pa_cvolume v;
+  pulseaudio_makeVolume(&v, channels, volume);
+
+  pa_threaded_mainloop_lock(pa.loop);
+  const uint32_t index = pa_stream_get_index(pa.source);
+  if (index != PA_INVALID_INDEX)
+    pa_context_set_source_output_volume(pa.context, index, &v, NULL, NULL);
+  pa_threaded_mainloop_unlock(pa.loop);
+}
+
+static void pulseaudio_recordMute(bool mute)
+{
+  if (!pa.source)
+    return;
+
+  pa_threaded_mainloop_lock(pa.loop);
+  const uint32_t index = pa_stream_get_index(pa.source);
+  if (index != PA_INVALID_INDEX)
+    pa_context_set_source_output_mute(pa.context, index, mute, NULL, NULL);
+  pa_threaded_mainloop_unlock(pa.loop);
+}
+
 struct LG_AudioDevOps LGAD_PulseAudio =
 {
-  .name   = "PulseAudio",
-  .init   = pulseaudio_init,
-  .free   = pulseaudio_free,
-  .start  = pulseaudio_start,
-  .play   = pulseaudio_play,
-  .stop   = pulseaudio_stop,
-  .volume = pulseaudio_volume,
-  .mute   = pulseaudio_mute
+  .name         = "PulseAudio",
+  .init         = pulseaudio_init,
+  .free         = pulseaudio_free,
+  .start        = pulseaudio_start,
+  .play         = pulseaudio_play,
+  .stop         = pulseaudio_stop,
+  .volume       = pulseaudio_volume,
+  .mute         = pulseaudio_mute,
+  .recordStart  = pulseaudio_recordStart,
+  .recordStop   = pulseaudio_recordStop,
+  .recordVolume = pulseaudio_recordVolume,
+  .recordMute   = pulseaudio_recordMute
 };
@@ -49,6 +49,12 @@ void app_updateWindowPos(int x, int y);
 void app_handleResizeEvent(int w, int h, double scale, const struct Border border);
 void app_invalidateWindow(bool full);
 
+/**
+ * Report that the host truncated a compressed frame as the IVSHMEM is too small
+ * for it, the user is alerted from the frame thread
+ */
+void app_frameTruncated(void);
+
 void app_handleMouseRelative(double normx, double normy,
     double rawx, double rawy);
 
@@ -32,6 +32,9 @@ struct GLDynProcs
   PFNGLBUFFERDATAPROC     glBufferData;
   PFNGLBUFFERSUBDATAPROC  glBufferSubData;
   PFNGLDELETEBUFFERSPROC  glDeleteBuffers;
+  PFNGLBUFFERSTORAGEPROC  glBufferStorage;
+  PFNGLMAPBUFFERRANGEPROC glMapBufferRange;
+  PFNGLUNMAPBUFFERPROC    glUnmapBuffer;
   PFNGLISSYNCPROC         glIsSync;
   PFNGLFENCESYNCPROC      glFenceSync;
   PFNGLCLIENTWAITSYNCPROC glClientWaitSync;
@@ -24,6 +24,11 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+/* called from the audio server's capture thread with each quantum of recorded
+ * audio, this is realtime safe and will never block
+ * Note: frames is the number of frames, not bytes */
+typedef void (*LG_AudioPushFn)(uint8_t * data, int frames);
+
 struct LG_AudioDevOps
 {
   /* internal name of the audio for debugging */
@@ -56,6 +61,22 @@ struct LG_AudioDevOps
 
   /* [optional] called to set muting of the output */
   void (*mute)(bool mute);
+
+  /* [optional] start capturing audio, recorded audio is passed to pushFn in
+   * small fixed size quanta to keep the capture latency low
+   * Note: as with playback only S16 samples are supported
+   */
+  void (*recordStart)(int channels, int sampleRate, LG_AudioPushFn pushFn);
+
+  /* [optional] called when SPICE reports the record stream has stopped,
+   * required if recordStart is provided */
+  void (*recordStop)(void);
+
+  /* [optional] called to set the volume of the capture channels */
+  void (*recordVolume)(int channels, const uint16_t volume[]);
+
+  /* [optional] called to set muting of the capture */
+  void (*recordMute)(bool mute);
 };
 
 #define ASSERT_LG_AUDIODEV_VALID(x) \
@@ -64,6 +85,7 @@ struct LG_AudioDevOps
   DEBUG_ASSERT((x)->free  ); \
   DEBUG_ASSERT((x)->start ); \
   DEBUG_ASSERT((x)->play  ); \
-  DEBUG_ASSERT((x)->stop  );
+  DEBUG_ASSERT((x)->stop  ); \
+  DEBUG_ASSERT(!(x)->recordStart || (x)->recordStop);
 
 #endif
@@ -66,13 +66,15 @@ LG_RendererRotate;
 
 typedef struct LG_RendererFormat
 {
-  FrameType         type;    // frame type
-  unsigned int      width;   // image width
-  unsigned int      height;  // image height
-  unsigned int      stride;  // scanline width (zero if compresed)
-  unsigned int      pitch;   // scanline bytes (or compressed size)
-  unsigned int      bpp;     // bits per pixel (zero if compressed)
-  LG_RendererRotate rotate;  // guest rotation
+  FrameType         type;       // frame type (after decompression)
+  bool              compressed; // frames are LZ4 compressed (framebuffer_read_lz4)
+  FrameTransfer     transfer;   // the transfer function of the pixel data
+  unsigned int      width;      // image width
+  unsigned int      height;     // image height
+  unsigned int      stride;     // scanline width
+  unsigned int      pitch;      // scanline bytes
+  unsigned int      bpp;        // bits per pixel
+  LG_RendererRotate rotate;     // guest rotation
 }
 LG_RendererFormat;
 
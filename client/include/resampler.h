@@ -0,0 +1,60 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_RESAMPLER_
+#define _H_LG_RESAMPLER_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/spscbuffer.h"
+
+/* A fractional resampler for interleaved S16 audio that compensates for the
+ * drift between the guest and local audio clocks.
+ *
+ * The playback rate is steered by a PI controller that holds the number of
+ * frames waiting in the audiodev's buffer at the configured target latency
+ * (audio:targetLatency) instead of dropping packets or letting it grow. When
+ * A/V sync is enabled the target is raised to hold the audio back to meet the
+ * video. */
+
+typedef struct Resampler Resampler;
+
+bool resampler_new(Resampler ** rs, int channels, int sampleRate);
+void resampler_free(Resampler ** rs);
+
+/* the most frames the controller will try to keep buffered, including any
+ * delay added to keep the audio in sync with the video */
+int resampler_getMaxTarget(const Resampler * rs);
+
+/* the latency of the audio server after the audio leaves the buffer, used to
+ * line the audio up with the video. This may be called from any thread */
+void resampler_setDeviceLatency(Resampler * rs, double ms);
+
+/* forget the controller state, call when the consumer (re)starts as the
+ * buffer will have filled while it was stopped */
+void resampler_reset(Resampler * rs);
+
+/* resamples frames of S16 audio from data into buffer, buffer must only be
+ * consumed from the audiodev's playback callback */
+void resampler_write(Resampler * rs, SPSCBuffer buffer, const int16_t * data,
+    int frames);
+
+#endif
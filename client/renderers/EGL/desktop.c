@@ -49,6 +49,7 @@ struct DesktopShader
   GLint uScaleAlgo;
   GLint uNVGain;
   GLint uCBMode;
+  GLint uTransfer;
 };
 
 struct EGL_Desktop
@@ -107,6 +108,7 @@ static bool egl_initDesktopShader(
   shader->uScaleAlgo   = egl_shaderGetUniform(shader->shader, "scaleAlgo"  );
   shader->uNVGain      = egl_shaderGetUniform(shader->shader, "nvGain"     );
   shader->uCBMode      = egl_shaderGetUniform(shader->shader, "cbMode"     );
+  shader->uTransfer    = egl_shaderGetUniform(shader->shader, "transfer"   );
 
   return true;
 }
@@ -304,6 +306,28 @@ bool egl_desktopSetup(EGL_Desktop * desktop, const LG_RendererFormat format)
   return true;
 }
 
+static bool egl_desktopDisableDMA(EGL_Desktop * desktop)
+{
+  desktop->useDMA = false;
+
+  const char * gl_exts = (const char *)glGetString(GL_EXTENSIONS);
+  if (!util_hasGLExt(gl_exts, "GL_EXT_buffer_storage"))
+  {
+    DEBUG_ERROR("GL_EXT_buffer_storage is needed to use EGL backend");
+    return false;
+  }
+
+  egl_textureFree(&desktop->texture);
+  if (!egl_textureInit(&desktop->texture, desktop->display,
+        EGL_TEXTYPE_FRAMEBUFFER, true))
+  {
+    DEBUG_ERROR("Failed to initialize the desktop texture");
+    return false;
+  }
+
+  return egl_desktopSetup(desktop, desktop->format);
+}
+
 bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dmaFd,
     const FrameDamageRect * damageRects, int damageRectsCount)
 {
@@ -324,29 +348,19 @@ bool egl_desktopUpdate(EGL_Desktop * desktop, const FrameBuffer * frame, int dma
       DEBUG_WARN("This is not a bug in Looking Glass");
     }
 
-    desktop->useDMA = false;
-
-    const char * gl_exts = (const char *)glGetString(GL_EXTENSIONS);
-    if (!util_hasGLExt(gl_exts, "GL_EXT_buffer_storage"))
-    {
-      DEBUG_ERROR("GL_EXT_buffer_storage is needed to use EGL backend");
+    if (!egl_desktopDisableDMA(desktop))
       return false;
-    }
-
-    egl_textureFree(&desktop->texture);
-    if (!egl_textureInit(&desktop->texture, desktop->display,
-          EGL_TEXTYPE_FRAMEBUFFER, true))
-    {
-      DEBUG_ERROR("Failed to initialize the desktop texture");
-      return false;
-    }
-
-    if (!egl_desktopSetup(desktop, desktop->format))
+  }
+  else if (desktop->useDMA)
+  {
+    // compressed and sparse frames have to be rebuilt by the CPU
+    DEBUG_INFO("Frames can not be imported, disabling DMABUF imports");
+    if (!egl_desktopDisableDMA(desktop))
       return false;
   }
 
   if (egl_textureUpdateFromFrame(desktop->texture, frame,
-        damageRects, damageRectsCount))
+        desktop->format.compressed, damageRects, damageRectsCount))
   {
     atomic_store(&desktop->processFrame, true);
     return true;
@@ -448,6 +462,11 @@ bool egl_desktopRender(EGL_Desktop * desktop, unsigned int outputWidth,
       .type        = EGL_UNIFORM_TYPE_1I,
       .location    = shader->uCBMode,
       .f           = { desktop->cbMode }
+    },
+    {
+      .type        = EGL_UNIFORM_TYPE_1I,
+      .location    = shader->uTransfer,
+      .i           = { desktop->format.transfer }
     }
   };
 
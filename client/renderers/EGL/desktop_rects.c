@@ -22,6 +22,7 @@
 #include "common/debug.h"
 #include "common/KVMFR.h"
 #include "common/locking.h"
+#include "common/region.h"
 
 #include <math.h>
 #include <stdlib.h>
@@ -36,6 +37,10 @@ struct EGL_DesktopRects
   GLuint  vao;
   int     count;
   int     maxCount;
+
+  // used to turn the damage into disjoint rects so no pixel is drawn twice
+  LGRegion          region;
+  FrameDamageRect * rects;
 };
 
 bool egl_desktopRectsInit(EGL_DesktopRects ** rects_, int maxCount)
@@ -49,6 +54,18 @@ bool egl_desktopRectsInit(EGL_DesktopRects ** rects_, int maxCount)
   *rects_ = rects;
   memset(rects, 0, sizeof(*rects));
 
+  rects->region = region_new();
+  rects->rects  = malloc(maxCount * sizeof(*rects->rects));
+  if (!rects->region || !rects->rects)
+  {
+    DEBUG_ERROR("Failed to allocate the damage region");
+    region_free(&rects->region);
+    free(rects->rects);
+    free(rects);
+    *rects_ = NULL;
+    return false;
+  }
+
   glGenVertexArrays(1, &rects->vao);
   glBindVertexArray(rects->vao);
 
@@ -88,6 +105,8 @@ void egl_desktopRectsFree(EGL_DesktopRects ** rects_)
 
   glDeleteVertexArrays(1, &rects->vao);
   glDeleteBuffers(2, rects->buffers);
+  region_free(&rects->region);
+  free(rects->rects);
   free(rects);
   *rects_ = NULL;
 }
@@ -113,7 +132,7 @@ void egl_desktopRectsUpdate(EGL_DesktopRects * rects, const struct DamageRects *
     return;
   }
 
-  GLfloat vertices[(!data || data->count < 0 ? 1 : data->count) * 8];
+  GLfloat vertices[(!data || data->count < 0 ? 1 : rects->maxCount) * 8];
   if (!data || data->count < 0)
   {
     FrameDamageRect full = {
@@ -124,11 +143,20 @@ void egl_desktopRectsUpdate(EGL_DesktopRects * rects, const struct DamageRects *
   }
   else
   {
-    rects->count = data->count;
-    DEBUG_ASSERT(rects->count <= rects->maxCount);
+    DEBUG_ASSERT(data->count <= rects->maxCount);
+
+    region_clear(rects->region);
+    if (region_addRects(rects->region, data->rects, data->count))
+      rects->count = region_toRects(rects->region, rects->rects,
+          rects->maxCount, &REGION_COST_DRAW);
+    else
+    {
+      rects->count = data->count;
+      memcpy(rects->rects, data->rects, data->count * sizeof(*rects->rects));
+    }
 
     for (int i = 0; i < rects->count; ++i)
-      rectToVertices(vertices + i * 8, data->rects + i);
+      rectToVertices(vertices + i * 8, rects->rects + i);
   }
 
   glBindBuffer(GL_ARRAY_BUFFER, rects->buffers[0]);
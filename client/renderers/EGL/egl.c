@@ -121,6 +121,7 @@ struct Inst
   struct Rect  overlayHistory[DESKTOP_DAMAGE_COUNT][MAX_OVERLAY_RECTS + 1];
   int          overlayHistoryCount[DESKTOP_DAMAGE_COUNT];
   unsigned int overlayHistoryIdx;
+  LGRegion     damageRegion; // scratch for merging the accumulated damage
 
   RingBuffer importTimings;
   GraphHandle importGraph;
@@ -256,6 +257,7 @@ static bool egl_create(LG_Renderer ** renderer, const LG_RendererParams params,
 
   LG_LOCK_INIT(this->desktopDamageLock);
   this->desktopDamage[0].count = -1;
+  this->damageRegion = region_new();
 
   this->importTimings = ringbuffer_new(256, sizeof(float));
   this->importGraph   = app_registerGraph("IMPORT", this->importTimings, 0.0f, 5.0f);
@@ -286,8 +288,8 @@ static void egl_deinitialize(LG_Renderer * renderer)
   egl_splashFree (&this->splash);
   egl_damageFree (&this->damage);
 
-  LG_LOCK_FREE(this->lock);
   LG_LOCK_FREE(this->desktopDamageLock);
+  region_free(&this->damageRegion);
 
   eglMakeCurrent(this->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 
@@ -1075,7 +1077,8 @@ static bool egl_render(LG_Renderer * renderer, LG_RendererRotate rotate,
         );
     }
 
-    accumulated->count = rectsMergeOverlapping(accumulated->rects, accumulated->count);
+    accumulated->count = rectsMergeOverlapping(accumulated->rects,
+        accumulated->count, this->damageRegion);
   }
   ++this->overlayHistoryIdx;
 
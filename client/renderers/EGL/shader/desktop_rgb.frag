@@ -6,6 +6,8 @@ precision mediump float;
 #define EGL_SCALE_LINEAR  2
 #define EGL_SCALE_MAX     3
 
+#define FRAME_TRANSFER_PQ 1
+
 #include "color_blind.h"
 
 in  vec2 uv;
@@ -17,6 +19,27 @@ uniform int   scaleAlgo;
 
 uniform float nvGain;
 uniform int   cbMode;
+uniform int   transfer;
+
+// decode SMPTE ST 2084 (PQ) with BT.2020 primaries to scRGB as the host would
+// have sent it unconverted, where 1.0 is 80 nits
+vec3 pqToScRGB(highp vec3 pq)
+{
+  const highp float m1 = 0.1593017578125;
+  const highp float m2 = 78.84375;
+  const highp float c1 = 0.8359375;
+  const highp float c2 = 18.8515625;
+  const highp float c3 = 18.6875;
+
+  const highp mat3 bt2020to709 = mat3(
+     1.6604910, -0.1245505, -0.0181508,
+    -0.5876411,  1.1328999, -0.1005789,
+    -0.0728499, -0.0083494,  1.1187297);
+
+  highp vec3 p = pow(pq, vec3(1.0 / m2));
+  highp vec3 l = pow(max(p - c1, 0.0) / (c2 - c3 * p), vec3(1.0 / m1));
+  return bt2020to709 * (l * 125.0);
+}
 
 void main()
 {
@@ -32,6 +55,9 @@ void main()
       break;
   }
 
+  if (transfer == FRAME_TRANSFER_PQ)
+    color.rgb = pqToScRGB(color.rgb);
+
   if (cbMode > 0)
     color = cbTransform(color, cbMode);
 
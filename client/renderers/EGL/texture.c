@@ -115,15 +115,16 @@ bool egl_textureUpdate(EGL_Texture * this, const uint8_t * buffer)
 }
 
 bool egl_textureUpdateFromFrame(EGL_Texture * this,
-    const FrameBuffer * frame, const FrameDamageRect * damageRects,
-    int damageRectsCount)
+    const FrameBuffer * frame, bool compressed,
+    const FrameDamageRect * damageRects, int damageRectsCount)
 {
   const struct EGL_TexUpdate update =
   {
-    .type      = EGL_TEXTYPE_FRAMEBUFFER,
-    .frame     = frame,
-    .rects     = damageRects,
-    .rectCount = damageRectsCount,
+    .type       = EGL_TEXTYPE_FRAMEBUFFER,
+    .frame      = frame,
+    .compressed = compressed,
+    .rects      = damageRects,
+    .rectCount  = damageRectsCount,
   };
 
   return this->ops.update(this, &update);
@@ -134,8 +135,9 @@ bool egl_textureUpdateFromDMA(EGL_Texture * this,
 {
   const struct EGL_TexUpdate update =
   {
-    .type  = EGL_TEXTYPE_DMABUF,
-    .dmaFD = dmaFd
+    .type     = EGL_TEXTYPE_DMABUF,
+    .dmaFD    = dmaFd,
+    .dmaFrame = frame
   };
 
   /* wait for completion */
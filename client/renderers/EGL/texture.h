@@ -52,12 +52,17 @@ typedef struct EGL_TexUpdate
     struct
     {
       const FrameBuffer * frame;
+      bool compressed;
       const FrameDamageRect * rects;
       int rectCount;
     };
 
     /* EGL_TEXTURE_DMABUF */
-    int dmaFD;
+    struct
+    {
+      int dmaFD;
+      const FrameBuffer * dmaFrame;
+    };
   };
 }
 EGL_TexUpdate;
@@ -104,8 +109,8 @@ bool egl_textureSetup(EGL_Texture * texture, enum EGL_PixelFormat pixFmt,
 bool egl_textureUpdate(EGL_Texture * texture, const uint8_t * buffer);
 
 bool egl_textureUpdateFromFrame(EGL_Texture * texture,
-    const FrameBuffer * frame, const FrameDamageRect * damageRects,
-    int damageRectsCount);
+    const FrameBuffer * frame, bool compressed,
+    const FrameDamageRect * damageRects, int damageRectsCount);
 
 bool egl_textureUpdateFromDMA(EGL_Texture * texture,
     const FrameBuffer * frame, const int dmaFd);
@@ -25,9 +25,12 @@
 #include "egl_dynprocs.h"
 #include "egldebug.h"
 
+/* the frame is part of the key as when the host moves a frame its dmabuf is
+ * reopened, which usually gets the fd of the one it replaces */
 struct FdImage
 {
   int fd;
+  const FrameBuffer * frame;
   EGLImage image;
 };
 
@@ -111,10 +114,18 @@ static bool egl_texDMABUFUpdate(EGL_Texture * texture,
 
   EGLImage image = EGL_NO_IMAGE;
 
+  // an image for the same fd but another frame is of a dmabuf since closed
+  struct FdImage * stale = NULL;
   struct FdImage * fdImage;
   vector_forEachRef(fdImage, &this->images)
     if (fdImage->fd == update->dmaFD)
     {
+      if (fdImage->frame != update->dmaFrame)
+      {
+        stale = fdImage;
+        continue;
+      }
+
       image = fdImage->image;
       break;
     }
@@ -145,8 +156,15 @@ static bool egl_texDMABUFUpdate(EGL_Texture * texture,
       return false;
     }
 
-    if (!vector_push(&this->images, &(struct FdImage) {
+    if (stale)
+    {
+      g_egl_dynProcs.eglDestroyImage(this->display, stale->image);
+      stale->frame = update->dmaFrame;
+      stale->image = image;
+    }
+    else if (!vector_push(&this->images, &(struct FdImage) {
       .fd    = update->dmaFD,
+      .frame = update->dmaFrame,
       .image = image,
     }))
     {
@@ -24,20 +24,32 @@
 #include "common/debug.h"
 #include "common/KVMFR.h"
 #include "common/rects.h"
+#include "common/region.h"
+#include "app.h"
 
 struct TexDamage
 {
-  int             count;
-  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  bool     full;
+  LGRegion region;
 };
 
 typedef struct TexFB
 {
   TextureBuffer base;
   struct TexDamage damage[EGL_TEX_BUFFER_MAX];
+  FrameDamageRect  rects [KVMFR_MAX_DAMAGE_RECTS];
 }
 TexFB;
 
+static void egl_texFBDamageAll(TexFB * this)
+{
+  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+  {
+    this->damage[i].full = true;
+    region_clear(this->damage[i].region);
+  }
+}
+
 static bool egl_texFBInit(EGL_Texture ** texture, EGLDisplay * display)
 {
   TexFB * this = calloc(1, sizeof(*this));
@@ -52,8 +64,18 @@ static bool egl_texFBInit(EGL_Texture ** texture, EGLDisplay * display)
   }
 
   for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
-    this->damage[i].count = -1;
+    if (!(this->damage[i].region = region_new()))
+    {
+      for (int j = 0; j < i; ++j)
+        region_free(&this->damage[j].region);
 
+      egl_texBufferFree(*texture);
+      free(this);
+      *texture = NULL;
+      return false;
+    }
+
+  egl_texFBDamageAll(this);
   return true;
 }
 
@@ -62,6 +84,9 @@ void egl_texFBFree(EGL_Texture * texture)
   TextureBuffer * parent = UPCAST(TextureBuffer, texture);
   TexFB         * this   = UPCAST(TexFB        , parent );
 
+  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
+    region_free(&this->damage[i].region);
+
   egl_texBufferFree(texture);
   free(this);
 }
@@ -71,9 +96,7 @@ bool egl_texFBSetup(EGL_Texture * texture, const EGL_TexSetup * setup)
   TextureBuffer * parent = UPCAST(TextureBuffer, texture);
   TexFB         * this   = UPCAST(TexFB        , parent );
 
-  for (int i = 0; i < EGL_TEX_BUFFER_MAX; ++i)
-    this->damage[i].count = -1;
-
+  egl_texFBDamageAll(this);
   return egl_texBufferStreamSetup(texture, setup);
 }
 
@@ -86,11 +109,25 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
 
   LG_LOCK(parent->copyLock);
 
+  const bool hasRects = update->rects && update->rectCount > 0;
+
   struct TexDamage * damage = this->damage + parent->bufIndex;
-  bool damageAll = !update->rects || update->rectCount == 0 || damage->count < 0 ||
-    damage->count + update->rectCount > KVMFR_MAX_DAMAGE_RECTS;
+  bool damageAll = !hasRects || damage->full ||
+    !region_addRects(damage->region, update->rects, update->rectCount);
 
-  if (damageAll)
+  if (update->compressed)
+  {
+    size_t rows;
+    if (framebuffer_read_lz4(
+          update->frame,
+          parent->buf[parent->bufIndex].map,
+          texture->format.stride,
+          texture->format.height,
+          texture->format.stride,
+          &rows) && rows < texture->format.height)
+      app_frameTruncated();
+  }
+  else if (damageAll)
     framebuffer_read(
       update->frame,
       parent->buf[parent->bufIndex].map,
@@ -102,12 +139,13 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
     );
   else
   {
-    memcpy(damage->rects + damage->count, update->rects,
-      update->rectCount * sizeof(FrameDamageRect));
-    damage->count += update->rectCount;
+    // only copy what changed since this buffer was last written
+    const int count = region_toRects(damage->region, this->rects,
+        KVMFR_MAX_DAMAGE_RECTS, &REGION_COST_COPY(texture->format.bpp));
+
     rectsFramebufferToBuffer(
-      damage->rects,
-      damage->count,
+      this->rects,
+      count,
       parent->buf[parent->bufIndex].map,
       texture->format.stride,
       texture->format.height,
@@ -122,16 +160,16 @@ static bool egl_texFBUpdate(EGL_Texture * texture, const EGL_TexUpdate * update)
   {
     struct TexDamage * damage = this->damage + i;
     if (i == parent->bufIndex)
-      damage->count = 0;
-    else if (update->rects && update->rectCount > 0 && damage->count >= 0 &&
-             damage->count + update->rectCount <= KVMFR_MAX_DAMAGE_RECTS)
     {
-      memcpy(damage->rects + damage->count, update->rects,
-        update->rectCount * sizeof(FrameDamageRect));
-      damage->count += update->rectCount;
+      damage->full = false;
+      region_clear(damage->region);
+    }
+    else if (!damage->full && (!hasRects ||
+          !region_addRects(damage->region, update->rects, update->rectCount)))
+    {
+      damage->full = true;
+      region_clear(damage->region);
     }
-    else
-      damage->count = -1;
   }
 
   LG_UNLOCK(parent->copyLock);
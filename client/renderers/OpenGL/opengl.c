@@ -35,11 +35,14 @@
 #include "common/option.h"
 #include "common/framebuffer.h"
 #include "common/locking.h"
+#include "common/rects.h"
+#include "common/KVMFR.h"
 #include "gl_dynprocs.h"
 #include "ll.h"
 #include "util.h"
 
 #define BUFFER_COUNT       2
+#define PBO_COUNT          3
 
 #define FPS_TEXTURE        0
 #define MOUSE_TEXTURE      1
@@ -94,6 +97,13 @@ struct IntRect
   int h;
 };
 
+// damage accumulated against a buffer, a count of -1 is full damage
+struct Damage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
 struct OpenGL_Options
 {
   bool mipmap;
@@ -110,6 +120,7 @@ struct Inst
   struct OpenGL_Options opt;
 
   bool              amdPinnedMemSupport;
+  bool              bufferStorageSupport;
   bool              renderStarted;
   bool              configured;
   bool              reconfigure;
@@ -130,11 +141,30 @@ struct Inst
 
   uint64_t          drawStart;
   bool              hasBuffers;
-  GLuint            vboID[BUFFER_COUNT];
-  uint8_t         * texPixels[BUFFER_COUNT];
+  GLuint            vboID[PBO_COUNT];
+  uint8_t         * texPixels[PBO_COUNT];
   LG_Lock           frameLock;
   bool              texReady;
   int               texWIndex, texRIndex;
+
+  /* when the PBOs are persistently mapped (or backed by AMD pinned memory) the
+   * frame thread copies the damaged areas into pboWrite and hands it to the
+   * render thread via pboReady, all protected by frameLock. The copy itself is
+   * done without frameLock but holding copyLock, and only one at a time */
+  LG_Lock           copyLock;
+  bool              copying;
+  bool              pboValid;
+  bool              pboPersistent;
+  uint8_t         * pboMap[PBO_COUNT];
+  bool              pboBusy[PBO_COUNT];
+  struct Damage     pboDamage[PBO_COUNT];
+  int               pboWrite, pboReady;
+  bool              needsCopy;
+  struct Damage     copyDamage;   // damage not yet copied into a PBO
+  struct Damage     uploadDamage; // damage not yet uploaded to a texture
+  struct Damage     texDamage[BUFFER_COUNT];
+  LGRegion          damageRegion; // scratch for merging the texture damage
+  int               texPBO[BUFFER_COUNT];
   int               texList;
   int               mouseList;
   LG_RendererRect   destRect;
@@ -176,10 +206,32 @@ enum ConfigStatus
 static void deconfigure(struct Inst * this);
 static enum ConfigStatus configure(struct Inst * this);
 static void updateMouseShape(struct Inst * this, bool * newShape);
+static void copyFrame(struct Inst * this);
 static bool drawFrame(struct Inst * this);
 static void drawMouse(struct Inst * this);
 static void renderWait(struct Inst * this);
 
+static void damageAddRects(struct Damage * damage,
+    const FrameDamageRect * rects, int count)
+{
+  if (count == 0 || damage->count < 0)
+    return;
+
+  if (count < 0 || damage->count + count > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    damage->count = -1;
+    return;
+  }
+
+  memcpy(damage->rects + damage->count, rects, count * sizeof(*rects));
+  damage->count += count;
+}
+
+static inline void damageAdd(struct Damage * damage, const struct Damage * add)
+{
+  damageAddRects(damage, add->rects, add->count);
+}
+
 const char * opengl_getName(void)
 {
   return "OpenGL";
@@ -211,8 +263,11 @@ bool opengl_create(LG_Renderer ** renderer, const LG_RendererParams params,
 
   LG_LOCK_INIT(this->formatLock);
   LG_LOCK_INIT(this->frameLock );
+  LG_LOCK_INIT(this->copyLock  );
   LG_LOCK_INIT(this->mouseLock );
 
+  this->damageRegion = region_new();
+
   *needsOpenGL = true;
   return true;
 }
@@ -257,8 +312,10 @@ void opengl_deinitialize(LG_Renderer * renderer)
 
   LG_LOCK_FREE(this->formatLock);
   LG_LOCK_FREE(this->frameLock );
+  LG_LOCK_FREE(this->copyLock  );
   LG_LOCK_FREE(this->mouseLock );
 
+  region_free(&this->damageRegion);
   free(this);
 }
 
@@ -357,10 +414,18 @@ bool opengl_onFrameFormat(LG_Renderer * renderer, const LG_RendererFormat format
 {
   struct Inst * this = UPCAST(struct Inst, renderer);
 
+  if (format.transfer == FRAME_TRANSFER_PQ)
+    DEBUG_WARN("PQ frames are shown without decoding, use the EGL renderer");
+
   LG_LOCK(this->formatLock);
   memcpy(&this->format, &format, sizeof(LG_RendererFormat));
   this->reconfigure = true;
   LG_UNLOCK(this->formatLock);
+
+  // the PBOs are for the old format, hold frames for the render thread
+  LG_LOCK(this->frameLock);
+  this->pboValid = false;
+  LG_UNLOCK(this->frameLock);
   return true;
 }
 
@@ -371,6 +436,16 @@ bool opengl_onFrame(LG_Renderer * renderer, const FrameBuffer * frame, int dmaFd
 
   LG_LOCK(this->frameLock);
   this->frame = frame;
+  damageAddRects(&this->copyDamage, damage, damageCount > 0 ? damageCount : -1);
+
+  // copy straight into a mapped PBO if we have one, otherwise leave it for
+  // the render thread to pick up
+  if (this->pboValid && this->pboPersistent && this->pboWrite >= 0 &&
+      !this->copying)
+    copyFrame(this);
+  else
+    this->needsCopy = true;
+
   atomic_store_explicit(&this->frameUpdate, true, memory_order_release);
   LG_UNLOCK(this->frameLock);
 
@@ -419,6 +494,15 @@ bool opengl_renderStartup(LG_Renderer * renderer, bool useDMA)
   glGetIntegerv(GL_MAJOR_VERSION, &maj);
   glGetIntegerv(GL_MINOR_VERSION, &min);
 
+  if (!this->amdPinnedMemSupport &&
+      (maj > 4 || (maj == 4 && min >= 4) ||
+       util_hasGLExt(exts, "GL_ARB_buffer_storage")) &&
+      g_gl_dynProcs.glBufferStorage && g_gl_dynProcs.glMapBufferRange)
+  {
+    this->bufferStorageSupport = true;
+    DEBUG_INFO("Using persistently mapped PBOs");
+  }
+
   if ((maj < 3 || (maj == 3 && min < 2)) && !util_hasGLExt(exts, "GL_ARB_sync"))
   {
     DEBUG_ERROR("Need OpenGL 3.2+ or GL_ARB_sync for sync objects");
@@ -732,7 +816,7 @@ static enum ConfigStatus configure(struct Inst * this)
   this->texSize = this->format.height * this->format.pitch;
   this->texPos  = 0;
 
-  g_gl_dynProcs.glGenBuffers(BUFFER_COUNT, this->vboID);
+  g_gl_dynProcs.glGenBuffers(PBO_COUNT, this->vboID);
   if (check_gl_error("glGenBuffers"))
   {
     LG_UNLOCK(this->formatLock);
@@ -744,7 +828,7 @@ static enum ConfigStatus configure(struct Inst * this)
   {
     const int pagesize = getpagesize();
 
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    for(int i = 0; i < PBO_COUNT; ++i)
     {
       this->texPixels[i] = aligned_alloc(pagesize, this->texSize);
       if (!this->texPixels[i])
@@ -774,12 +858,43 @@ static enum ConfigStatus configure(struct Inst * this)
         LG_UNLOCK(this->formatLock);
         return CONFIG_STATUS_ERROR;
       }
+
+      this->pboMap[i] = this->texPixels[i];
     }
     g_gl_dynProcs.glBindBuffer(GL_EXTERNAL_VIRTUAL_MEMORY_BUFFER_AMD, 0);
+    this->pboPersistent = true;
+  }
+  else if (this->bufferStorageSupport)
+  {
+    const GLbitfield flags =
+      GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+    for(int i = 0; i < PBO_COUNT; ++i)
+    {
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
+      g_gl_dynProcs.glBufferStorage(GL_PIXEL_UNPACK_BUFFER, this->texSize, NULL,
+          flags);
+      if (check_gl_error("glBufferStorage"))
+      {
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+
+      this->pboMap[i] = g_gl_dynProcs.glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+          0, this->texSize, flags);
+      if (!this->pboMap[i])
+      {
+        check_gl_error("glMapBufferRange");
+        LG_UNLOCK(this->formatLock);
+        return CONFIG_STATUS_ERROR;
+      }
+    }
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    this->pboPersistent = true;
   }
   else
   {
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    for(int i = 0; i < PBO_COUNT; ++i)
     {
       g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
       if (check_gl_error("glBindBuffer"))
@@ -862,6 +977,22 @@ static enum ConfigStatus configure(struct Inst * this)
   glBindTexture(GL_TEXTURE_2D, 0);
   g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
+  // every buffer and texture starts out fully damaged
+  LG_LOCK(this->frameLock);
+  for(int i = 0; i < PBO_COUNT; ++i)
+  {
+    this->pboBusy  [i]       = false;
+    this->pboDamage[i].count = -1;
+  }
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+    this->texDamage[i].count = -1;
+  this->copyDamage.count   = -1;
+  this->uploadDamage.count = -1;
+  this->pboWrite           = 0;
+  this->pboReady           = -1;
+  this->pboValid           = true;
+  LG_UNLOCK(this->frameLock);
+
   this->drawStart   = nanotime();
   this->configured  = true;
   this->reconfigure = false;
@@ -872,35 +1003,54 @@ static enum ConfigStatus configure(struct Inst * this)
 
 static void deconfigure(struct Inst * this)
 {
+  // stop the frame thread from writing into the buffers and wait for any copy
+  // it is already doing
+  LG_LOCK(this->frameLock);
+  this->pboValid = false;
+  LG_UNLOCK(this->frameLock);
+  LG_LOCK(this->copyLock);
+  LG_UNLOCK(this->copyLock);
+
   if (this->hasFrames)
   {
     glDeleteTextures(BUFFER_COUNT, this->frames);
     this->hasFrames = false;
   }
 
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+    if (this->fences[i])
+    {
+      g_gl_dynProcs.glDeleteSync(this->fences[i]);
+      this->fences[i] = NULL;
+    }
+
   if (this->hasBuffers)
   {
-    g_gl_dynProcs.glDeleteBuffers(BUFFER_COUNT, this->vboID);
+    if (this->pboPersistent && !this->amdPinnedMemSupport)
+    {
+      for(int i = 0; i < PBO_COUNT; ++i)
+        if (this->pboMap[i])
+        {
+          g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[i]);
+          g_gl_dynProcs.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    g_gl_dynProcs.glDeleteBuffers(PBO_COUNT, this->vboID);
     this->hasBuffers = false;
   }
 
-  if (this->amdPinnedMemSupport)
+  for(int i = 0; i < PBO_COUNT; ++i)
   {
-    for(int i = 0; i < BUFFER_COUNT; ++i)
+    this->pboMap[i] = NULL;
+    if (this->texPixels[i])
     {
-      if (this->fences[i])
-      {
-        g_gl_dynProcs.glDeleteSync(this->fences[i]);
-        this->fences[i] = NULL;
-      }
-
-      if (this->texPixels[i])
-      {
-        free(this->texPixels[i]);
-        this->texPixels[i] = NULL;
-      }
+      free(this->texPixels[i]);
+      this->texPixels[i] = NULL;
     }
   }
+  this->pboPersistent = false;
 
   this->configured = false;
 }
@@ -1067,77 +1217,247 @@ static bool opengl_bufferFn(void * opaque, const void * data, size_t size)
   return true;
 }
 
+/* copy the pending frame into the write PBO and hand it to the render thread.
+ * frameLock must be held, it is released while copying so the render thread is
+ * not held up by it. Without persistently mapped buffers the whole frame is
+ * streamed with glBufferSubData, so it must be called on the render thread */
+static void copyFrame(struct Inst * this)
+{
+  const int           index  = this->pboWrite;
+  const FrameBuffer * frame  = this->frame;
+  const int           bpp    = this->format.bpp / 8;
+  const int           pitch  = this->format.width * bpp;
+  struct Damage       copied;
+  struct Damage       damage;
+
+  // claim the buffer and take the damage the copy is for
+  memcpy(&copied, &this->copyDamage, sizeof(copied));
+  damageAdd(this->pboDamage + index, &copied);
+  memcpy(&damage, this->pboDamage + index, sizeof(damage));
+
+  for(int i = 0; i < PBO_COUNT; ++i)
+    if (i == index)
+      this->pboDamage[i].count = 0;
+    else
+      damageAdd(this->pboDamage + i, &copied);
+
+  this->copyDamage.count = 0;
+  this->needsCopy        = false;
+  this->pboWrite         = -1;
+  this->copying          = true;
+
+  LG_LOCK(this->copyLock);
+  LG_UNLOCK(this->frameLock);
+
+  if (this->format.compressed)
+  {
+    // compressed frames are always sent whole and decompressed into the PBO
+    void * map = this->pboMap[index];
+    if (!this->pboPersistent)
+    {
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[index]);
+      map = g_gl_dynProcs.glMapBufferRange ?
+        g_gl_dynProcs.glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+          this->texSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT) :
+        NULL;
+    }
+
+    size_t rows;
+    if (map)
+    {
+      if (framebuffer_read_lz4(
+            frame,
+            map,
+            pitch,
+            this->format.height,
+            this->format.pitch,
+            &rows) && rows < this->format.height)
+        app_frameTruncated();
+    }
+    else
+      DEBUG_ERROR("Unable to map the PBO to decompress the frame");
+
+    if (!this->pboPersistent)
+    {
+      if (map)
+        g_gl_dynProcs.glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+  }
+  else if (!this->pboPersistent)
+  {
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[index]);
+    this->texPos = 0;
+    framebuffer_read_fn(
+      frame,
+      this->format.height,
+      this->format.width,
+      bpp,
+      this->format.pitch,
+      opengl_bufferFn,
+      this
+    );
+    g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  }
+  else if (damage.count < 0 || bpp != 4)
+    framebuffer_read(
+      frame,
+      this->pboMap[index],
+      pitch,
+      this->format.height,
+      this->format.width,
+      bpp,
+      this->format.pitch
+    );
+  else
+    rectsFramebufferToBuffer(
+      damage.rects,
+      damage.count,
+      this->pboMap[index],
+      pitch,
+      this->format.height,
+      frame,
+      this->format.pitch
+    );
+
+  // publish the buffer
+  LG_LOCK(this->frameLock);
+  LG_UNLOCK(this->copyLock);
+  this->copying = false;
+
+  damageAdd(&this->uploadDamage, &copied);
+  const int ready = this->pboReady;
+  this->pboReady  = index;
+
+  // if the previous frame was never uploaded its buffer can be reused
+  if (ready >= 0)
+  {
+    this->pboWrite = ready;
+    return;
+  }
+
+  // the render thread may have retired a buffer for us while we copied
+  if (this->pboWrite >= 0)
+    return;
+
+  for(int i = 0; i < PBO_COUNT; ++i)
+    if (i != index && !this->pboBusy[i])
+    {
+      this->pboWrite = i;
+      break;
+    }
+}
+
 static bool drawFrame(struct Inst * this)
 {
-  if (g_gl_dynProcs.glIsSync(this->fences[this->texWIndex]))
+  // retire the last upload once the GPU is done with it, but never wait on it
+  GLsync fence = this->fences[this->texWIndex];
+  if (fence)
   {
-    switch(g_gl_dynProcs.glClientWaitSync(this->fences[this->texWIndex], 0, GL_TIMEOUT_IGNORED))
+    switch(g_gl_dynProcs.glClientWaitSync(fence, 0, 0))
     {
       case GL_ALREADY_SIGNALED:
-        break;
-
       case GL_CONDITION_SATISFIED:
-        DEBUG_WARN("Had to wait for the sync");
         break;
 
       case GL_TIMEOUT_EXPIRED:
-        DEBUG_WARN("Timeout expired, DMA transfers are too slow!");
-        break;
+        return true;
 
       case GL_WAIT_FAILED:
         DEBUG_ERROR("Wait failed %d", glGetError());
         break;
     }
 
-    g_gl_dynProcs.glDeleteSync(this->fences[this->texWIndex]);
+    g_gl_dynProcs.glDeleteSync(fence);
     this->fences[this->texWIndex] = NULL;
 
+    const int pbo = this->texPBO[this->texWIndex];
+    LG_LOCK(this->frameLock);
+    this->pboBusy[pbo] = false;
+    if (this->pboWrite < 0)
+      this->pboWrite = pbo;
+    LG_UNLOCK(this->frameLock);
+
     this->texRIndex = this->texWIndex;
     if (++this->texWIndex == BUFFER_COUNT)
       this->texWIndex = 0;
   }
 
+  if (!atomic_load_explicit(&this->frameUpdate, memory_order_acquire))
+    return true;
+
+  LG_LOCK(this->formatLock);
   LG_LOCK(this->frameLock);
-  if (!atomic_exchange_explicit(&this->frameUpdate, false, memory_order_acquire))
+
+  // the frame thread had nowhere to put the frame, copy it now
+  if (this->needsCopy && this->pboValid && this->pboWrite >= 0 &&
+      !this->copying)
+    copyFrame(this);
+
+  struct Damage damage;
+  const int index = this->pboReady;
+  if (index >= 0)
   {
-    LG_UNLOCK(this->frameLock);
+    memcpy(&damage, &this->uploadDamage, sizeof(damage));
+    this->uploadDamage.count = 0;
+    this->pboReady           = -1;
+    this->pboBusy[index]     = true;
+  }
+
+  atomic_store_explicit(&this->frameUpdate, this->needsCopy,
+      memory_order_relaxed);
+  LG_UNLOCK(this->frameLock);
+
+  if (index < 0)
+  {
+    LG_UNLOCK(this->formatLock);
     return true;
   }
 
-  LG_LOCK(this->formatLock);
   glBindTexture(GL_TEXTURE_2D, this->frames[this->texWIndex]);
-  g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[this->texWIndex]);
+  g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, this->vboID[index]);
 
   const int bpp = this->format.bpp / 8;
   glPixelStorei(GL_UNPACK_ALIGNMENT , bpp);
   glPixelStorei(GL_UNPACK_ROW_LENGTH, this->format.width);
 
-  this->texPos = 0;
+  // upload only what changed since this texture was last written
+  struct Damage * texDamage = this->texDamage + this->texWIndex;
+  damageAdd(texDamage, &damage);
 
-  framebuffer_read_fn(
-    this->frame,
-    this->format.height,
-    this->format.width,
-    bpp,
-    this->format.pitch,
-    opengl_bufferFn,
-    this
-  );
-
-  LG_UNLOCK(this->frameLock);
+  if (texDamage->count < 0)
+    glTexSubImage2D(
+      GL_TEXTURE_2D,
+      0,
+      0,
+      0,
+      this->format.width ,
+      this->format.height,
+      this->vboFormat,
+      this->dataFormat,
+      (void*)0
+    );
+  else
+  {
+    texDamage->count = rectsMergeOverlapping(texDamage->rects,
+        texDamage->count, this->damageRegion);
+    for(int i = 0; i < texDamage->count; ++i)
+    {
+      const FrameDamageRect * rect = texDamage->rects + i;
+      glTexSubImage2D(
+        GL_TEXTURE_2D,
+        0,
+        rect->x,
+        rect->y,
+        rect->width,
+        rect->height,
+        this->vboFormat,
+        this->dataFormat,
+        (void*)(uintptr_t)((rect->y * this->format.width + rect->x) * bpp)
+      );
+    }
+  }
 
-  // update the texture
-  glTexSubImage2D(
-    GL_TEXTURE_2D,
-    0,
-    0,
-    0,
-    this->format.width ,
-    this->format.height,
-    this->vboFormat,
-    this->dataFormat,
-    (void*)0
-  );
   if (check_gl_error("glTexSubImage2D"))
   {
     DEBUG_ERROR("texWIndex: %u, width: %u, height: %u, vboFormat: %x, texSize: %lu",
@@ -1145,6 +1465,12 @@ static bool drawFrame(struct Inst * this)
     );
   }
 
+  for(int i = 0; i < BUFFER_COUNT; ++i)
+    if (i == this->texWIndex)
+      this->texDamage[i].count = 0;
+    else
+      damageAdd(this->texDamage + i, &damage);
+
   // unbind the buffer
   g_gl_dynProcs.glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
 
@@ -1166,6 +1492,7 @@ static bool drawFrame(struct Inst * this)
   glBindTexture(GL_TEXTURE_2D, 0);
 
   // set a fence so we don't overwrite a buffer in use
+  this->texPBO[this->texWIndex] = index;
   this->fences[this->texWIndex] =
     g_gl_dynProcs.glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
   glFlush();
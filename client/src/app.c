@@ -522,6 +522,11 @@ void app_invalidateWindow(bool full)
   lgSignalEvent(g_state.frameEvent);
 }
 
+void app_frameTruncated(void)
+{
+  atomic_store(&g_state.frameTruncated, true);
+}
+
 void app_handleCloseEvent(void)
 {
   if (!g_params.ignoreQuit || !g_cursor.inView)
@@ -0,0 +1,212 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "avsync.h"
+#include "app.h"
+
+#include "common/debug.h"
+#include "common/ringbuffer.h"
+#include "common/time.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* how fast the arrival baseline may rise to follow the drift between the
+ * guest and local clocks, in ms per second of audio */
+#define BASELINE_RISE 1.0
+
+struct AVSync
+{
+  bool enabled;
+  int  tolerance;
+
+  RingBuffer  offsetTimings;
+  GraphHandle offsetGraph;
+
+  // only accessed by the frame thread
+  uint64_t receiveTime;
+
+  // the receive time of the last uploaded frame less the host's capture time
+  _Atomic(uint64_t) pendingStart;
+
+  // the filtered capture to present latency of the video in microseconds
+  atomic_uint videoLatency;
+
+  // the playback latency from arrival to the speaker in microseconds
+  atomic_uint audioLatency;
+
+  // only accessed by the SPICE thread
+  int      sampleRate;
+  uint32_t spiceTime;
+  uint64_t frames;
+  bool     haveBaseline;
+  double   baseline; // the lowest arrival offset seen, in ms
+  double   jitter;   // the filtered arrival delay above the baseline, in ms
+  int      delay;    // the delay currently being applied, in ms
+};
+
+static struct AVSync av = { 0 };
+
+bool avsync_init(bool enable, int toleranceMs)
+{
+  memset(&av, 0, sizeof(av));
+  atomic_init(&av.pendingStart, 0);
+  atomic_init(&av.videoLatency, 0);
+  atomic_init(&av.audioLatency, 0);
+
+  if (!enable)
+    return true;
+
+  av.tolerance     = toleranceMs;
+  av.offsetTimings = ringbuffer_new(256, sizeof(float));
+  av.offsetGraph   = app_registerGraph("A/V OFFSET", av.offsetTimings,
+      -100.0f, 100.0f);
+  av.enabled       = true;
+  return true;
+}
+
+void avsync_free(void)
+{
+  if (!av.enabled)
+    return;
+
+  app_unregisterGraph(av.offsetGraph);
+  ringbuffer_free(&av.offsetTimings);
+  av.enabled = false;
+}
+
+void avsync_frameReceived(const KVMFRFrame * frame)
+{
+  if (!av.enabled)
+    return;
+
+  /* the host timestamps are in the guest's clock domain so only the time the
+   * frame spent on the host can be added to what is measured locally */
+  av.receiveTime = nanotime();
+  if (frame->captureTime && frame->postTime >= frame->captureTime)
+    av.receiveTime -= frame->postTime - frame->captureTime;
+}
+
+void avsync_frameUploaded(void)
+{
+  if (!av.enabled)
+    return;
+
+  atomic_store_explicit(&av.pendingStart, av.receiveTime,
+      memory_order_release);
+}
+
+void avsync_preSwap(void)
+{
+  if (!av.enabled)
+    return;
+
+  const uint64_t start = atomic_exchange_explicit(&av.pendingStart, 0,
+      memory_order_acquire);
+  if (!start)
+    return;
+
+  const unsigned int latency = (nanotime() - start) / 1000;
+  const unsigned int prev    = atomic_load_explicit(&av.videoLatency,
+      memory_order_relaxed);
+
+  atomic_store_explicit(&av.videoLatency,
+      prev ? prev + ((int)latency - (int)prev) / 8 : latency,
+      memory_order_relaxed);
+}
+
+void avsync_audioStart(int sampleRate, uint32_t time)
+{
+  if (!av.enabled)
+    return;
+
+  // a new stream starts a new timeline
+  av.sampleRate   = sampleRate;
+  av.spiceTime    = time;
+  av.frames       = 0;
+  av.haveBaseline = false;
+  av.jitter       = 0.0;
+}
+
+void avsync_audioData(int frames)
+{
+  if (!av.enabled || !av.sampleRate)
+    return;
+
+  /* PureSpice only gives us the stream's start time, so each packet's time on
+   * the SPICE clock is reconstructed from the number of frames before it. The
+   * offset between the two clocks is unknown but constant (less drift), so
+   * the arrival delay is measured against the earliest packet seen */
+  const double pos    = av.spiceTime + av.frames * 1000.0 / av.sampleRate;
+  const double offset = nanotime() / 1e6 - pos;
+  const double dt     = (double)frames / av.sampleRate;
+  av.frames += frames;
+
+  if (!av.haveBaseline)
+  {
+    av.baseline     = offset;
+    av.haveBaseline = true;
+  }
+  else
+    av.baseline = fmin(offset, av.baseline + BASELINE_RISE * dt);
+
+  av.jitter += ((offset - av.baseline) - av.jitter) * fmin(dt * 2.0, 1.0);
+}
+
+int avsync_audioBuffered(double bufferedMs, double targetMs)
+{
+  atomic_store_explicit(&av.audioLatency,
+      (unsigned int)((av.jitter + bufferedMs) * 1000.0), memory_order_relaxed);
+
+  if (!av.enabled)
+    return 0;
+
+  const unsigned int videoUs = atomic_load_explicit(&av.videoLatency,
+      memory_order_relaxed);
+
+  // nothing to sync to until a frame has been presented
+  if (!videoUs)
+    return av.delay;
+
+  const double video = videoUs / 1000.0;
+  ringbuffer_push(av.offsetTimings,
+      &(float){ av.jitter + bufferedMs - video });
+
+  /* the audio can be held back to meet the video but it can't be brought
+   * forward past the resampler's own target without running dry */
+  const double wanted = video - (av.jitter + targetMs);
+  const int    delay  = (int)fmax(fmin(wanted, AVSYNC_MAX_DELAY_MS), 0.0);
+
+  if (abs(delay - av.delay) > av.tolerance)
+  {
+    DEBUG_INFO("A/V sync delaying audio by %d ms (video latency %.1f ms)",
+        delay, video);
+    av.delay = delay;
+  }
+
+  return av.delay;
+}
+
+double avsync_getAudioLatency(void)
+{
+  return atomic_load_explicit(&av.audioLatency, memory_order_relaxed) / 1000.0;
+}
@@ -0,0 +1,54 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_AVSYNC_
+#define _H_LG_AVSYNC_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "common/KVMFR.h"
+
+// the most the audio will be held back to line it up with the video
+#define AVSYNC_MAX_DELAY_MS 200
+
+bool avsync_init(bool enable, int toleranceMs);
+void avsync_free(void);
+
+// called from the frame thread as a frame arrives and after the renderer
+// has taken it
+void avsync_frameReceived(const KVMFRFrame * frame);
+void avsync_frameUploaded(void);
+
+// called from the render thread just before the swap
+void avsync_preSwap(void);
+
+// called from the SPICE thread as playback starts and as each packet arrives
+void avsync_audioStart(int sampleRate, uint32_t time);
+void avsync_audioData(int frames);
+
+/* called by the resampler with the amount of audio currently buffered and the
+ * buffer level it targets on its own, returns the extra delay in milliseconds
+ * the buffer should hold so the audio lines up with the video */
+int avsync_audioBuffered(double bufferedMs, double targetMs);
+
+// the last reported playback latency in milliseconds, even if sync is disabled
+double avsync_getAudioLatency(void);
+
+#endif
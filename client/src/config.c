@@ -45,6 +45,8 @@ static char *     optSizeToString    (struct Option * opt);
 static bool       optScancodeValidate(struct Option * opt, const char ** error);
 static char *     optScancodeToString(struct Option * opt);
 static bool       optRotateValidate  (struct Option * opt, const char ** error);
+static bool       optTargetLatencyValidate(struct Option * opt,
+    const char ** error);
 
 static void doLicense();
 
@@ -98,6 +100,34 @@ static struct Option options[] =
     .type          = OPTION_TYPE_BOOL,
     .value.x_bool  = true
   },
+  {
+    .module        = "app",
+    .name          = "copyThreads",
+    .description   = "The number of threads used to copy large frame damage (0 or 1 to disable)",
+    .type          = OPTION_TYPE_INT,
+    .value.x_int   = 0
+  },
+  {
+    .module        = "app",
+    .name          = "latencyGraphs",
+    .description   = "Show the per stage frame latency in the timing graphs",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
+  {
+    .module         = "app",
+    .name           = "latencyLog",
+    .description    = "Write the per stage latency of each frame to this file as CSV",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module        = "app",
+    .name          = "lockStats",
+    .description   = "Show contention statistics for the renderer lock in the timing graphs",
+    .type          = OPTION_TYPE_BOOL,
+    .value.x_bool  = false
+  },
 
   // window options
   {
@@ -464,6 +494,37 @@ static struct Option options[] =
     .type          = OPTION_TYPE_BOOL,
     .value.x_bool  = true
   },
+
+  // audio options
+  {
+    .module         = "audio",
+    .name           = "targetLatency",
+    .description    = "The amount of audio to keep buffered in milliseconds, playback is resampled to hold it here",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 20,
+    .validator      = optTargetLatencyValidate
+  },
+  {
+    .module         = "audio",
+    .name           = "avSync",
+    .description    = "Delay the audio to keep it in sync with the video",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = true
+  },
+  {
+    .module         = "audio",
+    .name           = "syncTolerance",
+    .description    = "How far the audio may drift from the video in milliseconds before it is resynced",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 20
+  },
+  {
+    .module         = "audio",
+    .name           = "micEnable",
+    .description    = "Pass the local microphone to the guest via the SPICE record channel",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
   {0}
 };
 
@@ -550,6 +611,10 @@ bool config_load(int argc, char * argv[])
   g_params.cursorPollInterval = option_get_int   ("app"  , "cursorPollInterval");
   g_params.framePollInterval  = option_get_int   ("app"  , "framePollInterval" );
   g_params.allowDMA           = option_get_bool  ("app"  , "allowDMA"          );
+  g_params.copyThreads        = option_get_int   ("app"  , "copyThreads"       );
+  g_params.latencyGraphs      = option_get_bool  ("app"  , "latencyGraphs"     );
+  g_params.latencyLog         = option_get_string("app"  , "latencyLog"        );
+  g_params.lockStats          = option_get_bool  ("app"  , "lockStats"         );
 
   g_params.windowTitle     = option_get_string("win", "title"          );
   g_params.autoResize      = option_get_bool  ("win", "autoResize"     );
@@ -636,6 +701,10 @@ bool config_load(int argc, char * argv[])
     g_params.showCursorDot    = option_get_bool("spice", "showCursorDot");
   }
 
+  g_params.avSync          = option_get_bool("audio", "avSync"       );
+  g_params.avSyncTolerance = option_get_int ("audio", "syncTolerance");
+  g_params.micEnable       = option_get_bool("audio", "micEnable"    );
+
   return true;
 }
 
@@ -816,3 +885,12 @@ static bool optRotateValidate(struct Option * opt, const char ** error)
   *error = "Rotation angle must be one of 0, 90, 180 or 270";
   return false;
 }
+
+static bool optTargetLatencyValidate(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int > 0 && opt->value.x_int <= 1000)
+    return true;
+
+  *error = "Target latency must be between 1 and 1000 ms";
+  return false;
+}
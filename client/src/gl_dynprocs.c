@@ -44,6 +44,10 @@ void gl_dynProcsInit(void)
   g_gl_dynProcs.glBufferData    = getProcAddressGL2("glBufferData", "glBufferDataARB");
   g_gl_dynProcs.glBufferSubData = getProcAddressGL2("glBufferSubData", "glBufferSubDataARB");
   g_gl_dynProcs.glDeleteBuffers = getProcAddressGL2("glDeleteBuffers", "glDeleteBuffersARB");
+  g_gl_dynProcs.glUnmapBuffer   = getProcAddressGL2("glUnmapBuffer", "glUnmapBufferARB");
+
+  g_gl_dynProcs.glBufferStorage  = getProcAddressGL("glBufferStorage");
+  g_gl_dynProcs.glMapBufferRange = getProcAddressGL("glMapBufferRange");
 
   g_gl_dynProcs.glIsSync         = getProcAddressGL("glIsSync");
   g_gl_dynProcs.glFenceSync      = getProcAddressGL("glFenceSync");
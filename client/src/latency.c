@@ -0,0 +1,351 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "latency.h"
+#include "app.h"
+
+#include "common/debug.h"
+#include "common/event.h"
+#include "common/locking.h"
+#include "common/ringbuffer.h"
+#include "common/spscbuffer.h"
+#include "common/thread.h"
+#include "common/time.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+enum LatencyStage
+{
+  LATENCY_STAGE_POST,   // host: capture complete -> posted
+  LATENCY_STAGE_COPY,   // host: posted -> copy complete
+  LATENCY_STAGE_UPLOAD, // client: received -> upload complete
+  LATENCY_STAGE_SWAP,   // client: upload complete -> swap
+  LATENCY_STAGE_TOTAL,  // capture -> post + receive -> swap
+
+  LATENCY_STAGE_MAX
+};
+
+static const char * stageNames[LATENCY_STAGE_MAX] =
+{
+  "LAT POST"  ,
+  "LAT COPY"  ,
+  "LAT UPLOAD",
+  "LAT SWAP"  ,
+  "LAT TOTAL"
+};
+
+static const float stageMax[LATENCY_STAGE_MAX] =
+{
+  10.0f,
+  20.0f,
+  20.0f,
+  50.0f,
+  50.0f
+};
+
+struct LatencyFrame
+{
+  uint32_t serial;
+  float    stage[LATENCY_STAGE_MAX];
+
+  uint64_t receiveTime;
+  uint64_t uploadTime;
+  uint64_t postTime;
+
+  // set until the host has recorded the copy time of the frame
+  const KVMFRFrame * frame;
+};
+
+// what is written to the log for each presented or replaced frame
+struct LatencyRecord
+{
+  uint32_t serial;
+  float    stage[LATENCY_STAGE_MAX];
+};
+
+struct LatencyState
+{
+  bool       enabled;
+  RingBuffer stages[LATENCY_STAGE_MAX];
+
+  /* the log is written by its own thread so stdio never holds up the render
+   * thread, the records are queued to it under the lock */
+  FILE      * log;
+  SPSCBuffer  logBuffer;
+  LGEvent   * logEvent;
+  LGThread  * logThread;
+  atomic_bool logRunning;
+
+  // only accessed by the frame thread
+  uint64_t   receiveTime;
+
+  // the last uploaded frame that has not yet been presented
+  LG_Lock             lock;
+  bool                pendingValid;
+  struct LatencyFrame pending;
+};
+
+static struct LatencyState ls = { 0 };
+
+static void writeRecords(void)
+{
+  struct LatencyRecord rec;
+  while(spscbuffer_consume(ls.logBuffer, &rec, 1))
+  {
+    fprintf(ls.log, "%u", rec.serial);
+    for(int i = 0; i < LATENCY_STAGE_MAX; ++i)
+      if (rec.stage[i] < 0.0f)
+        fputc(',', ls.log);
+      else
+        fprintf(ls.log, ",%.3f", rec.stage[i]);
+    fputc('\n', ls.log);
+  }
+}
+
+static int logThread(void * unused)
+{
+  while(atomic_load_explicit(&ls.logRunning, memory_order_acquire))
+  {
+    if (lgWaitEvent(ls.logEvent, 100))
+      writeRecords();
+  }
+
+  writeRecords();
+  return 0;
+}
+
+static void closeLog(void)
+{
+  if (ls.logThread)
+  {
+    atomic_store_explicit(&ls.logRunning, false, memory_order_release);
+    lgSignalEvent(ls.logEvent);
+    lgJoinThread(ls.logThread, NULL);
+    ls.logThread = NULL;
+  }
+
+  if (ls.logEvent)
+  {
+    lgFreeEvent(ls.logEvent);
+    ls.logEvent = NULL;
+  }
+  spscbuffer_free(&ls.logBuffer);
+
+  if (ls.log)
+  {
+    fclose(ls.log);
+    ls.log = NULL;
+  }
+}
+
+bool latency_init(bool graphs, const char * logFile)
+{
+  memset(&ls, 0, sizeof(ls));
+  LG_LOCK_INIT(ls.lock);
+
+  if (!graphs && !logFile)
+    return true;
+
+  if (logFile)
+  {
+    ls.log = fopen(logFile, "w");
+    if (!ls.log)
+    {
+      DEBUG_ERROR("Failed to open the latency log %s: %s", logFile,
+          strerror(errno));
+      return false;
+    }
+
+    fprintf(ls.log, "serial,post_ms,copy_ms,upload_ms,swap_ms,total_ms\n");
+
+    // a few seconds of frames, far more than the log thread should fall behind
+    ls.logBuffer = spscbuffer_new(1024, sizeof(struct LatencyRecord));
+    ls.logEvent  = lgCreateEvent(true, 0);
+    if (!ls.logBuffer || !ls.logEvent)
+    {
+      DEBUG_ERROR("Failed to allocate the latency log buffers");
+      closeLog();
+      return false;
+    }
+
+    atomic_store(&ls.logRunning, true);
+    if (!lgCreateThread("latencyLogThread", logThread, NULL, &ls.logThread))
+    {
+      DEBUG_ERROR("Failed to create the latency log thread");
+      closeLog();
+      return false;
+    }
+
+    DEBUG_INFO("Latency log      : %s", logFile);
+  }
+
+  if (graphs)
+    for(int i = 0; i < LATENCY_STAGE_MAX; ++i)
+    {
+      ls.stages[i] = ringbuffer_new(256, sizeof(float));
+      app_registerGraph(stageNames[i], ls.stages[i], 0.0f, stageMax[i]);
+    }
+
+  ls.enabled = true;
+  return true;
+}
+
+void latency_free(void)
+{
+  closeLog();
+
+  for(int i = 0; i < LATENCY_STAGE_MAX; ++i)
+    ringbuffer_free(&ls.stages[i]);
+
+  ls.enabled = false;
+}
+
+static void pushStage(enum LatencyStage stage, float value)
+{
+  if (ls.stages[stage])
+    ringbuffer_push(ls.stages[stage], &value);
+}
+
+/* must be called with the lock held which makes this the only producer, a
+ * negative stage is not available */
+static void logFrame(const struct LatencyFrame * frame)
+{
+  if (!ls.logBuffer)
+    return;
+
+  struct LatencyRecord rec = { .serial = frame->serial };
+  memcpy(rec.stage, frame->stage, sizeof(rec.stage));
+
+  // if the log thread has fallen this far behind the record is dropped
+  spscbuffer_append(ls.logBuffer, &rec, 1);
+  lgSignalEvent(ls.logEvent);
+}
+
+/* the host records the copy time once it has finished writing the frame, which
+ * can be after the client has taken it. The frame header stays mapped but is
+ * reused by later frames, so the time is only taken while the serial shows it
+ * is still the same frame. The host writes the serial before it clears the
+ * copy time, as such reading them in the reverse order is safe. */
+static void fillCopyStage(struct LatencyFrame * lf)
+{
+  if (!lf->frame)
+    return;
+
+  const uint64_t copyTime = *(volatile const uint64_t *)&lf->frame->copyTime;
+  atomic_thread_fence(memory_order_acquire);
+  if (*(volatile const uint32_t *)&lf->frame->frameSerial != lf->serial)
+  {
+    lf->frame = NULL;
+    return;
+  }
+
+  if (!copyTime)
+    return;
+
+  lf->frame = NULL;
+  if (copyTime < lf->postTime)
+    return;
+
+  lf->stage[LATENCY_STAGE_COPY] = (copyTime - lf->postTime) * 1e-6f;
+  pushStage(LATENCY_STAGE_COPY, lf->stage[LATENCY_STAGE_COPY]);
+}
+
+void latency_frameReceived(const KVMFRFrame * frame)
+{
+  if (!ls.enabled)
+    return;
+
+  ls.receiveTime = nanotime();
+}
+
+void latency_frameUploaded(const KVMFRFrame * frame)
+{
+  if (!ls.enabled)
+    return;
+
+  /* the host timestamps are in the guest's clock domain, so only the
+   * differences between them are meaningful here */
+  const uint64_t captureTime = frame->captureTime;
+
+  struct LatencyFrame lf =
+  {
+    .serial      = frame->frameSerial,
+    .receiveTime = ls.receiveTime,
+    .uploadTime  = nanotime(),
+    .postTime    = frame->postTime,
+    .frame       = frame
+  };
+
+  lf.stage[LATENCY_STAGE_POST] = captureTime && lf.postTime >= captureTime ?
+    (lf.postTime - captureTime) * 1e-6f : -1.0f;
+  lf.stage[LATENCY_STAGE_COPY  ] = -1.0f;
+  lf.stage[LATENCY_STAGE_UPLOAD] = (lf.uploadTime - lf.receiveTime) * 1e-6f;
+  lf.stage[LATENCY_STAGE_SWAP  ] = -1.0f;
+  lf.stage[LATENCY_STAGE_TOTAL ] = -1.0f;
+
+  if (lf.stage[LATENCY_STAGE_POST] >= 0.0f)
+    pushStage(LATENCY_STAGE_POST, lf.stage[LATENCY_STAGE_POST]);
+  pushStage(LATENCY_STAGE_UPLOAD, lf.stage[LATENCY_STAGE_UPLOAD]);
+
+  LG_LOCK(ls.lock);
+  // the previous frame was replaced before it was presented
+  if (ls.pendingValid)
+  {
+    fillCopyStage(&ls.pending);
+    logFrame(&ls.pending);
+  }
+  ls.pending      = lf;
+  ls.pendingValid = true;
+
+  // the COPY stage is pushed from both threads so is only filled in locked
+  fillCopyStage(&ls.pending);
+  LG_UNLOCK(ls.lock);
+}
+
+void latency_preSwap(void)
+{
+  if (!ls.enabled)
+    return;
+
+  const uint64_t now = nanotime();
+
+  LG_LOCK(ls.lock);
+  if (!ls.pendingValid)
+  {
+    LG_UNLOCK(ls.lock);
+    return;
+  }
+
+  struct LatencyFrame * lf = &ls.pending;
+  fillCopyStage(lf);
+  lf->stage[LATENCY_STAGE_SWAP ] = (now - lf->uploadTime) * 1e-6f;
+  lf->stage[LATENCY_STAGE_TOTAL] = (now - lf->receiveTime) * 1e-6f;
+  if (lf->stage[LATENCY_STAGE_POST] >= 0.0f)
+    lf->stage[LATENCY_STAGE_TOTAL] += lf->stage[LATENCY_STAGE_POST];
+
+  pushStage(LATENCY_STAGE_SWAP , lf->stage[LATENCY_STAGE_SWAP ]);
+  pushStage(LATENCY_STAGE_TOTAL, lf->stage[LATENCY_STAGE_TOTAL]);
+  logFrame(lf);
+  ls.pendingValid = false;
+  LG_UNLOCK(ls.lock);
+}
@@ -0,0 +1,38 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_LATENCY_
+#define _H_LG_LATENCY_
+
+#include <stdbool.h>
+#include "common/KVMFR.h"
+
+bool latency_init(bool graphs, const char * logFile);
+void latency_free(void);
+
+// called from the frame thread as a frame arrives and after the renderer
+// has taken it
+void latency_frameReceived(const KVMFRFrame * frame);
+void latency_frameUploaded(const KVMFRFrame * frame);
+
+// called from the render thread just before the swap
+void latency_preSwap(void);
+
+#endif
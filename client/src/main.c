@@ -45,7 +45,10 @@
 #include "common/thread.h"
 #include "common/locking.h"
 #include "common/event.h"
+#include "common/spscbuffer.h"
+#include "common/rects.h"
 #include "common/ivshmem.h"
+#include "common/framebuffer.h"
 #include "common/time.h"
 #include "common/version.h"
 #include "common/paths.h"
@@ -53,6 +56,8 @@
 
 #include "core.h"
 #include "app.h"
+#include "latency.h"
+#include "avsync.h"
 #include "keybind.h"
 #include "clipboard.h"
 #include "kb.h"
@@ -112,9 +117,10 @@ static bool fpsTimerFn(void * unused)
       memory_order_acquire);
 
   float fps, ups;
+  uint64_t frameCount = 0;
   if (renderCount > 0)
   {
-    const uint64_t frameCount = atomic_exchange_explicit(&g_state.frameCount, 0,
+    frameCount = atomic_exchange_explicit(&g_state.frameCount, 0,
         memory_order_acquire);
 
     const uint64_t time      = nanotime();
@@ -135,6 +141,13 @@ static bool fpsTimerFn(void * unused)
   atomic_store_explicit(&g_state.fps, fps, memory_order_relaxed);
   atomic_store_explicit(&g_state.ups, ups, memory_order_relaxed);
 
+  /* record the CPU time spent busy waiting on the framebuffer per frame */
+  FrameBufferWaitStats stats;
+  framebuffer_get_wait_stats(&stats, true);
+  if (frameCount > 0)
+    ringbuffer_push(g_state.waitTimings,
+        &(float) { stats.spinNs * 1e-6f / frameCount });
+
   return true;
 }
 
@@ -143,6 +156,8 @@ static void preSwapCallback(void * udata)
   const uint64_t * renderStart = (const uint64_t *)udata;
   ringbuffer_push(g_state.renderDuration,
       &(float) {(nanotime() - *renderStart) * 1e-6f});
+  latency_preSwap();
+  avsync_preSwap();
 }
 
 static int renderThread(void * unused)
@@ -169,6 +184,8 @@ static int renderThread(void * unused)
   }
 
   LG_LOCK_INIT(g_state.lgrLock);
+  if (g_params.lockStats)
+    lgLockEnableStats(&g_state.lgrLock, "lgrLock");
 
   /* signal to other threads that the renderer is ready */
   lgSignalEvent(e_startup);
@@ -479,11 +496,25 @@ int main_cursorThread(void * unused)
   return 0;
 }
 
+static void alertTruncated(int size)
+{
+  DEBUG_BREAK();
+  DEBUG_WARN("IVSHMEM too small, screen truncated");
+  DEBUG_WARN("Recommend increase size to %d MiB", size);
+  DEBUG_BREAK();
+
+  app_alert(LG_ALERT_ERROR,
+    "IVSHMEM too small, screen truncated\n"
+    "Recommend increasing size to %d MiB",
+    size);
+}
+
 int main_frameThread(void * unused)
 {
   struct DMAFrameInfo
   {
     KVMFRFrame * frame;
+    uint32_t     offset;
     size_t       dataSize;
     int          fd;
   };
@@ -491,12 +522,14 @@ int main_frameThread(void * unused)
   LGMP_STATUS      status;
   PLGMPClientQueue queue;
 
-  uint32_t          frameSerial = 0;
-  uint32_t          formatVer   = 0;
-  size_t            dataSize    = 0;
-  LG_RendererFormat lgrFormat;
+  uint32_t          frameSerial  = 0;
+  uint32_t          formatVer    = 0;
+  size_t            dataSize     = 0;
+  LG_RendererFormat lgrFormat    = { 0 };
+  int               shmSize      = 0; // the recommended IVSHMEM size in MiB
+  bool              truncAlerted = false;
 
-  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN] = {0};
+  struct DMAFrameInfo dmaInfo[LGMP_Q_FRAME_LEN_MAX] = {0};
   if (g_state.useDMA)
     DEBUG_INFO("Using DMA buffer support");
 
@@ -504,6 +537,13 @@ int main_frameThread(void * unused)
   if (g_state.state != APP_STATE_RUNNING)
     return 0;
 
+  /* sparse frames only carry what changed, so when the host may send them
+   * every frame is applied to a local copy which the renderer reads from */
+  const bool    sparse      = g_state.kvmfrFeatures & KVMFR_FEATURE_SPARSE;
+  FrameBuffer * shadow      = NULL;
+  size_t        shadowSize  = 0;
+  bool          shadowValid = false;
+
   // subscribe to the frame queue
   while(g_state.state == APP_STATE_RUNNING)
   {
@@ -569,34 +609,47 @@ int main_frameThread(void * unused)
       continue;
     }
     frameSerial = frame->frameSerial;
+    latency_frameReceived(frame);
+    avsync_frameReceived(frame);
 
     struct DMAFrameInfo *dma = NULL;
 
-    if (!g_state.formatValid || frame->formatVer != formatVer)
+    const bool compressed = frame->type == FRAME_TYPE_LZ4 && !sparse;
+    if (!g_state.formatValid || frame->formatVer != formatVer ||
+        compressed != lgrFormat.compressed ||
+        frame->transfer != lgrFormat.transfer)
     {
       // setup the renderer format with the frame format details
-      lgrFormat.type   = frame->type;
-      lgrFormat.width  = frame->width;
-      lgrFormat.height = frame->height;
-      lgrFormat.stride = frame->stride;
-      lgrFormat.pitch  = frame->pitch;
-
-      if (frame->height != frame->realHeight)
-      {
-        const float needed =
-          ((frame->realHeight * frame->pitch * 2) / 1048576.0f) + 10.0f;
-        const int   size   = (int)powf(2.0f, ceilf(logf(needed) / logf(2.0f)));
-
-        DEBUG_BREAK();
-        DEBUG_WARN("IVSHMEM too small, screen truncated");
-        DEBUG_WARN("Recommend increase size to %d MiB", size);
-        DEBUG_BREAK();
-
-        app_alert(LG_ALERT_ERROR,
-          "IVSHMEM too small, screen truncated\n"
-          "Recommend increasing size to %d MiB",
-          size);
-      }
+      lgrFormat.type       =
+        frame->type == FRAME_TYPE_LZ4 || frame->type == FRAME_TYPE_SPARSE ?
+        frame->dataType : frame->type;
+      lgrFormat.compressed = compressed;
+      lgrFormat.transfer   = frame->transfer;
+      lgrFormat.width      = frame->width;
+      lgrFormat.height     = frame->height;
+      lgrFormat.stride     = frame->stride;
+      lgrFormat.pitch      = frame->pitch;
+
+      /* the host reports the frame memory it needs for this format, add what
+       * the rest of the IVSHMEM is used for to recommend a size */
+      const float needed =
+        (g_state.shm.size - frame->memSize + frame->memNeeded) / 1048576.0f;
+      const int   size   = (int)powf(2.0f, ceilf(logf(needed) / logf(2.0f)));
+
+      DEBUG_INFO("Frame memory     : %.1f of %.1f MiB in use, %.1f MiB needed",
+          frame->memUsed   / 1048576.0f,
+          frame->memSize   / 1048576.0f,
+          frame->memNeeded / 1048576.0f);
+
+      shmSize      = size;
+      truncAlerted = frame->height != frame->realHeight;
+      atomic_store(&g_state.frameTruncated, false);
+
+      if (truncAlerted)
+        alertTruncated(size);
+      else if (frame->memNeeded > frame->memSize)
+        DEBUG_WARN("IVSHMEM too small to queue full frames, "
+            "recommend increasing size to %d MiB", size);
 
       switch(frame->rotation)
       {
@@ -608,7 +661,7 @@ int main_frameThread(void * unused)
       g_state.rotate = lgrFormat.rotate;
 
       bool error = false;
-      switch(frame->type)
+      switch(lgrFormat.type)
       {
         case FRAME_TYPE_RGBA:
         case FRAME_TYPE_BGRA:
@@ -638,8 +691,10 @@ int main_frameThread(void * unused)
       g_state.formatValid = true;
       formatVer = frame->formatVer;
 
-      DEBUG_INFO("Format: %s %ux%u stride:%u pitch:%u rotation:%d",
-          FrameTypeStr[frame->type],
+      DEBUG_INFO("Format: %s%s%s %ux%u stride:%u pitch:%u rotation:%d",
+          FrameTypeStr[lgrFormat.type],
+          lgrFormat.transfer == FRAME_TRANSFER_PQ ? " PQ" : "",
+          sparse ? " (sparse)" : compressed ? " (LZ4)" : "",
           frame->width, frame->height,
           frame->stride, frame->pitch,
           frame->rotation);
@@ -663,7 +718,8 @@ int main_frameThread(void * unused)
       core_updatePositionInfo();
     }
 
-    if (g_state.useDMA)
+    // compressed and sparse frames can not be imported directly
+    if (g_state.useDMA && !compressed && !sparse)
     {
       /* find the existing dma buffer if it exists */
       for(int i = 0; i < ARRAY_LENGTH(dmaInfo); ++i)
@@ -671,8 +727,8 @@ int main_frameThread(void * unused)
         if (dmaInfo[i].frame == frame)
         {
           dma = &dmaInfo[i];
-          /* if it's too small close it */
-          if (dma->dataSize < dataSize)
+          /* if it's too small or the host moved it close it */
+          if (dma->dataSize < dataSize || dma->offset != frame->offset)
           {
             close(dma->fd);
             dma->fd = -1;
@@ -700,6 +756,7 @@ int main_frameThread(void * unused)
         const uintptr_t pos    = (uintptr_t)msg.mem - (uintptr_t)g_state.shm.mem;
         const uintptr_t offset = (uintptr_t)frame->offset + FrameBufferStructSize;
 
+        dma->offset   = frame->offset;
         dma->dataSize = dataSize;
         dma->fd       = ivshmemGetDMABuf(&g_state.shm, pos + offset, dataSize);
         if (dma->fd < 0)
@@ -712,7 +769,65 @@ int main_frameThread(void * unused)
     }
 
     FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    if (!RENDERER(onFrame, fb, g_state.useDMA ? dma->fd : -1,
+    if (sparse)
+    {
+      if (dataSize > shadowSize)
+      {
+        free(shadow);
+        shadowValid = false;
+        if (!(shadow = malloc(FrameBufferStructSize + dataSize)))
+        {
+          DEBUG_ERROR("Failed to allocate the frame buffer");
+          lgmpClientMessageDone(queue);
+          g_state.state = APP_STATE_SHUTDOWN;
+          break;
+        }
+        shadowSize = dataSize;
+        framebuffer_prepare(shadow);
+      }
+
+      uint8_t    * dst = framebuffer_get_data(shadow);
+      const size_t bpp = lgrFormat.bpp / 8;
+      bool ok;
+      switch(frame->type)
+      {
+        // there is nothing to apply a sparse frame to until a full one arrives
+        case FRAME_TYPE_SPARSE:
+          ok = shadowValid && framebuffer_read_sparse(fb, dst, frame->pitch,
+              frame->width, frame->height, bpp);
+          break;
+
+        case FRAME_TYPE_LZ4:
+        {
+          size_t rows;
+          ok = framebuffer_read_lz4(fb, dst, frame->pitch, frame->height,
+              frame->pitch, &rows);
+          if (ok && rows < frame->height)
+            app_frameTruncated();
+          break;
+        }
+
+        default:
+          ok = framebuffer_read(fb, dst, frame->pitch, frame->height,
+              frame->width, bpp, frame->pitch);
+          break;
+      }
+
+      /* a failed or partial read leaves the local copy corrupt, sparse frames
+       * are dropped until a full frame replaces it */
+      if (!ok)
+      {
+        shadowValid = false;
+        lgmpClientMessageDone(queue);
+        continue;
+      }
+
+      shadowValid = true;
+      framebuffer_set_write_ptr(shadow, dataSize);
+      fb = shadow;
+    }
+
+    if (!RENDERER(onFrame, fb, dma ? dma->fd : -1,
           frame->damageRects, frame->damageRectsCount))
     {
       lgmpClientMessageDone(queue);
@@ -720,6 +835,16 @@ int main_frameThread(void * unused)
       g_state.state = APP_STATE_SHUTDOWN;
       break;
     }
+    latency_frameUploaded(frame);
+    avsync_frameUploaded();
+
+    /* a compressed frame the host had to truncate is only found when it is
+     * decompressed, which the renderer may do later, alert once per format */
+    if (atomic_exchange(&g_state.frameTruncated, false) && !truncAlerted)
+    {
+      truncAlerted = true;
+      alertTruncated(shmSize);
+    }
 
     if (g_params.autoScreensaver && g_state.autoIdleInhibitState != frame->blockScreensaver)
     {
@@ -753,6 +878,7 @@ int main_frameThread(void * unused)
 
   lgmpClientUnsubscribe(&queue);
   RENDERER(onRestart);
+  free(shadow);
 
   if (g_state.useDMA)
   {
@@ -765,31 +891,38 @@ int main_frameThread(void * unused)
   return 0;
 }
 
-void audioStart(int channels, int sampleRate, PSAudioFormat format,
-  uint32_t time)
+static void audioProbe(void)
 {
   /*
    * we probe here so that the audiodev is operating in the context of the SPICE
    * thread/loop to avoid any audio API threading issues
    */
   static int probed = false;
-  if (!probed)
-  {
-    probed = true;
+  if (probed)
+    return;
 
-    // search for the best audiodev to use
-    for(int i = 0; i < LG_AUDIODEV_COUNT; ++i)
-      if (LG_AudioDevs[i]->init())
-      {
-        g_state.audioDev = LG_AudioDevs[i];
-        DEBUG_INFO("Using AudioDev: %s", g_state.audioDev->name);
-        break;
-      }
+  probed = true;
 
-    if (!g_state.audioDev)
-      DEBUG_WARN("Failed to initialize an audio backend");
-  }
+  // search for the best audiodev to use
+  for(int i = 0; i < LG_AUDIODEV_COUNT; ++i)
+    if (LG_AudioDevs[i]->init())
+    {
+      g_state.audioDev = LG_AudioDevs[i];
+      DEBUG_INFO("Using AudioDev: %s", g_state.audioDev->name);
+      break;
+    }
+
+  if (!g_state.audioDev)
+    DEBUG_WARN("Failed to initialize an audio backend");
+}
+
+void audioStart(int channels, int sampleRate, PSAudioFormat format,
+  uint32_t time)
+{
+  g_state.audioChannels = channels;
+  avsync_audioStart(sampleRate, time);
 
+  audioProbe();
   if (g_state.audioDev)
   {
     static int lastChannels   = 0;
@@ -834,7 +967,183 @@ static void audioMute(bool mute)
 static void audioData(uint8_t * data, size_t size)
 {
   if (g_state.audioDev)
+  {
+    // SPICE audio is always S16
+    avsync_audioData(size / (g_state.audioChannels * sizeof(int16_t)));
     g_state.audioDev->play(data, size);
+  }
+}
+
+/*
+ * The microphone path, the audiodev pushes small quanta from its capture thread
+ * into a wait-free ring which the record thread drains into SPICE so that the
+ * realtime capture thread never blocks on the socket.
+ */
+static struct
+{
+  bool        started;
+  int         channels;
+  int         sampleRate;
+  int         stride;
+
+  SPSCBuffer  buffer;
+  LGEvent   * event;
+  LGThread  * thread;
+  atomic_bool running;
+
+  // when the oldest sample waiting to be sent was captured
+  _Atomic(uint64_t) captureTime;
+
+  RingBuffer  latencyTimings;
+  RingBuffer  rttTimings;
+  GraphHandle latencyGraph;
+  GraphHandle rttGraph;
+}
+rec = { 0 };
+
+static void recordPush(uint8_t * data, int frames)
+{
+  // the first sample of the quantum was captured a quantum ago
+  const uint64_t captured = nanotime() -
+    (uint64_t)frames * 1000000000ULL / rec.sampleRate;
+
+  uint64_t expected = 0;
+  atomic_compare_exchange_strong_explicit(&rec.captureTime, &expected,
+      captured, memory_order_relaxed, memory_order_relaxed);
+
+  // if the record thread has fallen this far behind the audio is dropped
+  spscbuffer_append(rec.buffer, data, frames);
+  lgSignalEvent(rec.event);
+}
+
+static int recordThread(void * unused)
+{
+  SPSCBufferSpan span[2];
+  while(atomic_load_explicit(&rec.running, memory_order_acquire))
+  {
+    if (!lgWaitEvent(rec.event, 100))
+      continue;
+
+    const uint64_t captured = atomic_exchange_explicit(&rec.captureTime, 0,
+        memory_order_relaxed);
+
+    int frames;
+    while((frames = spscbuffer_peekRead(rec.buffer, span)) > 0)
+    {
+      for(int i = 0; i < 2; ++i)
+        if (span[i].count)
+          purespice_writeAudio(span[i].values, span[i].count * rec.stride, 0);
+      spscbuffer_commitRead(rec.buffer, frames);
+    }
+
+    if (!captured)
+      continue;
+
+    /* the round trip is the time to get the microphone to the guest plus the
+     * time for the guest's audio to get back out of the speakers, it does not
+     * include any processing inside the guest itself */
+    const float latency = (nanotime() - captured) * 1e-6f;
+    ringbuffer_push(rec.latencyTimings, &latency);
+    ringbuffer_push(rec.rttTimings,
+        &(float){ latency + avsync_getAudioLatency() });
+  }
+
+  return 0;
+}
+
+static void recordStop(void)
+{
+  if (!rec.started)
+    return;
+
+  if (g_state.audioDev)
+    g_state.audioDev->recordStop();
+
+  atomic_store_explicit(&rec.running, false, memory_order_release);
+  lgSignalEvent(rec.event);
+  lgJoinThread(rec.thread, NULL);
+  rec.thread = NULL;
+
+  lgFreeEvent(rec.event);
+  rec.event = NULL;
+  spscbuffer_free(&rec.buffer);
+
+  app_unregisterGraph(rec.latencyGraph);
+  app_unregisterGraph(rec.rttGraph);
+  ringbuffer_free(&rec.latencyTimings);
+  ringbuffer_free(&rec.rttTimings);
+
+  rec.started = false;
+}
+
+static void recordStart(int channels, int sampleRate, PSAudioFormat format)
+{
+  audioProbe();
+  if (!g_state.audioDev || !g_state.audioDev->recordStart)
+    return;
+
+  if (rec.started)
+  {
+    if (channels == rec.channels && sampleRate == rec.sampleRate)
+      return;
+    recordStop();
+  }
+
+  rec.channels   = channels;
+  rec.sampleRate = sampleRate;
+  rec.stride     = channels * sizeof(int16_t);
+  atomic_store(&rec.captureTime, 0);
+
+  // 100ms is far more than the record thread should ever fall behind
+  rec.buffer = spscbuffer_new(sampleRate / 10, rec.stride);
+  rec.event  = lgCreateEvent(true, 0);
+  if (!rec.buffer || !rec.event)
+  {
+    DEBUG_ERROR("Failed to allocate the record buffers");
+    goto err;
+  }
+
+  rec.latencyTimings = ringbuffer_new(256, sizeof(float));
+  rec.rttTimings     = ringbuffer_new(256, sizeof(float));
+
+  atomic_store(&rec.running, true);
+  if (!lgCreateThread("recordThread", recordThread, NULL, &rec.thread))
+  {
+    DEBUG_ERROR("Failed to create the record thread");
+    goto err;
+  }
+
+  rec.latencyGraph = app_registerGraph("MIC LAT"  , rec.latencyTimings,
+      0.0f, 50.0f);
+  rec.rttGraph     = app_registerGraph("AUDIO RTT", rec.rttTimings,
+      0.0f, 200.0f);
+  rec.started      = true;
+
+  DEBUG_INFO("Record %d channels @ %dHz", channels, sampleRate);
+  g_state.audioDev->recordStart(channels, sampleRate, recordPush);
+  return;
+
+err:
+  if (rec.event)
+  {
+    lgFreeEvent(rec.event);
+    rec.event = NULL;
+  }
+  spscbuffer_free(&rec.buffer);
+  ringbuffer_free(&rec.latencyTimings);
+  ringbuffer_free(&rec.rttTimings);
+}
+
+static void recordVolume(int channels, const uint16_t volume[])
+{
+  if (g_state.audioDev && g_state.audioDev->recordVolume)
+    g_state.audioDev->recordVolume(channels, volume);
+}
+
+static void recordMute(bool mute)
+{
+  if (g_state.audioDev && g_state.audioDev->recordMute)
+    g_state.audioDev->recordMute(mute);
 }
 
 void spiceReady(void)
@@ -873,6 +1182,14 @@ int spiceThread(void * arg)
       .mute   = audioMute,
       .stop   = audioStop,
       .data   = audioData
+    },
+    .record =
+    {
+      .enable = g_params.useSpiceAudio && g_params.micEnable,
+      .start  = recordStart,
+      .volume = recordVolume,
+      .mute   = recordMute,
+      .stop   = recordStop
     }
   };
 
@@ -896,6 +1213,7 @@ int spiceThread(void * arg)
 
 end:
 
+  recordStop();
   if (g_state.audioDev)
   {
     g_state.audioDev->free();
@@ -999,11 +1317,19 @@ static int lg_run(void)
   // initialize metrics ringbuffers
   g_state.renderTimings  = ringbuffer_new(256, sizeof(float));
   g_state.uploadTimings  = ringbuffer_new(256, sizeof(float));
+  g_state.waitTimings    = ringbuffer_new(256, sizeof(float));
   g_state.renderDuration = ringbuffer_new(256, sizeof(float));
   overlayGraph_register("FRAME" , g_state.renderTimings , 0.0f, 50.0f);
   overlayGraph_register("UPLOAD", g_state.uploadTimings , 0.0f, 50.0f);
+  overlayGraph_register("FBSPIN", g_state.waitTimings   , 0.0f,  1.0f);
   overlayGraph_register("RENDER", g_state.renderDuration, 0.0f, 10.0f);
 
+  if (!latency_init(g_params.latencyGraphs, g_params.latencyLog))
+    return -1;
+
+  if (!avsync_init(g_params.avSync, g_params.avSyncTolerance))
+    return -1;
+
   initImGuiKeyMap(g_state.io->KeyMap);
 
   // search for the best displayserver ops to use
@@ -1280,6 +1606,14 @@ restart:
       return -1;
   }
 
+  if (udata->frameQueueLen < LGMP_Q_FRAME_LEN_MIN ||
+      udata->frameQueueLen > LGMP_Q_FRAME_LEN_MAX)
+  {
+    DEBUG_ERROR("Unsupported frame queue length %u, expected %d to %d",
+        udata->frameQueueLen, LGMP_Q_FRAME_LEN_MIN, LGMP_Q_FRAME_LEN_MAX);
+    return -1;
+  }
+
   /* parse the kvmfr records from the userdata */
   udataSize -= sizeof(*udata);
   uint8_t * p = (uint8_t *)(udata + 1);
@@ -1362,6 +1696,7 @@ restart:
   }
 
   DEBUG_INFO("Host ready, reported version: %s", udata->hostver);
+  DEBUG_INFO("Frame queue length: %u", udata->frameQueueLen);
   DEBUG_INFO("Starting session");
 
   g_state.kvmfrFeatures = udata->features;
@@ -1467,7 +1802,10 @@ static void lg_shutdown(void)
   // free metrics ringbuffers
   ringbuffer_free(&g_state.renderTimings);
   ringbuffer_free(&g_state.uploadTimings);
+  ringbuffer_free(&g_state.waitTimings);
   ringbuffer_free(&g_state.renderDuration);
+  latency_free();
+  avsync_free();
 
   free(g_state.fontName);
   igDestroyContext(NULL);
@@ -1501,6 +1839,7 @@ int main(int argc, char * argv[])
   lgPathsInit("looking-glass");
   config_init();
   ivshmemOptionsInit();
+  framebuffer_options_init();
   egl_dynProcsInit();
   gl_dynProcsInit();
 
@@ -1521,8 +1860,13 @@ int main(int argc, char * argv[])
   if (!config_load(argc, argv))
     return -1;
 
+  framebuffer_init();
+  if (!rectsStartCopyThreads(g_params.copyThreads))
+    DEBUG_WARN("Failed to start the damage copy threads, continuing without");
+
   const int ret = lg_run();
   lg_shutdown();
+  rectsStopCopyThreads();
 
   config_free();
 
@@ -115,6 +115,7 @@ struct AppState
   LGThread            * frameThread;
   LGEvent             * frameEvent;
   atomic_bool           invalidateWindow;
+  atomic_bool           frameTruncated;
   bool                  formatValid;
   uint64_t              frameTime;
   uint64_t              overlayFrameTime;
@@ -125,6 +126,7 @@ struct AppState
   RingBuffer            renderTimings;
   RingBuffer            renderDuration;
   RingBuffer            uploadTimings;
+  RingBuffer            waitTimings;
 
   atomic_uint_least64_t pendingCount;
   atomic_uint_least64_t renderCount, frameCount;
@@ -137,6 +139,7 @@ struct AppState
 
   struct LG_AudioDevOps * audioDev;
   bool audioStarted;
+  int  audioChannels;
 };
 
 struct AppParams
@@ -185,6 +188,13 @@ struct AppParams
   unsigned int      cursorPollInterval;
   unsigned int      framePollInterval;
   bool              allowDMA;
+  unsigned int      copyThreads;
+  bool              latencyGraphs;
+  const char *      latencyLog;
+  bool              lockStats;
+  bool              avSync;
+  bool              micEnable;
+  int               avSyncTolerance;
 
   bool              forceRenderer;
   unsigned int      forceRendererIndex;
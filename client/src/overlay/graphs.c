@@ -25,11 +25,18 @@
 
 #include "ll.h"
 #include "common/debug.h"
+#include "common/locking.h"
 #include "overlay_utils.h"
 
+#include <float.h>
+#include <inttypes.h>
+
+#define HISTOGRAM_BINS 64
+
 struct GraphState
 {
   bool show;
+  bool histogram;
   struct ll * graphs;
 };
 
@@ -48,6 +55,7 @@ struct OverlayGraph
 static void configCallback(void * udata, int * id)
 {
   igCheckbox("Show Timing Graphs", &gs.show);
+  igCheckbox("Show as Histograms", &gs.histogram);
   igSeparator();
 
   igBeginTable("split", 2, 0, (ImVec2){}, 0);
@@ -117,6 +125,96 @@ static bool rbCalcMetrics(int index, void * value_, void * udata_)
   return true;
 }
 
+struct Histogram
+{
+  float min;
+  float width;
+  int   count;
+  float bins[HISTOGRAM_BINS];
+};
+
+static bool rbCalcHistogram(int index, void * value_, void * udata_)
+{
+  float * value = value_;
+  struct Histogram * udata = udata_;
+
+  int bin = (int)((*value - udata->min) / udata->width);
+  if (bin < 0)
+    bin = 0;
+  else if (bin >= HISTOGRAM_BINS)
+    bin = HISTOGRAM_BINS - 1;
+
+  ++udata->bins[bin];
+  ++udata->count;
+  return true;
+}
+
+static float histogramPercentile(const struct Histogram * hist, float pct)
+{
+  const float target = hist->count * pct;
+  float sum = 0.0f;
+  for(int i = 0; i < HISTOGRAM_BINS; ++i)
+  {
+    sum += hist->bins[i];
+    if (sum >= target)
+      return hist->min + (i + 0.5f) * hist->width;
+  }
+  return hist->min + HISTOGRAM_BINS * hist->width;
+}
+
+static void renderHistogram(GraphHandle graph,
+    const struct BufferMetrics * metrics, ImVec2 size)
+{
+  struct Histogram hist =
+  {
+    .min   = graph->min,
+    .width = (graph->max - graph->min) / HISTOGRAM_BINS
+  };
+  ringbuffer_forEach(graph->buffer, rbCalcHistogram, &hist, false);
+
+  char title[64];
+  if (hist.count)
+    snprintf(title, sizeof(title),
+        "%s: p50:%4.2f p99:%4.2f max:%4.2f",
+        graph->name,
+        histogramPercentile(&hist, 0.50f),
+        histogramPercentile(&hist, 0.99f),
+        metrics->max);
+  else
+    snprintf(title, sizeof(title), "%s: no data", graph->name);
+
+  igPlotHistogramFloatPtr(
+      "",
+      hist.bins,
+      HISTOGRAM_BINS,
+      0,
+      title,
+      0.0f,
+      FLT_MAX,
+      size,
+      sizeof(float));
+}
+
+static void countLockStats(const LG_LockStats * stats, void * udata)
+{
+  ++*(int *)udata;
+}
+
+static void renderLockStats(const LG_LockStats * stats, void * udata)
+{
+  const uint64_t acquisitions = atomic_load(&stats->acquisitions);
+  const uint64_t contended    = atomic_load(&stats->contended   );
+
+  igText("%s: %" PRIu64 " locks, %.2f%% contended, "
+      "%" PRIu64 " spins, %" PRIu64 " parks, max hold %.2fms",
+      stats->name,
+      acquisitions,
+      acquisitions ? contended * 100.0 / acquisitions : 0.0,
+      (uint64_t)atomic_load(&stats->spins),
+      (uint64_t)atomic_load(&stats->parks),
+      atomic_load(&stats->maxHoldNs) / 1e6);
+}
+
 static int graphs_render(void * udata, bool interactive,
     struct Rect * windowRects, int maxRects)
 {
@@ -147,9 +245,13 @@ static int graphs_render(void * udata, bool interactive,
 
   igBegin("Performance Metrics",  NULL, flags);
 
+  int lockCount = 0;
+  lgLockStatsForEach(countLockStats, &lockCount);
+
   ImVec2 winSize;
   igGetContentRegionAvail(&winSize);
-  const float height = (winSize.y / graphCount)
+  const float height =
+    ((winSize.y - lockCount * igGetTextLineHeightWithSpacing()) / graphCount)
     - igGetStyle()->ItemSpacing.y;
 
   for (ll_reset(gs.graphs); ll_walk(gs.graphs, (void **)&graph); )
@@ -166,6 +268,12 @@ static int graphs_render(void * udata, bool interactive,
       metrics.freq = 1000.0f / metrics.avg;
     }
 
+    if (gs.histogram)
+    {
+      renderHistogram(graph, &metrics, (ImVec2){ winSize.x, height });
+      continue;
+    }
+
     char title[64];
     snprintf(title, sizeof(title),
         "%s: min:%4.2f max:%4.2f avg:%4.2f/%4.2fHz",
@@ -183,6 +291,8 @@ static int graphs_render(void * udata, bool interactive,
         sizeof(float));
   };
 
+  lgLockStatsForEach(renderLockStats, NULL);
+
   overlayGetImGuiRect(windowRects);
   igEnd();
   return 1;
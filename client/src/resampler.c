@@ -0,0 +1,321 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "resampler.h"
+#include "app.h"
+#include "avsync.h"
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/ringbuffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* the controller gains, the error is in seconds of buffered audio. A 2ms
+ * error moves the rate by 0.1% while the integral term tracks the steady
+ * clock drift which is usually well under 0.05% */
+#define PI_KP         0.5
+#define PI_KI         0.05
+#define MAX_ADJUST    0.005 // +/- 0.5%
+#define FILTER_PERIOD 0.5   // seconds, smooths the callback sawtooth
+
+struct Resampler
+{
+  int    channels;
+  int    sampleRate;
+  int    baseTarget; // frames, from audio:targetLatency
+  int    target;     // frames, including any A/V sync delay
+
+  // the latency of the audio server past our buffer in microseconds
+  atomic_uint deviceLatency;
+
+  // controller state
+  bool   primed;
+  double fill;    // filtered occupancy in frames
+  double integral;
+  double ratio;   // output frames per input frame
+
+  /* input frames converted to float, the first frame is history needed by the
+   * interpolator and pos is the fractional offset of the next output frame */
+  float * in;
+  int     inFrames;
+  int     inSize;
+  double  pos;
+
+  float * out;
+  int     outSize;
+
+  RingBuffer  latencyTimings;
+  RingBuffer  ratioTimings;
+  GraphHandle latencyGraph;
+  GraphHandle ratioGraph;
+};
+
+bool resampler_new(Resampler ** rs, int channels, int sampleRate)
+{
+  Resampler * this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  const int targetMs = option_get_int("audio", "targetLatency");
+
+  this->channels   = channels;
+  this->sampleRate = sampleRate;
+  this->baseTarget = (int)((int64_t)sampleRate * targetMs / 1000);
+  this->target     = this->baseTarget;
+  this->pos        = 1.0;
+  atomic_init(&this->deviceLatency, 0);
+  resampler_reset(this);
+
+  this->latencyTimings = ringbuffer_new(256, sizeof(float));
+  this->ratioTimings   = ringbuffer_new(256, sizeof(float));
+  this->latencyGraph   = app_registerGraph("AUDIO LAT",
+      this->latencyTimings, 0.0f, targetMs * 2.0f);
+  this->ratioGraph     = app_registerGraph("AUDIO PPM",
+      this->ratioTimings, -MAX_ADJUST * 1e6f, MAX_ADJUST * 1e6f);
+
+  *rs = this;
+  return true;
+}
+
+void resampler_free(Resampler ** rs)
+{
+  Resampler * this = *rs;
+  if (!this)
+    return;
+
+  app_unregisterGraph(this->latencyGraph);
+  app_unregisterGraph(this->ratioGraph);
+  ringbuffer_free(&this->latencyTimings);
+  ringbuffer_free(&this->ratioTimings);
+
+  free(this->in);
+  free(this->out);
+  free(this);
+  *rs = NULL;
+}
+
+int resampler_getMaxTarget(const Resampler * rs)
+{
+  return rs->baseTarget + rs->sampleRate * AVSYNC_MAX_DELAY_MS / 1000;
+}
+
+void resampler_setDeviceLatency(Resampler * rs, double ms)
+{
+  atomic_store_explicit(&rs->deviceLatency, (unsigned int)(ms * 1000.0),
+      memory_order_relaxed);
+}
+
+void resampler_reset(Resampler * rs)
+{
+  rs->primed   = false;
+  rs->fill     = rs->target;
+  rs->integral = 0.0;
+  rs->ratio    = 1.0;
+}
+
+static bool reserve(float ** buf, int * size, int frames, int channels)
+{
+  if (frames <= *size)
+    return true;
+
+  float * tmp = realloc(*buf, frames * channels * sizeof(float));
+  if (!tmp)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  *buf  = tmp;
+  *size = frames;
+  return true;
+}
+
+static void updateRatio(Resampler * rs, int occupancy, int frames)
+{
+  const double dt = (double)frames / rs->sampleRate;
+
+  // don't drag the filter through the initial fill
+  if (!rs->primed)
+  {
+    rs->fill   = occupancy;
+    rs->primed = true;
+  }
+  else
+  {
+    const double alpha = fmin(dt / FILTER_PERIOD, 1.0);
+    rs->fill += (occupancy - rs->fill) * alpha;
+  }
+
+  // positive error means there is too much buffered, slow the output down
+  const double error = (rs->fill - rs->target) / rs->sampleRate;
+  const double iMax  = MAX_ADJUST / PI_KI;
+  rs->integral = fmax(fmin(rs->integral + error * dt, iMax), -iMax);
+
+  const double adjust = PI_KP * error + PI_KI * rs->integral;
+  rs->ratio = 1.0 - fmax(fmin(adjust, MAX_ADJUST), -MAX_ADJUST);
+}
+
+static void s16ToFloat(float * restrict dst, const int16_t * restrict src,
+    int count)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  for(; i + 8 <= count; i += 8)
+  {
+    const __m128i s  = _mm_loadu_si128((const __m128i *)(src + i));
+    const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+    const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+    _mm_storeu_ps(dst + i    , _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+#endif
+  for(; i < count; ++i)
+    dst[i] = src[i] * (1.0f / 32768.0f);
+}
+
+static void floatToS16(int16_t * restrict dst, const float * restrict src,
+    int count)
+{
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  for(; i + 8 <= count; i += 8)
+  {
+    // cvtps rounds to nearest and packs saturates, so no clipping is needed
+    const __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i    ), scale));
+    const __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(src + i + 4), scale));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+  }
+#endif
+  for(; i < count; ++i)
+  {
+    const float v = roundf(src[i] * 32768.0f);
+    dst[i] = v > 32767.0f ? 32767 : v < -32768.0f ? -32768 : (int16_t)v;
+  }
+}
+
+/* 4 point Catmull-Rom interpolation between y1 and y2 */
+static inline float cubic(float y0, float y1, float y2, float y3, float t)
+{
+  return y1 + 0.5f * t * (y2 - y0 + t * (2.0f * y0 - 5.0f * y1 + 4.0f * y2 -
+        y3 + t * (3.0f * (y1 - y2) + y3 - y0)));
+}
+
+void resampler_write(Resampler * rs, SPSCBuffer buffer, const int16_t * data,
+    int frames)
+{
+  if (frames <= 0)
+    return;
+
+  const int channels = rs->channels;
+  // hold back the audio to meet the video if it is running ahead
+  const double toMs   = 1000.0 / rs->sampleRate;
+  const double device = atomic_load_explicit(&rs->deviceLatency,
+      memory_order_relaxed) / 1000.0;
+  const int    delay  = avsync_audioBuffered(rs->fill * toMs + device,
+      rs->baseTarget * toMs + device);
+  rs->target = rs->baseTarget + delay * rs->sampleRate / 1000;
+
+  updateRatio(rs, spscbuffer_getCount(buffer), frames);
+
+  ringbuffer_push(rs->latencyTimings,
+      &(float){ rs->fill * toMs });
+  ringbuffer_push(rs->ratioTimings,
+      &(float){ (rs->ratio - 1.0) * 1e6 });
+
+  // append the new frames after the history
+  if (!reserve(&rs->in, &rs->inSize, rs->inFrames + frames + 1, channels))
+    return;
+
+  // start with a single frame of silence as the interpolator history
+  if (rs->inFrames == 0)
+  {
+    memset(rs->in, 0, channels * sizeof(float));
+    rs->inFrames = 1;
+  }
+
+  s16ToFloat(rs->in + rs->inFrames * channels, data, frames * channels);
+  rs->inFrames += frames;
+
+  // interpolate every output frame that has the two frames after it available
+  const double step   = 1.0 / rs->ratio;
+  const int    maxOut = (int)((rs->inFrames - rs->pos) * rs->ratio) + 2;
+  if (!reserve(&rs->out, &rs->outSize, maxOut, channels))
+    return;
+
+  int outFrames = 0;
+  double pos = rs->pos;
+  while((int)pos + 2 < rs->inFrames)
+  {
+    const int     i  = (int)pos;
+    const float   t  = (float)(pos - i);
+    const float * y0 = rs->in + (i - 1) * channels;
+    const float * y1 = y0 + channels;
+    const float * y2 = y1 + channels;
+    const float * y3 = y2 + channels;
+    float       * o  = rs->out + outFrames * channels;
+
+    for(int c = 0; c < channels; ++c)
+      o[c] = cubic(y0[c], y1[c], y2[c], y3[c], t);
+
+    ++outFrames;
+    pos += step;
+  }
+
+  // keep one frame of history before the next output position
+  const int consumed = (int)pos - 1;
+  if (consumed > 0)
+  {
+    memmove(rs->in, rs->in + consumed * channels,
+        (rs->inFrames - consumed) * channels * sizeof(float));
+    rs->inFrames -= consumed;
+    pos          -= consumed;
+  }
+  rs->pos = pos;
+
+  // write straight into the ring, anything that doesn't fit is dropped
+  SPSCBufferSpan span[2];
+  int avail = spscbuffer_peekWrite(buffer, span);
+  if (outFrames > avail)
+    outFrames = avail;
+
+  const float * src = rs->out;
+  int remain = outFrames;
+  for(int i = 0; i < 2 && remain > 0; ++i)
+  {
+    const int count = remain < span[i].count ? remain : span[i].count;
+    floatToS16(span[i].values, src, count * channels);
+    src    += count * channels;
+    remain -= count;
+  }
+  spscbuffer_commitWrite(buffer, outFrames);
+}
@@ -28,15 +28,19 @@
 #include "types.h"
 
 #define KVMFR_MAGIC   "KVMFR---"
-#define KVMFR_VERSION 15
+#define KVMFR_VERSION 22
 
 #define KVMFR_MAX_DAMAGE_RECTS 64
 
 #define LGMP_Q_POINTER     1
 #define LGMP_Q_FRAME       2
 
-#define LGMP_Q_FRAME_LEN   2
-#define LGMP_Q_POINTER_LEN 20
+// the frame queue depth is selected by the host and reported in
+// KVMFR.frameQueueLen, arrays indexed by frame should use the max
+#define LGMP_Q_FRAME_LEN_MIN     2
+#define LGMP_Q_FRAME_LEN_MAX     4
+#define LGMP_Q_FRAME_LEN_DEFAULT 2
+#define LGMP_Q_POINTER_LEN       20
 
 enum
 {
@@ -49,7 +53,8 @@ typedef uint32_t KVMFRCursorFlags;
 
 enum
 {
-  KVMFR_FEATURE_SETCURSORPOS = 0x1
+  KVMFR_FEATURE_SETCURSORPOS = 0x1,
+  KVMFR_FEATURE_SPARSE       = 0x2  // FRAME_TYPE_SPARSE frames may be sent
 };
 
 typedef uint32_t KVMFRFeatureFlags;
@@ -67,6 +72,7 @@ typedef struct KVMFR
   uint32_t          version;
   char              hostver[32];
   KVMFRFeatureFlags features;
+  uint32_t          frameQueueLen; // number of messages in LGMP_Q_FRAME
   //KVMFRRecords start here if there are any
 }
 KVMFR;
@@ -128,16 +134,29 @@ typedef struct KVMFRFrame
   uint32_t        formatVer;          // the frame format version number
   uint32_t        frameSerial;        // the unique frame number
   FrameType       type;               // the frame data type
+  FrameType       dataType;           // the pixel data type if type is FRAME_TYPE_LZ4 or FRAME_TYPE_SPARSE
+  FrameTransfer   transfer;           // the transfer function the pixel data is encoded with
   uint32_t        width;              // the frame width
   uint32_t        height;             // the frame height
   uint32_t        realHeight;         // the real height if the frame was truncated due to low mem
   FrameRotation   rotation;           // the frame rotation
-  uint32_t        stride;             // the row stride (zero if compressed data)
-  uint32_t        pitch;              // the row pitch  (stride in bytes or the compressed frame size)
+  uint32_t        stride;             // the row stride (of the decompressed data if compressed)
+  uint32_t        pitch;              // the row pitch  (stride in bytes of the decompressed data)
   uint32_t        offset;             // offset from the start of this header to the FrameBuffer header
   uint32_t        damageRectsCount;   // the number of damage rectangles (zero for full-frame damage)
   FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
   bool            blockScreensaver;   // whether the guest has requested to block screensavers
+
+  // host monotonic timestamps in nanoseconds for latency tracing, these are
+  // only comparable with each other as the client clock is unrelated
+  uint64_t        captureTime;        // when the capture completed
+  uint64_t        postTime;           // when the frame was posted to the queue
+  uint64_t        copyTime;           // when the copy completed (zero until then)
+
+  // frame memory use in bytes, to size the IVSHMEM from
+  uint64_t        memUsed;            // in use by the queued frames including this one
+  uint64_t        memNeeded;          // needed to queue full frames of this format
+  uint64_t        memSize;            // the frame memory size
 }
 KVMFRFrame;
 
@@ -24,7 +24,23 @@
 #include <stddef.h>
 #include <stdbool.h>
 
+typedef enum CPUFeature
+{
+  CPU_FEATURE_SSE2,
+  CPU_FEATURE_SSE4_1,
+  CPU_FEATURE_AVX,
+  CPU_FEATURE_AVX2,
+  CPU_FEATURE_AVX512F,
+  CPU_FEATURE_AVX512BW,
+  CPU_FEATURE_F16C,
+
+  CPU_FEATURE_MAX
+}
+CPUFeature;
+
 bool lgCPUInfo(char * model, size_t modelSize, int * procs, int * cores);
+bool lgCPUHasFeature(CPUFeature feature);
+const char * lgCPUFeatureName(CPUFeature feature);
 void lgDebugCPU(void);
 
 #endif
@@ -0,0 +1,75 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_FRAMEALLOC_
+#define _H_LG_COMMON_FRAMEALLOC_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Places the frame buffer of each frame queue slot within one shared block of
+ * memory, each sized for the frame it holds rather than dividing the memory
+ * into equal slots. A slot stays in place while it is large enough and no
+ * other slot has been placed over it, room no other slot keeps is preferred
+ * when placing. Once a slot moves it no longer holds its previous contents,
+ * which the caller is told about so that the whole frame is written to it.
+ * Offsets are of the FrameBuffer header, the data following it is aligned as
+ * requested. */
+
+typedef struct FrameAlloc * FrameAlloc;
+
+FrameAlloc framealloc_new(size_t size, unsigned int slots);
+void framealloc_free(FrameAlloc * fa);
+
+/**
+ * Place the frame buffer for `slot` with room for at least `min` and up to
+ * `want` bytes of data, without overlapping any slot that is live. The slot is
+ * marked live and `size` receives the usable data size. `moved` is set if the
+ * slot did not keep its placement, in which case it does not hold its previous
+ * contents and any released slot it was placed over loses its placement.
+ *
+ * Returns false if there is no room until live slots are released.
+ */
+bool framealloc_place(FrameAlloc fa, unsigned int slot, size_t min,
+    size_t want, size_t align, size_t * offset, size_t * size, bool * moved);
+
+/**
+ * Reduce the slot to `size` bytes of data once it is known how much of its
+ * placement was used, freeing the rest for other slots.
+ */
+void framealloc_shrink(FrameAlloc fa, unsigned int slot, size_t size);
+
+/**
+ * Mark the slot as in use by a reader, or release it. Released slots keep
+ * their placement until another slot is placed over it.
+ */
+void framealloc_setLive(FrameAlloc fa, unsigned int slot, bool live);
+
+/**
+ * The bytes held by live slots, including headers and alignment.
+ */
+size_t framealloc_getUsed(const FrameAlloc fa);
+
+/**
+ * The bytes that `slots` frames of `size` bytes of data can need at most
+ */
+size_t framealloc_getSpan(size_t size, size_t align, unsigned int slots);
+
+#endif
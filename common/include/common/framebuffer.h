@@ -25,20 +25,64 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "common/types.h"
+
 typedef struct stFrameBuffer FrameBuffer;
 
 typedef bool (*FrameBufferReadFn)(void * opaque, const void * src, size_t size);
 
+typedef struct FrameBufferWaitStats
+{
+  uint64_t waits;    // number of calls that had to wait for the writer
+  uint64_t spins;    // number of busy spin iterations
+  uint64_t sleeps;   // number of times the reader slept
+  uint64_t wakeups;  // number of times the writer woke the reader
+  uint64_t timeouts; // number of waits that gave up
+  uint64_t spinNs;   // time spent busy spinning
+  uint64_t sleepNs;  // time spent sleeping
+}
+FrameBufferWaitStats;
+
 /**
  * The size of the FrameBuffer struct
  */
 extern const size_t FrameBufferStructSize;
 
+/**
+ * Register the framebuffer options
+ */
+void framebuffer_options_init(void);
+
+/**
+ * Select the copy kernel to use, this should be called once after the options
+ * have been parsed. If it is not called the kernel is selected automatically
+ * on first use.
+ */
+void framebuffer_init(void);
+
+/**
+ * Start a pool of threads that framebuffer_write uses to copy large frames in
+ * parallel. The count includes the calling thread, values less then 2 leave
+ * framebuffer_write single threaded. The write pointer is only advanced over
+ * the contiguous range of completed chunks so readers may still stream.
+ */
+bool framebuffer_start_write_threads(unsigned int count);
+
+/**
+ * Stop the write threads started by framebuffer_start_write_threads
+ */
+void framebuffer_stop_write_threads(void);
+
 /**
  * Wait for the framebuffer to fill to the specified size
  */
 bool framebuffer_wait(const FrameBuffer * frame, size_t size);
 
+/**
+ * Get the accumulated framebuffer_wait statistics, optionally resetting them
+ */
+void framebuffer_get_wait_stats(FrameBufferWaitStats * stats, bool reset);
+
 /**
  * Read data from the KVMFRFrame into the dst buffer
  */
@@ -61,6 +105,49 @@ void framebuffer_prepare(FrameBuffer * frame);
  */
 bool framebuffer_write(FrameBuffer * frame, const void * src, size_t size);
 
+/**
+ * The same as framebuffer_write but for a src buffer in write-combined or
+ * uncached memory such as a mapped DMA-BUF, which is read with streaming loads
+ */
+bool framebuffer_write_uncached(FrameBuffer * frame, const void * src,
+    size_t size);
+
+/**
+ * Compress height rows of pitch bytes from the src buffer into the KVMFRFrame
+ * as a stream of LZ4 blocks, each published as it completes so the reader can
+ * decompress while the rest of the frame is still being compressed. At most
+ * maxSize bytes are written, if the frame does not fit the stream is ended
+ * early and false is returned.
+ */
+bool framebuffer_write_lz4(FrameBuffer * frame, const void * src,
+    size_t height, size_t pitch, size_t maxSize);
+
+/**
+ * Decompress a frame written by framebuffer_write_lz4 into the dst buffer.
+ * If rows is not NULL it is set to the number of rows decompressed, which is
+ * less than height if the host ran out of room and truncated the frame, the
+ * rows below are left as they were.
+ */
+bool framebuffer_read_lz4(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t height, size_t pitch, size_t * rows);
+
+/**
+ * Write only the tiles of the src frame that intersect the damage rects into
+ * the KVMFRFrame, as a tile index followed by the tiles packed one after the
+ * other. Returns false without publishing anything if the result would be
+ * larger then maxSize.
+ */
+bool framebuffer_write_sparse(FrameBuffer * frame, const void * src,
+    size_t width, size_t height, size_t bpp, size_t pitch,
+    const FrameDamageRect * rects, int count, size_t maxSize);
+
+/**
+ * Copy the tiles of a frame written by framebuffer_write_sparse into the dst
+ * buffer, which must already hold the previous frame
+ */
+bool framebuffer_read_sparse(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t width, size_t height, size_t bpp);
+
 /**
  * Gets the underlying data buffer of the framebuffer.
  * For custom read routines only.
@@ -79,4 +166,9 @@ uint8_t * framebuffer_get_data(FrameBuffer * frame);
  */
 void framebuffer_set_write_ptr(FrameBuffer * frame, size_t size);
 
+/**
+ * Gets the number of bytes written to the framebuffer so far
+ */
+size_t framebuffer_get_write_ptr(const FrameBuffer * frame);
+
 #endif
@@ -0,0 +1,79 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _LG_COMMON_FRAMEDIFF_H_
+#define _LG_COMMON_FRAMEDIFF_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "common/framebuffer.h"
+#include "common/types.h"
+
+typedef struct FrameDiff * FrameDiff;
+
+/**
+ * Create a tile based frame differ for 32bpp frames of the given geometry.
+ * A copy of the previous frame is kept to compare each new frame against,
+ * this is allocated on the first call to framediff_compare.
+ */
+FrameDiff framediff_new(unsigned int width, unsigned int height,
+    unsigned int pitch);
+void framediff_free(FrameDiff * diff);
+
+/**
+ * Force the next compare to report full-frame damage
+ */
+void framediff_reset(FrameDiff diff);
+
+/**
+ * Compare `src` against the previous frame and store the damaged regions in
+ * `rects`, which must hold KVMFR_MAX_DAMAGE_RECTS entries.
+ *
+ * Returns the number of rects, -1 if the frame is unchanged, or zero for
+ * full-frame damage which is reported if the damage can not be described
+ * within the rect limit or covers most of the frame.
+ */
+int framediff_compare(FrameDiff diff, const uint8_t * src,
+    FrameDamageRect * rects);
+
+/**
+ * Use externally provided damage (ie, from the compositor) for the next write
+ * instead of the result of framediff_compare. A count of zero is full-frame
+ * damage.
+ */
+void framediff_setDamage(FrameDiff diff, const FrameDamageRect * rects,
+    int count);
+
+/**
+ * The framebuffer at `frameIndex` no longer holds what was written to it, the
+ * next write to it will copy the whole frame
+ */
+void framediff_invalidate(FrameDiff diff, int frameIndex);
+
+/**
+ * Write `src` into the framebuffer copying only the regions damaged since the
+ * framebuffer at `frameIndex` was last written to. If `uncached` is set `src`
+ * is in write-combined or uncached memory, see framebuffer_write_uncached.
+ */
+void framediff_write(FrameDiff diff, FrameBuffer * frame, int frameIndex,
+    const uint8_t * src, unsigned int height, bool uncached);
+
+#endif
@@ -0,0 +1,44 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_HDR_
+#define _H_LG_COMMON_HDR_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Conversion of scRGB RGBA16F frames, the linear BT.709 format Windows
+ * composes HDR desktops in where 1.0 is 80 nits, to RGBA10 (10:10:10:2)
+ * encoded as HDR10 with the SMPTE ST 2084 (PQ) transfer function and BT.2020
+ * primaries. This halves the size of the frame, colours outside of BT.2020 and
+ * above 10000 nits are clipped. */
+
+/**
+ * Build the conversion table and select the kernel, one of auto, scalar or
+ * avx2. Returns the name of the kernel in use.
+ */
+const char * hdr_init(const char * kernel);
+
+/**
+ * Convert `count` RGBA16F pixels to PQ RGBA10, the alpha is set opaque.
+ */
+void hdr_convertPQ(uint32_t * dst, const uint16_t * src, size_t count);
+
+#endif
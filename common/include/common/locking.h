@@ -24,15 +24,97 @@
 #include "time.h"
 
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-#define LG_LOCK_MODE "Atomic"
-typedef atomic_flag LG_Lock;
-#define LG_LOCK_INIT(x) atomic_flag_clear(&(x))
-#define LG_LOCK(x) \
-  while(atomic_flag_test_and_set_explicit(&(x), memory_order_acquire)) { ; }
-#define LG_UNLOCK(x) \
-  atomic_flag_clear_explicit(&(x), memory_order_release);
-#define LG_LOCK_FREE(x)
+/**
+ * LG_Lock is a small mutex intended for short critical sections. An
+ * uncontended lock and unlock are a single atomic operation. Under contention
+ * the waiter spins for a bounded, per lock adaptive number of iterations
+ * before parking on a futex (or yielding on platforms without one).
+ *
+ * A zero filled LG_Lock is a valid unlocked lock.
+ */
+
+#define LG_LOCK_MODE "Adaptive"
+
+typedef struct LG_LockStats
+{
+  const char          * name;
+  atomic_uint_least64_t acquisitions;
+  atomic_uint_least64_t contended; // acquisitions that had to wait
+  atomic_uint_least64_t spins;     // pause iterations spent waiting
+  atomic_uint_least64_t parks;     // times a waiter went to sleep
+  atomic_uint_least64_t maxHoldNs; // longest time the lock was held
+}
+LG_LockStats;
+
+typedef struct LG_Lock
+{
+  atomic_uint    state;    // see LG_LOCK_STATE_*
+  unsigned int   spinAvg;  // running average of spins needed to acquire
+  LG_LockStats * stats;    // NULL unless lgLockEnableStats was called
+  uint64_t       lockTime; // when the holder acquired the lock, stats only
+}
+LG_Lock;
+
+enum
+{
+  LG_LOCK_STATE_FREE,
+  LG_LOCK_STATE_HELD,
+  LG_LOCK_STATE_WAITERS // held and there may be parked waiters
+};
+
+void lgLockSlow(LG_Lock * lock);
+void lgLockWake(LG_Lock * lock);
+void lgLockAcquired(LG_Lock * lock);
+void lgLockReleased(LG_Lock * lock);
+
+/**
+ * Record contention statistics for the lock under `name`, this adds a small
+ * amount of overhead to every acquisition so is intended for diagnostics.
+ */
+bool lgLockEnableStats(LG_Lock * lock, const char * name);
+
+/**
+ * Call `fn` for each lock with statistics enabled
+ */
+void lgLockStatsForEach(
+    void (*fn)(const LG_LockStats * stats, void * udata), void * udata);
+
+static inline void lgLockInit(LG_Lock * lock)
+{
+  atomic_store_explicit(&lock->state, LG_LOCK_STATE_FREE, memory_order_relaxed);
+  lock->spinAvg = 0;
+  lock->stats   = NULL;
+}
+
+void lgLockFree(LG_Lock * lock);
+
+static inline void lgLock(LG_Lock * lock)
+{
+  unsigned int expected = LG_LOCK_STATE_FREE;
+  if (!atomic_compare_exchange_strong_explicit(&lock->state, &expected,
+        LG_LOCK_STATE_HELD, memory_order_acquire, memory_order_relaxed))
+    lgLockSlow(lock);
+  else if (lock->stats)
+    lgLockAcquired(lock);
+}
+
+static inline void lgUnlock(LG_Lock * lock)
+{
+  if (lock->stats)
+    lgLockReleased(lock);
+
+  if (atomic_exchange_explicit(&lock->state, LG_LOCK_STATE_FREE,
+        memory_order_release) == LG_LOCK_STATE_WAITERS)
+    lgLockWake(lock);
+}
+
+#define LG_LOCK_INIT(x) lgLockInit(&(x))
+#define LG_LOCK(x) lgLock(&(x));
+#define LG_UNLOCK(x) lgUnlock(&(x));
+#define LG_LOCK_FREE(x) lgLockFree(&(x))
 
 #define INTERLOCKED_INC(x) atomic_fetch_add((x), 1)
 #define INTERLOCKED_DEC(x) atomic_fetch_sub((x), 1)
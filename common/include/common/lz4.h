@@ -0,0 +1,53 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_LZ4_
+#define _H_LG_COMMON_LZ4_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A compressor and decompressor for the LZ4 block format. The compressor is
+ * the greedy single pass one as it only needs to keep pace with a capture, the
+ * decompressor copies literals and matches 16 bytes at a time. */
+
+#define LZ4_HASH_LOG  12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_LOG)
+
+// the worst case compressed size of size bytes
+#define LZ4_COMPRESS_BOUND(size) ((size) + ((size) / 255) + 16)
+
+typedef struct LZ4State
+{
+  uint32_t table[LZ4_HASH_SIZE];
+}
+LZ4State;
+
+/* compresses src into dst returning the compressed size, or zero if it would
+ * not fit in dstSize bytes */
+size_t lz4_compress(LZ4State * state, void * dst, size_t dstSize,
+    const void * src, size_t srcSize);
+
+/* decompresses src into dst returning the decompressed size, or zero if the
+ * data is invalid or would not fit in dstSize bytes */
+size_t lz4_decompress(void * dst, size_t dstSize, const void * src,
+    size_t srcSize);
+
+#endif
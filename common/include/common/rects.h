@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include "common/framebuffer.h"
+#include "common/region.h"
 #include "common/types.h"
 
 inline static void rectCopyUnaligned(uint8_t * dest, const uint8_t * src,
@@ -42,11 +43,26 @@ void rectsBufferToFramebuffer(FrameDamageRect * rects, int count,
   FrameBuffer * frame, int dstStride, int height,
   const uint8_t * src, int srcStride);
 
+/* Start a pool of threads that rectsFramebufferToBuffer uses to copy large
+ * damage in parallel by splitting it into horizontal bands. The count includes
+ * the calling thread, values less then 2 leave the copy single threaded */
+bool rectsStartCopyThreads(unsigned int count);
+void rectsStopCopyThreads(void);
+
 void rectsFramebufferToBuffer(FrameDamageRect * rects, int count,
   uint8_t * dst, int dstStride, int height,
   const FrameBuffer * frame, int srcStride);
 
-int rectsMergeOverlapping(FrameDamageRect * rects, int count);
-int rectsRejectContained(FrameDamageRect * rects, int count);
+/* replaces the rects with at most count disjoint rects covering them, joining
+ * rects where copying the pixels between them is cheaper than the extra rect.
+ * scratch is a region owned by the caller that is reused across calls so the
+ * per frame path does not allocate, if NULL a temporary region is created */
+int rectsMergeOverlapping(FrameDamageRect * rects, int count,
+    LGRegion scratch);
+
+/* replaces the rects with the disjoint rects covering exactly them, simplified
+ * only if that would take more than count rects */
+int rectsRejectContained(FrameDamageRect * rects, int count,
+    LGRegion scratch);
 
 #endif
@@ -0,0 +1,88 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_REGION_
+#define _H_LG_COMMON_REGION_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common/types.h"
+
+/* A set of pixels stored as y-bands of sorted, non-overlapping x-spans.
+ *
+ * Each band covers the rows [y1, y2) and holds the spans [x1, x2) that are set
+ * on every one of those rows. Adjacent bands with identical spans are always
+ * coalesced so a region has exactly one representation, which keeps the set
+ * operations linear in the number of spans. */
+
+typedef struct LGRegion * LGRegion;
+
+LGRegion region_new(void);
+void region_free(LGRegion * region);
+
+void region_clear(LGRegion region);
+bool region_copy (LGRegion dst, const LGRegion src);
+
+bool     region_isEmpty  (const LGRegion region);
+uint64_t region_getArea  (const LGRegion region);
+int      region_getBands (const LGRegion region);
+int      region_getSpans (const LGRegion region);
+bool     region_getBounds(const LGRegion region, FrameDamageRect * bounds);
+
+/* adds the union of rects to the region */
+bool region_addRects(LGRegion region, const FrameDamageRect * rects, int count);
+
+/* dst = a op b, dst may be the same region as a or b */
+bool region_union    (LGRegion dst, const LGRegion a, const LGRegion b);
+bool region_intersect(LGRegion dst, const LGRegion a, const LGRegion b);
+bool region_subtract (LGRegion dst, const LGRegion a, const LGRegion b);
+
+/* the relative cost of handling a rect, used to decide when it is cheaper to
+ * copy the pixels between two rects than to handle them separately. All costs
+ * are in bytes copied */
+typedef struct RegionCost
+{
+  unsigned int rectCost; // the fixed cost of each rect
+  unsigned int rowCost;  // the cost of each row of each rect
+  unsigned int bpp;      // the bytes per pixel
+}
+RegionCost;
+
+// row by row CPU copies such as rectsFramebufferToBuffer
+#define REGION_COST_COPY(x) \
+  ((const RegionCost){ .rectCost = 4096, .rowCost = 64, .bpp = (x) })
+
+// a separate GPU upload or copy call for each rect
+#define REGION_COST_UPLOAD(x) \
+  ((const RegionCost){ .rectCost = 65536, .rowCost = 0, .bpp = (x) })
+
+// a quad drawn for each rect
+#define REGION_COST_DRAW \
+  ((const RegionCost){ .rectCost = 256, .rowCost = 0, .bpp = 4 })
+
+/* writes at most maxRects non-overlapping rects covering the region to rects,
+ * growing them where the cost model says the extra pixels are cheaper than the
+ * extra rects, and returns how many were written.
+ * Note: the rects may cover more than the region but never less */
+int region_toRects(const LGRegion region, FrameDamageRect * rects,
+    int maxRects, const RegionCost * cost);
+
+#endif
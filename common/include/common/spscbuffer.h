@@ -0,0 +1,71 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_LG_COMMON_SPSCBUFFER_
+#define _H_LG_COMMON_SPSCBUFFER_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* A wait-free single producer, single consumer ring buffer.
+ *
+ * Exactly one thread may call the producer functions and exactly one thread
+ * may call the consumer functions at any one time, neither will ever block.
+ * This makes it suitable for feeding realtime callbacks such as the audio
+ * server's process callback. */
+
+typedef struct SPSCBuffer * SPSCBuffer;
+
+/* a contiguous run of values within the buffer, a peek returns up to two of
+ * these as the available space may wrap around the end of the buffer */
+typedef struct SPSCBufferSpan
+{
+  void * values;
+  int    count;
+}
+SPSCBufferSpan;
+
+SPSCBuffer spscbuffer_new(int length, size_t valueSize);
+void spscbuffer_free(SPSCBuffer * sb);
+
+int spscbuffer_getLength(const SPSCBuffer sb);
+
+/* returns the number of values available to read, this is a snapshot that the
+ * other side may change at any time */
+int spscbuffer_getCount(const SPSCBuffer sb);
+
+/* producer: returns the free space, filling span with where to write it */
+int  spscbuffer_peekWrite  (SPSCBuffer sb, SPSCBufferSpan span[2]);
+void spscbuffer_commitWrite(SPSCBuffer sb, int count);
+
+/* producer: copies up to count values in returning the number copied */
+int spscbuffer_append(SPSCBuffer sb, const void * values, int count);
+
+/* consumer: returns the values available, filling span with where they are */
+int  spscbuffer_peekRead  (SPSCBuffer sb, SPSCBufferSpan span[2]);
+void spscbuffer_commitRead(SPSCBuffer sb, int count);
+
+/* consumer: copies up to count values out returning the number copied */
+int spscbuffer_consume(SPSCBuffer sb, void * dst, int count);
+
+/* consumer: discards all values currently in the buffer */
+void spscbuffer_drain(SPSCBuffer sb);
+
+#endif
@@ -131,3 +131,15 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     void * udata, LGTimer ** result);
 
 void lgTimerDestroy(LGTimer * timer);
+
+typedef struct LGTimerStats
+{
+  uint64_t count;     // the number of times the callback has run
+  uint64_t overruns;  // expiries skipped because the callback ran too late
+  uint64_t avgLateNs; // how late the callback ran on average
+  uint64_t maxLateNs; // the latest the callback has run
+}
+LGTimerStats;
+
+// get the scheduling jitter of the timer, optionally resetting it
+bool lgTimerGetStats(LGTimer * timer, LGTimerStats * stats, bool reset);
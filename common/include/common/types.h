@@ -55,10 +55,19 @@ typedef enum FrameType
   FRAME_TYPE_RGBA      , // RGBA interleaved: R,G,B,A 32bpp
   FRAME_TYPE_RGBA10    , // RGBA interleaved: R,G,B,A 10,10,10,2 bpp
   FRAME_TYPE_RGBA16F   , // RGBA interleaved: R,G,B,A 16,16,16,16 bpp float
+  FRAME_TYPE_LZ4       , // LZ4 compressed blocks of another frame type
+  FRAME_TYPE_SPARSE    , // only the damaged tiles of another frame type
   FRAME_TYPE_MAX       , // sentinel value
 }
 FrameType;
 
+typedef enum FrameTransfer
+{
+  FRAME_TRANSFER_DEFAULT, // as the frame type is normally encoded
+  FRAME_TRANSFER_PQ     , // SMPTE ST 2084 (PQ) with BT.2020 primaries (HDR10)
+}
+FrameTransfer;
+
 typedef enum FrameRotation
 {
   FRAME_ROT_0,
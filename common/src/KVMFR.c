@@ -26,5 +26,7 @@ const char * FrameTypeStr[FRAME_TYPE_MAX] =
   "FRAME_TYPE_BGRA",
   "FRAME_TYPE_RGBA",
   "FRAME_TYPE_RGBA10",
-  "FRAME_TYPE_RGBA16F"
+  "FRAME_TYPE_RGBA16F",
+  "FRAME_TYPE_LZ4",
+  "FRAME_TYPE_SPARSE"
 };
@@ -21,6 +21,51 @@
 #include "common/cpuinfo.h"
 #include "common/debug.h"
 
+#include <stdio.h>
+
+static const char * featureNames[CPU_FEATURE_MAX] =
+{
+  [CPU_FEATURE_SSE2    ] = "SSE2",
+  [CPU_FEATURE_SSE4_1  ] = "SSE4.1",
+  [CPU_FEATURE_AVX     ] = "AVX",
+  [CPU_FEATURE_AVX2    ] = "AVX2",
+  [CPU_FEATURE_AVX512F ] = "AVX512F",
+  [CPU_FEATURE_AVX512BW] = "AVX512BW",
+  [CPU_FEATURE_F16C    ] = "F16C"
+};
+
+bool lgCPUHasFeature(CPUFeature feature)
+{
+  static bool init = false;
+  static bool features[CPU_FEATURE_MAX];
+
+  if (!init)
+  {
+    __builtin_cpu_init();
+    features[CPU_FEATURE_SSE2    ] = __builtin_cpu_supports("sse2"    );
+    features[CPU_FEATURE_SSE4_1  ] = __builtin_cpu_supports("sse4.1"  );
+    features[CPU_FEATURE_AVX     ] = __builtin_cpu_supports("avx"     );
+    features[CPU_FEATURE_AVX2    ] = __builtin_cpu_supports("avx2"    );
+    features[CPU_FEATURE_AVX512F ] = __builtin_cpu_supports("avx512f" );
+    features[CPU_FEATURE_AVX512BW] = __builtin_cpu_supports("avx512bw");
+    features[CPU_FEATURE_F16C    ] = __builtin_cpu_supports("f16c"    );
+    init = true;
+  }
+
+  if (feature < 0 || feature >= CPU_FEATURE_MAX)
+    return false;
+
+  return features[feature];
+}
+
+const char * lgCPUFeatureName(CPUFeature feature)
+{
+  if (feature < 0 || feature >= CPU_FEATURE_MAX)
+    return "Unknown";
+
+  return featureNames[feature];
+}
+
 void lgDebugCPU(void)
 {
   char model[1024];
@@ -35,4 +80,20 @@ void lgDebugCPU(void)
 
   DEBUG_INFO("CPU Model: %s", model);
   DEBUG_INFO("CPU: %d cores, %d threads", cores, procs);
+
+  char   features[256];
+  size_t len = 0;
+  features[0] = '\0';
+  for(int i = 0; i < CPU_FEATURE_MAX; ++i)
+  {
+    if (!lgCPUHasFeature(i))
+      continue;
+
+    len += snprintf(features + len, sizeof(features) - len, "%s%s",
+        len ? " " : "", lgCPUFeatureName(i));
+    if (len >= sizeof(features))
+      break;
+  }
+
+  DEBUG_INFO("CPU Features: %s", len ? features : "None");
 }
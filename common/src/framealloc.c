@@ -0,0 +1,194 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/framealloc.h"
+#include "common/framebuffer.h"
+#include "common/debug.h"
+
+#include <stdlib.h>
+
+#define ALIGN_TO(x, a) (((x) + (a) - 1) & ~((a) - 1))
+
+struct FrameSlot
+{
+  size_t offset;
+  size_t size;   // including the FrameBuffer header, zero if not placed
+  bool   live;
+};
+
+struct FrameAlloc
+{
+  size_t           size;
+  unsigned int     slots;
+  struct FrameSlot slot[0];
+};
+
+FrameAlloc framealloc_new(size_t size, unsigned int slots)
+{
+  struct FrameAlloc * fa = calloc(1, sizeof(*fa) + sizeof(*fa->slot) * slots);
+  if (!fa)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  fa->size  = size;
+  fa->slots = slots;
+  return fa;
+}
+
+void framealloc_free(FrameAlloc * fa)
+{
+  if (!*fa)
+    return;
+
+  free(*fa);
+  *fa = NULL;
+}
+
+/**
+ * Find the first gap between the placed slots that fits `want` bytes of data,
+ * otherwise the largest that fits `min`. Released slots are only kept out of
+ * the way if `keep` is set.
+ */
+static bool findGap(FrameAlloc fa, unsigned int slot, size_t min, size_t want,
+    size_t align, bool keep, size_t * pos, size_t * size)
+{
+  // the slots in the way sorted by offset
+  struct FrameSlot * used[fa->slots];
+  unsigned int count = 0;
+  for(unsigned int i = 0; i < fa->slots; ++i)
+  {
+    struct FrameSlot * l = fa->slot + i;
+    if (i == slot || !l->size || !(l->live || keep))
+      continue;
+
+    unsigned int j = count++;
+    for(; j > 0 && used[j - 1]->offset > l->offset; --j)
+      used[j] = used[j - 1];
+    used[j] = l;
+  }
+
+  size_t bestPos  = 0;
+  size_t bestSize = 0;
+  size_t at       = 0;
+  for(unsigned int i = 0; i <= count; ++i)
+  {
+    const size_t end   = i < count ? used[i]->offset : fa->size;
+    const size_t start =
+      ALIGN_TO(at + FrameBufferStructSize, align) - FrameBufferStructSize;
+
+    if (start < end && end - start > FrameBufferStructSize)
+    {
+      const size_t avail = end - start - FrameBufferStructSize;
+      if (avail >= want)
+      {
+        bestPos  = start;
+        bestSize = want;
+        break;
+      }
+
+      if (avail >= min && avail > bestSize)
+      {
+        bestPos  = start;
+        bestSize = avail;
+      }
+    }
+
+    if (i < count && used[i]->offset + used[i]->size > at)
+      at = used[i]->offset + used[i]->size;
+  }
+
+  *pos  = bestPos;
+  *size = bestSize;
+  return bestSize > 0;
+}
+
+bool framealloc_place(FrameAlloc fa, unsigned int slot, size_t min,
+    size_t want, size_t align, size_t * offset, size_t * size, bool * moved)
+{
+  DEBUG_ASSERT(slot < fa->slots);
+  DEBUG_ASSERT(min <= want && want > 0);
+  struct FrameSlot * s = fa->slot + slot;
+
+  // stay in place if we can, the other slots can not have been placed over it
+  if (s->size >= FrameBufferStructSize + want &&
+      ((s->offset + FrameBufferStructSize) & (align - 1)) == 0)
+  {
+    s->size = FrameBufferStructSize + want;
+    s->live = true;
+    *offset = s->offset;
+    *size   = want;
+    *moved  = false;
+    return true;
+  }
+
+  /* prefer room that no other slot keeps so their contents stay valid, but
+   * place over released slots rather than wait for the live ones */
+  size_t bestPos, bestSize;
+  if (!findGap(fa, slot, want, want, align, true, &bestPos, &bestSize) &&
+      !findGap(fa, slot, min, want, align, false, &bestPos, &bestSize))
+    return false;
+
+  // anything we are placed over is lost
+  const size_t bestEnd = bestPos + FrameBufferStructSize + bestSize;
+  for(unsigned int i = 0; i < fa->slots; ++i)
+  {
+    struct FrameSlot * o = fa->slot + i;
+    if (o->size && o->offset < bestEnd && bestPos < o->offset + o->size)
+      o->size = 0;
+  }
+
+  s->offset = bestPos;
+  s->size   = FrameBufferStructSize + bestSize;
+  s->live   = true;
+  *offset   = bestPos;
+  *size     = bestSize;
+  *moved    = true;
+  return true;
+}
+
+void framealloc_shrink(FrameAlloc fa, unsigned int slot, size_t size)
+{
+  DEBUG_ASSERT(slot < fa->slots);
+  struct FrameSlot * s = fa->slot + slot;
+  if (s->size > FrameBufferStructSize + size)
+    s->size = FrameBufferStructSize + size;
+}
+
+void framealloc_setLive(FrameAlloc fa, unsigned int slot, bool live)
+{
+  DEBUG_ASSERT(slot < fa->slots);
+  fa->slot[slot].live = live;
+}
+
+size_t framealloc_getUsed(const FrameAlloc fa)
+{
+  size_t used = 0;
+  for(unsigned int i = 0; i < fa->slots; ++i)
+    if (fa->slot[i].live)
+      used += fa->slot[i].size;
+  return used;
+}
+
+size_t framealloc_getSpan(size_t size, size_t align, unsigned int slots)
+{
+  return (ALIGN_TO(FrameBufferStructSize + size, align) + align) * slots;
+}
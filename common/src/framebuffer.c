@@ -20,6 +20,13 @@
 
 #include "common/framebuffer.h"
 #include "common/debug.h"
+#include "common/cpuinfo.h"
+#include "common/option.h"
+#include "common/stringlist.h"
+#include "common/thread.h"
+#include "common/event.h"
+#include "common/time.h"
+#include "common/lz4.h"
 
 //#define FB_PROFILE
 #ifdef FB_PROFILE
@@ -27,38 +34,691 @@
 #endif
 
 #include <string.h>
+#include <strings.h>
 #include <stdatomic.h>
-#include <emmintrin.h>
-#include <smmintrin.h>
+#include <immintrin.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <errno.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 #define FB_CHUNK_SIZE 1048576 // 1MB
-#define FB_SPIN_LIMIT 10000   // 10ms
+
+#define FB_WAIT_TIMEOUT  500000000ULL // 500ms, give up if the frame stalls
+#define FB_SPIN_TIME         20000ULL // 20μs of busy spinning before sleeping
+#define FB_SLEEP_MIN          5000ULL // 5μs
+#define FB_SLEEP_MAX       1000000ULL // 1ms
+#define FB_MAX_WRITE_THREADS 16
+
+// frames smaller then this many chunks are not worth splitting across threads
+#define FB_PARALLEL_MIN_CHUNKS 4
+
+// the target uncompressed size of each block in a compressed frame
+#define FB_LZ4_BLOCK_SIZE 65536
+#define FB_LZ4_RAW        0x80000000U // the block is stored uncompressed
+
+// the size of the square tiles in a sparse frame
+#define FB_TILE_SIZE 64
 
 struct stFrameBuffer
 {
   atomic_uint_least32_t wp;
+  atomic_uint_least32_t waiters; // readers sleeping on wp
   uint8_t               data[0];
 };
 
 const size_t FrameBufferStructSize = sizeof(FrameBuffer);
 
-bool framebuffer_wait(const FrameBuffer * frame, size_t size)
+static struct
+{
+  atomic_uint_least64_t waits;
+  atomic_uint_least64_t spins;
+  atomic_uint_least64_t sleeps;
+  atomic_uint_least64_t wakeups;
+  atomic_uint_least64_t timeouts;
+  atomic_uint_least64_t spinNs;
+  atomic_uint_least64_t sleepNs;
+}
+waitStats = { 0 };
+
+/**
+ * Wake any readers sleeping in framebuffer_wait, this only has an effect if
+ * the readers share the same kernel as the writer (ie, loopback or host to
+ * host), across a VM boundary the readers fall back to the adaptive backoff.
+ */
+static inline void fbWake(FrameBuffer * frame)
+{
+#if defined(__linux__)
+  // order the write pointer store before the waiters load
+  atomic_thread_fence(memory_order_seq_cst);
+  uint_least32_t waiters =
+    atomic_load_explicit(&frame->waiters, memory_order_relaxed);
+
+  /* if nobody was asleep the count is stale, left by a reader that went away
+   * or by whatever the memory held before it was a frame buffer, so drop it
+   * unless a reader has come along since */
+  if (waiters &&
+      syscall(SYS_futex, &frame->wp, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0) == 0)
+    atomic_compare_exchange_strong_explicit(&frame->waiters, &waiters, 0,
+        memory_order_relaxed, memory_order_relaxed);
+#endif
+}
+
+static inline void fbSetWritePtr(FrameBuffer * frame, uint_least32_t wp)
 {
-  while(atomic_load_explicit(&frame->wp, memory_order_acquire) < size)
+  atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  fbWake(frame);
+}
+
+/**
+ * Sleep until the write pointer moves from `wp` or `ns` elapses, returns true
+ * if we were woken by the writer.
+ */
+static bool fbSleep(const FrameBuffer * frame, uint_least32_t wp, uint64_t ns)
+{
+  bool woken = false;
+  FrameBuffer * fb = (FrameBuffer *)frame;
+  atomic_fetch_add_explicit(&fb->waiters, 1, memory_order_acq_rel);
+
+#if defined(__linux__)
+  const struct timespec ts =
   {
-    int spinCount = 0;
-    while(frame->wp < size)
+    .tv_sec  = ns / 1000000000ULL,
+    .tv_nsec = ns % 1000000000ULL
+  };
+
+  if (syscall(SYS_futex, &fb->wp, FUTEX_WAIT, wp, &ts, NULL, 0) == 0)
+    woken = atomic_load_explicit(&fb->wp, memory_order_acquire) != wp;
+  else if (errno == EAGAIN)
+    woken = false; // wp had already moved on
+#else
+  nsleep(ns);
+#endif
+
+  // the writer may have dropped our count, never take it below zero
+  uint_least32_t waiters =
+    atomic_load_explicit(&fb->waiters, memory_order_relaxed);
+  while(waiters && !atomic_compare_exchange_weak_explicit(&fb->waiters,
+        &waiters, waiters - 1, memory_order_acq_rel, memory_order_relaxed)) {}
+  return woken;
+}
+
+void framebuffer_get_wait_stats(FrameBufferWaitStats * stats, bool reset)
+{
+#define FB_STAT(x) stats->x = reset ? \
+  atomic_exchange(&waitStats.x, 0) : atomic_load(&waitStats.x)
+  FB_STAT(waits   );
+  FB_STAT(spins   );
+  FB_STAT(sleeps  );
+  FB_STAT(wakeups );
+  FB_STAT(timeouts);
+  FB_STAT(spinNs  );
+  FB_STAT(sleepNs );
+#undef FB_STAT
+}
+
+typedef void (*FBCopyFn)(void * restrict dst, const void * restrict src,
+    size_t size);
+
+struct FBCopyKernel
+{
+  const char * name;
+  CPUFeature   feature;
+  bool         nonTemporal;
+  FBCopyFn     fn;
+};
+
+/**
+ * Copy the unaligned head so that the destination is aligned to `align`
+ */
+static inline size_t fbCopyHead(uint8_t ** d, const uint8_t ** s, size_t size,
+    size_t align)
+{
+  size_t head = (align - ((uintptr_t)*d & (align - 1))) & (align - 1);
+  if (head > size)
+    head = size;
+
+  if (head)
+  {
+    memcpy(*d, *s, head);
+    *d += head;
+    *s += head;
+  }
+
+  return head;
+}
+
+/**
+ * Generates a copy kernel that moves four vectors per iteration with unaligned
+ * loads and aligned stores, the destination is aligned first.
+ */
+#define FB_COPY_KERNEL(fnName, isa, vecType, load, store, fence) \
+  __attribute__((target(isa))) \
+  static void fnName(void * restrict dst, const void * restrict src, \
+      size_t size) \
+  { \
+    uint8_t       * d = (uint8_t *)dst; \
+    const uint8_t * s = (const uint8_t *)src; \
+    size -= fbCopyHead(&d, &s, size, sizeof(vecType)); \
+    \
+    for(; size >= 4 * sizeof(vecType); size -= 4 * sizeof(vecType)) \
+    { \
+      const vecType * _s = (const vecType *)s; \
+      vecType       * _d = (vecType       *)d; \
+      const vecType v1 = load(_s + 0); \
+      const vecType v2 = load(_s + 1); \
+      const vecType v3 = load(_s + 2); \
+      const vecType v4 = load(_s + 3); \
+      store(_d + 0, v1); \
+      store(_d + 1, v2); \
+      store(_d + 2, v3); \
+      store(_d + 3, v4); \
+      s += 4 * sizeof(vecType); \
+      d += 4 * sizeof(vecType); \
+    } \
+    \
+    fence; \
+    if (size) \
+      memcpy(d, s, size); \
+  }
+
+static void fbCopyMemcpy(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  memcpy(dst, src, size);
+}
+
+FB_COPY_KERNEL(fbCopySSE2   , "sse2"   , __m128i, _mm_loadu_si128   ,
+    _mm_store_si128   , (void)0     )
+FB_COPY_KERNEL(fbCopySSE2NT , "sse2"   , __m128i, _mm_loadu_si128   ,
+    _mm_stream_si128  , _mm_sfence())
+FB_COPY_KERNEL(fbCopyAVX2   , "avx2"   , __m256i, _mm256_loadu_si256,
+    _mm256_store_si256, (void)0     )
+FB_COPY_KERNEL(fbCopyAVX2NT , "avx2"   , __m256i, _mm256_loadu_si256,
+    _mm256_stream_si256, _mm_sfence())
+FB_COPY_KERNEL(fbCopyAVX512 , "avx512f", __m512i, _mm512_loadu_si512,
+    _mm512_store_si512, (void)0     )
+FB_COPY_KERNEL(fbCopyAVX512NT, "avx512f", __m512i, _mm512_loadu_si512,
+    _mm512_stream_si512, _mm_sfence())
+
+/**
+ * Copy from write-combined or uncached memory (ie, a mapped DMA-BUF) where
+ * ordinary loads are not cached and each one is a round trip to the memory.
+ * Streaming loads fetch a whole line at a time into the fill buffers instead.
+ * They require an aligned source, so the source is aligned rather than the
+ * destination.
+ */
+__attribute__((target("sse4.1")))
+static void fbCopySSE41SL(void * restrict dst, const void * restrict src,
+    size_t size)
+{
+  uint8_t       * d = (uint8_t *)dst;
+  const uint8_t * s = (const uint8_t *)src;
+
+  size_t head = (16 - ((uintptr_t)s & 15)) & 15;
+  if (head > size)
+    head = size;
+
+  if (head)
+  {
+    memcpy(d, s, head);
+    d    += head;
+    s    += head;
+    size -= head;
+  }
+
+  const bool aligned = ((uintptr_t)d & 15) == 0;
+  for(; size > 63; size -= 64, s += 64, d += 64)
+  {
+    __m128i * _s = (__m128i *)s;
+    __m128i * _d = (__m128i *)d;
+    const __m128i v1 = _mm_stream_load_si128(_s + 0);
+    const __m128i v2 = _mm_stream_load_si128(_s + 1);
+    const __m128i v3 = _mm_stream_load_si128(_s + 2);
+    const __m128i v4 = _mm_stream_load_si128(_s + 3);
+    if (aligned)
     {
-      if (++spinCount == FB_SPIN_LIMIT)
-        return false;
-      usleep(1);
+      _mm_stream_si128(_d + 0, v1);
+      _mm_stream_si128(_d + 1, v2);
+      _mm_stream_si128(_d + 2, v3);
+      _mm_stream_si128(_d + 3, v4);
+    }
+    else
+    {
+      _mm_storeu_si128(_d + 0, v1);
+      _mm_storeu_si128(_d + 1, v2);
+      _mm_storeu_si128(_d + 2, v3);
+      _mm_storeu_si128(_d + 3, v4);
     }
   }
 
+  _mm_sfence();
+  if (size)
+    memcpy(d, s, size);
+}
+
+// ordered from the most to the least preferred for automatic selection
+static const struct FBCopyKernel copyKernels[] =
+{
+  { "avx512nt", CPU_FEATURE_AVX512F, true , fbCopyAVX512NT },
+  { "avx512"  , CPU_FEATURE_AVX512F, false, fbCopyAVX512   },
+  { "avx2nt"  , CPU_FEATURE_AVX2   , true , fbCopyAVX2NT   },
+  { "avx2"    , CPU_FEATURE_AVX2   , false, fbCopyAVX2     },
+  { "sse2nt"  , CPU_FEATURE_SSE2   , true , fbCopySSE2NT   },
+  { "sse2"    , CPU_FEATURE_SSE2   , false, fbCopySSE2     },
+  { "sse41sl" , CPU_FEATURE_SSE4_1 , false, fbCopySSE41SL  },
+  { "memcpy"  , CPU_FEATURE_MAX    , false, fbCopyMemcpy   },
+  { NULL }
+};
+
+static const struct FBCopyKernel * copyKernel         = NULL;
+static const struct FBCopyKernel * uncachedCopyKernel = NULL;
+
+static const struct FBCopyKernel * fbFindKernel(const char * name)
+{
+  for(const struct FBCopyKernel * k = copyKernels; k->name; ++k)
+    if (strcasecmp(k->name, name) == 0)
+      return k;
+  return NULL;
+}
+
+static bool fbKernelSupported(const struct FBCopyKernel * kernel)
+{
+  return kernel->feature == CPU_FEATURE_MAX || lgCPUHasFeature(kernel->feature);
+}
+
+static const struct FBCopyKernel * fbSelectKernel(const char * name)
+{
+  if (name && *name && strcasecmp(name, "auto") != 0)
+  {
+    const struct FBCopyKernel * k = fbFindKernel(name);
+    if (k && fbKernelSupported(k))
+      return k;
+
+    DEBUG_WARN("Copy kernel `%s` is not supported by this CPU, using auto",
+        name);
+  }
+
+  /* a frame is written once and is far larger than the cache, so whether it is
+   * written to the IVSHMEM for another process or read out of it into a PBO or
+   * a local copy, none of it is still cached when it is next read. As such the
+   * non-temporal kernels are preferred to avoid the RFO and cache pollution.
+   * Streaming loads gain nothing over plain ones from cacheable memory, the
+   * sse41sl kernel is only picked for uncached sources, see
+   * fbSelectUncachedKernel */
+  for(const struct FBCopyKernel * k = copyKernels; k->name; ++k)
+    if (k->nonTemporal && fbKernelSupported(k))
+      return k;
+
+  return fbFindKernel("memcpy");
+}
+
+static inline FBCopyFn fbGetCopyFn(void)
+{
+  if (!copyKernel)
+    copyKernel = fbSelectKernel(NULL);
+  return copyKernel->fn;
+}
+
+/**
+ * Select the kernel for sources that are write-combined or uncached, plain
+ * loads from these are many times slower than from cacheable memory so the
+ * streaming load kernel is used where supported, unless a kernel was chosen.
+ */
+static const struct FBCopyKernel * fbSelectUncachedKernel(const char * name)
+{
+  if (name && *name && strcasecmp(name, "auto") != 0)
+    return fbSelectKernel(name);
+
+  const struct FBCopyKernel * k = fbFindKernel("sse41sl");
+  return fbKernelSupported(k) ? k : fbSelectKernel(NULL);
+}
+
+static inline FBCopyFn fbGetUncachedCopyFn(void)
+{
+  if (!uncachedCopyKernel)
+    uncachedCopyKernel = fbSelectUncachedKernel(NULL);
+  return uncachedCopyKernel->fn;
+}
+
+static bool fbCopyKernelValidator(struct Option * opt, const char ** error)
+{
+  if (strcasecmp(opt->value.x_string, "auto") == 0)
+    return true;
+
+  if (!fbFindKernel(opt->value.x_string))
+  {
+    *error = "Invalid copy kernel specified";
+    return false;
+  }
+
+  return true;
+}
+
+static StringList fbCopyKernelGetValues(struct Option * option)
+{
+  StringList sl = stringlist_new(false);
+  stringlist_push(sl, "auto");
+  for(const struct FBCopyKernel * k = copyKernels; k->name; ++k)
+    stringlist_push(sl, (char *)k->name);
+  return sl;
+}
+
+void framebuffer_options_init(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "app",
+      .name           = "copyKernel",
+      .description    = "The frame copy kernel to use (auto, memcpy, sse2, avx2, avx512, ...)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "auto",
+      .validator      = fbCopyKernelValidator,
+      .getValues      = fbCopyKernelGetValues
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+void framebuffer_init(void)
+{
+  const char * name = NULL;
+  if (option_get("app", "copyKernel"))
+    name = option_get_string("app", "copyKernel");
+
+  copyKernel         = fbSelectKernel(name);
+  uncachedCopyKernel = fbSelectUncachedKernel(name);
+  DEBUG_INFO("Copy Kernel      : %s", copyKernel->name);
+}
+
+struct FBWriteJob
+{
+  FrameBuffer   * frame;
+  const uint8_t * src;
+  size_t          size;
+  unsigned int    chunks;
+  FBCopyFn        copy;
+
+  atomic_bool   * chunkDone;
+  unsigned int    chunkDoneSize;
+
+  atomic_uint     nextChunk;
+  atomic_uint     completed;
+  atomic_uint     published;
+};
+
+static struct
+{
+  unsigned int      threadCount;
+  LGThread        * threads[FB_MAX_WRITE_THREADS];
+  LGEvent         * events [FB_MAX_WRITE_THREADS];
+  atomic_bool       running;
+
+  struct FBWriteJob job;
+  atomic_bool       live;
+  atomic_uint       active;
+}
+pool = { 0 };
+
+/**
+ * Advance the write pointer over the contiguous prefix of completed chunks.
+ * Any thread may call this, the write pointer is only ever moved forwards.
+ */
+static void fbPublishChunks(struct FBWriteJob * job)
+{
+  unsigned int p = atomic_load(&job->published);
+  while(p < job->chunks && atomic_load(&job->chunkDone[p]))
+  {
+    if (!atomic_compare_exchange_weak(&job->published, &p, p + 1))
+      continue;
+
+    ++p;
+    size_t end = (size_t)p * FB_CHUNK_SIZE;
+    if (end > job->size)
+      end = job->size;
+
+    uint_least32_t wp = atomic_load_explicit(&job->frame->wp,
+        memory_order_relaxed);
+    while(wp < end && !atomic_compare_exchange_weak_explicit(&job->frame->wp,
+          &wp, end, memory_order_release, memory_order_relaxed)) {}
+    fbWake(job->frame);
+  }
+}
+
+static void fbProcessChunks(struct FBWriteJob * job)
+{
+  unsigned int chunk;
+  while((chunk = atomic_fetch_add(&job->nextChunk, 1)) < job->chunks)
+  {
+    const size_t offset = (size_t)chunk * FB_CHUNK_SIZE;
+    const size_t remain = job->size - offset;
+    job->copy(job->frame->data + offset, job->src + offset,
+        remain < FB_CHUNK_SIZE ? remain : FB_CHUNK_SIZE);
+
+    atomic_store(&job->chunkDone[chunk], true);
+    atomic_fetch_add(&job->completed, 1);
+    fbPublishChunks(job);
+  }
+}
+
+static int fbWriteThread(void * opaque)
+{
+  LGEvent * event = (LGEvent *)opaque;
+  while(atomic_load(&pool.running))
+  {
+    if (!lgWaitEvent(event, TIMEOUT_INFINITE))
+      continue;
+
+    atomic_fetch_add(&pool.active, 1);
+    if (atomic_load(&pool.live))
+      fbProcessChunks(&pool.job);
+    atomic_fetch_sub(&pool.active, 1);
+  }
+  return 0;
+}
+
+bool framebuffer_start_write_threads(unsigned int count)
+{
+  if (pool.threadCount)
+    framebuffer_stop_write_threads();
+
+  // the calling thread also copies, so it counts as one of the threads
+  if (count < 2)
+    return true;
+
+  if (count > FB_MAX_WRITE_THREADS + 1)
+  {
+    DEBUG_WARN("Limiting the frame write threads to %d",
+        FB_MAX_WRITE_THREADS + 1);
+    count = FB_MAX_WRITE_THREADS + 1;
+  }
+
+  atomic_store(&pool.running, true);
+  atomic_store(&pool.live   , false);
+  atomic_store(&pool.active , 0);
+
+  for(unsigned int i = 0; i < count - 1; ++i)
+  {
+    if (!(pool.events[i] = lgCreateEvent(true, 0)))
+    {
+      DEBUG_ERROR("Failed to create the frame write event");
+      framebuffer_stop_write_threads();
+      return false;
+    }
+
+    if (!lgCreateThread("FBWriteThread", fbWriteThread, pool.events[i],
+          &pool.threads[i]))
+    {
+      DEBUG_ERROR("Failed to create the frame write thread");
+      lgFreeEvent(pool.events[i]);
+      pool.events[i] = NULL;
+      framebuffer_stop_write_threads();
+      return false;
+    }
+
+    ++pool.threadCount;
+  }
+
+  DEBUG_INFO("Copy Threads     : %u", count);
   return true;
 }
 
+void framebuffer_stop_write_threads(void)
+{
+  atomic_store(&pool.running, false);
+  for(unsigned int i = 0; i < pool.threadCount; ++i)
+  {
+    lgSignalEvent(pool.events[i]);
+    lgJoinThread(pool.threads[i], NULL);
+    lgFreeEvent(pool.events[i]);
+    pool.threads[i] = NULL;
+    pool.events [i] = NULL;
+  }
+  pool.threadCount = 0;
+
+  free(pool.job.chunkDone);
+  pool.job.chunkDone     = NULL;
+  pool.job.chunkDoneSize = 0;
+}
+
+static bool fbWriteParallel(FrameBuffer * frame, const uint8_t * src,
+    size_t size, FBCopyFn copy)
+{
+  struct FBWriteJob * job = &pool.job;
+  const unsigned int chunks = (size + FB_CHUNK_SIZE - 1) / FB_CHUNK_SIZE;
+
+  if (chunks > job->chunkDoneSize)
+  {
+    atomic_bool * tmp = realloc(job->chunkDone, chunks * sizeof(*tmp));
+    if (!tmp)
+    {
+      DEBUG_ERROR("Failed to allocate memory");
+      return false;
+    }
+    job->chunkDone     = tmp;
+    job->chunkDoneSize = chunks;
+  }
+
+  for(unsigned int i = 0; i < chunks; ++i)
+    atomic_init(&job->chunkDone[i], false);
+
+  job->frame  = frame;
+  job->src    = src;
+  job->size   = size;
+  job->chunks = chunks;
+  job->copy   = copy;
+  atomic_store(&job->nextChunk, 0);
+  atomic_store(&job->completed, 0);
+  atomic_store(&job->published, 0);
+
+  atomic_store(&pool.live, true);
+  for(unsigned int i = 0; i < pool.threadCount; ++i)
+    lgSignalEvent(pool.events[i]);
+
+  // the caller takes part in the copy too
+  fbProcessChunks(job);
+
+  // wait for the other threads to finish their last chunks
+  while(atomic_load(&job->completed) < chunks)
+    _mm_pause();
+
+  /* ensure no thread is still looking at the job before it is reused, any
+   * thread that wakes late will see that the job is no longer live */
+  atomic_store(&pool.live, false);
+  while(atomic_load(&pool.active) > 0)
+    _mm_pause();
+
+  fbPublishChunks(job);
+  return true;
+}
+
+bool framebuffer_wait(const FrameBuffer * frame, size_t size)
+{
+  uint_least32_t wp = atomic_load_explicit(&frame->wp, memory_order_acquire);
+  if (wp >= size)
+    return true;
+
+  atomic_fetch_add_explicit(&waitStats.waits, 1, memory_order_relaxed);
+
+  /* spin for a short time first as the writer is usually only a few
+   * microseconds away from publishing the next chunk */
+  const uint64_t start = nanotime();
+  uint64_t       now   = start;
+  uint64_t       spins = 0;
+  do
+  {
+    for(int i = 0; i < 16; ++i)
+      _mm_pause();
+    ++spins;
+
+    if ((wp = atomic_load_explicit(&frame->wp, memory_order_acquire)) >= size)
+      break;
+
+    now = nanotime();
+  }
+  while(now - start < FB_SPIN_TIME);
+
+  atomic_fetch_add_explicit(&waitStats.spins , spins      , memory_order_relaxed);
+  atomic_fetch_add_explicit(&waitStats.spinNs, now - start, memory_order_relaxed);
+  if (wp >= size)
+    return true;
+
+  /* sleep until woken by the writer, or for the time it should take the
+   * writer to reach `size` based on the rate it has been progressing at */
+  uint_least32_t lastWp    = wp;
+  uint64_t       lastTime  = now;
+  uint64_t       backoff   = FB_SLEEP_MIN;
+  const uint64_t sleepFrom = now;
+  bool           canWake   = false;
+  bool           ret       = true;
+
+  while((wp = atomic_load_explicit(&frame->wp, memory_order_acquire)) < size)
+  {
+    now = nanotime();
+    if (now - start > FB_WAIT_TIMEOUT)
+    {
+      atomic_fetch_add_explicit(&waitStats.timeouts, 1, memory_order_relaxed);
+      ret = false;
+      break;
+    }
+
+    if (wp > lastWp)
+    {
+      const double rate = (double)(wp - lastWp) / (double)(now - lastTime);
+      backoff  = (uint64_t)((double)(size - wp) / rate);
+      lastWp   = wp;
+      lastTime = now;
+    }
+    else
+      backoff *= 2;
+
+    // once the writer of this frame has woken us there is no need to poll
+    if (canWake)
+      backoff = FB_SLEEP_MAX;
+    else if (backoff > FB_SLEEP_MAX)
+      backoff = FB_SLEEP_MAX;
+    else if (backoff < FB_SLEEP_MIN)
+      backoff = FB_SLEEP_MIN;
+
+    atomic_fetch_add_explicit(&waitStats.sleeps, 1, memory_order_relaxed);
+    if (fbSleep(frame, wp, backoff))
+    {
+      atomic_fetch_add_explicit(&waitStats.wakeups, 1, memory_order_relaxed);
+      canWake = true;
+    }
+  }
+
+  atomic_fetch_add_explicit(&waitStats.sleepNs, nanotime() - sleepFrom,
+      memory_order_relaxed);
+  return ret;
+}
+
 bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
     size_t dstpitch, size_t height, size_t width, size_t bpp, size_t pitch)
 {
@@ -72,6 +732,7 @@ bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
 
   uint8_t * restrict d     = (uint8_t*)dst;
   uint_least32_t rp        = 0;
+  const FBCopyFn copy      = fbGetCopyFn();
 
   // copy in large 1MB chunks if the pitches match
   if (dstpitch == pitch)
@@ -79,14 +740,14 @@ bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
     size_t remaining = height * pitch;
     while(remaining)
     {
-      const size_t copy = remaining < FB_CHUNK_SIZE ? remaining : FB_CHUNK_SIZE;
-      if (!framebuffer_wait(frame, rp + copy))
+      const size_t size = remaining < FB_CHUNK_SIZE ? remaining : FB_CHUNK_SIZE;
+      if (!framebuffer_wait(frame, rp + size))
         return false;
 
-      memcpy(d, frame->data + rp, copy);
-      remaining -= copy;
-      rp        += copy;
-      d         += copy;
+      copy(d, frame->data + rp, size);
+      remaining -= size;
+      rp        += size;
+      d         += size;
     }
   }
   else
@@ -98,7 +759,7 @@ bool framebuffer_read(const FrameBuffer * frame, void * restrict dst,
       if (!framebuffer_wait(frame, rp + linewidth))
         return false;
 
-      memcpy(d, frame->data + rp, dstpitch);
+      copy(d, frame->data + rp, dstpitch);
       rp += pitch;
       d  += dstpitch;
     }
@@ -154,10 +815,13 @@ bool framebuffer_read_fn(const FrameBuffer * frame, size_t height, size_t width,
  */
 void framebuffer_prepare(FrameBuffer * frame)
 {
+  /* waiters is left alone as a reader of the last frame that is still asleep
+   * would take it below zero, a stale count is dropped by fbWake instead */
   atomic_store_explicit(&frame->wp, 0, memory_order_release);
 }
 
-bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t size)
+static bool fbWrite(FrameBuffer * frame, const void * restrict src,
+    size_t size, FBCopyFn copy)
 {
 #ifdef FB_PROFILE
   static RunningAvg ra = NULL;
@@ -167,44 +831,30 @@ bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t si
     ra = runningavg_new(100);
 #endif
 
-  __m128i * restrict s = (__m128i *)src;
-  __m128i * restrict d = (__m128i *)frame->data;
-  size_t wp = 0;
+  const uint8_t * restrict s  = (const uint8_t *)src;
+  size_t                    wp = 0;
 
   _mm_mfence();
 
-  /* copy in chunks */
-  while(size > 63)
-  {
-    __m128i *_d = (__m128i *)d;
-    __m128i *_s = (__m128i *)s;
-    __m128i v1 = _mm_stream_load_si128(_s + 0);
-    __m128i v2 = _mm_stream_load_si128(_s + 1);
-    __m128i v3 = _mm_stream_load_si128(_s + 2);
-    __m128i v4 = _mm_stream_load_si128(_s + 3);
-
-    _mm_store_si128(_d + 0, v1);
-    _mm_store_si128(_d + 1, v2);
-    _mm_store_si128(_d + 2, v3);
-    _mm_store_si128(_d + 3, v4);
+  if (pool.threadCount && size >= FB_PARALLEL_MIN_CHUNKS * FB_CHUNK_SIZE &&
+      fbWriteParallel(frame, s, size, copy))
+    goto done;
 
-    s    += 4;
-    d    += 4;
-    size -= 64;
-    wp   += 64;
-
-    if (wp % FB_CHUNK_SIZE == 0)
-      atomic_store_explicit(&frame->wp, wp, memory_order_release);
-  }
-
-  if(size)
+  /* copy in chunks, publishing the write pointer as each completes */
+  while(size)
   {
-    memcpy(frame->data + wp, s, size);
-    wp += size;
+    const size_t chunk = size < FB_CHUNK_SIZE ? size : FB_CHUNK_SIZE;
+    copy(frame->data + wp, s + wp, chunk);
+    size -= chunk;
+    wp   += chunk;
+
+    if (size)
+      fbSetWritePtr(frame, wp);
   }
 
-  atomic_store_explicit(&frame->wp, wp, memory_order_release);
+  fbSetWritePtr(frame, wp);
 
+done:
 #ifdef FB_PROFILE
   runningavg_push(ra, microtime() - ts);
   if (++raCount % 100 == 0)
@@ -214,6 +864,332 @@ bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t si
   return true;
 }
 
+
+bool framebuffer_write(FrameBuffer * frame, const void * restrict src, size_t size)
+{
+  return fbWrite(frame, src, size, fbGetCopyFn());
+}
+
+bool framebuffer_write_uncached(FrameBuffer * frame, const void * restrict src,
+    size_t size)
+{
+  return fbWrite(frame, src, size, fbGetUncachedCopyFn());
+}
+
+/**
+ * The header of each block in a compressed frame, a block holds whole rows so
+ * it can be decompressed on its own. The stream ends with a block of 0 rows.
+ */
+typedef struct FBLZ4Block
+{
+  uint32_t rows;
+  uint32_t size; // the size of the data that follows, or'd with FB_LZ4_RAW
+}
+FBLZ4Block;
+
+#define FB_LZ4_ALIGN(x) (((x) + 3) & ~(size_t)3)
+
+bool framebuffer_write_lz4(FrameBuffer * frame, const void * src,
+    size_t height, size_t pitch, size_t maxSize)
+{
+  LZ4State        state;
+  const FBCopyFn  copy   = fbGetCopyFn();
+  const uint8_t * s      = (const uint8_t *)src;
+  size_t          wp     = 0;
+  size_t          y      = 0;
+  const size_t    stride = pitch < FB_LZ4_BLOCK_SIZE ?
+    FB_LZ4_BLOCK_SIZE / pitch : 1;
+
+  // always leave room for the end of stream marker
+  if (maxSize < 2 * sizeof(FBLZ4Block))
+    return false;
+  const size_t limit = (maxSize - sizeof(FBLZ4Block)) & ~(size_t)3;
+
+  while(y < height && limit - wp > sizeof(FBLZ4Block))
+  {
+    const size_t rows  = height - y < stride ? height - y : stride;
+    const size_t bytes = rows * pitch;
+    const size_t avail = limit - wp - sizeof(FBLZ4Block);
+    FBLZ4Block * block = (FBLZ4Block *)(frame->data + wp);
+    uint8_t    * out   = frame->data + wp + sizeof(FBLZ4Block);
+
+    // data that does not shrink is stored as is
+    size_t size = lz4_compress(&state, out, avail < bytes ? avail : bytes - 1,
+        s, bytes);
+    if (size)
+      block->size = size;
+    else if (bytes <= avail)
+    {
+      copy(out, s, bytes);
+      size        = bytes;
+      block->size = size | FB_LZ4_RAW;
+    }
+    else
+      break;
+
+    block->rows = rows;
+
+    wp += FB_LZ4_ALIGN(sizeof(FBLZ4Block) + size);
+    s  += bytes;
+    y  += rows;
+    fbSetWritePtr(frame, wp);
+  }
+
+  FBLZ4Block * end = (FBLZ4Block *)(frame->data + wp);
+  end->rows = 0;
+  end->size = 0;
+  fbSetWritePtr(frame, wp + sizeof(FBLZ4Block));
+
+  return y == height;
+}
+
+bool framebuffer_read_lz4(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t height, size_t pitch, size_t * rows)
+{
+  uint8_t * d       = (uint8_t *)dst;
+  uint8_t * tmp     = NULL;
+  size_t    tmpSize = 0;
+  size_t    rp      = 0;
+  size_t    y       = 0;
+  bool      ret     = false;
+
+  const FBCopyFn copy     = fbGetCopyFn();
+  const size_t   linesize = dstpitch < pitch ? dstpitch : pitch;
+
+  while(y < height)
+  {
+    if (!framebuffer_wait(frame, rp + sizeof(FBLZ4Block)))
+      goto out;
+
+    FBLZ4Block block;
+    memcpy(&block, frame->data + rp, sizeof(block));
+    rp += sizeof(block);
+
+    // the host ran out of space, the remaining rows were not sent
+    if (!block.rows)
+      break;
+
+    const size_t size = block.size & ~FB_LZ4_RAW;
+    if (block.rows > height - y)
+    {
+      DEBUG_ERROR("Compressed frame has too many rows");
+      goto out;
+    }
+
+    if (!framebuffer_wait(frame, rp + size))
+      goto out;
+
+    const uint8_t * in    = frame->data + rp;
+    const size_t    bytes = block.rows * pitch;
+
+    // decompress straight into the destination when the layouts match
+    uint8_t * out = d + y * dstpitch;
+    if (dstpitch != pitch)
+    {
+      if (bytes > tmpSize)
+      {
+        free(tmp);
+        if (!(tmp = malloc(bytes)))
+        {
+          DEBUG_ERROR("Failed to allocate memory");
+          goto out;
+        }
+        tmpSize = bytes;
+      }
+      out = tmp;
+    }
+
+    if (block.size & FB_LZ4_RAW)
+    {
+      if (size != bytes)
+      {
+        DEBUG_ERROR("Compressed frame has an invalid block");
+        goto out;
+      }
+      copy(out, in, bytes);
+    }
+    else if (lz4_decompress(out, bytes, in, size) != bytes)
+    {
+      DEBUG_ERROR("Compressed frame has an invalid block");
+      goto out;
+    }
+
+    if (out == tmp)
+      for(size_t i = 0; i < block.rows; ++i)
+        memcpy(d + (y + i) * dstpitch, tmp + i * pitch, linesize);
+
+    rp = FB_LZ4_ALIGN(rp + size);
+    y += block.rows;
+  }
+
+  ret = true;
+
+out:
+  if (rows)
+    *rows = y;
+  free(tmp);
+  return ret;
+}
+
+/**
+ * The header of a sparse frame, it is followed by the sorted index of the
+ * tiles present and then the tiles themselves starting at a 64 byte boundary.
+ * Tiles on the right and bottom edges are clipped to the frame.
+ */
+typedef struct FBSparseHeader
+{
+  uint32_t tileSize;
+  uint32_t tileCount;
+  uint32_t tiles[];
+}
+FBSparseHeader;
+
+#define FB_SPARSE_DATA(count) \
+  ((sizeof(FBSparseHeader) + (count) * sizeof(uint32_t) + 63) & ~(size_t)63)
+
+static int fbTileCompare(const void * a, const void * b)
+{
+  const uint32_t ia = *(const uint32_t *)a;
+  const uint32_t ib = *(const uint32_t *)b;
+  return (ia > ib) - (ia < ib);
+}
+
+bool framebuffer_write_sparse(FrameBuffer * frame, const void * src,
+    size_t width, size_t height, size_t bpp, size_t pitch,
+    const FrameDamageRect * rects, int count, size_t maxSize)
+{
+  FBSparseHeader * hdr    = (FBSparseHeader *)frame->data;
+  const size_t     tilesX = (width + FB_TILE_SIZE - 1) / FB_TILE_SIZE;
+
+  if (maxSize < sizeof(*hdr))
+    return false;
+  const size_t maxTiles = (maxSize - sizeof(*hdr)) / sizeof(uint32_t);
+
+  // build the index of the tiles touched by the damage
+  size_t n = 0;
+  for(int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * r = rects + i;
+    if (r->x >= width || r->y >= height || !r->width || !r->height)
+      continue;
+
+    const size_t x2 = r->x + r->width  < width  ? r->x + r->width  : width;
+    const size_t y2 = r->y + r->height < height ? r->y + r->height : height;
+    const size_t tx1 = r->x / FB_TILE_SIZE, tx2 = (x2 - 1) / FB_TILE_SIZE;
+    const size_t ty1 = r->y / FB_TILE_SIZE, ty2 = (y2 - 1) / FB_TILE_SIZE;
+
+    if (n + (tx2 - tx1 + 1) * (ty2 - ty1 + 1) > maxTiles)
+      return false;
+
+    for(size_t ty = ty1; ty <= ty2; ++ty)
+      for(size_t tx = tx1; tx <= tx2; ++tx)
+        hdr->tiles[n++] = ty * tilesX + tx;
+  }
+
+  // sort the index so the tiles are written in memory order and drop repeats
+  qsort(hdr->tiles, n, sizeof(*hdr->tiles), fbTileCompare);
+  size_t unique = 0;
+  for(size_t i = 0; i < n; ++i)
+    if (!unique || hdr->tiles[unique - 1] != hdr->tiles[i])
+      hdr->tiles[unique++] = hdr->tiles[i];
+  n = unique;
+
+  const size_t offset = FB_SPARSE_DATA(n);
+  size_t       size   = offset;
+  for(size_t i = 0; i < n; ++i)
+  {
+    const size_t x = (hdr->tiles[i] % tilesX) * FB_TILE_SIZE;
+    const size_t y = (hdr->tiles[i] / tilesX) * FB_TILE_SIZE;
+    size += (width  - x < FB_TILE_SIZE ? width  - x : FB_TILE_SIZE) *
+            (height - y < FB_TILE_SIZE ? height - y : FB_TILE_SIZE) * bpp;
+  }
+
+  if (size > maxSize)
+    return false;
+
+  hdr->tileSize  = FB_TILE_SIZE;
+  hdr->tileCount = n;
+  fbSetWritePtr(frame, offset);
+
+  const uint8_t * s      = (const uint8_t *)src;
+  size_t          wp     = offset;
+  size_t          lastWp = offset;
+  for(size_t i = 0; i < n; ++i)
+  {
+    const size_t x    = (hdr->tiles[i] % tilesX) * FB_TILE_SIZE;
+    const size_t y    = (hdr->tiles[i] / tilesX) * FB_TILE_SIZE;
+    const size_t line = (width  - x < FB_TILE_SIZE ? width  - x : FB_TILE_SIZE)
+      * bpp;
+    const size_t rows =  height - y < FB_TILE_SIZE ? height - y : FB_TILE_SIZE;
+
+    const uint8_t * sp = s + y * pitch + x * bpp;
+    for(size_t row = 0; row < rows; ++row, sp += pitch, wp += line)
+      memcpy(frame->data + wp, sp, line);
+
+    if (wp - lastWp >= FB_CHUNK_SIZE)
+    {
+      fbSetWritePtr(frame, wp);
+      lastWp = wp;
+    }
+  }
+
+  fbSetWritePtr(frame, wp);
+  return true;
+}
+
+bool framebuffer_read_sparse(const FrameBuffer * frame, void * dst,
+    size_t dstpitch, size_t width, size_t height, size_t bpp)
+{
+  if (!framebuffer_wait(frame, sizeof(FBSparseHeader)))
+    return false;
+
+  const FBSparseHeader * hdr   = (const FBSparseHeader *)frame->data;
+  const size_t           tsize = hdr->tileSize;
+  const size_t           n     = hdr->tileCount;
+  if (!tsize)
+  {
+    DEBUG_ERROR("Sparse frame has an invalid tile size");
+    return false;
+  }
+
+  const size_t tilesX = (width  + tsize - 1) / tsize;
+  const size_t tilesY = (height + tsize - 1) / tsize;
+  if (n > tilesX * tilesY)
+  {
+    DEBUG_ERROR("Sparse frame has too many tiles");
+    return false;
+  }
+
+  size_t rp = FB_SPARSE_DATA(n);
+  if (!framebuffer_wait(frame, rp))
+    return false;
+
+  uint8_t * d = (uint8_t *)dst;
+  for(size_t i = 0; i < n; ++i)
+  {
+    const uint32_t tile = hdr->tiles[i];
+    if (tile >= tilesX * tilesY)
+    {
+      DEBUG_ERROR("Sparse frame has an invalid tile");
+      return false;
+    }
+
+    const size_t x    = (tile % tilesX) * tsize;
+    const size_t y    = (tile / tilesX) * tsize;
+    const size_t line = (width - x < tsize ? width - x : tsize) * bpp;
+    const size_t rows =  height - y < tsize ? height - y : tsize;
+
+    if (!framebuffer_wait(frame, rp + line * rows))
+      return false;
+
+    uint8_t * dp = d + y * dstpitch + x * bpp;
+    for(size_t row = 0; row < rows; ++row, dp += dstpitch, rp += line)
+      memcpy(dp, frame->data + rp, line);
+  }
+
+  return true;
+}
+
 const uint8_t * framebuffer_get_buffer(const FrameBuffer * frame)
 {
   return frame->data;
@@ -226,5 +1202,10 @@ uint8_t * framebuffer_get_data(FrameBuffer * frame)
 
 void framebuffer_set_write_ptr(FrameBuffer * frame, size_t size)
 {
-  atomic_store_explicit(&frame->wp, size, memory_order_release);
+  fbSetWritePtr(frame, size);
+}
+
+size_t framebuffer_get_write_ptr(const FrameBuffer * frame)
+{
+  return atomic_load_explicit(&frame->wp, memory_order_acquire);
 }
@@ -0,0 +1,341 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/framediff.h"
+#include "common/KVMFR.h"
+#include "common/cpuinfo.h"
+#include "common/debug.h"
+#include "common/rects.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#define TILE_SIZE 64 // pixels, square
+
+// if more then this fraction of the tiles change treat it as a full update
+#define FULL_DAMAGE_NUM 3
+#define FULL_DAMAGE_DEN 4
+
+typedef bool (*TileEqualFn)(const uint8_t * a, const uint8_t * b, size_t len);
+
+struct FrameDamage
+{
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
+struct FrameDiff
+{
+  unsigned int width, height, pitch;
+  unsigned int tilesX, tilesY;
+
+  bool      valid;
+  uint8_t * prev;
+  uint8_t * dirty;
+
+  int             lastCount;
+  FrameDamageRect lastRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN_MAX];
+};
+
+static bool tileEqualSSE2(const uint8_t * a, const uint8_t * b, size_t len)
+{
+  __m128i acc = _mm_setzero_si128();
+  for(; len >= 16; len -= 16, a += 16, b += 16)
+    acc = _mm_or_si128(acc, _mm_xor_si128(
+        _mm_loadu_si128((const __m128i *)a),
+        _mm_loadu_si128((const __m128i *)b)));
+
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xFFFF)
+    return false;
+
+  return len == 0 || memcmp(a, b, len) == 0;
+}
+
+__attribute__((target("avx2")))
+static bool tileEqualAVX2(const uint8_t * a, const uint8_t * b, size_t len)
+{
+  __m256i acc = _mm256_setzero_si256();
+  for(; len >= 32; len -= 32, a += 32, b += 32)
+    acc = _mm256_or_si256(acc, _mm256_xor_si256(
+        _mm256_loadu_si256((const __m256i *)a),
+        _mm256_loadu_si256((const __m256i *)b)));
+
+  if (!_mm256_testz_si256(acc, acc))
+    return false;
+
+  return len == 0 || memcmp(a, b, len) == 0;
+}
+
+static TileEqualFn tileEqual = NULL;
+
+FrameDiff framediff_new(unsigned int width, unsigned int height,
+    unsigned int pitch)
+{
+  if (!tileEqual)
+    tileEqual = lgCPUHasFeature(CPU_FEATURE_AVX2) ?
+      tileEqualAVX2 : tileEqualSSE2;
+
+  struct FrameDiff * diff = calloc(1, sizeof(*diff));
+  if (!diff)
+  {
+    DEBUG_ERROR("Failed to allocate memory");
+    return NULL;
+  }
+
+  diff->width  = width;
+  diff->height = height;
+  diff->pitch  = pitch;
+  diff->tilesX = (width  + TILE_SIZE - 1) / TILE_SIZE;
+  diff->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+  diff->dirty  = malloc(diff->tilesX);
+
+  if (!diff->dirty)
+  {
+    DEBUG_ERROR("Failed to allocate memory");
+    framediff_free(&diff);
+    return NULL;
+  }
+
+  for(int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+    diff->frameDamage[i].count = -1;
+
+  return diff;
+}
+
+void framediff_free(FrameDiff * diff)
+{
+  if (!*diff)
+    return;
+
+  free((*diff)->prev);
+  free((*diff)->dirty);
+  free(*diff);
+  *diff = NULL;
+}
+
+void framediff_reset(FrameDiff diff)
+{
+  diff->valid = false;
+}
+
+int framediff_compare(FrameDiff diff, const uint8_t * src,
+    FrameDamageRect * rects)
+{
+  diff->lastCount = 0;
+
+  // the previous frame is only needed if compare is used
+  if (!diff->prev)
+  {
+    diff->prev = malloc((size_t)diff->height * diff->pitch);
+    if (!diff->prev)
+    {
+      DEBUG_ERROR("Failed to allocate memory");
+      return 0;
+    }
+    diff->valid = false;
+  }
+
+  if (!diff->valid)
+  {
+    memcpy(diff->prev, src, (size_t)diff->height * diff->pitch);
+    diff->valid = true;
+    return 0;
+  }
+
+  const unsigned int fullTiles = diff->tilesX * diff->tilesY *
+    FULL_DAMAGE_NUM / FULL_DAMAGE_DEN;
+  unsigned int dirtyTiles = 0;
+  bool         overflow   = false;
+  int          count      = 0;
+  int          prevStart  = 0;
+  int          prevEnd    = 0;
+
+  for(unsigned int ty = 0; ty < diff->tilesY; ++ty)
+  {
+    const unsigned int y0 = ty * TILE_SIZE;
+    const unsigned int y1 = y0 + TILE_SIZE < diff->height ?
+      y0 + TILE_SIZE : diff->height;
+
+    // compare line by line so the memory is walked sequentially
+    memset(diff->dirty, 0, diff->tilesX);
+    for(unsigned int y = y0; y < y1; ++y)
+    {
+      const size_t line = (size_t)y * diff->pitch;
+      for(unsigned int tx = 0; tx < diff->tilesX; ++tx)
+      {
+        if (diff->dirty[tx])
+          continue;
+
+        const unsigned int x0 = tx * TILE_SIZE;
+        const unsigned int w  = x0 + TILE_SIZE < diff->width ?
+          TILE_SIZE : diff->width - x0;
+
+        if (!tileEqual(src + line + x0 * 4, diff->prev + line + x0 * 4, w * 4))
+          diff->dirty[tx] = 1;
+      }
+    }
+
+    // update the previous frame and build the damage spans for this row
+    for(unsigned int tx = 0; tx < diff->tilesX; )
+    {
+      if (!diff->dirty[tx])
+      {
+        ++tx;
+        continue;
+      }
+
+      unsigned int te = tx;
+      while(te < diff->tilesX && diff->dirty[te])
+        ++te;
+
+      dirtyTiles += te - tx;
+
+      const unsigned int x0 = tx * TILE_SIZE;
+      const unsigned int x1 = te * TILE_SIZE < diff->width ?
+        te * TILE_SIZE : diff->width;
+
+      for(unsigned int y = y0; y < y1; ++y)
+      {
+        const size_t offset = (size_t)y * diff->pitch + x0 * 4;
+        memcpy(diff->prev + offset, src + offset, (x1 - x0) * 4);
+      }
+
+      tx = te;
+      if (overflow)
+        continue;
+
+      // extend a rect from the previous row if it has the same span
+      bool merged = false;
+      for(int i = prevStart; i < prevEnd; ++i)
+        if (rects[i].x == x0 && rects[i].width == x1 - x0 &&
+            rects[i].y + rects[i].height == y0)
+        {
+          rects[i].height += y1 - y0;
+
+          // move it into this row so it can continue to grow
+          const FrameDamageRect r = rects[i];
+          memmove(rects + i, rects + i + 1,
+              (count - i - 1) * sizeof(*rects));
+          rects[count - 1] = r;
+          --prevEnd;
+          --i;
+          merged = true;
+          break;
+        }
+
+      if (merged)
+        continue;
+
+      if (count == KVMFR_MAX_DAMAGE_RECTS)
+      {
+        overflow = true;
+        continue;
+      }
+
+      rects[count++] = (FrameDamageRect) {
+        .x      = x0,
+        .y      = y0,
+        .width  = x1 - x0,
+        .height = y1 - y0
+      };
+    }
+
+    /* rects that were not extended by this row are closed, only the rects
+     * touched by this row (moved to the end) can be extended by the next */
+    prevStart = prevEnd;
+    prevEnd   = count;
+  }
+
+  if (dirtyTiles == 0)
+    return -1;
+
+  if (overflow || dirtyTiles > fullTiles)
+    return 0;
+
+  diff->lastCount = count;
+  memcpy(diff->lastRects, rects, count * sizeof(*rects));
+  return count;
+}
+
+void framediff_setDamage(FrameDiff diff, const FrameDamageRect * rects,
+    int count)
+{
+  if (count < 0 || count > KVMFR_MAX_DAMAGE_RECTS)
+    count = 0;
+
+  diff->lastCount = count;
+  memcpy(diff->lastRects, rects, count * sizeof(*rects));
+
+  // the previous frame copy is now stale
+  diff->valid = false;
+}
+
+void framediff_invalidate(FrameDiff diff, int frameIndex)
+{
+  DEBUG_ASSERT(frameIndex >= 0 && frameIndex < LGMP_Q_FRAME_LEN_MAX);
+  diff->frameDamage[frameIndex].count = -1;
+}
+
+void framediff_write(FrameDiff diff, FrameBuffer * frame, int frameIndex,
+    const uint8_t * src, unsigned int height, bool uncached)
+{
+  DEBUG_ASSERT(frameIndex >= 0 && frameIndex < LGMP_Q_FRAME_LEN_MAX);
+
+  struct FrameDamage * damage = diff->frameDamage + frameIndex;
+  const bool damageAll = diff->lastCount == 0 || damage->count < 0 ||
+    damage->count + diff->lastCount > KVMFR_MAX_DAMAGE_RECTS;
+
+  if (damageAll)
+  {
+    const size_t size = (size_t)diff->pitch * height;
+    if (uncached)
+      framebuffer_write_uncached(frame, src, size);
+    else
+      framebuffer_write(frame, src, size);
+  }
+  else
+  {
+    memcpy(damage->rects + damage->count, diff->lastRects,
+      diff->lastCount * sizeof(*diff->lastRects));
+    damage->count += diff->lastCount;
+    rectsBufferToFramebuffer(damage->rects, damage->count, frame, diff->pitch,
+      height, src, diff->pitch);
+  }
+
+  // accumulate the damage for the other frame buffers
+  for(int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+  {
+    struct FrameDamage * damage = diff->frameDamage + i;
+    if (i == frameIndex)
+      damage->count = 0;
+    else if (diff->lastCount > 0 && damage->count >= 0 &&
+             damage->count + diff->lastCount <= KVMFR_MAX_DAMAGE_RECTS)
+    {
+      memcpy(damage->rects + damage->count, diff->lastRects,
+        diff->lastCount * sizeof(*diff->lastRects));
+      damage->count += diff->lastCount;
+    }
+    else
+      damage->count = -1;
+  }
+}
@@ -0,0 +1,275 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/hdr.h"
+#include "common/debug.h"
+#include "common/cpuinfo.h"
+#include "common/util.h"
+
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <immintrin.h>
+
+// scRGB 1.0 is 80 nits, PQ tops out at 10000 nits
+#define PQ_MAX   125.0f
+#define PQ_MAX_H 0x57D0 // PQ_MAX as a half float
+
+// BT.709 to BT.2020, both linear
+#define M00 0.6274040f
+#define M01 0.3292820f
+#define M02 0.0433136f
+#define M10 0.0690970f
+#define M11 0.9195400f
+#define M12 0.0113612f
+#define M20 0.0163916f
+#define M21 0.0880132f
+#define M22 0.8955950f
+
+typedef void (*HDRConvertFn)(uint32_t * dst, const uint16_t * src,
+    size_t count);
+
+/* the 10 bit PQ code of every half float from zero to PQ_MAX, the extra entry
+ * keeps the 32 bit gathers of the last one in bounds */
+static uint16_t pqTable[PQ_MAX_H + 2];
+
+static float halfToFloat(uint16_t h)
+{
+  const uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  const uint32_t exp  = (h >> 10) & 0x1F;
+  const uint32_t mant = h & 0x3FF;
+
+  /* infinities are clamped to the brightest PQ can encode and NaN is made
+   * black before they reach the float math, so the result does not depend on
+   * how it treats them or on -ffast-math. sanitizeHalves does the same. */
+  if (exp == 0x1F)
+    return mant ? 0.0f : (sign ? -PQ_MAX : PQ_MAX);
+
+  uint32_t bits;
+  if (exp)
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  else
+  {
+    // zero or subnormal, mant * 2^-24
+    const float f = mant * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+
+  float f;
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+// `f` must be within 0 and PQ_MAX
+static inline uint16_t floatToHalf(float f)
+{
+  // below the smallest normal half
+  if (f < 6.103515625e-05f)
+    return (uint16_t)lrintf(f * 16777216.0f);
+
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  bits += 0xFFF + ((bits >> 13) & 1);
+  return (bits >> 13) - (112 << 10);
+}
+
+static inline uint32_t pqCode(float v)
+{
+  if (v <= 0.0f)
+    return pqTable[0];
+  return pqTable[floatToHalf(v < PQ_MAX ? v : PQ_MAX)];
+}
+
+static void hdrConvertScalar(uint32_t * dst, const uint16_t * src,
+    size_t count)
+{
+  for(size_t i = 0; i < count; ++i, src += 4)
+  {
+    const float r = halfToFloat(src[0]);
+    const float g = halfToFloat(src[1]);
+    const float b = halfToFloat(src[2]);
+
+    dst[i] =
+      pqCode(M00 * r + M01 * g + M02 * b)       |
+      pqCode(M10 * r + M11 * g + M12 * b) << 10 |
+      pqCode(M20 * r + M21 * g + M22 * b) << 20 |
+      3U << 30;
+  }
+}
+
+// the same handling of infinities and NaN as halfToFloat, on eight halves
+__attribute__((target("avx2,f16c")))
+static inline __m128i sanitizeHalves(__m128i h)
+{
+  const __m128i expMask = _mm_set1_epi16(0x7C00);
+  const __m128i special = _mm_cmpeq_epi16(_mm_and_si128(h, expMask), expMask);
+  const __m128i nan     = _mm_andnot_si128(
+      _mm_cmpeq_epi16(_mm_and_si128(h, _mm_set1_epi16(0x3FF)),
+        _mm_setzero_si128()),
+      special);
+  const __m128i inf     = _mm_or_si128(
+      _mm_and_si128(h, _mm_set1_epi16((short)0x8000)),
+      _mm_set1_epi16(PQ_MAX_H));
+
+  return _mm_andnot_si128(nan, _mm_blendv_epi8(h, inf, special));
+}
+
+__attribute__((target("avx2,f16c")))
+static inline __m256i hdrCodeAVX2(__m256 v)
+{
+  // the inputs are finite so the mix is too
+  v = _mm256_max_ps(v, _mm256_setzero_ps());
+  v = _mm256_min_ps(v, _mm256_set1_ps(PQ_MAX));
+
+  const __m256i h = _mm256_cvtepu16_epi32(
+      _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+
+  return _mm256_and_si256(
+      _mm256_i32gather_epi32((const int *)pqTable, h, 2),
+      _mm256_set1_epi32(0x3FF));
+}
+
+__attribute__((target("avx2,f16c")))
+static void hdrConvertAVX2(uint32_t * dst, const uint16_t * src,
+    size_t count)
+{
+  // the pixels come out of the transpose in the order 0 2 4 6 1 3 5 7
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  const __m256i alpha = _mm256_set1_epi32(3U << 30);
+
+  /* the frame is read by the client and not by us, so stream it out when we
+   * can to avoid the read for ownership */
+  const bool stream = ((uintptr_t)dst & 31) == 0;
+
+  for(; count >= 8; count -= 8, src += 32, dst += 8)
+  {
+    #define LOAD(i) _mm256_cvtph_ps(sanitizeHalves( \
+        _mm_loadu_si128((const __m128i *)src + (i))))
+
+    const __m256 p01 = LOAD(0);
+    const __m256 p23 = LOAD(1);
+    const __m256 p45 = LOAD(2);
+    const __m256 p67 = LOAD(3);
+    #undef LOAD
+
+    const __m256 t0 = _mm256_unpacklo_ps(p01, p23);
+    const __m256 t1 = _mm256_unpackhi_ps(p01, p23);
+    const __m256 t2 = _mm256_unpacklo_ps(p45, p67);
+    const __m256 t3 = _mm256_unpackhi_ps(p45, p67);
+
+    const __m256 r = _mm256_shuffle_ps(t0, t2, 0x44);
+    const __m256 g = _mm256_shuffle_ps(t0, t2, 0xEE);
+    const __m256 b = _mm256_shuffle_ps(t1, t3, 0x44);
+
+    #define MIX(x, y, z) _mm256_add_ps(_mm256_add_ps( \
+        _mm256_mul_ps(r, _mm256_set1_ps(x)),           \
+        _mm256_mul_ps(g, _mm256_set1_ps(y))),          \
+        _mm256_mul_ps(b, _mm256_set1_ps(z)))
+
+    const __m256i cr = hdrCodeAVX2(MIX(M00, M01, M02));
+    const __m256i cg = hdrCodeAVX2(MIX(M10, M11, M12));
+    const __m256i cb = hdrCodeAVX2(MIX(M20, M21, M22));
+    #undef MIX
+
+    __m256i out = _mm256_or_si256(
+      _mm256_or_si256(cr, _mm256_slli_epi32(cg, 10)),
+      _mm256_or_si256(_mm256_slli_epi32(cb, 20), alpha));
+
+    out = _mm256_permutevar8x32_epi32(out, order);
+    if (stream)
+      _mm256_stream_si256((__m256i *)dst, out);
+    else
+      _mm256_storeu_si256((__m256i *)dst, out);
+  }
+
+  if (stream)
+    _mm_sfence();
+
+  hdrConvertScalar(dst, src, count);
+}
+
+struct HDRKernel
+{
+  const char * name;
+  bool         (*supported)(void);
+  HDRConvertFn fn;
+};
+
+static bool hdrHasAVX2(void)
+{
+  return lgCPUHasFeature(CPU_FEATURE_AVX2) && lgCPUHasFeature(CPU_FEATURE_F16C);
+}
+
+// ordered from the most to the least preferred for automatic selection
+static const struct HDRKernel kernels[] =
+{
+  { "avx2"  , hdrHasAVX2, hdrConvertAVX2   },
+  { "scalar", NULL      , hdrConvertScalar },
+  { NULL }
+};
+
+static HDRConvertFn convertFn = hdrConvertScalar;
+
+const char * hdr_init(const char * kernel)
+{
+  static bool tableValid = false;
+  if (!tableValid)
+  {
+    const double m1 = 0.1593017578125;
+    const double m2 = 78.84375;
+    const double c1 = 0.8359375;
+    const double c2 = 18.8515625;
+    const double c3 = 18.6875;
+
+    for(unsigned int i = 0; i <= PQ_MAX_H; ++i)
+    {
+      const double l  = halfToFloat(i) / PQ_MAX;
+      const double lm = pow(l, m1);
+      const double pq = pow((c1 + c2 * lm) / (1.0 + c3 * lm), m2);
+      pqTable[i] = (uint16_t)lrint(min(pq, 1.0) * 1023.0);
+    }
+    pqTable[PQ_MAX_H + 1] = pqTable[PQ_MAX_H];
+    tableValid = true;
+  }
+
+  const struct HDRKernel * k = kernels;
+  if (kernel && strcasecmp(kernel, "auto") != 0)
+  {
+    for(; k->name; ++k)
+      if (strcasecmp(k->name, kernel) == 0)
+        break;
+
+    if (!k->name || (k->supported && !k->supported()))
+    {
+      DEBUG_WARN("HDR kernel `%s` is not supported by this CPU, using auto",
+          kernel);
+      k = kernels;
+    }
+  }
+
+  for(; k->supported && !k->supported(); ++k) {}
+  convertFn = k->fn;
+  return k->name;
+}
+
+void hdr_convertPQ(uint32_t * dst, const uint16_t * src, size_t count)
+{
+  convertFn(dst, src, count);
+}
@@ -0,0 +1,191 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/locking.h"
+#include "common/debug.h"
+
+#include <stdlib.h>
+#include <immintrin.h>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+// bounds for the number of pause iterations before parking
+#define LOCK_SPIN_MIN   16
+#define LOCK_SPIN_MAX 1024
+
+#define LOCK_STATS_MAX  16
+
+static struct
+{
+  LG_Lock        lock;
+  int            count;
+  LG_LockStats * stats[LOCK_STATS_MAX];
+}
+registry = { 0 };
+
+static inline void lockPark(LG_Lock * lock)
+{
+#if defined(__linux__)
+  syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, LG_LOCK_STATE_WAITERS,
+      NULL, NULL, 0);
+#elif defined(_WIN32)
+  // WaitOnAddress needs Windows 8, yield the rest of the timeslice instead
+  SwitchToThread();
+#endif
+}
+
+void lgLockWake(LG_Lock * lock)
+{
+#if defined(__linux__)
+  syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+void lgLockSlow(LG_Lock * lock)
+{
+  /* spin for up to twice what recently worked so short critical sections
+   * are waited out without a syscall, while long ones quickly stop spinning */
+  unsigned int limit = lock->spinAvg * 2 + LOCK_SPIN_MIN;
+  if (limit > LOCK_SPIN_MAX)
+    limit = LOCK_SPIN_MAX;
+
+  unsigned int spins  = 0;
+  bool         parked = false;
+  while(spins < limit)
+  {
+    ++spins;
+    _mm_pause();
+
+    unsigned int expected = LG_LOCK_STATE_FREE;
+    if (atomic_load_explicit(&lock->state, memory_order_relaxed) ==
+          LG_LOCK_STATE_FREE &&
+        atomic_compare_exchange_weak_explicit(&lock->state, &expected,
+          LG_LOCK_STATE_HELD, memory_order_acquire, memory_order_relaxed))
+      goto acquired;
+  }
+
+  /* mark the lock as having waiters so the holder wakes us on release, we
+   * keep this state once acquired as other waiters may still be parked */
+  parked = true;
+  while(atomic_exchange_explicit(&lock->state, LG_LOCK_STATE_WAITERS,
+        memory_order_acquire) != LG_LOCK_STATE_FREE)
+    lockPark(lock);
+
+acquired:
+  // the lock is held here so the average is only ever updated by one thread
+  if (parked)
+    lock->spinAvg -= lock->spinAvg / 8;
+  else
+    lock->spinAvg += ((int)spins - (int)lock->spinAvg) / 8;
+
+  LG_LockStats * stats = lock->stats;
+  if (!stats)
+    return;
+
+  atomic_fetch_add_explicit(&stats->contended, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&stats->spins, spins, memory_order_relaxed);
+  if (parked)
+    atomic_fetch_add_explicit(&stats->parks, 1, memory_order_relaxed);
+  lgLockAcquired(lock);
+}
+
+void lgLockAcquired(LG_Lock * lock)
+{
+  atomic_fetch_add_explicit(&lock->stats->acquisitions, 1,
+      memory_order_relaxed);
+  lock->lockTime = nanotime();
+}
+
+void lgLockReleased(LG_Lock * lock)
+{
+  const uint64_t held = nanotime() - lock->lockTime;
+  uint64_t max = atomic_load_explicit(&lock->stats->maxHoldNs,
+      memory_order_relaxed);
+  while(held > max && !atomic_compare_exchange_weak_explicit(
+        &lock->stats->maxHoldNs, &max, held,
+        memory_order_relaxed, memory_order_relaxed)) {}
+}
+
+bool lgLockEnableStats(LG_Lock * lock, const char * name)
+{
+  if (lock->stats)
+    return true;
+
+  LG_LockStats * stats = calloc(1, sizeof(*stats));
+  if (!stats)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+  stats->name = name;
+
+  LG_LOCK(registry.lock);
+  if (registry.count == LOCK_STATS_MAX)
+  {
+    LG_UNLOCK(registry.lock);
+    DEBUG_WARN("Too many locks with statistics, ignoring %s", name);
+    free(stats);
+    return false;
+  }
+  registry.stats[registry.count++] = stats;
+  LG_UNLOCK(registry.lock);
+
+  // take the lock so the holder can't see stats change mid critical section
+  LG_LOCK(*lock);
+  lock->stats    = stats;
+  lock->lockTime = nanotime();
+  LG_UNLOCK(*lock);
+  return true;
+}
+
+void lgLockStatsForEach(
+    void (*fn)(const LG_LockStats * stats, void * udata), void * udata)
+{
+  LG_LOCK(registry.lock);
+  for(int i = 0; i < registry.count; ++i)
+    fn(registry.stats[i], udata);
+  LG_UNLOCK(registry.lock);
+}
+
+void lgLockFree(LG_Lock * lock)
+{
+  LG_LockStats * stats = lock->stats;
+  if (!stats)
+    return;
+
+  lock->stats = NULL;
+
+  LG_LOCK(registry.lock);
+  for(int i = 0; i < registry.count; ++i)
+    if (registry.stats[i] == stats)
+    {
+      registry.stats[i] = registry.stats[--registry.count];
+      break;
+    }
+  LG_UNLOCK(registry.lock);
+
+  free(stats);
+}
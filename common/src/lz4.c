@@ -0,0 +1,277 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/lz4.h"
+
+#include <string.h>
+#include <stdbool.h>
+#include <immintrin.h>
+
+#define MIN_MATCH    4
+#define LAST_LITERAL 5  // the last bytes of a block are always literals
+#define MF_LIMIT     12 // a match may not start closer than this to the end
+#define MAX_DISTANCE 65535
+#define SKIP_TRIGGER 6
+
+static inline uint32_t read32(const uint8_t * p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read64(const uint8_t * p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash(uint32_t seq)
+{
+  return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// the number of matching bytes at a and b, stopping at limit
+static inline size_t matchLength(const uint8_t * a, const uint8_t * b,
+    const uint8_t * limit)
+{
+  const uint8_t * start = a;
+  while(a + 8 <= limit)
+  {
+    const uint64_t diff = read64(a) ^ read64(b);
+    if (diff)
+      return a - start + (__builtin_ctzll(diff) >> 3);
+    a += 8;
+    b += 8;
+  }
+
+  while(a < limit && *a == *b)
+  {
+    ++a;
+    ++b;
+  }
+  return a - start;
+}
+
+static inline uint8_t * writeLength(uint8_t * op, size_t len)
+{
+  for(; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+size_t lz4_compress(LZ4State * state, void * dst, size_t dstSize,
+    const void * src, size_t srcSize)
+{
+  const uint8_t * const base   = src;
+  const uint8_t * const iend   = base + srcSize;
+  const uint8_t *       ip     = base;
+  const uint8_t *       anchor = base;
+  uint8_t       *       op     = dst;
+  uint8_t       * const oend   = op + dstSize;
+
+  if (srcSize >= MF_LIMIT + 1)
+  {
+    const uint8_t * const mflimit    = iend - MF_LIMIT;
+    const uint8_t * const matchlimit = iend - LAST_LITERAL;
+
+    memset(state->table, 0, sizeof(state->table));
+    ++ip;
+
+    while(ip < mflimit)
+    {
+      const uint32_t  seq = read32(ip);
+      const uint32_t  h   = hash(seq);
+      const uint8_t * ref = base + state->table[h];
+      state->table[h] = ip - base;
+
+      if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != seq)
+      {
+        // skip faster through data that does not compress
+        ip += 1 + ((ip - anchor) >> SKIP_TRIGGER);
+        continue;
+      }
+
+      while(ip > anchor && ref > base && ip[-1] == ref[-1])
+      {
+        --ip;
+        --ref;
+      }
+
+      const size_t litLen   = ip - anchor;
+      const size_t matchLen = matchLength(ip + MIN_MATCH, ref + MIN_MATCH,
+          matchlimit);
+
+      if ((size_t)(oend - op) <
+          1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1)
+        return 0;
+
+      uint8_t * token = op++;
+      if (litLen >= 15)
+      {
+        *token = 15 << 4;
+        op     = writeLength(op, litLen - 15);
+      }
+      else
+        *token = litLen << 4;
+
+      memcpy(op, anchor, litLen);
+      op += litLen;
+
+      const uint16_t offset = ip - ref;
+      *op++ = offset;
+      *op++ = offset >> 8;
+
+      if (matchLen >= 15)
+      {
+        *token |= 15;
+        op      = writeLength(op, matchLen - 15);
+      }
+      else
+        *token |= matchLen;
+
+      ip    += MIN_MATCH + matchLen;
+      anchor = ip;
+
+      // index the position before the end of the match as the next often
+      // continues from it
+      if (ip - 2 > base && ip < mflimit)
+        state->table[hash(read32(ip - 2))] = ip - 2 - base;
+    }
+  }
+
+  const size_t litLen = iend - anchor;
+  if ((size_t)(oend - op) < 1 + litLen / 255 + 1 + litLen)
+    return 0;
+
+  if (litLen >= 15)
+  {
+    *op++ = 15 << 4;
+    op    = writeLength(op, litLen - 15);
+  }
+  else
+    *op++ = litLen << 4;
+
+  memcpy(op, anchor, litLen);
+  op += litLen;
+
+  return op - (uint8_t *)dst;
+}
+
+static inline bool readLength(const uint8_t ** ip, const uint8_t * iend,
+    size_t * len)
+{
+  uint8_t b;
+  do
+  {
+    if (*ip >= iend)
+      return false;
+    b     = *(*ip)++;
+    *len += b;
+  }
+  while(b == 255);
+  return true;
+}
+
+// copies 16 bytes at a time, may write up to 15 bytes past dst + len
+static inline void wildCopy(uint8_t * dst, const uint8_t * src, size_t len)
+{
+  uint8_t * const end = dst + len;
+  do
+  {
+    _mm_storeu_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+    dst += 16;
+    src += 16;
+  }
+  while(dst < end);
+}
+
+size_t lz4_decompress(void * dst, size_t dstSize, const void * src,
+    size_t srcSize)
+{
+  const uint8_t *       ip   = src;
+  const uint8_t * const iend = ip + srcSize;
+  uint8_t       *       op   = dst;
+  uint8_t       * const oend = op + dstSize;
+
+  while(ip < iend)
+  {
+    const uint8_t token = *ip++;
+
+    size_t litLen = token >> 4;
+    if (litLen == 15 && !readLength(&ip, iend, &litLen))
+      return 0;
+
+    if (litLen > (size_t)(iend - ip) || litLen > (size_t)(oend - op))
+      return 0;
+
+    if (op + litLen + 16 <= oend && ip + litLen + 16 <= iend)
+      wildCopy(op, ip, litLen);
+    else
+      memcpy(op, ip, litLen);
+
+    ip += litLen;
+    op += litLen;
+
+    // the last sequence has no match
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return 0;
+
+    const size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+      return 0;
+
+    size_t matchLen = token & 15;
+    if (matchLen == 15 && !readLength(&ip, iend, &matchLen))
+      return 0;
+
+    matchLen += MIN_MATCH;
+    if (matchLen > (size_t)(oend - op))
+      return 0;
+
+    const uint8_t * match = op - offset;
+    if (offset >= 16 && op + matchLen + 16 <= oend)
+      wildCopy(op, match, matchLen);
+    else
+    {
+      /* the match overlaps the output, repeat the pattern doubling the amount
+       * copied each time, this is the common case for runs of one colour */
+      uint8_t * o   = op;
+      size_t    len = matchLen;
+      while(len)
+      {
+        const size_t n = len < (size_t)(o - match) ? len : (size_t)(o - match);
+        memcpy(o, match, n);
+        o   += n;
+        len -= n;
+      }
+    }
+
+    op += matchLen;
+  }
+
+  return op - (uint8_t *)dst;
+}
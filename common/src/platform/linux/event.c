@@ -21,20 +21,24 @@
 #include "common/event.h"
 
 #include "common/debug.h"
+#include "common/time.h"
 
 #include <stdlib.h>
-#include <pthread.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdatomic.h>
 #include <stdint.h>
+#include <immintrin.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 struct LGEvent
 {
-  pthread_mutex_t mutex;
-  pthread_cond_t  cond;
-  atomic_int      waiting;
-  atomic_bool     signaled;
-  bool            autoReset;
+  atomic_uint signaled; // the futex word, 1 when signaled
+  atomic_int  waiting;  // threads parked (or about to park) on the futex
+  bool        autoReset;
+  uint64_t    spinTime; // ns to spin before parking
 };
 
 LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
@@ -46,32 +50,12 @@ LGEvent * lgCreateEvent(bool autoReset, unsigned int msSpinTime)
     return NULL;
   }
 
-  if (pthread_mutex_init(&handle->mutex, NULL) != 0)
-  {
-    DEBUG_ERROR("Failed to create the mutex");
-    free(handle);
-    return NULL;
-  }
-
-  pthread_condattr_t cattr;
-  pthread_condattr_init(&cattr);
-
-  if (pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC) != 0)
-  {
-    DEBUG_ERROR("Failed to set the condition clock to realtime");
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
+  handle->autoReset = autoReset;
 
-  if (pthread_cond_init(&handle->cond, &cattr) != 0)
-  {
-    pthread_mutex_destroy(&handle->mutex);
-    free(handle);
-    return NULL;
-  }
+  // spinning can only delay the signalling thread on a single CPU system
+  if (sysconf(_SC_NPROCESSORS_ONLN) > 1)
+    handle->spinTime = msSpinTime * 1000000ULL;
 
-  handle->autoReset = autoReset;
   return handle;
 }
 
@@ -82,64 +66,91 @@ void lgFreeEvent(LGEvent * handle)
   if (atomic_load_explicit(&handle->waiting, memory_order_acquire) != 0)
     DEBUG_ERROR("BUG: Freeing an event that still has threads waiting on it");
 
-  pthread_cond_destroy (&handle->cond );
-  pthread_mutex_destroy(&handle->mutex);
   free(handle);
 }
 
+/**
+ * Check for the signal, consuming it if the event is auto reset so that only
+ * one waiter is released per signal.
+ */
+static inline bool eventTryWait(LGEvent * handle)
+{
+  if (!atomic_load_explicit(&handle->signaled, memory_order_acquire))
+    return false;
+
+  if (!handle->autoReset)
+    return true;
+
+  return atomic_exchange_explicit(&handle->signaled, 0,
+      memory_order_acquire) != 0;
+}
+
+static inline bool timespecPassed(const struct timespec * ts)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > ts->tv_sec ||
+    (now.tv_sec == ts->tv_sec && now.tv_nsec >= ts->tv_nsec);
+}
+
 bool lgWaitEventAbs(LGEvent * handle, struct timespec * ts)
 {
   DEBUG_ASSERT(handle);
 
-  bool ret   = true;
-  int  res;
-
-  if (pthread_mutex_lock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to lock the mutex");
-    return false;
-  }
+  if (eventTryWait(handle))
+    return true;
 
-  atomic_fetch_add_explicit(&handle->waiting, 1, memory_order_release);
-  while(ret && !atomic_load_explicit(&handle->signaled, memory_order_acquire))
+  if (handle->spinTime)
   {
-    if (!ts)
+    const uint64_t until = nanotime() + handle->spinTime;
+    do
     {
-      if ((res = pthread_cond_wait(&handle->cond, &handle->mutex)) != 0)
+      for(int i = 0; i < 64; ++i)
       {
-        DEBUG_ERROR("Failed to wait on the condition (err: %d)", res);
-        ret = false;
+        _mm_pause();
+        if (eventTryWait(handle))
+          return true;
       }
+
+      if (ts && timespecPassed(ts))
+        return false;
     }
-    else
+    while(nanotime() < until);
+  }
+
+  /* register as a waiter before the final check so that a signal after the
+   * check is guaranteed to see us and issue the wake */
+  atomic_fetch_add_explicit(&handle->waiting, 1, memory_order_seq_cst);
+
+  bool ret = true;
+  while(!eventTryWait(handle))
+  {
+    /* FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC timeout, which is
+     * exactly what we are given */
+    if (syscall(SYS_futex, &handle->signaled, FUTEX_WAIT_BITSET_PRIVATE, 0,
+          ts, NULL, FUTEX_BITSET_MATCH_ANY) == 0)
+      continue;
+
+    switch(errno)
     {
-      switch((res = pthread_cond_timedwait(&handle->cond, &handle->mutex, ts)))
-      {
-        case 0:
-          break;
+      case EAGAIN: // already signaled
+      case EINTR:
+        continue;
 
-        case ETIMEDOUT:
-          ret = false;
-          break;
+      case ETIMEDOUT:
+        // don't miss a signal that raced with the timeout
+        ret = eventTryWait(handle);
+        break;
 
-        default:
-          ret = false;
-          DEBUG_ERROR("Timed wait failed (err: %d)", res);
-          break;
-      }
+      default:
+        DEBUG_ERROR("futex wait failed (err: %d)", errno);
+        ret = false;
+        break;
     }
+    break;
   }
 
   atomic_fetch_sub_explicit(&handle->waiting, 1, memory_order_release);
-  if (pthread_mutex_unlock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to unlock the mutex");
-    return false;
-  }
-
-  if (ret && handle->autoReset)
-    atomic_store_explicit(&handle->signaled, false, memory_order_release);
-
   return ret;
 }
 
@@ -151,13 +162,8 @@ bool lgWaitEventNS(LGEvent * handle, unsigned int timeout)
   struct timespec ts;
   clock_gettime(CLOCK_MONOTONIC, &ts);
   uint64_t nsec = ts.tv_nsec + timeout;
-  if(nsec > 1000000000UL)
-  {
-    ts.tv_nsec = nsec - 1000000000UL;
-    ++ts.tv_sec;
-  }
-  else
-    ts.tv_nsec = nsec;
+  ts.tv_sec  += nsec / 1000000000UL;
+  ts.tv_nsec  = nsec % 1000000000UL;
 
   return lgWaitEventAbs(handle, &ts);
 }
@@ -167,32 +173,30 @@ bool lgWaitEvent(LGEvent * handle, unsigned int timeout)
   if (timeout == TIMEOUT_INFINITE)
     return lgWaitEventAbs(handle, NULL);
 
-  return lgWaitEventNS(handle, timeout * 1000000U);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t nsec = ts.tv_nsec + (uint64_t)timeout * 1000000ULL;
+  ts.tv_sec  += nsec / 1000000000UL;
+  ts.tv_nsec  = nsec % 1000000000UL;
+
+  return lgWaitEventAbs(handle, &ts);
 }
 
 bool lgSignalEvent(LGEvent * handle)
 {
   DEBUG_ASSERT(handle);
 
-  if (pthread_mutex_lock(&handle->mutex) != 0)
-  {
-    DEBUG_ERROR("Failed to lock the mutex");
-    return false;
-  }
+  if (atomic_exchange_explicit(&handle->signaled, 1, memory_order_seq_cst))
+    return true;
 
-  const bool signaled = atomic_exchange_explicit(&handle->signaled, true,
-      memory_order_release);
-
-  if (!signaled)
-    if (pthread_cond_broadcast(&handle->cond) != 0)
-    {
-      DEBUG_ERROR("Failed to signal the condition");
-      return false;
-    }
+  // only enter the kernel if there is someone to wake
+  if (atomic_load_explicit(&handle->waiting, memory_order_seq_cst) == 0)
+    return true;
 
-  if (pthread_mutex_unlock(&handle->mutex) != 0)
+  if (syscall(SYS_futex, &handle->signaled, FUTEX_WAKE_PRIVATE,
+        handle->autoReset ? 1 : INT_MAX, NULL, NULL, 0) < 0)
   {
-    DEBUG_ERROR("Failed to unlock the mutex");
+    DEBUG_ERROR("futex wake failed (err: %d)", errno);
     return false;
   }
 
@@ -202,5 +206,5 @@ bool lgSignalEvent(LGEvent * handle)
 bool lgResetEvent(LGEvent * handle)
 {
   DEBUG_ASSERT(handle);
-  return atomic_exchange_explicit(&handle->signaled, false, memory_order_release);
+  return atomic_exchange_explicit(&handle->signaled, 0, memory_order_release);
 }
@@ -26,6 +26,9 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -37,6 +40,12 @@
 #include "common/stringutils.h"
 #include "module/kvmfr.h"
 
+#define MEMFD_NAME "memfd"
+#define MEMFD_HUGE "memfd:huge"
+
+// the largest loopback segment in MiB, the size is held in an unsigned int
+#define SHM_SIZE_MAX 4095
+
 struct IVSHMEMInfo
 {
   int  devFd;
@@ -44,13 +53,41 @@ struct IVSHMEMInfo
   bool hasDMA;
 };
 
+/* options for a loopback segment shared by a host and client on the same
+ * machine, these are not used for VM shared memory */
+struct IVSHMEMLoopback
+{
+  uint64_t     size;     // create or grow the segment to this size
+  bool         populate; // prefault the mapping
+  bool         lock;     // lock the mapping into memory
+};
+
+static bool isMemfd(const char * shmDevice)
+{
+  return
+    strcmp(shmDevice, MEMFD_NAME) == 0 ||
+    strcmp(shmDevice, MEMFD_HUGE) == 0;
+}
+
 static bool ivshmemDeviceValidator(struct Option * opt, const char ** error)
 {
+  if (isMemfd(opt->value.x_string))
+  {
+    if (option_get_int("app", "shmSize") <= 0)
+    {
+      *error = "app:shmSize must be set to create a memfd segment";
+      return false;
+    }
+    return true;
+  }
+
   // if it's not a kvmfr device, it must be a file on disk
   if (strlen(opt->value.x_string) > 3 && memcmp(opt->value.x_string, "kvmfr", 5) != 0)
   {
+    // unless we have been asked to create it
     struct stat st;
-    if (stat(opt->value.x_string, &st) != 0)
+    if (stat(opt->value.x_string, &st) != 0 &&
+        option_get_int("app", "shmSize") <= 0)
     {
       *error = "Invalid path to the ivshmem file specified";
       return false;
@@ -61,6 +98,15 @@ static bool ivshmemDeviceValidator(struct Option * opt, const char ** error)
   return true;
 }
 
+static bool shmSizeValidator(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= 0 && opt->value.x_int <= SHM_SIZE_MAX)
+    return true;
+
+  *error = "app:shmSize must be between 0 and 4095";
+  return false;
+}
+
 static StringList ivshmemDeviceGetValues(struct Option * option)
 {
   StringList sl = stringlist_new(true);
@@ -98,6 +144,28 @@ void ivshmemOptionsInit(void)
       .validator      = ivshmemDeviceValidator,
       .getValues      = ivshmemDeviceGetValues
     },
+    {
+      .module         = "app",
+      .name           = "shmSize",
+      .description    = "Create the shared memory file with this size in MiB for loopback use (0 to disable)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 0,
+      .validator      = shmSizeValidator
+    },
+    {
+      .module         = "app",
+      .name           = "shmPopulate",
+      .description    = "Prefault the shared memory mapping",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
+    {
+      .module         = "app",
+      .name           = "shmLock",
+      .description    = "Lock the shared memory mapping into RAM",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = false
+    },
     {0}
   };
 
@@ -110,12 +178,109 @@ bool ivshmemInit(struct IVSHMEM * dev)
   return true;
 }
 
-bool ivshmemOpen(struct IVSHMEM * dev)
+/**
+ * Create an anonymous memfd segment, other processes owned by the same user
+ * can attach to it via the /proc path that is logged
+ */
+static int createMemfd(const char * shmDevice, uint64_t size,
+    unsigned int * devSize)
 {
-  return ivshmemOpenDev(dev, option_get_string("app", "shmFile"));
+  const bool huge = strcmp(shmDevice, MEMFD_HUGE) == 0;
+  int fd = memfd_create("looking-glass", MFD_CLOEXEC |
+      (huge ? MFD_HUGETLB : 0));
+  if (fd < 0)
+  {
+    DEBUG_ERROR("memfd_create failed: %s", strerror(errno));
+    if (huge)
+      DEBUG_ERROR("Check that huge pages have been reserved (vm.nr_hugepages)");
+    return -1;
+  }
+
+  if (huge)
+  {
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0)
+      size = ALIGN_PAD(size, (uint64_t)sfs.f_bsize);
+  }
+
+  if (size > UINT_MAX)
+  {
+    DEBUG_ERROR("The memfd segment is too large once aligned to the page size");
+    close(fd);
+    return -1;
+  }
+
+  *devSize = size;
+  if (ftruncate(fd, size) != 0)
+  {
+    DEBUG_ERROR("Failed to size the memfd segment: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  DEBUG_INFO("Loopback Segment : /proc/%d/fd/%d", getpid(), fd);
+  return fd;
 }
 
-bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
+/**
+ * Open a shared memory file, creating or growing it to the loopback size if
+ * one was given. Files on hugetlbfs are sized to a multiple of the huge page
+ * size.
+ */
+static int openFile(const char * shmDevice, unsigned int * size,
+    const struct IVSHMEMLoopback * loopback)
+{
+  const int flags = O_RDWR | (loopback->size ? O_CREAT : 0);
+  int fd = open(shmDevice, flags, (mode_t)0600);
+  if (fd < 0)
+  {
+    DEBUG_ERROR("Failed to open: %s", shmDevice);
+    DEBUG_ERROR("%s", strerror(errno));
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    DEBUG_ERROR("Failed to stat: %s", shmDevice);
+    DEBUG_ERROR("%s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  *size = st.st_size;
+  if (loopback->size > *size)
+  {
+    uint64_t newSize = loopback->size;
+
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == 0 && sfs.f_type == HUGETLBFS_MAGIC)
+      newSize = ALIGN_PAD(newSize, (uint64_t)sfs.f_bsize);
+
+    if (newSize > UINT_MAX)
+    {
+      DEBUG_ERROR("%s is too large once aligned to the page size", shmDevice);
+      close(fd);
+      return -1;
+    }
+
+    if (ftruncate(fd, newSize) != 0)
+    {
+      DEBUG_ERROR("Failed to resize %s: %s", shmDevice, strerror(errno));
+      close(fd);
+      return -1;
+    }
+
+    *size = newSize;
+    DEBUG_INFO("Loopback Segment : %s (%u MiB)", shmDevice,
+        (unsigned int)(newSize / 1048576));
+  }
+
+  return fd;
+}
+
+static bool openDev(struct IVSHMEM * dev, const char * shmDevice,
+    const struct IVSHMEMLoopback * loopback)
 {
   DEBUG_ASSERT(dev);
 
@@ -141,36 +306,43 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
     devSize = ioctl(devFd, KVMFR_DMABUF_GETSIZE, 0);
     hasDMA = true;
   }
-  else
+  else if (isMemfd(shmDevice))
   {
-    struct stat st;
-    if (stat(shmDevice, &st) != 0)
-    {
-      DEBUG_ERROR("Failed to stat: %s", shmDevice);
-      DEBUG_ERROR("%s", strerror(errno));
+    devFd = createMemfd(shmDevice, loopback->size, &devSize);
+    if (devFd < 0)
       return false;
-    }
 
-    devSize = st.st_size;
-    devFd   = open(shmDevice, O_RDWR, (mode_t)0600);
+    hasDMA = false;
+  }
+  else
+  {
+    devFd = openFile(shmDevice, &devSize, loopback);
     if (devFd < 0)
-    {
-      DEBUG_ERROR("Failed to open: %s", shmDevice);
-      DEBUG_ERROR("%s", strerror(errno));
       return false;
-    }
 
     hasDMA = false;
   }
 
-  void * map = mmap(0, devSize, PROT_READ | PROT_WRITE, MAP_SHARED, devFd, 0);
+  const int mapFlags = MAP_SHARED | (loopback->populate ? MAP_POPULATE : 0);
+  void * map = mmap(0, devSize, PROT_READ | PROT_WRITE, mapFlags, devFd, 0);
   if (map == MAP_FAILED)
   {
     DEBUG_ERROR("Failed to map the shared memory device: %s", shmDevice);
     DEBUG_ERROR("%s", strerror(errno));
+    close(devFd);
     return false;
   }
 
+  if (!hasDMA)
+  {
+    // ask for transparent huge pages, this is a no-op for hugetlbfs
+    madvise(map, devSize, MADV_HUGEPAGE);
+
+    if (loopback->lock && mlock(map, devSize) != 0)
+      DEBUG_WARN("Failed to lock the shared memory: %s (check RLIMIT_MEMLOCK)",
+          strerror(errno));
+  }
+
   struct IVSHMEMInfo * info = malloc(sizeof(*info));
   info->size   = devSize;
   info->devFd  = devFd;
@@ -182,6 +354,24 @@ bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
   return true;
 }
 
+bool ivshmemOpen(struct IVSHMEM * dev)
+{
+  const struct IVSHMEMLoopback loopback =
+  {
+    .size     = (uint64_t)option_get_int("app", "shmSize") * 1048576U,
+    .populate = option_get_bool("app", "shmPopulate"),
+    .lock     = option_get_bool("app", "shmLock"    )
+  };
+
+  return openDev(dev, option_get_string("app", "shmFile"), &loopback);
+}
+
+bool ivshmemOpenDev(struct IVSHMEM * dev, const char * shmDevice)
+{
+  const struct IVSHMEMLoopback loopback = { 0 };
+  return openDev(dev, shmDevice, &loopback);
+}
+
 void ivshmemClose(struct IVSHMEM * dev)
 {
   DEBUG_ASSERT(dev);
@@ -22,89 +22,263 @@
 #include "common/debug.h"
 
 #include <errno.h>
-#include <signal.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <sys/prctl.h>
+
+/* All timers are serviced by one thread which sleeps until the earliest
+ * deadline in a min-heap of timers and runs the callbacks itself. The thread
+ * is started with the first timer and then idles when there are none. */
 
 struct LGTimer
 {
   LGTimerFn   fn;
   void      * udata;
-  timer_t     id;
-  bool        running;
+  uint64_t    interval; // ns
+  uint64_t    next;     // the next deadline, CLOCK_MONOTONIC ns
+  int         index;    // position in the heap, -1 if not scheduled
+
+  LGTimerStats stats;
+  uint64_t     lateSum;
+};
+
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;     // signalled when the heap changes
+  pthread_cond_t  idle;     // signalled when a callback completes
+  pthread_t       thread;
+  bool            running;
+  LGTimer       * current;  // the timer whose callback is running
+
+  LGTimer      ** heap;
+  int             count;
+  int             size;
+}
+timers =
+{
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER
 };
 
-static void TimerProc(union sigval arg)
+static void heapSwap(int a, int b)
 {
-  LGTimer * timer = (LGTimer *)arg.sival_ptr;
-  if (!timer->fn(timer->udata))
+  LGTimer * tmp = timers.heap[a];
+  timers.heap[a] = timers.heap[b];
+  timers.heap[b] = tmp;
+  timers.heap[a]->index = a;
+  timers.heap[b]->index = b;
+}
+
+static void heapUp(int i)
+{
+  while(i > 0)
   {
-    if (timer_delete(timer->id))
-      DEBUG_ERROR("failed to destroy the timer: %s", strerror(errno));
-    timer->running = false;
+    const int parent = (i - 1) / 2;
+    if (timers.heap[parent]->next <= timers.heap[i]->next)
+      break;
+    heapSwap(i, parent);
+    i = parent;
   }
 }
 
-bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
-    void * udata, LGTimer ** result)
+static void heapDown(int i)
 {
-  LGTimer * ret = malloc(sizeof(*ret));
+  for(;;)
+  {
+    const int l = i * 2 + 1;
+    const int r = l + 1;
+    int min = i;
 
-  if (!ret)
+    if (l < timers.count && timers.heap[l]->next < timers.heap[min]->next)
+      min = l;
+    if (r < timers.count && timers.heap[r]->next < timers.heap[min]->next)
+      min = r;
+    if (min == i)
+      break;
+
+    heapSwap(i, min);
+    i = min;
+  }
+}
+
+static bool heapPush(LGTimer * timer)
+{
+  if (timers.count == timers.size)
   {
-    DEBUG_ERROR("failed to malloc LGTimer struct");
-    return false;
+    const int size = timers.size ? timers.size * 2 : 8;
+    LGTimer ** heap = realloc(timers.heap, size * sizeof(*heap));
+    if (!heap)
+      return false;
+
+    timers.heap = heap;
+    timers.size = size;
   }
 
-  ret->fn      = fn;
-  ret->udata   = udata;
-  ret->running = true;
+  timer->index = timers.count;
+  timers.heap[timers.count++] = timer;
+  heapUp(timer->index);
+  return true;
+}
+
+static void heapRemove(LGTimer * timer)
+{
+  const int i = timer->index;
+  timer->index = -1;
 
-  struct sigevent sev =
+  if (i != --timers.count)
   {
-    .sigev_notify = SIGEV_THREAD,
-    .sigev_notify_function = &TimerProc,
-    .sigev_value.sival_ptr = ret,
-  };
+    timers.heap[i] = timers.heap[timers.count];
+    timers.heap[i]->index = i;
+    heapDown(i);
+    heapUp(i);
+  }
+}
 
-  if (timer_create(CLOCK_MONOTONIC, &sev, &ret->id))
+static void * timerThread(void * opaque)
+{
+  // the default 50us slack would make short timers fire late
+  prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+
+  pthread_mutex_lock(&timers.lock);
+  while(timers.running)
   {
-    DEBUG_ERROR("failed to create timer: %s", strerror(errno));
-    free(ret);
-    return false;
+    if (timers.count == 0)
+    {
+      pthread_cond_wait(&timers.cond, &timers.lock);
+      continue;
+    }
+
+    LGTimer * timer = timers.heap[0];
+    uint64_t  now   = nanotime();
+    if (now < timer->next)
+    {
+      struct timespec ts =
+      {
+        .tv_sec  = timer->next / 1000000000ULL,
+        .tv_nsec = timer->next % 1000000000ULL
+      };
+      pthread_cond_timedwait(&timers.cond, &timers.lock, &ts);
+      continue;
+    }
+
+    const uint64_t late = now - timer->next;
+    LGTimerStats * stats = &timer->stats;
+    ++stats->count;
+    timer->lateSum   += late;
+    stats->avgLateNs  = timer->lateSum / stats->count;
+    if (late > stats->maxLateNs)
+      stats->maxLateNs = late;
+
+    // schedule the next expiry, dropping any we are too late for
+    timer->next += timer->interval;
+    if (timer->next <= now)
+    {
+      const uint64_t missed = (now - timer->next) / timer->interval + 1;
+      stats->overruns += missed;
+      timer->next     += missed * timer->interval;
+    }
+    heapDown(0);
+
+    timers.current = timer;
+    pthread_mutex_unlock(&timers.lock);
+    const bool keep = timer->fn(timer->udata);
+    pthread_mutex_lock(&timers.lock);
+
+    // current is cleared if the callback destroyed its own timer
+    if (timers.current && !keep && timer->index >= 0)
+      heapRemove(timer);
+    timers.current = NULL;
+
+    pthread_cond_broadcast(&timers.idle);
   }
+  pthread_mutex_unlock(&timers.lock);
+  return NULL;
+}
 
-  struct timespec interval =
+bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
+    void * udata, LGTimer ** result)
+{
+  LGTimer * ret = calloc(1, sizeof(*ret));
+  if (!ret)
   {
-    .tv_sec  = intervalMS / 1000,
-    .tv_nsec = (intervalMS % 1000) * 1000000,
-  };
-  struct itimerspec spec =
+    DEBUG_ERROR("failed to malloc LGTimer struct");
+    return false;
+  }
+
+  ret->fn       = fn;
+  ret->udata    = udata;
+  ret->interval = intervalMS * 1000000ULL;
+  ret->next     = nanotime() + ret->interval;
+
+  pthread_mutex_lock(&timers.lock);
+  if (!timers.running)
   {
-    .it_interval = interval,
-    .it_value = interval,
-  };
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&timers.cond, &attr);
+    pthread_condattr_destroy(&attr);
 
-  if (timer_settime(ret->id, 0, &spec, NULL))
+    timers.running = true;
+    if (pthread_create(&timers.thread, NULL, timerThread, NULL) != 0)
+    {
+      DEBUG_ERROR("failed to create the timer thread");
+      timers.running = false;
+      pthread_cond_destroy(&timers.cond);
+      pthread_mutex_unlock(&timers.lock);
+      free(ret);
+      return false;
+    }
+    pthread_setname_np(timers.thread, "timer");
+  }
+
+  if (!heapPush(ret))
   {
-    DEBUG_ERROR("failed to set timer: %s", strerror(errno));
-    timer_delete(ret->id);
+    DEBUG_ERROR("failed to grow the timer heap");
+    pthread_mutex_unlock(&timers.lock);
     free(ret);
     return false;
   }
 
+  pthread_cond_signal(&timers.cond);
+  pthread_mutex_unlock(&timers.lock);
+
   *result = ret;
   return true;
 }
 
 void lgTimerDestroy(LGTimer * timer)
 {
-  if (timer->running)
+  pthread_mutex_lock(&timers.lock);
+  if (timer->index >= 0)
+    heapRemove(timer);
+
+  if (timers.current == timer)
   {
-    if (timer_delete(timer->id))
-      DEBUG_ERROR("failed to destroy the timer: %s", strerror(errno));
+    // destroyed from its own callback, tell the thread not to touch it
+    if (pthread_equal(pthread_self(), timers.thread))
+      timers.current = NULL;
+    else
+      while(timers.current == timer)
+        pthread_cond_wait(&timers.idle, &timers.lock);
   }
+  pthread_mutex_unlock(&timers.lock);
 
   free(timer);
 }
+
+bool lgTimerGetStats(LGTimer * timer, LGTimerStats * stats, bool reset)
+{
+  pthread_mutex_lock(&timers.lock);
+  memcpy(stats, &timer->stats, sizeof(*stats));
+  if (reset)
+  {
+    memset(&timer->stats, 0, sizeof(timer->stats));
+    timer->lateSum = 0;
+  }
+  pthread_mutex_unlock(&timers.lock);
+  return true;
+}
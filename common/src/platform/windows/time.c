@@ -21,6 +21,8 @@
 #include "common/time.h"
 #include "common/debug.h"
 
+#include <string.h>
+
 // decared by the platform
 extern HWND MessageHWND;
 
@@ -30,11 +32,28 @@ struct LGTimer
   void      * udata;
   UINT_PTR    handle;
   bool        running;
+
+  uint64_t     interval; // ns
+  uint64_t     next;     // the expected time of the next expiry
+  uint64_t     lateSum;
+  LGTimerStats stats;
 };
 
 static void TimerProc(HWND Arg1, UINT Arg2, UINT_PTR Arg3, DWORD Arg4)
 {
   LGTimer * timer = (LGTimer *)Arg3;
+
+  const uint64_t now  = nanotime();
+  const uint64_t late = now > timer->next ? now - timer->next : 0;
+  ++timer->stats.count;
+  timer->lateSum         += late;
+  timer->stats.avgLateNs  = timer->lateSum / timer->stats.count;
+  if (late > timer->stats.maxLateNs)
+    timer->stats.maxLateNs = late;
+  if (late >= timer->interval)
+    timer->stats.overruns += late / timer->interval;
+  timer->next = now + timer->interval;
+
   if (!timer->fn(timer->udata))
   {
     KillTimer(Arg1, timer->handle);
@@ -52,10 +71,14 @@ bool lgCreateTimer(const unsigned int intervalMS, LGTimerFn fn,
     return false;
   }
 
-  ret->fn      = fn;
-  ret->udata   = udata;
-  ret->running = true;
-  ret->handle  = SetTimer(MessageHWND, (UINT_PTR)ret, intervalMS, TimerProc);
+  memset(&ret->stats, 0, sizeof(ret->stats));
+  ret->fn       = fn;
+  ret->udata    = udata;
+  ret->running  = true;
+  ret->lateSum  = 0;
+  ret->interval = intervalMS * 1000000ULL;
+  ret->next     = nanotime() + ret->interval;
+  ret->handle   = SetTimer(MessageHWND, (UINT_PTR)ret, intervalMS, TimerProc);
 
   *result = ret;
   return true;
@@ -72,6 +95,18 @@ void lgTimerDestroy(LGTimer * timer)
   free(timer);
 }
 
+bool lgTimerGetStats(LGTimer * timer, LGTimerStats * stats, bool reset)
+{
+  // the timer runs on the message thread so the stats may be mid update
+  memcpy(stats, &timer->stats, sizeof(*stats));
+  if (reset)
+  {
+    memset(&timer->stats, 0, sizeof(timer->stats));
+    timer->lateSum = 0;
+  }
+  return true;
+}
+
 NTSYSCALLAPI NTSTATUS NTAPI NtSetTimerResolution(
   _In_ ULONG DesiredTime,
   _In_ BOOLEAN SetResolution,
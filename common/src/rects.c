@@ -20,8 +20,22 @@
 
 #include "common/rects.h"
 #include "common/util.h"
+#include "common/region.h"
+#include "common/debug.h"
+#include "common/thread.h"
+#include "common/event.h"
 
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <immintrin.h>
+
+#define RECTS_MAX_COPY_THREADS   16
+#define RECTS_BANDS_PER_THREAD   2
+#define RECTS_MAX_BANDS          ((RECTS_MAX_COPY_THREADS + 1) * \
+                                  RECTS_BANDS_PER_THREAD)
+
+// damage smaller then this is not worth splitting across threads
+#define RECTS_PARALLEL_MIN_BYTES (512 * 1024)
 
 struct Corner
 {
@@ -36,39 +50,11 @@ struct Edge
   int delta;
 };
 
-inline static bool rectIntersects(const FrameDamageRect * r1,
-    const FrameDamageRect * r2)
-{
-  return !(
-    r1->x > r2->x + r2->width  ||
-    r2->x > r1->x + r1->width  ||
-    r1->y > r2->y + r2->height ||
-    r2->y > r1->y + r1->height);
-}
-
-inline static bool rectContains(const FrameDamageRect * r1,
-    const FrameDamageRect * r2)
-{
-  return !(
-    r2->x              < r1->x              ||
-    r2->x + r2->width  > r1->x + r1->width  ||
-    r2->y              < r1->y              ||
-    r2->y + r2->height > r1->y + r1->height);
-}
-
-inline static int removeRects(FrameDamageRect * rects, int count,
-    bool removed[])
+static int intCompare(const void * a_, const void * b_)
 {
-  int o = 0;
-  for (int i = 0; i < count; ++i)
-  {
-    if (removed[i] || i == o++)
-      continue;
-
-    rects[o-1] = rects[i];
-  }
-
-  return o;
+  const int a = *(const int *)a_;
+  const int b = *(const int *)b_;
+  return (a > b) - (a < b);
 }
 
 static int cornerCompare(const void * a_, const void * b_)
@@ -225,76 +211,361 @@ static void fbRowStart(int y, void * opaque)
   framebuffer_wait(data->frame, y * data->stride);
 }
 
-void rectsFramebufferToBuffer(FrameDamageRect * rects, int count,
-  uint8_t * dst, int dstStride, int height,
-  const FrameBuffer * frame, int srcStride)
+struct RectsCopyJob
 {
-  struct FromFramebufferData data = { .frame = frame, .stride = srcStride };
-  rectsBufferCopy(rects, count, dst, dstStride, height,
-    framebuffer_get_buffer(frame), srcStride, &data, fbRowStart, NULL);
+  const FrameDamageRect * rects;
+  int                     count;
+  uint8_t               * dst;
+  int                     dstStride;
+  int                     height;
+  const FrameBuffer     * frame;
+  int                     srcStride;
+
+  // the rows each band covers, band i is [bandY[i], bandY[i + 1])
+  int                     bandY[RECTS_MAX_BANDS + 1];
+  int                     bands;
+
+  // count rects of scratch per band to clip the rects into
+  FrameDamageRect       * scratch;
+  int                     scratchSize;
+
+  atomic_uint             nextBand;
+  atomic_uint             completed;
+};
+
+static struct
+{
+  unsigned int        threadCount;
+  LGThread          * threads[RECTS_MAX_COPY_THREADS];
+  LGEvent           * events [RECTS_MAX_COPY_THREADS];
+  LGEvent           * doneEvent; // signalled when the last band completes
+  atomic_bool         running;
+
+  struct RectsCopyJob job;
+  atomic_flag         busy;
+  atomic_bool         live;
+  atomic_uint         active;
 }
+pool = { .busy = ATOMIC_FLAG_INIT };
 
-int rectsMergeOverlapping(FrameDamageRect * rects, int count)
+/**
+ * Copy the part of the damage that falls within a band. As the sweep only ever
+ * waits for the rows it is about to copy, a band never waits on the frame past
+ * its own last row, so the bands nearer the top can complete while the rest of
+ * the frame is still arriving.
+ */
+static void rectsCopyBand(struct RectsCopyJob * job, int band)
 {
-  if (count == 0)
-    return 0;
+  const int y1 = job->bandY[band];
+  const int y2 = job->bandY[band + 1];
+  FrameDamageRect * clipped = job->scratch + band * job->count;
 
-  bool removed[count];
-  bool changed;
+  int n = 0;
+  for(int i = 0; i < job->count; ++i)
+  {
+    const FrameDamageRect * rect = job->rects + i;
+    const int ry1 = max((int)rect->y, y1);
+    const int ry2 = min((int)(rect->y + rect->height), y2);
+    if (ry1 >= ry2)
+      continue;
 
-  memset(removed, 0, sizeof(removed));
+    clipped[n++] = (FrameDamageRect)
+    {
+      .x      = rect->x,
+      .y      = ry1,
+      .width  = rect->width,
+      .height = ry2 - ry1
+    };
+  }
 
-  do
+  if (!n)
+    return;
+
+  struct FromFramebufferData data =
+    { .frame = job->frame, .stride = job->srcStride };
+  rectsBufferCopy(clipped, n, job->dst, job->dstStride, y2,
+    framebuffer_get_buffer(job->frame), job->srcStride, &data, fbRowStart,
+    NULL);
+}
+
+static void rectsProcessBands(struct RectsCopyJob * job)
+{
+  unsigned int band;
+  while((band = atomic_fetch_add(&job->nextBand, 1)) < (unsigned)job->bands)
   {
-    changed = false;
-    for (int i = 0; i < count; ++i)
-    {
-      if (removed[i])
-        continue;
+    rectsCopyBand(job, band);
+    if (atomic_fetch_add(&job->completed, 1) + 1 == (unsigned)job->bands)
+      lgSignalEvent(pool.doneEvent);
+  }
+}
 
-      for (int j = i + 1; j < count; ++j)
-      {
-        if (removed[j] || !rectIntersects(rects + i, rects + j))
-          continue;
+static int rectsCopyThread(void * opaque)
+{
+  LGEvent * event = (LGEvent *)opaque;
+  while(atomic_load(&pool.running))
+  {
+    if (!lgWaitEvent(event, TIMEOUT_INFINITE))
+      continue;
+
+    atomic_fetch_add(&pool.active, 1);
+    if (atomic_load(&pool.live))
+      rectsProcessBands(&pool.job);
+    atomic_fetch_sub(&pool.active, 1);
+  }
+  return 0;
+}
 
-        const uint32_t x2 = max(rects[i].x + rects[i].width,
-            rects[j].x + rects[j].width);
-        const uint32_t y2 = max(rects[i].y + rects[i].height,
-            rects[j].y + rects[j].height);
+bool rectsStartCopyThreads(unsigned int count)
+{
+  if (pool.threadCount)
+    rectsStopCopyThreads();
 
-        rects[i].x      = min(rects[i].x, rects[j].x);
-        rects[i].y      = min(rects[i].y, rects[j].y);
-        rects[i].width  = x2 - rects[i].x;
-        rects[i].height = y2 - rects[i].y;
+  // the calling thread also copies, so it counts as one of the threads
+  if (count < 2)
+    return true;
 
-        removed[j] = true;
-        changed    = true;
-      }
+  if (count > RECTS_MAX_COPY_THREADS + 1)
+  {
+    DEBUG_WARN("Limiting the damage copy threads to %d",
+        RECTS_MAX_COPY_THREADS + 1);
+    count = RECTS_MAX_COPY_THREADS + 1;
+  }
+
+  atomic_store(&pool.running, true);
+  atomic_store(&pool.live   , false);
+  atomic_store(&pool.active , 0);
+
+  if (!(pool.doneEvent = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the damage copy done event");
+    return false;
+  }
+
+  for(unsigned int i = 0; i < count - 1; ++i)
+  {
+    if (!(pool.events[i] = lgCreateEvent(true, 0)))
+    {
+      DEBUG_ERROR("Failed to create the damage copy event");
+      rectsStopCopyThreads();
+      return false;
     }
+
+    if (!lgCreateThread("RectsCopyThread", rectsCopyThread, pool.events[i],
+          &pool.threads[i]))
+    {
+      DEBUG_ERROR("Failed to create the damage copy thread");
+      lgFreeEvent(pool.events[i]);
+      pool.events[i] = NULL;
+      rectsStopCopyThreads();
+      return false;
+    }
+
+    ++pool.threadCount;
   }
-  while (changed);
 
-  return removeRects(rects, count, removed);
+  DEBUG_INFO("Damage Threads   : %u", count);
+  return true;
 }
 
-int rectsRejectContained(FrameDamageRect * rects, int count)
+void rectsStopCopyThreads(void)
 {
-  bool removed[count];
-  memset(removed, 0, sizeof(removed));
+  atomic_store(&pool.running, false);
+  for(unsigned int i = 0; i < pool.threadCount; ++i)
+  {
+    lgSignalEvent(pool.events[i]);
+    lgJoinThread(pool.threads[i], NULL);
+    lgFreeEvent(pool.events[i]);
+    pool.threads[i] = NULL;
+    pool.events [i] = NULL;
+  }
+  pool.threadCount = 0;
 
-  for (int i = 0; i < count; ++i)
+  if (pool.doneEvent)
+  {
+    lgFreeEvent(pool.doneEvent);
+    pool.doneEvent = NULL;
+  }
+
+  free(pool.job.scratch);
+  pool.job.scratch     = NULL;
+  pool.job.scratchSize = 0;
+}
+
+/**
+ * Split the damaged rows into bands that each hold about the same number of
+ * damaged pixels, returns the number of bands or zero if the damage is too
+ * small to be worth splitting.
+ */
+static int rectsSplitBands(const FrameDamageRect * rects, int count,
+    int height, int maxBands, int bandY[])
+{
+  int ys[count * 2];
+  int nys = 0;
+  for(int i = 0; i < count; ++i)
+  {
+    ys[nys++] = min((int)rects[i].y                  , height);
+    ys[nys++] = min((int)(rects[i].y + rects[i].height), height);
+  }
+  qsort(ys, nys, sizeof(*ys), intCompare);
+
+  // the damaged width of each interval between the y edges, overlaps included
+  int64_t width[nys];
+  int64_t total = 0;
+  for(int i = 0; i < nys - 1; ++i)
+  {
+    width[i] = 0;
+    if (ys[i] == ys[i + 1])
+      continue;
+
+    for(int j = 0; j < count; ++j)
+      if ((int)rects[j].y <= ys[i] &&
+          (int)(rects[j].y + rects[j].height) >= ys[i + 1])
+        width[i] += rects[j].width;
+
+    total += width[i] * (ys[i + 1] - ys[i]);
+  }
+
+  // rectsBufferCopy always copies 32bpp pixels
+  if (total * 4 < RECTS_PARALLEL_MIN_BYTES)
+    return 0;
+
+  int bands = 0;
+  bandY[0] = ys[0];
+
+  int64_t acc = 0;
+  for(int i = 0; i < nys - 1 && bands < maxBands - 1; ++i)
   {
-    if (removed[i])
+    if (!width[i])
       continue;
 
-    for (int j = 0; j < count; ++j)
+    const int64_t area = width[i] * (ys[i + 1] - ys[i]);
+    while(bands < maxBands - 1 &&
+        acc + area >= total * (bands + 1) / maxBands)
     {
-      if (j == i || removed[j])
-        continue;
+      const int64_t need = total * (bands + 1) / maxBands - acc;
+      const int     y    = ys[i] + (need + width[i] - 1) / width[i];
+      if (y > bandY[bands] && y < ys[nys - 1])
+        bandY[++bands] = y;
+      else
+        break;
+    }
+    acc += area;
+  }
+
+  bandY[++bands] = ys[nys - 1];
+  return bands;
+}
+
+static bool rectsCopyParallel(FrameDamageRect * rects, int count,
+  uint8_t * dst, int dstStride, int height,
+  const FrameBuffer * frame, int srcStride)
+{
+  struct RectsCopyJob * job = &pool.job;
+  const int bands = rectsSplitBands(rects, count, height,
+      (pool.threadCount + 1) * RECTS_BANDS_PER_THREAD, job->bandY);
 
-      removed[j] = rectContains(rects + i, rects + j);
+  if (bands < 2)
+    return false;
+
+  if (bands * count > job->scratchSize)
+  {
+    FrameDamageRect * tmp = realloc(job->scratch,
+        bands * count * sizeof(*tmp));
+    if (!tmp)
+    {
+      DEBUG_ERROR("Failed to allocate memory");
+      return false;
     }
+    job->scratch     = tmp;
+    job->scratchSize = bands * count;
   }
 
-  return removeRects(rects, count, removed);
+  job->rects     = rects;
+  job->count     = count;
+  job->dst       = dst;
+  job->dstStride = dstStride;
+  job->height    = height;
+  job->frame     = frame;
+  job->srcStride = srcStride;
+  job->bands     = bands;
+  atomic_store(&job->nextBand , 0);
+  atomic_store(&job->completed, 0);
+  lgResetEvent(pool.doneEvent);
+
+  atomic_store(&pool.live, true);
+  for(unsigned int i = 0; i < pool.threadCount; ++i)
+    lgSignalEvent(pool.events[i]);
+
+  // the caller takes part in the copy too
+  rectsProcessBands(job);
+
+  /* sleep until the other threads finish their last bands, these may still be
+   * waiting on the frame to arrive so this can take as long as the transfer */
+  while(atomic_load(&job->completed) < (unsigned)bands)
+    lgWaitEvent(pool.doneEvent, TIMEOUT_INFINITE);
+
+  /* ensure no thread is still looking at the job before it is reused, any
+   * thread that wakes late will see that the job is no longer live. This is
+   * only ever the few instructions after a thread's last band, so spin */
+  atomic_store(&pool.live, false);
+  while(atomic_load(&pool.active) > 0)
+    _mm_pause();
+
+  return true;
+}
+
+void rectsFramebufferToBuffer(FrameDamageRect * rects, int count,
+  uint8_t * dst, int dstStride, int height,
+  const FrameBuffer * frame, int srcStride)
+{
+  // the pool runs one job at a time, any other caller copies on its own
+  if (pool.threadCount && count > 1 &&
+      !atomic_flag_test_and_set(&pool.busy))
+  {
+    const bool done = rectsCopyParallel(rects, count, dst, dstStride, height,
+        frame, srcStride);
+    atomic_flag_clear(&pool.busy);
+    if (done)
+      return;
+  }
+
+  struct FromFramebufferData data = { .frame = frame, .stride = srcStride };
+  rectsBufferCopy(rects, count, dst, dstStride, height,
+    framebuffer_get_buffer(frame), srcStride, &data, fbRowStart, NULL);
+}
+
+/* both of these hand the rects to the region engine, which returns the disjoint
+ * rects covering their union. Merging is driven by the cost of the row copies
+ * rectsFramebufferToBuffer will make instead of by overlap alone, so two small
+ * rects that happen to touch are no longer replaced by their bounding box */
+static int rectsSimplify(FrameDamageRect * rects, int count,
+    LGRegion scratch, const RegionCost * cost)
+{
+  if (count <= 0)
+    return 0;
+
+  LGRegion region = scratch;
+  if (region)
+    region_clear(region);
+  else if (!(region = region_new()))
+    return count;
+
+  if (region_addRects(region, rects, count))
+    count = region_toRects(region, rects, count, cost);
+
+  if (!scratch)
+    region_free(&region);
+  return count;
+}
+
+int rectsMergeOverlapping(FrameDamageRect * rects, int count,
+    LGRegion scratch)
+{
+  return rectsSimplify(rects, count, scratch, &REGION_COST_COPY(4));
+}
+
+int rectsRejectContained(FrameDamageRect * rects, int count,
+    LGRegion scratch)
+{
+  return rectsSimplify(rects, count, scratch, NULL);
 }
@@ -0,0 +1,728 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/region.h"
+#include "common/debug.h"
+#include "common/util.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+// the largest cost factor tried before falling back to the bounding box
+#define MAX_FACTOR (1LL << 24)
+
+struct Span
+{
+  int x1, x2;
+};
+
+struct Band
+{
+  int y1, y2;
+  int first, count;
+};
+
+struct Store
+{
+  struct Band * bands;
+  int           nBands, maxBands;
+  struct Span * spans;
+  int           nSpans, maxSpans;
+};
+
+struct LGRegion
+{
+  // the region and a second store the operations build into before swapping
+  struct Store cur, spare;
+
+  // the rects added by region_addRects when the region is not empty
+  LGRegion tmp;
+
+  void * scratch;
+  size_t scratchSize;
+};
+
+enum Op
+{
+  OP_UNION,
+  OP_INTERSECT,
+  OP_SUBTRACT
+};
+
+LGRegion region_new(void)
+{
+  LGRegion region = calloc(1, sizeof(*region));
+  if (!region)
+    DEBUG_ERROR("out of memory");
+  return region;
+}
+
+static void storeFree(struct Store * s)
+{
+  free(s->bands);
+  free(s->spans);
+}
+
+void region_free(LGRegion * region)
+{
+  LGRegion r = *region;
+  if (!r)
+    return;
+
+  storeFree(&r->cur  );
+  storeFree(&r->spare);
+  region_free(&r->tmp);
+  free(r->scratch);
+  free(r);
+  *region = NULL;
+}
+
+void region_clear(LGRegion region)
+{
+  region->cur.nBands = 0;
+  region->cur.nSpans = 0;
+}
+
+static bool grow(void ** ptr, int * max, int need, size_t size)
+{
+  if (need <= *max)
+    return true;
+
+  int newMax = *max ? *max : 16;
+  while(newMax < need)
+    newMax *= 2;
+
+  void * new = realloc(*ptr, newMax * size);
+  if (!new)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  *ptr = new;
+  *max = newMax;
+  return true;
+}
+
+static bool storeReserve(struct Store * s, int bands, int spans)
+{
+  return
+    grow((void **)&s->bands, &s->maxBands, s->nBands + bands,
+        sizeof(*s->bands)) &&
+    grow((void **)&s->spans, &s->maxSpans, s->nSpans + spans,
+        sizeof(*s->spans));
+}
+
+static void * reserveScratch(LGRegion r, size_t size)
+{
+  if (size <= r->scratchSize)
+    return r->scratch;
+
+  void * new = realloc(r->scratch, size);
+  if (!new)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  r->scratch     = new;
+  r->scratchSize = size;
+  return new;
+}
+
+static inline void swapStores(LGRegion r)
+{
+  struct Store tmp = r->cur;
+  r->cur   = r->spare;
+  r->spare = tmp;
+}
+
+/* starts a new band at the end of the store, the band is not part of the store
+ * until bandEnd is called */
+static inline bool bandBegin(struct Store * s, int y1, int y2)
+{
+  if (!storeReserve(s, 1, 0))
+    return false;
+
+  s->bands[s->nBands] = (struct Band)
+  {
+    .y1    = y1,
+    .y2    = y2,
+    .first = s->nSpans,
+    .count = 0
+  };
+  return true;
+}
+
+// appends a span to the open band, the spans must be pushed in order of x1
+static inline bool spanPush(struct Store * s, struct Band * band, int x1,
+    int x2)
+{
+  if (band->count)
+  {
+    struct Span * last = s->spans + s->nSpans - 1;
+    if (x1 <= last->x2)
+    {
+      if (x2 > last->x2)
+        last->x2 = x2;
+      return true;
+    }
+  }
+
+  if (!storeReserve(s, 0, 1))
+    return false;
+
+  s->spans[s->nSpans++] = (struct Span){ .x1 = x1, .x2 = x2 };
+  ++band->count;
+  return true;
+}
+
+static inline bool spansEqual(const struct Store * s, const struct Band * a,
+    const struct Band * b)
+{
+  return a->count == b->count && memcmp(s->spans + a->first,
+      s->spans + b->first, a->count * sizeof(*s->spans)) == 0;
+}
+
+/* closes the open band, dropping it if it is empty or coalescing it into the
+ * previous band if that has the same spans and touches it */
+static inline void bandEnd(struct Store * s)
+{
+  struct Band * band = s->bands + s->nBands;
+  if (!band->count)
+    return;
+
+  if (s->nBands > 0)
+  {
+    struct Band * prev = band - 1;
+    if (prev->y2 == band->y1 && spansEqual(s, prev, band))
+    {
+      prev->y2   = band->y2;
+      s->nSpans -= band->count;
+      return;
+    }
+  }
+
+  ++s->nBands;
+}
+
+static inline bool opTest(enum Op op, bool inA, bool inB)
+{
+  switch(op)
+  {
+    case OP_UNION    : return inA || inB;
+    case OP_INTERSECT: return inA && inB;
+    case OP_SUBTRACT : return inA && !inB;
+  }
+  return false;
+}
+
+/* sweeps the span lists a and b pushing the result of op into the open band,
+ * s must already have room for na + nb spans if a or b point into it */
+static bool spanOp(struct Store * s, struct Band * band, enum Op op,
+    const struct Span * a, int na, const struct Span * b, int nb)
+{
+  int i = 0, j = 0;
+  int x = INT_MIN;
+
+  while(true)
+  {
+    while(i < na && a[i].x2 <= x) ++i;
+    while(j < nb && b[j].x2 <= x) ++j;
+    if (i == na && j == nb)
+      break;
+
+    const bool inA = i < na && a[i].x1 <= x;
+    const bool inB = j < nb && b[j].x1 <= x;
+
+    int next = INT_MAX;
+    if (i < na) next = min(next, inA ? a[i].x2 : a[i].x1);
+    if (j < nb) next = min(next, inB ? b[j].x2 : b[j].x1);
+
+    if (opTest(op, inA, inB) && !spanPush(s, band, x, next))
+      return false;
+
+    x = next;
+  }
+
+  return true;
+}
+
+static bool regionOp(LGRegion dst, const LGRegion a, const LGRegion b,
+    enum Op op)
+{
+  struct Store       * out = &dst->spare;
+  const struct Store * A   = &a->cur;
+  const struct Store * B   = &b->cur;
+
+  out->nBands = 0;
+  out->nSpans = 0;
+
+  int ia = 0, ib = 0;
+  int y  = INT_MIN;
+
+  while(true)
+  {
+    while(ia < A->nBands && A->bands[ia].y2 <= y) ++ia;
+    while(ib < B->nBands && B->bands[ib].y2 <= y) ++ib;
+
+    const bool moreA = ia < A->nBands;
+    const bool moreB = ib < B->nBands;
+    if (!moreA && (op != OP_UNION || !moreB))
+      break;
+    if (!moreB && op == OP_INTERSECT)
+      break;
+
+    const struct Band * bandA = A->bands + ia;
+    const struct Band * bandB = B->bands + ib;
+    const bool inA = moreA && bandA->y1 <= y;
+    const bool inB = moreB && bandB->y1 <= y;
+
+    int next = INT_MAX;
+    if (moreA) next = min(next, inA ? bandA->y2 : bandA->y1);
+    if (moreB) next = min(next, inB ? bandB->y2 : bandB->y1);
+
+    // a subtract band keeps the spans of a even where b has none
+    if (op == OP_SUBTRACT ? inA : opTest(op, inA, inB))
+    {
+      if (!bandBegin(out, y, next) ||
+          !spanOp(out, out->bands + out->nBands, op,
+            inA ? A->spans + bandA->first : NULL, inA ? bandA->count : 0,
+            inB ? B->spans + bandB->first : NULL, inB ? bandB->count : 0))
+        return false;
+      bandEnd(out);
+    }
+
+    y = next;
+  }
+
+  swapStores(dst);
+  return true;
+}
+
+bool region_union(LGRegion dst, const LGRegion a, const LGRegion b)
+{
+  return regionOp(dst, a, b, OP_UNION);
+}
+
+bool region_intersect(LGRegion dst, const LGRegion a, const LGRegion b)
+{
+  return regionOp(dst, a, b, OP_INTERSECT);
+}
+
+bool region_subtract(LGRegion dst, const LGRegion a, const LGRegion b)
+{
+  return regionOp(dst, a, b, OP_SUBTRACT);
+}
+
+bool region_copy(LGRegion dst, const LGRegion src)
+{
+  if (dst == src)
+    return true;
+
+  struct Store * out = &dst->cur;
+  out->nBands = 0;
+  out->nSpans = 0;
+  if (region_isEmpty(src))
+    return true;
+
+  if (!storeReserve(out, src->cur.nBands, src->cur.nSpans))
+    return false;
+
+  memcpy(out->bands, src->cur.bands, src->cur.nBands * sizeof(*out->bands));
+  memcpy(out->spans, src->cur.spans, src->cur.nSpans * sizeof(*out->spans));
+  out->nBands = src->cur.nBands;
+  out->nSpans = src->cur.nSpans;
+  return true;
+}
+
+bool region_isEmpty(const LGRegion region)
+{
+  return region->cur.nBands == 0;
+}
+
+uint64_t region_getArea(const LGRegion region)
+{
+  const struct Store * s = &region->cur;
+  uint64_t area = 0;
+
+  for(int i = 0; i < s->nBands; ++i)
+  {
+    const struct Band * band  = s->bands + i;
+    uint64_t            width = 0;
+    for(int j = 0; j < band->count; ++j)
+      width += s->spans[band->first + j].x2 - s->spans[band->first + j].x1;
+    area += width * (band->y2 - band->y1);
+  }
+
+  return area;
+}
+
+int region_getBands(const LGRegion region)
+{
+  return region->cur.nBands;
+}
+
+int region_getSpans(const LGRegion region)
+{
+  return region->cur.nSpans;
+}
+
+static void storeBounds(const struct Store * s, FrameDamageRect * bounds)
+{
+  int x1 = INT_MAX, x2 = INT_MIN;
+  for(int i = 0; i < s->nBands; ++i)
+  {
+    const struct Band * band = s->bands + i;
+    x1 = min(x1, s->spans[band->first].x1);
+    x2 = max(x2, s->spans[band->first + band->count - 1].x2);
+  }
+
+  const int y1 = s->bands[0].y1;
+  const int y2 = s->bands[s->nBands - 1].y2;
+  *bounds = (FrameDamageRect)
+  {
+    .x      = x1,
+    .y      = y1,
+    .width  = x2 - x1,
+    .height = y2 - y1
+  };
+}
+
+bool region_getBounds(const LGRegion region, FrameDamageRect * bounds)
+{
+  if (region_isEmpty(region))
+    return false;
+
+  storeBounds(&region->cur, bounds);
+  return true;
+}
+
+static int intCompare(const void * a_, const void * b_)
+{
+  const int a = *(const int *)a_;
+  const int b = *(const int *)b_;
+  return (a > b) - (a < b);
+}
+
+static int rectYCompare(const void * a_, const void * b_)
+{
+  const FrameDamageRect * a = *(const FrameDamageRect **)a_;
+  const FrameDamageRect * b = *(const FrameDamageRect **)b_;
+  return (a->y > b->y) - (a->y < b->y);
+}
+
+/* builds the region covered by the rects into out with a single sweep down
+ * the distinct y edges, keeping the rects that span each band sorted by x */
+static bool buildRects(LGRegion r, struct Store * out,
+    const FrameDamageRect * rects, int count)
+{
+  out->nBands = 0;
+  out->nSpans = 0;
+
+  const size_t size = count * (2 * sizeof(int) + 2 * sizeof(rects));
+  void * scratch = reserveScratch(r, size);
+  if (!scratch)
+    return false;
+
+  const FrameDamageRect ** order  = scratch;
+  const FrameDamageRect ** active = order + count;
+  int                    * ys     = (int *)(active + count);
+
+  int n = 0, nys = 0;
+  for(int i = 0; i < count; ++i)
+  {
+    const FrameDamageRect * rect = rects + i;
+    if (rect->width == 0 || rect->height == 0)
+      continue;
+
+    order[n++] = rect;
+    ys[nys++]  = rect->y;
+    ys[nys++]  = rect->y + rect->height;
+  }
+
+  if (n == 0)
+    return true;
+
+  qsort(order, n  , sizeof(*order), rectYCompare);
+  qsort(ys   , nys, sizeof(*ys   ), intCompare  );
+
+  int next = 0, nActive = 0;
+  for(int i = 0; i < nys - 1; ++i)
+  {
+    const int y1 = ys[i];
+    const int y2 = ys[i + 1];
+    if (y1 == y2)
+      continue;
+
+    // drop the rects that ended
+    int o = 0;
+    for(int j = 0; j < nActive; ++j)
+      if ((int)(active[j]->y + active[j]->height) > y1)
+        active[o++] = active[j];
+    nActive = o;
+
+    // insert the rects that start here in order of x
+    for(; next < n && (int)order[next]->y <= y1; ++next)
+    {
+      const FrameDamageRect * rect = order[next];
+      int j = nActive++;
+      for(; j > 0 && active[j - 1]->x > rect->x; --j)
+        active[j] = active[j - 1];
+      active[j] = rect;
+    }
+
+    if (!nActive)
+      continue;
+
+    if (!bandBegin(out, y1, y2))
+      return false;
+
+    struct Band * band = out->bands + out->nBands;
+    for(int j = 0; j < nActive; ++j)
+      if (!spanPush(out, band, active[j]->x, active[j]->x + active[j]->width))
+        return false;
+
+    bandEnd(out);
+  }
+
+  return true;
+}
+
+bool region_addRects(LGRegion region, const FrameDamageRect * rects,
+    int count)
+{
+  if (count <= 0)
+    return true;
+
+  if (region_isEmpty(region))
+  {
+    if (!buildRects(region, &region->spare, rects, count))
+      return false;
+
+    swapStores(region);
+    return true;
+  }
+
+  if (!region->tmp && !(region->tmp = region_new()))
+    return false;
+
+  if (!buildRects(region, &region->tmp->cur, rects, count))
+    return false;
+
+  return regionOp(region, region, region->tmp, OP_UNION);
+}
+
+static inline int64_t spansWidth(const struct Span * spans, int count)
+{
+  int64_t width = 0;
+  for(int i = 0; i < count; ++i)
+    width += spans[i].x2 - spans[i].x1;
+  return width;
+}
+
+/* joins the spans of a band whose gaps are cheaper to copy than to handle as
+ * separate rects, returns the new span count */
+static int joinSpans(struct Span * spans, int count, int height,
+    const RegionCost * cost, int64_t factor)
+{
+  const int64_t maxGap = factor *
+    (cost->rectCost + (int64_t)height * cost->rowCost) /
+    ((int64_t)height * cost->bpp);
+
+  int o = 0;
+  for(int i = 0; i < count; ++i)
+  {
+    if (o > 0 && spans[i].x1 - spans[o - 1].x2 <= maxGap)
+    {
+      spans[o - 1].x2 = spans[i].x2;
+      continue;
+    }
+    spans[o++] = spans[i];
+  }
+  return o;
+}
+
+/* builds a simplified copy of the region into the spare store. Each band has
+ * its cheap gaps joined and is then merged into the band above it if the
+ * pixels this adds cost less than the rects it saves, all scaled by factor */
+static bool simplify(LGRegion r, const RegionCost * cost, int64_t factor)
+{
+  const struct Store * in  = &r->cur;
+  struct Store       * out = &r->spare;
+
+  out->nBands = 0;
+  out->nSpans = 0;
+
+  for(int i = 0; i < in->nBands; ++i)
+  {
+    const struct Band * src = in->bands + i;
+    const int h = src->y2 - src->y1;
+
+    if (!bandBegin(out, src->y1, src->y2) ||
+        !storeReserve(out, 0, src->count))
+      return false;
+
+    struct Band * cand = out->bands + out->nBands;
+    memcpy(out->spans + cand->first, in->spans + src->first,
+        src->count * sizeof(*out->spans));
+    cand->count  = joinSpans(out->spans + cand->first, src->count, h, cost,
+        factor);
+    out->nSpans += cand->count;
+
+    if (out->nBands == 0)
+    {
+      ++out->nBands;
+      continue;
+    }
+
+    // build the union of the previous band and this one after it
+    struct Band * tail = cand - 1;
+    if (!storeReserve(out, 0, tail->count + cand->count))
+      return false;
+
+    struct Band u = { .first = out->nSpans };
+    spanOp(out, &u, OP_UNION,
+        out->spans + tail->first, tail->count,
+        out->spans + cand->first, cand->count);
+
+    const int64_t hA = tail->y2 - tail->y1;
+    const int64_t hB = h;
+    const int64_t g  = cand->y1 - tail->y2;
+    const int64_t wA = spansWidth(out->spans + tail->first, tail->count);
+    const int64_t wB = spansWidth(out->spans + cand->first, cand->count);
+    const int64_t wU = spansWidth(out->spans + u.first    , u.count    );
+
+    const int64_t extra = (wU - wA) * hA + (wU - wB) * hB + wU * g;
+    const int64_t saved =
+      (int64_t)cost->rectCost * (tail->count + cand->count - u.count) +
+      (int64_t)cost->rowCost  *
+        (hA * tail->count + hB * cand->count - (hA + hB + g) * u.count);
+
+    if (extra * cost->bpp > factor * saved)
+    {
+      out->nSpans = cand->first + cand->count;
+      ++out->nBands;
+      continue;
+    }
+
+    memmove(out->spans + tail->first, out->spans + u.first,
+        u.count * sizeof(*out->spans));
+    tail->y2     = cand->y2;
+    tail->count  = joinSpans(out->spans + tail->first, u.count,
+        tail->y2 - tail->y1, cost, factor);
+    out->nSpans  = tail->first + tail->count;
+  }
+
+  return true;
+}
+
+/* writes the bands out as rects, a span that continues unchanged into the next
+ * band extends the rect above it instead of starting a new one. Returns -1 if
+ * more than maxRects are needed */
+static int emitRects(LGRegion r, const struct Store * s,
+    FrameDamageRect * rects, int maxRects)
+{
+  int * index = reserveScratch(r, s->nSpans * sizeof(int));
+  if (!index)
+    return -1;
+
+  const struct Band * prev = NULL;
+  int n = 0;
+
+  for(int i = 0; i < s->nBands; ++i)
+  {
+    const struct Band * band  = s->bands + i;
+    const bool          joins = prev && prev->y2 == band->y1;
+    int j = 0;
+
+    for(int k = 0; k < band->count; ++k)
+    {
+      const struct Span * span = s->spans + band->first + k;
+
+      if (joins)
+      {
+        while(j < prev->count && s->spans[prev->first + j].x1 < span->x1)
+          ++j;
+
+        if (j < prev->count &&
+            s->spans[prev->first + j].x1 == span->x1 &&
+            s->spans[prev->first + j].x2 == span->x2)
+        {
+          const int ri = index[prev->first + j];
+          rects[ri].height += band->y2 - band->y1;
+          index[band->first + k] = ri;
+          continue;
+        }
+      }
+
+      if (n == maxRects)
+        return -1;
+
+      rects[n] = (FrameDamageRect)
+      {
+        .x      = span->x1,
+        .y      = band->y1,
+        .width  = span->x2 - span->x1,
+        .height = band->y2 - band->y1
+      };
+      index[band->first + k] = n++;
+    }
+
+    prev = band;
+  }
+
+  return n;
+}
+
+int region_toRects(const LGRegion region, FrameDamageRect * rects,
+    int maxRects, const RegionCost * cost)
+{
+  if (region_isEmpty(region) || maxRects <= 0)
+    return 0;
+
+  int n;
+  RegionCost c = REGION_COST_COPY(4);
+
+  // exact unless the rects will not fit
+  if (!cost)
+  {
+    if ((n = emitRects(region, &region->cur, rects, maxRects)) >= 0)
+      return n;
+  }
+  else
+    c = *cost;
+
+  if (c.bpp == 0)
+    c.bpp = 1;
+
+  for(int64_t factor = 1; factor <= MAX_FACTOR; factor *= 2)
+  {
+    if (!simplify(region, &c, factor))
+      break;
+
+    if ((n = emitRects(region, &region->spare, rects, maxRects)) >= 0)
+      return n;
+  }
+
+  storeBounds(&region->cur, rects);
+  return 1;
+}
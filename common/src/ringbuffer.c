@@ -50,7 +50,7 @@ void ringbuffer_free(RingBuffer * rb)
   if (!*rb)
     return;
 
-  LG_LOCK_FREE(rb->lock);
+  LG_LOCK_FREE((*rb)->lock);
   free(*rb);
   *rb = NULL;
 }
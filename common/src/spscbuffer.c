@@ -0,0 +1,213 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/spscbuffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define CACHE_LINE 64
+
+/* positions run from 0 to (length * 2) - 1 so that a full buffer can be told
+ * apart from an empty one without wasting a slot */
+struct SPSCBuffer
+{
+  int      length;
+  unsigned wrap;
+  size_t   valueSize;
+  char   * values;
+
+  // written by the producer only
+  _Atomic(unsigned) writePos;
+  char pad0[CACHE_LINE - sizeof(unsigned)];
+
+  // written by the consumer only
+  _Atomic(unsigned) readPos;
+  char pad1[CACHE_LINE - sizeof(unsigned)];
+
+  char buffer[0];
+};
+
+static inline unsigned advance(const struct SPSCBuffer * sb, unsigned pos,
+    int count)
+{
+  pos += count;
+  return pos >= sb->wrap ? pos - sb->wrap : pos;
+}
+
+static inline int used(const struct SPSCBuffer * sb, unsigned readPos,
+    unsigned writePos)
+{
+  return writePos >= readPos ?
+    (int)(writePos - readPos) : (int)(writePos + sb->wrap - readPos);
+}
+
+/* split count values starting at pos into at most two contiguous spans */
+static inline void getSpans(const struct SPSCBuffer * sb, unsigned pos,
+    int count, SPSCBufferSpan span[2])
+{
+  const int index = pos >= (unsigned)sb->length ? pos - sb->length : pos;
+  const int first = sb->length - index;
+
+  span[0].values = sb->values + index * sb->valueSize;
+  if (count <= first)
+  {
+    span[0].count  = count;
+    span[1].values = NULL;
+    span[1].count  = 0;
+    return;
+  }
+
+  span[0].count  = first;
+  span[1].values = sb->values;
+  span[1].count  = count - first;
+}
+
+SPSCBuffer spscbuffer_new(int length, size_t valueSize)
+{
+  struct SPSCBuffer * sb = calloc(1,
+      sizeof(*sb) + CACHE_LINE + valueSize * length);
+  if (!sb)
+    return NULL;
+
+  sb->length    = length;
+  sb->wrap      = length * 2;
+  sb->valueSize = valueSize;
+
+  // keep the values off the cache line holding the read position
+  sb->values = (char *)(((uintptr_t)sb->buffer + CACHE_LINE - 1) &
+      ~(uintptr_t)(CACHE_LINE - 1));
+
+  atomic_init(&sb->writePos, 0);
+  atomic_init(&sb->readPos , 0);
+  return sb;
+}
+
+void spscbuffer_free(SPSCBuffer * sb)
+{
+  if (!*sb)
+    return;
+
+  free(*sb);
+  *sb = NULL;
+}
+
+int spscbuffer_getLength(const SPSCBuffer sb)
+{
+  return sb->length;
+}
+
+int spscbuffer_getCount(const SPSCBuffer sb)
+{
+  const unsigned readPos  =
+    atomic_load_explicit(&sb->readPos , memory_order_acquire);
+  const unsigned writePos =
+    atomic_load_explicit(&sb->writePos, memory_order_acquire);
+  return used(sb, readPos, writePos);
+}
+
+int spscbuffer_peekWrite(SPSCBuffer sb, SPSCBufferSpan span[2])
+{
+  const unsigned writePos =
+    atomic_load_explicit(&sb->writePos, memory_order_relaxed);
+  const unsigned readPos  =
+    atomic_load_explicit(&sb->readPos , memory_order_acquire);
+
+  const int count = sb->length - used(sb, readPos, writePos);
+  getSpans(sb, writePos, count, span);
+  return count;
+}
+
+void spscbuffer_commitWrite(SPSCBuffer sb, int count)
+{
+  const unsigned writePos =
+    atomic_load_explicit(&sb->writePos, memory_order_relaxed);
+  atomic_store_explicit(&sb->writePos, advance(sb, writePos, count),
+      memory_order_release);
+}
+
+int spscbuffer_append(SPSCBuffer sb, const void * values, int count)
+{
+  SPSCBufferSpan span[2];
+  const int avail = spscbuffer_peekWrite(sb, span);
+  if (count > avail)
+    count = avail;
+
+  if (count == 0)
+    return 0;
+
+  const int first = count < span[0].count ? count : span[0].count;
+  memcpy(span[0].values, values, first * sb->valueSize);
+  if (count > first)
+    memcpy(span[1].values, (const char *)values + first * sb->valueSize,
+        (count - first) * sb->valueSize);
+
+  spscbuffer_commitWrite(sb, count);
+  return count;
+}
+
+int spscbuffer_peekRead(SPSCBuffer sb, SPSCBufferSpan span[2])
+{
+  const unsigned readPos  =
+    atomic_load_explicit(&sb->readPos , memory_order_relaxed);
+  const unsigned writePos =
+    atomic_load_explicit(&sb->writePos, memory_order_acquire);
+
+  const int count = used(sb, readPos, writePos);
+  getSpans(sb, readPos, count, span);
+  return count;
+}
+
+void spscbuffer_commitRead(SPSCBuffer sb, int count)
+{
+  const unsigned readPos =
+    atomic_load_explicit(&sb->readPos, memory_order_relaxed);
+  atomic_store_explicit(&sb->readPos, advance(sb, readPos, count),
+      memory_order_release);
+}
+
+int spscbuffer_consume(SPSCBuffer sb, void * dst, int count)
+{
+  SPSCBufferSpan span[2];
+  const int avail = spscbuffer_peekRead(sb, span);
+  if (count > avail)
+    count = avail;
+
+  if (count == 0)
+    return 0;
+
+  const int first = count < span[0].count ? count : span[0].count;
+  memcpy(dst, span[0].values, first * sb->valueSize);
+  if (count > first)
+    memcpy((char *)dst + first * sb->valueSize, span[1].values,
+        (count - first) * sb->valueSize);
+
+  spscbuffer_commitRead(sb, count);
+  return count;
+}
+
+void spscbuffer_drain(SPSCBuffer sb)
+{
+  atomic_store_explicit(&sb->readPos,
+      atomic_load_explicit(&sb->writePos, memory_order_acquire),
+      memory_order_release);
+}
@@ -113,5 +113,9 @@ typedef struct CaptureInterface
   CaptureResult (*capture   )();
   CaptureResult (*waitFrame )(CaptureFrame * frame, const size_t maxFrameSize);
   CaptureResult (*getFrame  )(FrameBuffer  * frame, const unsigned int height, int frameIndex);
+
+  // the buffer of frameIndex no longer holds the last frame written to it, the
+  // next getFrame for it must write the whole frame
+  void          (*invalidateFrame)(int frameIndex);
 }
 CaptureInterface;
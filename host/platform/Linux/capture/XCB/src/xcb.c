@@ -24,6 +24,7 @@
 #include "common/debug.h"
 #include "common/event.h"
 #include "common/thread.h"
+#include "common/framediff.h"
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
@@ -56,6 +57,8 @@ struct xcb
   bool                                 hasFrame;
   xcb_shm_get_image_cookie_t           imgC;
   xcb_xfixes_get_cursor_image_cookie_t curC;
+
+  FrameDiff                            diff;
 };
 
 static struct xcb * this = NULL;
@@ -77,6 +80,13 @@ static void xcb_initOptions(void)
 {
   struct Option options[] =
   {
+    {
+      .module         = "xcb",
+      .name           = "trackDamage",
+      .description    = "Compare each frame to the last to only copy the changed areas",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
     {0}
   };
 
@@ -89,7 +99,8 @@ static bool xcb_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPo
   this             = calloc(1, sizeof(*this));
   this->shmID      = -1;
   this->data       = (void *)-1;
-  this->frameEvent = lgCreateEvent(true, 20);
+  // frames are waited for with no timeout, spinning for one would burn a core
+  this->frameEvent = lgCreateEvent(true, 0);
 
   this->getPointerBufferFn = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
@@ -150,6 +161,13 @@ static bool xcb_init(void)
   }
   DEBUG_INFO("Frame Data       : 0x%" PRIXPTR, (uintptr_t)this->data);
 
+  if (option_get_bool("xcb", "trackDamage"))
+  {
+    this->diff = framediff_new(this->width, this->height, this->width * 4);
+    if (!this->diff)
+      DEBUG_WARN("Failed to create the frame differ, damage tracking disabled");
+  }
+
   xcb_query_extension_cookie_t extension_cookie =
 		xcb_query_extension(this->xcb, strlen("XFIXES"), "XFIXES");
   xcb_query_extension_reply_t * extension_reply =
@@ -203,6 +221,8 @@ static bool xcb_deinit(void)
 {
   DEBUG_ASSERT(this);
 
+  framediff_free(&this->diff);
+
   if ((uintptr_t)this->data != -1)
   {
     shmdt(this->data);
@@ -262,6 +282,31 @@ static CaptureResult xcb_waitFrame(CaptureFrame * frame,
 {
   lgWaitEvent(this->frameEvent, TIMEOUT_INFINITE);
 
+  xcb_shm_get_image_reply_t * img;
+  img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
+  if (!img)
+  {
+    DEBUG_ERROR("Failed to get image reply");
+    return CAPTURE_RESULT_ERROR;
+  }
+  free(img);
+
+  frame->damageRectsCount = 0;
+  if (this->diff)
+  {
+    const int count = framediff_compare(this->diff, this->data,
+        frame->damageRects);
+
+    // nothing changed, there is no need to send the frame
+    if (count < 0)
+    {
+      this->hasFrame = false;
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+
+    frame->damageRectsCount = count;
+  }
+
   const unsigned int maxHeight = maxFrameSize / (this->width * 4);
 
   frame->width      = this->width;
@@ -281,16 +326,11 @@ static CaptureResult xcb_getFrame(FrameBuffer * frame,
   DEBUG_ASSERT(this);
   DEBUG_ASSERT(this->initialized);
 
-  xcb_shm_get_image_reply_t * img;
-  img = xcb_shm_get_image_reply(this->xcb, this->imgC, NULL);
-  if (!img)
-  {
-    DEBUG_ERROR("Failed to get image reply");
-    return CAPTURE_RESULT_ERROR;
-  }
-
-  framebuffer_write(frame, this->data, this->width * height * 4);
-  free(img);
+  if (this->diff)
+    framediff_write(this->diff, frame, frameIndex, this->data, height,
+        false);
+  else
+    framebuffer_write(frame, this->data, this->width * height * 4);
 
   this->hasFrame = false;
   return CAPTURE_RESULT_OK;
@@ -367,6 +407,12 @@ static int pointerThread(void * unused)
   return 0;
 }
 
+static void xcb_invalidateFrame(int frameIndex)
+{
+  if (this->diff)
+    framediff_invalidate(this->diff, frameIndex);
+}
+
 struct CaptureInterface Capture_XCB =
 {
   .shortName       = "XCB",
@@ -380,5 +426,6 @@ struct CaptureInterface Capture_XCB =
   .free            = xcb_free,
   .capture         = xcb_capture,
   .waitFrame       = xcb_waitFrame,
-  .getFrame        = xcb_getFrame
+  .getFrame        = xcb_getFrame,
+  .invalidateFrame = xcb_invalidateFrame
 };
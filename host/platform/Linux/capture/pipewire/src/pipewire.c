@@ -23,14 +23,27 @@
 #include "interface/platform.h"
 #include "common/debug.h"
 #include "common/stringutils.h"
+#include "common/option.h"
+#include "common/framediff.h"
+#include "common/rects.h"
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include <pipewire/pipewire.h>
 #include <spa/pod/builder.h>
 #include <spa/param/format.h>
 #include <spa/param/video/format-utils.h>
+#include <spa/buffer/meta.h>
+
+/**
+ * the following comes from drm_fourcc.h and is included here to avoid the
+ * external dependency for the one define we need
+ */
+#define DRM_FORMAT_MOD_LINEAR 0ULL
 
 struct pipewire
 {
@@ -49,7 +62,23 @@ struct pipewire
   int           width, height;
   CaptureFormat format;
   uint8_t     * frameData;
+  int           frameStride;
+  int           frameDmaBuf;
+  bool          dmaBufLinear; // the linear modifier was negotiated
   unsigned int  formatVer;
+
+  bool            trackDamage;
+  FrameDiff       diff;
+  unsigned int    diffFormatVer;
+  int             diffPitch;
+  int             damageRectsCount;
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  // damage reported by the compositor since the last frame, -1 for full
+  bool            hasDamageMeta;
+  int             spaDamageCount;
+  FrameDamageRect spaDamage[KVMFR_MAX_DAMAGE_RECTS];
+  LGRegion        spaRegion; // scratch for merging the compositor damage
 };
 
 static struct pipewire * this = NULL;
@@ -65,11 +94,29 @@ static const char * pipewire_getName(void)
   return "PipeWire";
 }
 
+static void pipewire_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "pipewire",
+      .name           = "trackDamage",
+      .description    = "Only copy the changed areas of each frame, comparing it to the last if the compositor does not report them",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
 static bool pipewire_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostPointerBuffer postPointerBufferFn)
 {
   DEBUG_ASSERT(!this);
   pw_init(NULL, NULL);
   this = calloc(1, sizeof(*this));
+  this->spaRegion = region_new();
   return true;
 }
 
@@ -84,12 +131,17 @@ static const struct pw_core_events coreEvents = {
   .error = coreErrorCallback,
 };
 
-static bool startStream(struct pw_stream * stream, uint32_t node)
+/**
+ * Build the format we accept. A DMA-BUF is read through its CPU mapping as a
+ * linear image, so the DMA-BUF format only allows the linear modifier.
+ */
+static const struct spa_pod * buildFormat(struct spa_pod_builder * builder,
+    bool dmaBuf)
 {
-  char buffer[1024];
-  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
-  const struct spa_pod * param = spa_pod_builder_add_object(
-    &builder, SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+  struct spa_pod_frame frame;
+  spa_pod_builder_push_object(builder, &frame,
+    SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat);
+  spa_pod_builder_add(builder,
     SPA_FORMAT_mediaType, SPA_POD_Id(SPA_MEDIA_TYPE_video),
     SPA_FORMAT_mediaSubtype, SPA_POD_Id(SPA_MEDIA_SUBTYPE_raw),
     SPA_FORMAT_VIDEO_format, SPA_POD_CHOICE_ENUM_Id(6,
@@ -99,10 +151,87 @@ static bool startStream(struct pw_stream * stream, uint32_t node)
     SPA_FORMAT_VIDEO_size, SPA_POD_CHOICE_RANGE_Rectangle(
       &SPA_RECTANGLE(1920, 1080), &SPA_RECTANGLE(1, 1), &SPA_RECTANGLE(8192, 4320)),
     SPA_FORMAT_VIDEO_framerate, SPA_POD_CHOICE_RANGE_Fraction(
-      &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)));
+      &SPA_FRACTION(60, 1), &SPA_FRACTION(0, 1), &SPA_FRACTION(360, 1)),
+    0);
+
+  if (dmaBuf)
+  {
+    spa_pod_builder_prop(builder, SPA_FORMAT_VIDEO_modifier,
+      SPA_POD_PROP_FLAG_MANDATORY);
+    spa_pod_builder_long(builder, DRM_FORMAT_MOD_LINEAR);
+  }
+
+  return spa_pod_builder_pop(builder, &frame);
+}
+
+static bool startStream(struct pw_stream * stream, uint32_t node)
+{
+  char buffer[2048];
+  struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+
+  // prefer a linear DMA-BUF, falling back to shared memory
+  const struct spa_pod * params[2];
+  params[0] = buildFormat(&builder, true );
+  params[1] = buildFormat(&builder, false);
 
   return pw_stream_connect(stream, PW_DIRECTION_INPUT, node,
-    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, &param, 1) >= 0;
+    PW_STREAM_FLAG_AUTOCONNECT | PW_STREAM_FLAG_MAP_BUFFERS, params, 2) >= 0;
+}
+
+/**
+ * Accumulate the damage regions attached to the buffer by the compositor.
+ * Returns false if the buffer does not carry damage metadata, or carries it
+ * without any valid region as then it does not say what changed.
+ */
+static bool accumulateSpaDamage(struct spa_buffer * buffer)
+{
+  struct spa_meta * meta = spa_buffer_find_meta(buffer, SPA_META_VideoDamage);
+  if (!meta)
+    return false;
+
+  if (this->spaDamageCount < 0)
+    return true;
+
+  bool valid = false;
+  struct spa_meta_region * region;
+  spa_meta_for_each(region, meta)
+  {
+    if (!spa_meta_region_is_valid(region))
+      break;
+
+    valid = true;
+
+    if (this->spaDamageCount == KVMFR_MAX_DAMAGE_RECTS)
+    {
+      this->spaDamageCount = -1;
+      break;
+    }
+
+    const int x1 = SPA_CLAMP(region->region.position.x, 0, this->width );
+    const int y1 = SPA_CLAMP(region->region.position.y, 0, this->height);
+    const int x2 = SPA_CLAMP(region->region.position.x +
+        (int)region->region.size.width , 0, this->width );
+    const int y2 = SPA_CLAMP(region->region.position.y +
+        (int)region->region.size.height, 0, this->height);
+    if (x2 <= x1 || y2 <= y1)
+      continue;
+
+    this->spaDamage[this->spaDamageCount++] = (FrameDamageRect) {
+      .x      = x1,
+      .y      = y1,
+      .width  = x2 - x1,
+      .height = y2 - y1
+    };
+  }
+
+  return valid;
+}
+
+static void dmaBufSync(int fd, uint64_t flags)
+{
+  struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+  while(ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) == -1 &&
+      (errno == EINTR || errno == EAGAIN)) {}
 }
 
 static void streamProcessCallback(void * opaque)
@@ -112,7 +241,9 @@ static void streamProcessCallback(void * opaque)
 
   struct pw_buffer * pwBuffer = NULL;
 
-  // dequeue all buffers to get the latest one
+  // dequeue all buffers to get the latest one, keeping the damage of any
+  // buffers that are skipped
+  this->hasDamageMeta = true;
   while (true)
   {
     struct pw_buffer * tmp = pw_stream_dequeue_buffer(this->stream);
@@ -121,6 +252,9 @@ static void streamProcessCallback(void * opaque)
     if (pwBuffer)
       pw_stream_queue_buffer(this->stream, pwBuffer);
     pwBuffer = tmp;
+
+    if (!accumulateSpaDamage(pwBuffer->buffer))
+      this->hasDamageMeta = false;
   }
 
   if (!pwBuffer)
@@ -130,12 +264,44 @@ static void streamProcessCallback(void * opaque)
   }
 
   struct spa_buffer * buffer = pwBuffer->buffer;
-  if (!buffer->datas[0].chunk->size)
+  struct spa_data   * data   = &buffer->datas[0];
+  if (data->type == SPA_DATA_DmaBuf && !this->dmaBufLinear)
+  {
+    static bool warned = false;
+    if (!warned)
+    {
+      DEBUG_WARN("PipeWire sent a DMA-BUF that is not linear, dropping it");
+      warned = true;
+    }
+    this->spaDamageCount = -1;
+    pw_stream_queue_buffer(this->stream, pwBuffer);
     return;
+  }
+
+  if (!data->chunk->size || !data->data)
+  {
+    if (data->chunk->size)
+      DEBUG_WARN("PipeWire buffer is not mappable");
+    pw_stream_queue_buffer(this->stream, pwBuffer);
+    return;
+  }
+
+  /* the buffer is mapped by PipeWire (PW_STREAM_FLAG_MAP_BUFFERS) for all
+   * data types, we read it directly into the framebuffer in getFrame. A mapped
+   * DMA-BUF is usually write-combined or uncached memory */
+  this->frameData   = (uint8_t *)data->data + data->chunk->offset;
+  this->frameStride = data->chunk->stride;
+  this->frameDmaBuf = data->type == SPA_DATA_DmaBuf ? data->fd : -1;
 
-  this->frameData = buffer->datas[0].data;
+  if (this->frameDmaBuf >= 0)
+    dmaBufSync(this->frameDmaBuf, DMA_BUF_SYNC_START);
 
+  // blocks until the frame has been consumed or dropped
   pw_thread_loop_signal(this->threadLoop, true);
+
+  if (this->frameDmaBuf >= 0)
+    dmaBufSync(this->frameDmaBuf, DMA_BUF_SYNC_END);
+
   pw_stream_queue_buffer(this->stream, pwBuffer);
 }
 
@@ -185,6 +351,12 @@ static void streamParamChangedCallback(void * opaque, uint32_t id,
   this->height = info.size.height;
   this->format = convertSpaFormat(info.format);
 
+  /* only the DMA-BUF format carries a modifier, and we only offered the
+   * linear one, but check it as it is what makes the buffer readable */
+  this->dmaBufLinear =
+    spa_pod_find_prop(param, NULL, SPA_FORMAT_VIDEO_modifier) &&
+    info.modifier == DRM_FORMAT_MOD_LINEAR;
+
   if (this->hasFormat)
   {
     this->formatChanged = true;
@@ -194,10 +366,23 @@ static void streamParamChangedCallback(void * opaque, uint32_t id,
   char buffer[1024];
   struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 
-  param = spa_pod_builder_add_object(
+  const struct spa_pod * params[2];
+  params[0] = spa_pod_builder_add_object(
     &builder, SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
-    SPA_PARAM_BUFFERS_dataType, SPA_POD_Int(1 << SPA_DATA_MemPtr));
-  pw_stream_update_params(this->stream, &param, 1);
+    SPA_PARAM_BUFFERS_dataType, SPA_POD_CHOICE_FLAGS_Int(
+      this->dmaBufLinear ?
+        (1 << SPA_DATA_DmaBuf) :
+        (1 << SPA_DATA_MemPtr) | (1 << SPA_DATA_MemFd)));
+
+  params[1] = spa_pod_builder_add_object(
+    &builder, SPA_TYPE_OBJECT_ParamMeta, SPA_PARAM_Meta,
+    SPA_PARAM_META_type, SPA_POD_Id(SPA_META_VideoDamage),
+    SPA_PARAM_META_size, SPA_POD_CHOICE_RANGE_Int(
+      sizeof(struct spa_meta_region) * KVMFR_MAX_DAMAGE_RECTS,
+      sizeof(struct spa_meta_region) * 1,
+      sizeof(struct spa_meta_region) * KVMFR_MAX_DAMAGE_RECTS));
+
+  pw_stream_update_params(this->stream, params, 2);
 
   this->hasFormat = true;
   pw_thread_loop_signal(this->threadLoop, true);
@@ -308,9 +493,12 @@ static bool pipewire_init(void)
     goto fail;
   }
 
-  this->hasFormat     = false;
-  this->formatChanged = false;
-  this->frameData     = NULL;
+  this->hasFormat      = false;
+  this->formatChanged  = false;
+  this->frameData      = NULL;
+  this->frameStride    = 0;
+  this->spaDamageCount = -1;
+  this->trackDamage    = option_get_bool("pipewire", "trackDamage");
   pw_stream_add_listener(this->stream, &this->streamListener, &streamEvents, NULL);
 
   if (!startStream(this->stream, pipewireNode))
@@ -351,6 +539,9 @@ static void pipewire_stop(void)
 
 static bool pipewire_deinit(void)
 {
+  framediff_free(&this->diff);
+  this->diffPitch = 0;
+
   if (this->stream)
   {
     pw_stream_disconnect(this->stream);
@@ -386,10 +577,42 @@ static void pipewire_free(void)
 {
   DEBUG_ASSERT(this);
   pw_deinit();
+  region_free(&this->spaRegion);
   free(this);
   this = NULL;
 }
 
+/**
+ * (Re)create the frame differ if the format has changed. Damage rects are
+ * only supported for 32bpp formats.
+ */
+static void updateDiff(int bpp, int pitch)
+{
+  if (this->diffFormatVer == this->formatVer && this->diffPitch == pitch)
+    return;
+
+  framediff_free(&this->diff);
+  this->diffFormatVer = this->formatVer;
+  this->diffPitch     = pitch;
+
+  if (!this->trackDamage || bpp != 4)
+    return;
+
+  this->diff = framediff_new(this->width, this->height, pitch);
+  if (!this->diff)
+    DEBUG_WARN("Failed to create the frame differ, damage tracking disabled");
+}
+
+static inline int getBpp(void)
+{
+  return this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
+}
+
+static inline int getPitch(void)
+{
+  return this->frameStride > 0 ? this->frameStride : this->width * getBpp();
+}
+
 static CaptureResult pipewire_capture(void)
 {
   int result;
@@ -406,11 +629,64 @@ restart:
   if (this->formatChanged)
   {
     ++this->formatVer;
-    this->formatChanged = false;
+    this->formatChanged  = false;
+    this->spaDamageCount = -1;
     pw_thread_loop_accept(this->threadLoop);
     goto restart;
   }
 
+  this->damageRectsCount = 0;
+  updateDiff(getBpp(), getPitch());
+
+  const int spaCount = this->spaDamageCount;
+  this->spaDamageCount = 0;
+
+  /* prefer the damage reported by the compositor if there is any, this does
+   * not need the differ, without it the whole frame is copied but the client
+   * still only has to update the damaged areas */
+  if (this->hasDamageMeta)
+  {
+    const int count = spaCount;
+    if (count == 0)
+    {
+      pw_thread_loop_accept(this->threadLoop);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+
+    // damage rects are only supported for 32bpp formats
+    if (count > 0 && getBpp() == 4)
+    {
+      this->damageRectsCount = rectsMergeOverlapping(this->spaDamage, count,
+          this->spaRegion);
+      memcpy(this->damageRects, this->spaDamage,
+          this->damageRectsCount * sizeof(*this->damageRects));
+    }
+
+    if (this->diff)
+      framediff_setDamage(this->diff, this->damageRects,
+          this->damageRectsCount);
+  }
+  else if (this->diff && this->frameDmaBuf >= 0)
+  {
+    /* comparing reads the whole uncached buffer and then copies it, which
+     * costs far more than the copy it could save, so send it all */
+    framediff_setDamage(this->diff, this->damageRects, 0);
+  }
+  else if (this->diff && this->frameData)
+  {
+    const int count = framediff_compare(this->diff, this->frameData,
+        this->damageRects);
+
+    // nothing changed, release the buffer without sending a frame
+    if (count < 0)
+    {
+      pw_thread_loop_accept(this->threadLoop);
+      return CAPTURE_RESULT_TIMEOUT;
+    }
+
+    this->damageRectsCount = count;
+  }
+
   return CAPTURE_RESULT_OK;
 }
 
@@ -420,20 +696,21 @@ static CaptureResult pipewire_waitFrame(CaptureFrame * frame,
   if (this->stop)
     return CAPTURE_RESULT_REINIT;
 
-  const int bpp = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
-  const unsigned int maxHeight = maxFrameSize / (this->width * bpp);
+  const int pitch = getPitch();
+  const unsigned int maxHeight = maxFrameSize / pitch;
 
   frame->formatVer  = this->formatVer;
   frame->format     = this->format;
   frame->width      = this->width;
   frame->height     = maxHeight > this->height ? this->height : maxHeight;
   frame->realHeight = this->height;
-  frame->pitch      = this->width * bpp;
-  frame->stride     = this->width;
+  frame->pitch      = pitch;
+  frame->stride     = pitch / getBpp();
   frame->rotation   = CAPTURE_ROT_0;
 
-  // TODO: implement damage.
-  frame->damageRectsCount = 0;
+  frame->damageRectsCount = this->damageRectsCount;
+  memcpy(frame->damageRects, this->damageRects,
+      this->damageRectsCount * sizeof(*this->damageRects));
 
   return CAPTURE_RESULT_OK;
 }
@@ -444,18 +721,31 @@ static CaptureResult pipewire_getFrame(FrameBuffer * frame,
   if (this->stop || !this->frameData)
     return CAPTURE_RESULT_REINIT;
 
-  const int bpp = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
-  framebuffer_write(frame, this->frameData, height * this->width * bpp);
+  const bool uncached = this->frameDmaBuf >= 0;
+  if (this->diff)
+    framediff_write(this->diff, frame, frameIndex, this->frameData, height,
+        uncached);
+  else if (uncached)
+    framebuffer_write_uncached(frame, this->frameData, height * getPitch());
+  else
+    framebuffer_write(frame, this->frameData, height * getPitch());
 
   pw_thread_loop_accept(this->threadLoop);
   return CAPTURE_RESULT_OK;
 }
 
+static void pipewire_invalidateFrame(int frameIndex)
+{
+  if (this->diff)
+    framediff_invalidate(this->diff, frameIndex);
+}
+
 struct CaptureInterface Capture_pipewire =
 {
   .shortName       = "pipewire",
   .asyncCapture    = false,
   .getName         = pipewire_getName,
+  .initOptions     = pipewire_initOptions,
   .create          = pipewire_create,
   .init            = pipewire_init,
   .stop            = pipewire_stop,
@@ -463,5 +753,6 @@ struct CaptureInterface Capture_pipewire =
   .free            = pipewire_free,
   .capture         = pipewire_capture,
   .waitFrame       = pipewire_waitFrame,
-  .getFrame        = pipewire_getFrame
+  .getFrame        = pipewire_getFrame,
+  .invalidateFrame = pipewire_invalidateFrame
 };
@@ -0,0 +1,620 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "interface/capture.h"
+#include "interface/platform.h"
+#include "common/option.h"
+#include "common/debug.h"
+#include "common/time.h"
+#include "common/array.h"
+#include "common/framediff.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <math.h>
+
+#define CURSOR_SIZE        32
+#define CURSOR_SHAPE_TIME  2000000000ULL
+#define SCROLL_LINES       8
+
+enum DamageMode
+{
+  DAMAGE_STATIC,
+  DAMAGE_SCROLL,
+  DAMAGE_RECTS,
+  DAMAGE_FULL
+};
+
+static const char * damageModeStr[] =
+{
+  [DAMAGE_STATIC] = "static",
+  [DAMAGE_SCROLL] = "scroll",
+  [DAMAGE_RECTS ] = "rects",
+  [DAMAGE_FULL  ] = "full"
+};
+
+struct synthetic
+{
+  bool            initialized;
+
+  CaptureGetPointerBuffer  getPointerBufferFn;
+  CapturePostPointerBuffer postPointerBufferFn;
+
+  unsigned int    width;
+  unsigned int    height;
+  unsigned int    pitch;
+  unsigned int    bpp;
+  CaptureFormat   format;
+  unsigned int    formatVer;
+  enum DamageMode damageMode;
+  int             rectCount;
+  int             fps;
+  bool            cursor;
+
+  uint8_t       * data;
+  FrameDiff       diff;
+  uint32_t        rng;
+  uint64_t        frameNum;
+  uint64_t        startTime;
+  uint64_t        nextFrameTime;
+
+  // -1 if unchanged, 0 for full damage
+  int             damageRectsCount;
+  FrameDamageRect damageRects[KVMFR_MAX_DAMAGE_RECTS];
+
+  int             cursorShape;
+};
+
+static struct synthetic * this = NULL;
+
+static bool synthetic_deinit(void);
+
+static const char * synthetic_getName(void)
+{
+  return "Synthetic";
+}
+
+static bool parseFormat(const char * str, CaptureFormat * format)
+{
+  if (!strcasecmp(str, "bgra"))
+    *format = CAPTURE_FMT_BGRA;
+  else if (!strcasecmp(str, "rgba10"))
+    *format = CAPTURE_FMT_RGBA10;
+  else if (!strcasecmp(str, "rgba16f"))
+    *format = CAPTURE_FMT_RGBA16F;
+  else
+    return false;
+  return true;
+}
+
+static bool parseDamageMode(const char * str, enum DamageMode * mode)
+{
+  for(int i = 0; i < ARRAY_LENGTH(damageModeStr); ++i)
+    if (!strcasecmp(str, damageModeStr[i]))
+    {
+      *mode = i;
+      return true;
+    }
+  return false;
+}
+
+static bool validateFormat(struct Option * opt, const char ** error)
+{
+  CaptureFormat format;
+  if (parseFormat(opt->value.x_string, &format))
+    return true;
+
+  *error = "Must be one of bgra, rgba10 or rgba16f";
+  return false;
+}
+
+static bool validateDamage(struct Option * opt, const char ** error)
+{
+  enum DamageMode mode;
+  if (parseDamageMode(opt->value.x_string, &mode))
+    return true;
+
+  *error = "Must be one of static, scroll, rects or full";
+  return false;
+}
+
+static void synthetic_initOptions(void)
+{
+  struct Option options[] =
+  {
+    {
+      .module         = "synthetic",
+      .name           = "width",
+      .description    = "The width of the generated frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 1920
+    },
+    {
+      .module         = "synthetic",
+      .name           = "height",
+      .description    = "The height of the generated frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 1080
+    },
+    {
+      .module         = "synthetic",
+      .name           = "format",
+      .description    = "The frame format (bgra, rgba10 or rgba16f)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "bgra",
+      .validator      = validateFormat
+    },
+    {
+      .module         = "synthetic",
+      .name           = "fps",
+      .description    = "The frame rate to generate frames at (0 for unlimited)",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 60
+    },
+    {
+      .module         = "synthetic",
+      .name           = "damage",
+      .description    = "The damage pattern (static, scroll, rects or full)",
+      .type           = OPTION_TYPE_STRING,
+      .value.x_string = "rects",
+      .validator      = validateDamage
+    },
+    {
+      .module         = "synthetic",
+      .name           = "rectCount",
+      .description    = "The number of random rects drawn per frame for the rects pattern",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 8
+    },
+    {
+      .module         = "synthetic",
+      .name           = "cursor",
+      .description    = "Generate cursor movement and shape changes",
+      .type           = OPTION_TYPE_BOOL,
+      .value.x_bool   = true
+    },
+    {
+      .module         = "synthetic",
+      .name           = "seed",
+      .description    = "The random seed, the same seed produces the same frames",
+      .type           = OPTION_TYPE_INT,
+      .value.x_int    = 1
+    },
+    {0}
+  };
+
+  option_register(options);
+}
+
+static bool synthetic_create(CaptureGetPointerBuffer getPointerBufferFn,
+    CapturePostPointerBuffer postPointerBufferFn)
+{
+  DEBUG_ASSERT(!this);
+
+  /* never pick this backend automatically, it would hide a failure of the
+   * real capture backends */
+  const char * capture = option_get_string("app", "capture");
+  if (!capture || strcasecmp(capture, "synthetic"))
+    return false;
+
+  this = calloc(1, sizeof(*this));
+  if (!this)
+  {
+    DEBUG_ERROR("out of memory");
+    return false;
+  }
+
+  this->getPointerBufferFn  = getPointerBufferFn;
+  this->postPointerBufferFn = postPointerBufferFn;
+  return true;
+}
+
+static inline uint32_t nextRandom(void)
+{
+  // xorshift32
+  uint32_t x = this->rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return this->rng = x;
+}
+
+static inline float randomFloat(void)
+{
+  return (nextRandom() & 0xffff) / 65535.0f;
+}
+
+static uint16_t floatToHalf(float f)
+{
+  union { float f; uint32_t u; } v = { .f = f };
+  const uint32_t sign = (v.u >> 16) & 0x8000;
+  const int32_t  exp  = (int32_t)((v.u >> 23) & 0xff) - 127 + 15;
+  const uint32_t mant = v.u & 0x7fffff;
+
+  if (exp <= 0)
+    return sign;
+  if (exp >= 31)
+    return sign | 0x7c00;
+  return sign | exp << 10 | mant >> 13;
+}
+
+static uint64_t makePixel(float r, float g, float b)
+{
+  switch(this->format)
+  {
+    case CAPTURE_FMT_RGBA10:
+      return
+        (uint32_t)(r * 1023.0f)       |
+        (uint32_t)(g * 1023.0f) << 10 |
+        (uint32_t)(b * 1023.0f) << 20 |
+        0x3U << 30;
+
+    case CAPTURE_FMT_RGBA16F:
+      return
+        (uint64_t)floatToHalf(r)          |
+        (uint64_t)floatToHalf(g)    << 16 |
+        (uint64_t)floatToHalf(b)    << 32 |
+        (uint64_t)floatToHalf(1.0f) << 48;
+
+    default:
+      return
+        (uint32_t)(b * 255.0f)       |
+        (uint32_t)(g * 255.0f) <<  8 |
+        (uint32_t)(r * 255.0f) << 16 |
+        0xffU << 24;
+  }
+}
+
+static void fillRect(unsigned int x, unsigned int y, unsigned int w,
+    unsigned int h, uint64_t pixel)
+{
+  for(unsigned int row = y; row < y + h; ++row)
+  {
+    uint8_t * line = this->data + row * this->pitch + x * this->bpp;
+    if (this->bpp == 4)
+    {
+      uint32_t * dst = (uint32_t *)line;
+      for(unsigned int i = 0; i < w; ++i)
+        dst[i] = (uint32_t)pixel;
+    }
+    else
+    {
+      uint64_t * dst = (uint64_t *)line;
+      for(unsigned int i = 0; i < w; ++i)
+        dst[i] = pixel;
+    }
+  }
+}
+
+static void addDamage(unsigned int x, unsigned int y, unsigned int w,
+    unsigned int h)
+{
+  if (this->damageRectsCount < 0)
+    this->damageRectsCount = 0;
+  else if (this->damageRectsCount == 0)
+    return;
+
+  if (this->damageRectsCount == KVMFR_MAX_DAMAGE_RECTS)
+  {
+    this->damageRectsCount = 0;
+    return;
+  }
+
+  this->damageRects[this->damageRectsCount++] = (FrameDamageRect) {
+    .x = x, .y = y, .width = w, .height = h
+  };
+}
+
+static bool synthetic_init(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(!this->initialized);
+
+  this->width  = option_get_int("synthetic", "width" );
+  this->height = option_get_int("synthetic", "height");
+  if (this->width < 64 || this->height < 64)
+  {
+    DEBUG_ERROR("The frame size must be at least 64x64");
+    return false;
+  }
+
+  parseFormat    (option_get_string("synthetic", "format"), &this->format    );
+  parseDamageMode(option_get_string("synthetic", "damage"), &this->damageMode);
+
+  this->bpp       = this->format == CAPTURE_FMT_RGBA16F ? 8 : 4;
+  this->pitch     = this->width * this->bpp;
+  this->fps       = option_get_int ("synthetic", "fps"      );
+  this->rectCount = option_get_int ("synthetic", "rectCount");
+  this->cursor    = option_get_bool("synthetic", "cursor"   );
+  this->rng       = option_get_int ("synthetic", "seed"     ) | 1;
+  this->frameNum  = 0;
+
+  if (this->rectCount < 1)
+    this->rectCount = 1;
+  else if (this->rectCount > KVMFR_MAX_DAMAGE_RECTS)
+    this->rectCount = KVMFR_MAX_DAMAGE_RECTS;
+
+  this->data = malloc((size_t)this->pitch * this->height);
+  if (!this->data)
+  {
+    DEBUG_ERROR("out of memory");
+    goto fail;
+  }
+
+  // damage rects are only supported for 32bpp formats
+  if (this->bpp == 4)
+  {
+    this->diff = framediff_new(this->width, this->height, this->pitch);
+    if (!this->diff)
+      DEBUG_WARN("Failed to create the frame differ, damage disabled");
+  }
+
+  ++this->formatVer;
+  DEBUG_INFO("Frame Size       : %u x %u", this->width, this->height);
+  DEBUG_INFO("Frame Rate       : %d", this->fps);
+  DEBUG_INFO("Damage Pattern   : %s", damageModeStr[this->damageMode]);
+
+  this->initialized = true;
+  return true;
+
+fail:
+  synthetic_deinit();
+  return false;
+}
+
+static bool synthetic_start(void)
+{
+  this->startTime     = nanotime();
+  this->nextFrameTime = this->startTime;
+  this->cursorShape   = -1;
+  return true;
+}
+
+static void synthetic_stop(void)
+{
+  // frames are generated on demand in capture, there is nothing to stop
+}
+
+static bool synthetic_deinit(void)
+{
+  DEBUG_ASSERT(this);
+
+  framediff_free(&this->diff);
+  free(this->data);
+  this->data = NULL;
+
+  this->initialized = false;
+  return true;
+}
+
+static void synthetic_free(void)
+{
+  free(this);
+  this = NULL;
+}
+
+static void drawScroll(void)
+{
+  // a window in the middle of the screen scrolling like a terminal
+  const unsigned int x = this->width  / 4;
+  const unsigned int y = this->height / 4;
+  const unsigned int w = this->width  / 2;
+  const unsigned int h = this->height / 2;
+
+  for(unsigned int row = y; row < y + h - SCROLL_LINES; ++row)
+    memcpy(this->data + row * this->pitch + x * this->bpp,
+        this->data + (row + SCROLL_LINES) * this->pitch + x * this->bpp,
+        w * this->bpp);
+
+  // draw a new "line of text" of random length
+  const unsigned int len = w / 8 + nextRandom() % (w - w / 8);
+  fillRect(x, y + h - SCROLL_LINES, w, SCROLL_LINES, makePixel(0.0f, 0.0f, 0.0f));
+  fillRect(x, y + h - SCROLL_LINES + 1, len, SCROLL_LINES - 2,
+      makePixel(0.8f, 0.8f, 0.8f));
+
+  addDamage(x, y, w, h);
+}
+
+static void drawRects(void)
+{
+  for(int i = 0; i < this->rectCount; ++i)
+  {
+    const unsigned int w = 16 + nextRandom() % (this->width  / 8);
+    const unsigned int h = 16 + nextRandom() % (this->height / 8);
+    const unsigned int x = nextRandom() % (this->width  - w);
+    const unsigned int y = nextRandom() % (this->height - h);
+    fillRect(x, y, w, h, makePixel(randomFloat(), randomFloat(), randomFloat()));
+    addDamage(x, y, w, h);
+  }
+}
+
+static void drawFull(void)
+{
+  // horizontal bands of colour moving down the screen
+  for(unsigned int y = 0; y < this->height; ++y)
+  {
+    const float t = (float)((y + this->frameNum * 4) % 512) / 511.0f;
+    fillRect(0, y, this->width, 1, makePixel(t, 1.0f - t, 0.5f));
+  }
+  this->damageRectsCount = 0;
+}
+
+static void updateCursor(uint64_t now)
+{
+  const int shape = ((now - this->startTime) / CURSOR_SHAPE_TIME) & 1;
+  const float t   = (now - this->startTime) * 1e-9f;
+
+  CapturePointer pointer =
+  {
+    .positionUpdate = true,
+    .visible        = true,
+    .x              = (int)(this->width  / 2 + cosf(t * 1.3f) * this->width  / 3),
+    .y              = (int)(this->height / 2 + sinf(t * 1.7f) * this->height / 3),
+    .format         = CAPTURE_FMT_COLOR,
+    .width          = CURSOR_SIZE,
+    .height         = CURSOR_SIZE,
+    .pitch          = CURSOR_SIZE * 4
+  };
+
+  if (shape != this->cursorShape)
+  {
+    void   * data;
+    uint32_t size;
+    if (this->getPointerBufferFn(&data, &size) &&
+        size >= CURSOR_SIZE * CURSOR_SIZE * 4)
+    {
+      uint32_t * dst = data;
+      for(int y = 0; y < CURSOR_SIZE; ++y)
+        for(int x = 0; x < CURSOR_SIZE; ++x)
+        {
+          uint32_t px;
+          if (shape == 0)
+            // white box with a black border
+            px = (x < 2 || y < 2 || x >= CURSOR_SIZE - 2 || y >= CURSOR_SIZE - 2) ?
+              0xff000000 : 0xffffffff;
+          else
+            // red crosshair
+            px = (abs(x - CURSOR_SIZE / 2) < 2 || abs(y - CURSOR_SIZE / 2) < 2) ?
+              0xffff0000 : 0x00000000;
+          dst[y * CURSOR_SIZE + x] = px;
+        }
+
+      pointer.shapeUpdate = true;
+      pointer.hx          = shape == 0 ? 0 : CURSOR_SIZE / 2;
+      pointer.hy          = shape == 0 ? 0 : CURSOR_SIZE / 2;
+      this->cursorShape   = shape;
+    }
+  }
+
+  this->postPointerBufferFn(pointer);
+}
+
+static CaptureResult synthetic_capture(void)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  if (this->fps > 0)
+  {
+    const uint64_t interval = 1000000000ULL / this->fps;
+    const uint64_t now      = nanotime();
+    if (now < this->nextFrameTime)
+      nsleep(this->nextFrameTime - now);
+
+    // don't try to catch up if we fell behind
+    this->nextFrameTime += interval;
+    if (this->nextFrameTime < now)
+      this->nextFrameTime = now + interval;
+  }
+
+  if (this->cursor)
+    updateCursor(nanotime());
+
+  this->damageRectsCount = -1;
+  if (this->frameNum == 0)
+  {
+    fillRect(0, 0, this->width, this->height, makePixel(0.2f, 0.2f, 0.2f));
+    drawRects();
+    this->damageRectsCount = 0;
+  }
+  else
+    switch(this->damageMode)
+    {
+      case DAMAGE_STATIC: break;
+      case DAMAGE_SCROLL: drawScroll(); break;
+      case DAMAGE_RECTS : drawRects (); break;
+      case DAMAGE_FULL  : drawFull  (); break;
+    }
+
+  ++this->frameNum;
+  if (this->damageRectsCount < 0)
+    return CAPTURE_RESULT_TIMEOUT;
+
+  // without the differ the damage can't be used
+  if (!this->diff)
+    this->damageRectsCount = 0;
+  else
+    framediff_setDamage(this->diff, this->damageRects, this->damageRectsCount);
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult synthetic_waitFrame(CaptureFrame * frame,
+    const size_t maxFrameSize)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  const unsigned int maxHeight = maxFrameSize / this->pitch;
+
+  frame->formatVer  = this->formatVer;
+  frame->format     = this->format;
+  frame->width      = this->width;
+  frame->height     = maxHeight > this->height ? this->height : maxHeight;
+  frame->realHeight = this->height;
+  frame->pitch      = this->pitch;
+  frame->stride     = this->width;
+  frame->rotation   = CAPTURE_ROT_0;
+
+  frame->damageRectsCount = this->damageRectsCount;
+  memcpy(frame->damageRects, this->damageRects,
+      this->damageRectsCount * sizeof(*this->damageRects));
+
+  return CAPTURE_RESULT_OK;
+}
+
+static CaptureResult synthetic_getFrame(FrameBuffer * frame,
+    const unsigned int height, int frameIndex)
+{
+  DEBUG_ASSERT(this);
+  DEBUG_ASSERT(this->initialized);
+
+  if (this->diff)
+    framediff_write(this->diff, frame, frameIndex, this->data, height,
+        false);
+  else
+    framebuffer_write(frame, this->data, height * this->pitch);
+
+  return CAPTURE_RESULT_OK;
+}
+
+static void synthetic_invalidateFrame(int frameIndex)
+{
+  if (this->diff)
+    framediff_invalidate(this->diff, frameIndex);
+}
+
+struct CaptureInterface Capture_synthetic =
+{
+  .shortName       = "synthetic",
+  .asyncCapture    = false,
+  .getName         = synthetic_getName,
+  .initOptions     = synthetic_initOptions,
+  .create          = synthetic_create,
+  .init            = synthetic_init,
+  .start           = synthetic_start,
+  .stop            = synthetic_stop,
+  .deinit          = synthetic_deinit,
+  .free            = synthetic_free,
+  .capture         = synthetic_capture,
+  .waitFrame       = synthetic_waitFrame,
+  .getFrame        = synthetic_getFrame,
+  .invalidateFrame = synthetic_invalidateFrame
+};
@@ -112,7 +112,8 @@ struct iface
   int  lastPointerX, lastPointerY;
   bool lastPointerVisible;
 
-  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN];
+  struct FrameDamage frameDamage[LGMP_Q_FRAME_LEN_MAX];
+  LGRegion           damageRegion; // scratch for merging the texture damage
 };
 
 static struct iface * this    = NULL;
@@ -194,6 +195,7 @@ static bool dxgi_create(CaptureGetPointerBuffer getPointerBufferFn, CapturePostP
   this->getPointerBufferFn  = getPointerBufferFn;
   this->postPointerBufferFn = postPointerBufferFn;
   this->avgMapTime          = runningavg_new(10);
+  this->damageRegion        = region_new();
   return true;
 }
 
@@ -580,7 +582,7 @@ static bool dxgi_init(void)
   this->stride = mapping.RowPitch / bpp;
   ID3D11DeviceContext_Unmap(this->deviceContext, (ID3D11Resource *)this->texture[0].tex, 0);
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
     this->frameDamage[i].count = -1;
 
   QueryPerformanceFrequency(&this->perfFreq) ;
@@ -684,6 +686,7 @@ static void dxgi_free(void)
   free(this->texture);
 
   runningavg_free(&this->avgMapTime);
+  region_free(&this->damageRegion);
   free(this);
   this = NULL;
 }
@@ -873,7 +876,8 @@ static CaptureResult dxgi_capture(void)
           memcpy(tex->texDamageRects + tex->texDamageCount, tex->damageRects,
             tex->damageRectsCount * sizeof(*tex->damageRects));
           tex->texDamageCount += tex->damageRectsCount;
-          tex->texDamageCount = rectsMergeOverlapping(tex->texDamageRects, tex->texDamageCount);
+          tex->texDamageCount = rectsMergeOverlapping(tex->texDamageRects,
+            tex->texDamageCount, this->damageRegion);
         }
 
         // issue the copy from GPU to CPU RAM
@@ -1099,7 +1103,7 @@ static CaptureResult dxgi_getFrame(FrameBuffer * frame,
       height, tex->map.pData, this->pitch);
   }
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     struct FrameDamage * damage = this->frameDamage + i;
     if (i == frameIndex)
@@ -1157,6 +1161,12 @@ static CaptureResult dxgi_releaseFrame(void)
   return CAPTURE_RESULT_OK;
 }
 
+static void dxgi_invalidateFrame(int frameIndex)
+{
+  DEBUG_ASSERT(this);
+  this->frameDamage[frameIndex].count = -1;
+}
+
 struct CaptureInterface Capture_DXGI =
 {
   .shortName       = "DXGI",
@@ -1170,5 +1180,6 @@ struct CaptureInterface Capture_DXGI =
   .free            = dxgi_free,
   .capture         = dxgi_capture,
   .waitFrame       = dxgi_waitFrame,
-  .getFrame        = dxgi_getFrame
+  .getFrame        = dxgi_getFrame,
+  .invalidateFrame = dxgi_invalidateFrame
 };
@@ -78,13 +78,19 @@ struct iface
   bool mouseHookCreated;
   bool forceCompositionCreated;
 
-  struct FrameInfo frameInfo[LGMP_Q_FRAME_LEN];
+  struct FrameInfo frameInfo[LGMP_Q_FRAME_LEN_MAX];
 };
 
 static struct iface * this = NULL;
 
 static bool nvfbc_deinit(void);
 static void nvfbc_free(void);
+static void nvfbc_invalidateFrame(int frameIndex)
+{
+  this->frameInfo[frameIndex].width  = 0;
+  this->frameInfo[frameIndex].height = 0;
+}
+
 static int pointerThread(void * unused);
 
 static void getDesktopSize(unsigned int * width, unsigned int * height)
@@ -236,7 +242,7 @@ static bool nvfbc_init(void)
   DEBUG_INFO("DiffMap block    : %dx%d", 1 << this->diffShift, 1 << this->diffShift);
   DEBUG_INFO("Cursor mode      : %s", this->seperateCursor ? "decoupled" : "integrated");
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     this->frameInfo[i].width    = 0;
     this->frameInfo[i].height   = 0;
@@ -309,7 +315,7 @@ static bool nvfbc_deinit(void)
 {
   this->cursorEvent = NULL;
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     free(this->frameInfo[i].diffMap);
     this->frameInfo[i].diffMap = NULL;
@@ -625,7 +631,7 @@ static CaptureResult nvfbc_getFrame(FrameBuffer * frame,
       height * this->grabInfo.dwBufferWidth * 4
     );
 
-  for (int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for (int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
   {
     if (i == frameIndex)
     {
@@ -713,5 +719,6 @@ struct CaptureInterface Capture_NVFBC =
   .free            = nvfbc_free,
   .capture         = nvfbc_capture,
   .waitFrame       = nvfbc_waitFrame,
-  .getFrame        = nvfbc_getFrame
+  .getFrame        = nvfbc_getFrame,
+  .invalidateFrame = nvfbc_invalidateFrame
 };
@@ -29,11 +29,16 @@
 #include "common/crash.h"
 #include "common/thread.h"
 #include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/framealloc.h"
+#include "common/hdr.h"
 #include "common/sysinfo.h"
 #include "common/time.h"
 #include "common/stringutils.h"
 #include "common/cpuinfo.h"
 #include "common/util.h"
+#include "common/event.h"
+#include "common/array.h"
 
 #include <lgmp/host.h>
 
@@ -43,14 +48,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdatomic.h>
 
 #define CONFIG_FILE "looking-glass-host.ini"
 #define POINTER_SHAPE_BUFFERS 3
+#define HUGE_PAGE_SIZE 2097152
+#define HDR_BAND_ROWS  32
 
-static const struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
+static struct LGMPQueueConfig FRAME_QUEUE_CONFIG =
 {
   .queueID     = LGMP_Q_FRAME,
-  .numMessages = LGMP_Q_FRAME_LEN,
+  .numMessages = LGMP_Q_FRAME_LEN_DEFAULT,
   .subTimeout  = 1000
 };
 
@@ -63,6 +71,20 @@ static const struct LGMPQueueConfig POINTER_QUEUE_CONFIG =
 
 #define MAX_POINTER_SIZE (sizeof(KVMFRCursor) + (512 * 512 * 4))
 
+enum CompressMode
+{
+  COMPRESS_AUTO,
+  COMPRESS_ALWAYS,
+  COMPRESS_NEVER
+};
+
+static const char * CompressModeStr[] =
+{
+  "auto",
+  "always",
+  "never"
+};
+
 enum AppState
 {
   APP_STATE_RUNNING,
@@ -91,16 +113,55 @@ struct app
   long           pageSize;
   size_t         maxFrameSize;
   PLGMPHostQueue frameQueue;
-  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN];
+  PLGMPMemory    frameMemory[LGMP_Q_FRAME_LEN_MAX];
+  unsigned int   frameQueueLen;
+  LGEvent      * frameQueueEvent;
   unsigned int   frameIndex;
   bool           frameValid;
   uint32_t       frameSerial;
 
+  // the frame buffers are placed in one block sized for each frame, the slots
+  // of the last posts still pending in the queue can not be touched
+  PLGMPMemory    frameArena;
+  size_t         frameArenaSize;
+  size_t         frameAlign;
+  FrameAlloc     frameAlloc;
+  unsigned int   postSlots[LGMP_Q_FRAME_LEN_MAX];
+  unsigned int   postIndex;
+
+  // compressed and sparse frames are captured into a staging buffer per
+  // queue slot as the capture backends only copy what changed since the slot
+  // was written, as such once in use all frames must go through it
+  enum CompressMode compressFrames;
+  bool              sparseFrames;
+  FrameBuffer     * staging    [LGMP_Q_FRAME_LEN_MAX];
+  size_t            stagingSize[LGMP_Q_FRAME_LEN_MAX];
+
+  // RGBA16F frames are captured into a staging buffer per slot to be
+  // converted, hdrDamage is what changed since hdrDst was converted into
+  bool              convertHDR;
+  FrameBuffer     * hdrStaging    [LGMP_Q_FRAME_LEN_MAX];
+  size_t            hdrStagingSize[LGMP_Q_FRAME_LEN_MAX];
+  const void      * hdrDst        [LGMP_Q_FRAME_LEN_MAX];
+  struct HDRDamage
+  {
+    int             count;
+    FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+  }
+  hdrDamage[LGMP_Q_FRAME_LEN_MAX];
+
   CaptureInterface * iface;
 
   enum AppState state;
   LGTimer  * lgmpTimer;
   LGThread * frameThread;
+
+  // time spent waiting for a free slot in the frame queue
+  bool                 queueStats;
+  _Atomic(uint64_t)    stallTime;
+  atomic_uint          stallCount;
+  _Atomic(uint64_t)    memPeak;
+  uint64_t             statsTime;
 };
 
 static struct app app;
@@ -117,6 +178,29 @@ static bool validateCaptureBackend(struct Option * opt, const char ** error)
   return false;
 }
 
+static bool validateFrameQueueLen(struct Option * opt, const char ** error)
+{
+  if (opt->value.x_int >= LGMP_Q_FRAME_LEN_MIN &&
+      opt->value.x_int <= LGMP_Q_FRAME_LEN_MAX)
+    return true;
+
+  static char msg[64];
+  snprintf(msg, sizeof(msg), "Must be between %d and %d",
+      LGMP_Q_FRAME_LEN_MIN, LGMP_Q_FRAME_LEN_MAX);
+  *error = msg;
+  return false;
+}
+
+static bool validateCompressFrames(struct Option * opt, const char ** error)
+{
+  for(unsigned int i = 0; i < ARRAY_LENGTH(CompressModeStr); ++i)
+    if (!strcasecmp(opt->value.x_string, CompressModeStr[i]))
+      return true;
+
+  *error = "Must be one of auto, always or never";
+  return false;
+}
+
 static struct Option options[] =
 {
   {
@@ -134,6 +218,51 @@ static struct Option options[] =
     .type           = OPTION_TYPE_INT,
     .value.x_int    = 0,
   },
+  {
+    .module         = "app",
+    .name           = "copyThreads",
+    .description    = "The number of threads used to copy each frame (0 or 1 to disable)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0,
+  },
+  {
+    .module         = "app",
+    .name           = "frameQueueLen",
+    .description    = "The number of frames that can be queued for the client",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = LGMP_Q_FRAME_LEN_DEFAULT,
+    .validator      = validateFrameQueueLen,
+  },
+  {
+    .module         = "app",
+    .name           = "compressFrames",
+    .description    = "Compress frames that do not fit in the IVSHMEM (auto), "
+                      "all frames (always) or none (never)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "auto",
+    .validator      = validateCompressFrames,
+  },
+  {
+    .module         = "app",
+    .name           = "sparseFrames",
+    .description    = "Send only the tiles that changed when the damage is known",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "convertHDR",
+    .description    = "Convert HDR (RGBA16F) frames to 10 bit PQ, halving their size",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
+  {
+    .module         = "app",
+    .name           = "queueStats",
+    .description    = "Log frame queue stalls, frame memory use and LGMP timer overruns each second",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false,
+  },
   {0}
 };
 
@@ -174,30 +303,358 @@ static bool lgmpTimer(void * opaque)
     lgmpHostAckData(app.pointerQueue);
   }
 
+  // wake the frame sender if it is waiting for a free slot
+  if (lgmpHostQueuePending(app.frameQueue) < app.frameQueueLen)
+    lgSignalEvent(app.frameQueueEvent);
+
+  if (app.queueStats)
+  {
+    const uint64_t now = nanotime();
+    if (now - app.statsTime >= 1000000000ULL)
+    {
+      const uint64_t     stallTime  = atomic_exchange(&app.stallTime , 0);
+      const unsigned int stallCount = atomic_exchange(&app.stallCount, 0);
+      if (stallCount)
+        DEBUG_INFO("Frame queue stalled %u times for %.2f ms (%.1f%%)",
+            stallCount, stallTime / 1e6,
+            stallTime * 100.0 / (now - app.statsTime));
+
+      const uint64_t memPeak = atomic_exchange(&app.memPeak, 0);
+      if (memPeak)
+        DEBUG_INFO("Frame memory peaked at %.1f of %.1f MiB",
+            memPeak / 1048576.0, app.frameArenaSize / 1048576.0);
+
+      LGTimerStats ts;
+      if (lgTimerGetStats(app.lgmpTimer, &ts, true) && ts.overruns)
+        DEBUG_INFO("LGMP timer overran %" PRIu64 " times, "
+            "late by %.2f ms avg, %.2f ms max",
+            ts.overruns, ts.avgLateNs / 1e6, ts.maxLateNs / 1e6);
+
+      app.statsTime = now;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Wait for a free slot in the frame queue. Slots are released by
+ * lgmpHostProcess in lgmpTimer which signals frameQueueEvent, the timeout
+ * only bounds the wait should the queue drain between timer ticks.
+ */
+static void waitFrameQueue(void)
+{
+  if (lgmpHostQueuePending(app.frameQueue) < app.frameQueueLen)
+    return;
+
+  const uint64_t start = nanotime();
+  while(app.state == APP_STATE_RUNNING &&
+      lgmpHostQueuePending(app.frameQueue) >= app.frameQueueLen)
+    lgWaitEvent(app.frameQueueEvent, 1);
+
+  atomic_fetch_add(&app.stallTime, nanotime() - start);
+  atomic_fetch_add(&app.stallCount, 1);
+}
+
+/**
+ * Post the frame slot and remember that it was, the last posts that are still
+ * pending in the queue are the slots the client may be reading.
+ */
+static bool postFrame(unsigned int index)
+{
+  LGMP_STATUS status;
+  if ((status = lgmpHostQueuePost(app.frameQueue, 0,
+          app.frameMemory[index])) != LGMP_OK)
+  {
+    DEBUG_ERROR("%s", lgmpStatusString(status));
+    return false;
+  }
+
+  app.postSlots[app.postIndex] = index;
+  if (++app.postIndex == LGMP_Q_FRAME_LEN_MAX)
+    app.postIndex = 0;
   return true;
 }
 
+static void releaseFrames(void)
+{
+  bool live[LGMP_Q_FRAME_LEN_MAX] = { 0 };
+  unsigned int pending = lgmpHostQueuePending(app.frameQueue);
+  if (pending > LGMP_Q_FRAME_LEN_MAX)
+    pending = LGMP_Q_FRAME_LEN_MAX;
+
+  for(unsigned int i = 1; i <= pending; ++i)
+    live[app.postSlots[
+      (app.postIndex + LGMP_Q_FRAME_LEN_MAX - i) % LGMP_Q_FRAME_LEN_MAX]] = true;
+
+  for(unsigned int i = 0; i < app.frameQueueLen; ++i)
+    framealloc_setLive(app.frameAlloc, i, live[i]);
+}
+
+/**
+ * Place the frame buffer of the current slot with room for at least `min` and
+ * up to `want` bytes. If the frames in the queue leave no room for it we wait
+ * for the client to release them, as the queue is bounded this can not take
+ * longer than the subscriber timeout. If the slot moved the backend and the
+ * HDR conversion have to write the whole frame to it again.
+ */
+static FrameBuffer * placeFrame(KVMFRFrame * fi, size_t min, size_t want,
+    size_t * size)
+{
+  const size_t align = want >= app.frameAlign ? app.frameAlign : app.pageSize;
+  size_t offset;
+  bool   moved;
+
+  releaseFrames();
+  if (!framealloc_place(app.frameAlloc, app.frameIndex, min, want, align,
+        &offset, size, &moved))
+  {
+    const uint64_t start = nanotime();
+    do
+    {
+      if (app.state != APP_STATE_RUNNING)
+        return NULL;
+
+      lgWaitEvent(app.frameQueueEvent, 1);
+      releaseFrames();
+    }
+    while(!framealloc_place(app.frameAlloc, app.frameIndex, min, want, align,
+          &offset, size, &moved));
+
+    atomic_fetch_add(&app.stallTime, nanotime() - start);
+    atomic_fetch_add(&app.stallCount, 1);
+  }
+
+  if (moved)
+  {
+    app.iface->invalidateFrame(app.frameIndex);
+    app.hdrDst[app.frameIndex] = NULL;
+  }
+
+  fi->memUsed = framealloc_getUsed(app.frameAlloc);
+  if (fi->memUsed > atomic_load(&app.memPeak))
+    atomic_store(&app.memPeak, fi->memUsed);
+
+  uint8_t * fb = (uint8_t *)lgmpHostMemPtr(app.frameArena) + offset;
+  fi->offset = fb - (uint8_t *)fi;
+  return (FrameBuffer *)fb;
+}
+
+/**
+ * Get a staging buffer of the frame slot, growing it if needed
+ */
+static FrameBuffer * getStaging(FrameBuffer ** staging, size_t * stagingSize,
+    size_t size)
+{
+  if (*stagingSize >= size)
+    return *staging;
+
+  FrameBuffer * fb = realloc(*staging, FrameBufferStructSize + size);
+  if (!fb)
+  {
+    DEBUG_ERROR("Failed to allocate the frame staging buffer");
+    return NULL;
+  }
+
+  *staging     = fb;
+  *stagingSize = size;
+  return fb;
+}
+
+/**
+ * Capture the RGBA16F frame into the HDR staging buffer of the slot and
+ * convert it into `fb`. Like the capture backends only what changed since
+ * `fb` was last converted into for this slot is converted, a whole frame is
+ * converted in bands so the client can start reading it before it is done.
+ */
+static void getFrameHDR(FrameBuffer * fb, const CaptureFrame * frame,
+    size_t srcPitch)
+{
+  const unsigned int index   = app.frameIndex;
+  FrameBuffer      * staging = app.hdrStaging[index];
+  struct HDRDamage * damage  = app.hdrDamage + index;
+  const int          count   = frame->damageRectsCount;
+
+  framebuffer_prepare(staging);
+  app.iface->getFrame(staging, frame->height, index);
+  framebuffer_wait(staging, frame->height * srcPitch);
+
+  const uint8_t * src = framebuffer_get_buffer(staging);
+  uint8_t       * dst = framebuffer_get_data(fb);
+
+  if (count == 0 || damage->count < 0 || app.hdrDst[index] != fb ||
+      damage->count + count > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    for(unsigned int y = 0; y < frame->height; y += HDR_BAND_ROWS)
+    {
+      const unsigned int end = min(y + HDR_BAND_ROWS, frame->height);
+      for(unsigned int row = y; row < end; ++row)
+        hdr_convertPQ(
+          (uint32_t *)(dst + row * frame->pitch),
+          (const uint16_t *)(src + row * srcPitch),
+          frame->width);
+      framebuffer_set_write_ptr(fb, end * frame->pitch);
+    }
+  }
+  else
+  {
+    memcpy(damage->rects + damage->count, frame->damageRects,
+        count * sizeof(*damage->rects));
+    damage->count += count;
+
+    for(int i = 0; i < damage->count; ++i)
+    {
+      const FrameDamageRect * rect = damage->rects + i;
+      const unsigned int      end  =
+        min(rect->y + rect->height, frame->height);
+
+      for(unsigned int row = rect->y; row < end; ++row)
+        hdr_convertPQ(
+          (uint32_t *)(dst + row * frame->pitch + rect->x * 4),
+          (const uint16_t *)(src + row * srcPitch + rect->x * 8),
+          rect->width);
+    }
+    framebuffer_set_write_ptr(fb, frame->height * frame->pitch);
+  }
+
+  for(int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+  {
+    struct HDRDamage * d = app.hdrDamage + i;
+    if (i == index)
+      d->count = 0;
+    else if (count > 0 && d->count >= 0 &&
+        d->count + count <= KVMFR_MAX_DAMAGE_RECTS)
+    {
+      memcpy(d->rects + d->count, frame->damageRects,
+          count * sizeof(*d->rects));
+      d->count += count;
+    }
+    else
+      d->count = -1;
+  }
+  app.hdrDst[index] = fb;
+}
+
+/**
+ * Get the frame from the capture backend into `fb`, converting it to PQ
+ * RGBA10 if `hdrPitch`, the pitch of the captured RGBA16F frame, is set.
+ */
+static void getFrame(FrameBuffer * fb, const CaptureFrame * frame,
+    size_t hdrPitch)
+{
+  if (hdrPitch)
+    getFrameHDR(fb, frame, hdrPitch);
+  else
+  {
+    app.hdrDst[app.frameIndex] = NULL;
+    app.iface->getFrame(fb, frame->height, app.frameIndex);
+  }
+}
+
+/**
+ * Compressed frames take the room there is up to their uncompressed size, but
+ * at least what each slot had when the memory was divided equally.
+ */
+static FrameBuffer * placeCompressed(KVMFRFrame * fi, size_t frameSize,
+    size_t * size)
+{
+  const size_t want = min(frameSize, app.maxFrameSize);
+  return placeFrame(fi, min(want, app.maxFrameSize / app.frameQueueLen), want,
+      size);
+}
+
+static size_t frameTypeBpp(FrameType type)
+{
+  return type == FRAME_TYPE_RGBA16F ? 8 : 4;
+}
+
+/**
+ * Sparse frames only make sense to clients that saw the frames before them,
+ * so to bring a new client up to date the last frame is sent again in full
+ * from the staging buffer it was captured into.
+ */
+static void resendFullFrame(void)
+{
+  const unsigned int last = app.frameIndex;
+  if (++app.frameIndex >= app.frameQueueLen)
+    app.frameIndex = 0;
+
+  const KVMFRFrame * prev = lgmpHostMemPtr(app.frameMemory[last]);
+  KVMFRFrame       * fi   = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
+  memcpy(fi, prev, sizeof(*fi));
+
+  const size_t frameSize = (size_t)fi->height * fi->pitch;
+  const bool   compress  = app.compressFrames == COMPRESS_ALWAYS ||
+    (app.compressFrames == COMPRESS_AUTO && frameSize > app.maxFrameSize);
+
+  size_t        avail;
+  FrameBuffer * fb = compress ?
+    placeCompressed(fi, frameSize, &avail) :
+    placeFrame(fi, frameSize, frameSize, &avail);
+  if (!fb)
+    return;
+
+  fi->type             = compress ? FRAME_TYPE_LZ4 : fi->dataType;
+  fi->frameSerial      = app.frameSerial++;
+  fi->damageRectsCount = 0;
+  fi->copyTime         = 0;
+  fi->postTime         = nanotime();
+  framebuffer_prepare(fb);
+
+  if (!postFrame(app.frameIndex))
+    return;
+
+  const uint8_t * src = framebuffer_get_buffer(app.staging[last]);
+  if (compress)
+  {
+    framebuffer_write_lz4(fb, src, fi->height, fi->pitch, avail);
+    framealloc_shrink(app.frameAlloc, app.frameIndex,
+        framebuffer_get_write_ptr(fb));
+  }
+  else
+    framebuffer_write(fb, src, frameSize);
+
+  fi->copyTime = nanotime();
+}
+
+/**
+ * Post the last frame again for a new client, a sparse frame is resent in full
+ * as the new client has not seen the frames it depends on.
+ */
+static void repostLastFrame(void)
+{
+  const KVMFRFrame * last = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
+  if (last->type == FRAME_TYPE_SPARSE)
+    resendFullFrame();
+  else
+    postFrame(app.frameIndex);
+}
+
 static bool sendFrame(void)
 {
   CaptureFrame frame = { 0 };
   bool repeatFrame = false;
+  bool newSubs = false;
+  uint64_t captureTime = 0;
 
   //wait until there is room in the queue
-  while(app.state == APP_STATE_RUNNING &&
-      lgmpHostQueuePending(app.frameQueue) == LGMP_Q_FRAME_LEN)
-  {
-    usleep(1);
-    continue;
-  }
+  waitFrameQueue();
 
   if (app.state != APP_STATE_RUNNING)
     return false;
 
-  switch(app.iface->waitFrame(&frame, app.maxFrameSize))
+  /* when frames may be compressed, sparse or converted the backend must not
+   * truncate them, the frame is truncated below instead if it needs to be */
+  const size_t maxFrameSize =
+    app.compressFrames == COMPRESS_NEVER && !app.sparseFrames &&
+    !app.convertHDR ? app.maxFrameSize : SIZE_MAX;
+
+  switch(app.iface->waitFrame(&frame, maxFrameSize))
   {
     case CAPTURE_RESULT_OK:
+      captureTime = nanotime();
       // reading the new subs count zeros it
-      lgmpHostQueueNewSubs(app.frameQueue);
+      newSubs = lgmpHostQueueNewSubs(app.frameQueue) > 0;
       break;
 
     case CAPTURE_RESULT_REINIT:
@@ -226,22 +683,45 @@ static bool sendFrame(void)
     }
   }
 
-  LGMP_STATUS status;
-
   // if we are repeating a frame just send the last frame again
   if (repeatFrame)
   {
-    if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-           app.frameMemory[app.frameIndex])) != LGMP_OK)
-      DEBUG_ERROR("%s", lgmpStatusString(status));
+    repostLastFrame();
     return true;
   }
 
   // we increment the index first so that if we need to repeat a frame
   // the index still points to the latest valid frame
-  if (++app.frameIndex == LGMP_Q_FRAME_LEN)
+  if (++app.frameIndex >= app.frameQueueLen)
     app.frameIndex = 0;
 
+  /* RGBA16F frames are converted to PQ RGBA10 which is half the size, from
+   * here on the frame is what it is converted to */
+  size_t hdrPitch = 0;
+  if (app.convertHDR && frame.format == CAPTURE_FMT_RGBA16F &&
+      getStaging(&app.hdrStaging[app.frameIndex],
+        &app.hdrStagingSize[app.frameIndex],
+        (size_t)frame.height * frame.pitch))
+  {
+    hdrPitch     = frame.pitch;
+    frame.format = CAPTURE_FMT_RGBA10;
+    frame.stride = frame.width;
+    frame.pitch  = frame.width * 4;
+  }
+
+  const size_t frameSize = (size_t)frame.height * frame.pitch;
+  const bool   compress  = app.compressFrames == COMPRESS_ALWAYS ||
+    (app.compressFrames == COMPRESS_AUTO && frameSize > app.maxFrameSize);
+
+  FrameBuffer * staging = NULL;
+  if (compress || app.sparseFrames)
+    staging = getStaging(&app.staging[app.frameIndex],
+        &app.stagingSize[app.frameIndex], frameSize);
+
+  // without compression the frame has to be truncated to fit
+  if (!(staging && compress) && frameSize > app.maxFrameSize)
+    frame.height = app.maxFrameSize / frame.pitch;
+
   KVMFRFrame * fi = lgmpHostMemPtr(app.frameMemory[app.frameIndex]);
   switch(frame.format)
   {
@@ -266,6 +746,20 @@ static bool sendFrame(void)
       break;
   }
 
+  /* the frame buffer is sized for the data it will hold, full size frames are
+   * hugepage aligned to allow for aligned DMA transfers by the receiver */
+  const size_t  dataSize = (size_t)frame.height * frame.pitch;
+  size_t        avail;
+  FrameBuffer * fb = staging && compress ?
+    placeCompressed(fi, frameSize, &avail) :
+    placeFrame(fi, dataSize, dataSize, &avail);
+  if (!fb)
+    return false;
+
+  const size_t realSize  = (size_t)frame.realHeight * frame.pitch;
+  const size_t realAlign =
+    realSize >= app.frameAlign ? app.frameAlign : app.pageSize;
+
   fi->formatVer         = frame.formatVer;
   fi->frameSerial       = app.frameSerial++;
   fi->width             = frame.width;
@@ -273,26 +767,79 @@ static bool sendFrame(void)
   fi->realHeight        = frame.realHeight;
   fi->stride            = frame.stride;
   fi->pitch             = frame.pitch;
-  fi->offset            = app.pageSize - FrameBufferStructSize;
+  fi->transfer          = hdrPitch ? FRAME_TRANSFER_PQ : FRAME_TRANSFER_DEFAULT;
   fi->blockScreensaver  = os_blockScreensaver();
+  fi->memNeeded         =
+    framealloc_getSpan(realSize, realAlign, app.frameQueueLen);
+  fi->memSize           = app.frameArenaSize;
   app.frameValid        = true;
 
   fi->damageRectsCount  = frame.damageRectsCount;
   memcpy(fi->damageRects, frame.damageRects, frame.damageRectsCount * sizeof(FrameDamageRect));
 
-  // put the framebuffer on the border of the next page
-  // this is to allow for aligned DMA transfers by the receiver
-  FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)fi) + fi->offset);
   framebuffer_prepare(fb);
 
-  /* we post and then get the frame, this is intentional! */
-  if ((status = lgmpHostQueuePost(app.frameQueue, 0, app.frameMemory[app.frameIndex])) != LGMP_OK)
+  /* a sparse frame is written before it is posted as it is only known if the
+   * changed tiles fit once they have been captured, as they are usually few
+   * this costs little latency. New clients need a full frame to start from. */
+  const uint8_t * src = staging ? framebuffer_get_buffer(staging) : NULL;
+  bool captured = false;
+  fi->dataType  = fi->type;
+  if (staging && app.sparseFrames && frame.damageRectsCount > 0 && !newSubs)
   {
-    DEBUG_ERROR("%s", lgmpStatusString(status));
+    framebuffer_prepare(staging);
+    getFrame(staging, &frame, hdrPitch);
+    captured = true;
+
+    if (framebuffer_write_sparse(fb, src, frame.width, frame.height,
+          frameTypeBpp(fi->type), frame.pitch, frame.damageRects,
+          frame.damageRectsCount, avail))
+    {
+      fi->type = FRAME_TYPE_SPARSE;
+      framealloc_shrink(app.frameAlloc, app.frameIndex,
+          framebuffer_get_write_ptr(fb));
+    }
+    else
+      framebuffer_prepare(fb);
+  }
+
+  // compressed frames are always sent whole
+  if (fi->type != FRAME_TYPE_SPARSE && staging && compress)
+  {
+    fi->type             = FRAME_TYPE_LZ4;
+    fi->damageRectsCount = 0;
+  }
+
+  fi->captureTime = captureTime;
+  fi->copyTime    = 0;
+  fi->postTime    = nanotime();
+
+  /* we post and then get the frame, this is intentional! */
+  if (!postFrame(app.frameIndex))
     return true;
+
+  if (staging && fi->type != FRAME_TYPE_SPARSE)
+  {
+    if (!captured)
+    {
+      framebuffer_prepare(staging);
+      getFrame(staging, &frame, hdrPitch);
+    }
+
+    if (!compress)
+      framebuffer_write(fb, src, dataSize);
+    else
+    {
+      if (!framebuffer_write_lz4(fb, src, frame.height, frame.pitch, avail))
+        DEBUG_WARN("Compressed frame too large for the IVSHMEM, truncated");
+      framealloc_shrink(app.frameAlloc, app.frameIndex,
+          framebuffer_get_write_ptr(fb));
+    }
   }
+  else if (!staging)
+    getFrame(fb, &frame, hdrPitch);
 
-  app.iface->getFrame(fb, frame.height, app.frameIndex);
+  fi->copyTime = nanotime();
   return true;
 }
 
@@ -513,8 +1060,25 @@ static void lgmpShutdown()
   if (app.lgmpTimer)
     lgTimerDestroy(app.lgmpTimer);
 
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  if (app.frameQueueEvent)
+  {
+    lgFreeEvent(app.frameQueueEvent);
+    app.frameQueueEvent = NULL;
+  }
+
+  framealloc_free(&app.frameAlloc);
+  lgmpHostMemFree(&app.frameArena);
+  for(int i = 0; i < LGMP_Q_FRAME_LEN_MAX; ++i)
+  {
     lgmpHostMemFree(&app.frameMemory[i]);
+    free(app.staging[i]);
+    app.staging    [i] = NULL;
+    app.stagingSize[i] = 0;
+    free(app.hdrStaging[i]);
+    app.hdrStaging    [i] = NULL;
+    app.hdrStagingSize[i] = 0;
+    app.hdrDst        [i] = NULL;
+  }
   for(int i = 0; i < LGMP_Q_POINTER_LEN; ++i)
     lgmpHostMemFree(&app.pointerMemory[i]);
   for(int i = 0; i < POINTER_SHAPE_BUFFERS; ++i)
@@ -589,6 +1153,9 @@ static bool newKVMFRData(KVMFRUserData * dst)
       min(sizeof(kvmfr->magic), sizeof(KVMFR_MAGIC)));
   kvmfr->version  = KVMFR_VERSION;
   kvmfr->features = os_hasSetCursorPos() ? KVMFR_FEATURE_SETCURSORPOS : 0;
+  if (app.sparseFrames)
+    kvmfr->features |= KVMFR_FEATURE_SPARSE;
+  kvmfr->frameQueueLen = app.frameQueueLen;
   strncpy(kvmfr->hostver, BUILD_VERSION, sizeof(kvmfr->hostver) - 1);
 
   {
@@ -692,21 +1259,41 @@ static bool lgmpSetup(struct IVSHMEM * shmDev)
     memset(lgmpHostMemPtr(app.pointerShapeMemory[i]), 0, MAX_POINTER_SIZE);
   }
 
-  app.maxFrameSize = lgmpHostMemAvail(app.lgmp);
-  app.maxFrameSize = (app.maxFrameSize - (app.pageSize - 1)) & ~(app.pageSize - 1);
-  app.maxFrameSize /= LGMP_Q_FRAME_LEN;
-  DEBUG_INFO("Max Frame Size   : %u MiB", (unsigned int)(app.maxFrameSize / 1048576LL));
-
-  for(int i = 0; i < LGMP_Q_FRAME_LEN; ++i)
+  for(int i = 0; i < app.frameQueueLen; ++i)
   {
-    if ((status = lgmpHostMemAllocAligned(app.lgmp, app.maxFrameSize,
-            app.pageSize, &app.frameMemory[i])) != LGMP_OK)
+    if ((status = lgmpHostMemAlloc(app.lgmp, sizeof(KVMFRFrame),
+            &app.frameMemory[i])) != LGMP_OK)
     {
       DEBUG_ERROR("lgmpHostMemAlloc Failed (Frame): %s", lgmpStatusString(status));
       goto fail_lgmp;
     }
   }
 
+  /* the rest of the memory holds the frame buffers, hugepage aligned if there
+   * is enough of it so that large frames can be placed on hugepages */
+  const size_t avail = lgmpHostMemAvail(app.lgmp);
+  app.frameAlign = avail >= 8 * HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : app.pageSize;
+  app.frameArenaSize = (avail - app.frameAlign) & ~(app.frameAlign - 1);
+  app.maxFrameSize   = app.frameArenaSize - app.frameAlign;
+  DEBUG_INFO("Frame Memory     : %u MiB", (unsigned int)(app.frameArenaSize / 1048576LL));
+  DEBUG_INFO("Max Frame Size   : %u MiB", (unsigned int)(app.maxFrameSize / 1048576LL));
+
+  if ((status = lgmpHostMemAllocAligned(app.lgmp, app.frameArenaSize,
+          app.frameAlign, &app.frameArena)) != LGMP_OK)
+  {
+    DEBUG_ERROR("lgmpHostMemAlloc Failed (Frame Memory): %s", lgmpStatusString(status));
+    goto fail_lgmp;
+  }
+
+  if (!(app.frameAlloc = framealloc_new(app.frameArenaSize, app.frameQueueLen)))
+    goto fail_lgmp;
+
+  if (!(app.frameQueueEvent = lgCreateEvent(true, 0)))
+  {
+    DEBUG_ERROR("Failed to create the frame queue event");
+    goto fail_lgmp;
+  }
+
   if (!lgCreateTimer(10, lgmpTimer, NULL, &app.lgmpTimer))
   {
     DEBUG_ERROR("Failed to create the LGMP timer");
@@ -732,6 +1319,7 @@ int app_main(int argc, char * argv[])
 
   app.state = APP_STATE_RUNNING;
   ivshmemOptionsInit();
+  framebuffer_options_init();
 
   // register capture interface options
   for(int i = 0; CaptureInterfaces[i]; ++i)
@@ -778,6 +1366,7 @@ int app_main(int argc, char * argv[])
 
   DEBUG_INFO("Looking Glass Host (%s)", BUILD_VERSION);
   lgDebugCPU();
+  framebuffer_init();
 
   struct IVSHMEM shmDev = { 0 };
   if (!ivshmemInit(&shmDev))
@@ -798,9 +1387,26 @@ int app_main(int argc, char * argv[])
   DEBUG_INFO("Max Pointer Size : %u KiB", (unsigned int)MAX_POINTER_SIZE / 1024);
   DEBUG_INFO("KVMFR Version    : %u", KVMFR_VERSION);
 
+  if (!framebuffer_start_write_threads(option_get_int("app", "copyThreads")))
+    DEBUG_WARN("Failed to start the frame copy threads, continuing without");
+
   app.pageSize          = sysinfo_getPageSize();
   app.frameValid        = false;
   app.pointerShapeValid = false;
+  app.frameQueueLen     = option_get_int("app", "frameQueueLen");
+  app.queueStats        = option_get_bool("app", "queueStats");
+  app.statsTime         = nanotime();
+  FRAME_QUEUE_CONFIG.numMessages = app.frameQueueLen;
+  DEBUG_INFO("Frame Queue Len  : %u", app.frameQueueLen);
+
+  const char * compressFrames = option_get_string("app", "compressFrames");
+  for(unsigned int i = 0; i < ARRAY_LENGTH(CompressModeStr); ++i)
+    if (!strcasecmp(compressFrames, CompressModeStr[i]))
+      app.compressFrames = i;
+  app.sparseFrames = option_get_bool("app", "sparseFrames");
+  app.convertHDR   = option_get_bool("app", "convertHDR");
+  if (app.convertHDR)
+    DEBUG_INFO("HDR Conversion   : %s", hdr_init("auto"));
 
   int throttleFps = option_get_int("app", "throttleFPS");
   int throttleUs = throttleFps ? 1000000 / throttleFps : 0;
@@ -928,10 +1534,9 @@ int app_main(int argc, char * argv[])
           if (!iface->asyncCapture)
             if (app.frameValid && lgmpHostQueueNewSubs(app.frameQueue) > 0)
             {
-              LGMP_STATUS status;
-              if ((status = lgmpHostQueuePost(app.frameQueue, 0,
-                      app.frameMemory[app.frameIndex])) != LGMP_OK)
-                DEBUG_ERROR("%s", lgmpStatusString(status));
+              waitFrameQueue();
+              if (app.state == APP_STATE_RUNNING)
+                repostLastFrame();
             }
 
           continue;
@@ -984,6 +1589,7 @@ fail_lgmp:
   lgmpShutdown();
 
 fail_ivshmem:
+  framebuffer_stop_write_threads();
   ivshmemClose(&shmDev);
   ivshmemFree(&shmDev);
   DEBUG_INFO("Host application exited");
@@ -30,10 +30,13 @@
 #include <common/ivshmem.h>
 #include <common/KVMFR.h>
 #include <common/framebuffer.h>
+#include <common/rects.h>
 #include <lgmp/client.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <GL/gl.h>
 
@@ -60,12 +63,30 @@ LGState;
 
 typedef struct
 {
-  KVMFRFrame * frame;
-  size_t       dataSize;
-  int          fd;
+  KVMFRFrame   * frame;
+  uint32_t       offset;
+  size_t         dataSize;
+  int            fd;
+  gs_texture_t * texture;
 }
 DMAFrameInfo;
 
+/* the number of textures frames are rotated through when not using DMABUF,
+ * one is displayed, one is being written and one is ready or free */
+#define TEXTURE_COUNT 3
+
+typedef struct
+{
+  gs_texture_t    * texture;
+  uint8_t         * data;     // the mapped texture data, NULL if unmapped
+  uint32_t          linesize;
+
+  // damage since this texture was last written, -1 for full damage
+  int               damageCount;
+  FrameDamageRect   damage[KVMFR_MAX_DAMAGE_RECTS];
+}
+LGTexture;
+
 typedef struct
 {
   obs_source_t    * context;
@@ -74,21 +95,41 @@ typedef struct
   uint32_t          formatVer;
   uint32_t          width, height;
   FrameType         type;
+  FrameTransfer     transfer;
   int               bpp;
+  bool              compressed;
+
+  /* when the host may send sparse frames they are applied to a local copy
+   * of the frame which the textures are then updated from */
+  bool              sparse;
+  FrameBuffer     * shadow;
+  size_t            shadowSize;
+  bool              shadowValid;
   struct IVSHMEM    shmDev;
   PLGMPClient       lgmp;
   PLGMPClientQueue  frameQueue, pointerQueue;
+
+  /* the frame thread writes into texWrite and hands it to the video tick
+   * through texReady, the tick returns the previously displayed texture
+   * through texFree. texLock is held while swapping or recreating them */
+  pthread_mutex_t   texLock;
+  bool              texValid;
+  LGTexture         textures[TEXTURE_COUNT];
   gs_texture_t    * texture;
-  uint8_t         * texData;
-  uint32_t          linesize;
+  int               texCurrent;
+  int               texWrite;
+  atomic_int        texReady;
+  atomic_int        texFree;
+  LGRegion          damageRegion; // scratch for merging the texture damage
 
 #if LIBOBS_API_MAJOR_VER >= 27
-  bool              dmabuf;
-  DMAFrameInfo      dmaInfo[LGMP_Q_FRAME_LEN];
+  bool                 dmabuf;
+  DMAFrameInfo         dmaInfo[LGMP_Q_FRAME_LEN_MAX];
+  enum gs_color_format dmaFormat;
+  uint32_t             dmaDRMFormat;
 #endif
 
   pthread_t         frameThread, pointerThread;
-  os_sem_t        * frameSem;
 
   bool                 cursorMono;
   gs_texture_t       * cursorTex;
@@ -105,6 +146,7 @@ typedef struct
 LGPlugin;
 
 static void lgUpdate(void * data, obs_data_t * settings);
+static void destroyTextures(LGPlugin * this);
 
 static const char * lgGetName(void * unused)
 {
@@ -115,9 +157,12 @@ static void * lgCreate(obs_data_t * settings, obs_source_t * context)
 {
   LGPlugin * this = bzalloc(sizeof(LGPlugin));
   this->context = context;
-  os_sem_init (&this->frameSem , 0);
+  pthread_mutex_init(&this->texLock, NULL);
   os_sem_init (&this->cursorSem, 1);
   atomic_store(&this->cursorVer, 0);
+  atomic_store(&this->texReady , -1);
+  atomic_store(&this->texFree  , -1);
+  this->damageRegion = region_new();
   lgUpdate(this, settings);
   return this;
 }
@@ -164,14 +209,9 @@ static void deinit(LGPlugin * this)
     this->shmFile = NULL;
   }
 
-  if (this->texture)
-  {
-    obs_enter_graphics();
-    gs_texture_destroy(this->texture);
-    gs_texture_unmap(this->texture);
-    obs_leave_graphics();
-    this->texture = NULL;
-  }
+  obs_enter_graphics();
+  destroyTextures(this);
+  obs_leave_graphics();
 
   if (this->cursorTex)
   {
@@ -189,8 +229,9 @@ static void lgDestroy(void * data)
 {
   LGPlugin * this = (LGPlugin *)data;
   deinit(this);
-  os_sem_destroy(this->frameSem );
+  pthread_mutex_destroy(&this->texLock);
   os_sem_destroy(this->cursorSem);
+  region_free(&this->damageRegion);
   bfree(this);
 }
 
@@ -215,6 +256,326 @@ static obs_properties_t * lgGetProperties(void * data)
   return props;
 }
 
+static void destroyTextures(LGPlugin * this)
+{
+  for(int i = 0; i < TEXTURE_COUNT; ++i)
+  {
+    LGTexture * tex = this->textures + i;
+    if (!tex->texture)
+      continue;
+
+    if (tex->data)
+      gs_texture_unmap(tex->texture);
+    gs_texture_destroy(tex->texture);
+    tex->texture = NULL;
+    tex->data    = NULL;
+  }
+
+#if LIBOBS_API_MAJOR_VER >= 27
+  for(int i = 0; i < ARRAY_LENGTH(this->dmaInfo); ++i)
+    if (this->dmaInfo[i].texture)
+    {
+      gs_texture_destroy(this->dmaInfo[i].texture);
+      this->dmaInfo[i].texture = NULL;
+    }
+#endif
+
+  this->texture  = NULL;
+  this->texValid = false;
+  atomic_store(&this->texReady, -1);
+  atomic_store(&this->texFree , -1);
+}
+
+static bool getFormat(FrameType type, enum gs_color_format * format,
+    uint32_t * drm_format, int * bpp)
+{
+  *bpp = 4;
+  switch(type)
+  {
+    case FRAME_TYPE_BGRA:
+      *format     = GS_BGRA;
+      *drm_format = DRM_FORMAT_ARGB8888;
+      return true;
+
+    case FRAME_TYPE_RGBA:
+      *format     = GS_RGBA;
+      *drm_format = DRM_FORMAT_ARGB8888;
+      return true;
+
+    case FRAME_TYPE_RGBA10:
+      *format     = GS_R10G10B10A2;
+      *drm_format = DRM_FORMAT_BGRA1010102;
+      return true;
+
+    case FRAME_TYPE_RGBA16F:
+      *bpp        = 8;
+      *format     = GS_RGBA16F;
+      *drm_format = DRM_FORMAT_ABGR16161616F;
+      return true;
+
+    default:
+      printf("invalid type %d\n", type);
+      return false;
+  }
+}
+
+/* called from the frame thread when the frame format changes */
+static bool createTextures(LGPlugin * this, KVMFRFrame * frame)
+{
+  enum gs_color_format format;
+  uint32_t drm_format;
+  int bpp;
+
+  const bool compressed = frame->type == FRAME_TYPE_LZ4 && !this->sparse;
+  const FrameType type  =
+    frame->type == FRAME_TYPE_LZ4 || frame->type == FRAME_TYPE_SPARSE ?
+    frame->dataType : frame->type;
+
+  if (!getFormat(type, &format, &drm_format, &bpp))
+    return false;
+
+  pthread_mutex_lock(&this->texLock);
+  obs_enter_graphics();
+  destroyTextures(this);
+
+  this->formatVer = frame->formatVer;
+  this->width     = frame->width;
+  this->height    = frame->height;
+  this->type       = type;
+  this->transfer   = frame->transfer;
+  this->bpp        = bpp;
+  this->compressed = compressed;
+
+  if (frame->transfer == FRAME_TRANSFER_PQ)
+    puts("PQ frames are shown without decoding, disable app:convertHDR on the "
+        "host to capture HDR");
+
+  bool ok = true;
+#if LIBOBS_API_MAJOR_VER >= 27
+  /* dmabuf textures are created per frame buffer as they are seen */
+  this->dmaFormat    = format;
+  this->dmaDRMFormat = drm_format;
+
+  /* compressed and sparse frames can not be imported */
+  if ((compressed || this->sparse) && this->dmabuf)
+  {
+    puts("Compressed or sparse frames can not be imported, disabling dmabuf");
+    this->dmabuf = false;
+  }
+
+  if (this->dmabuf)
+    goto done;
+#else
+  (void) drm_format;
+#endif
+
+  for(int i = 0; i < TEXTURE_COUNT; ++i)
+  {
+    LGTexture * tex = this->textures + i;
+    tex->texture = gs_texture_create(
+        this->width, this->height, format, 1, NULL, GS_DYNAMIC);
+    if (!tex->texture)
+    {
+      printf("create texture failed\n");
+      destroyTextures(this);
+      ok = false;
+      goto done;
+    }
+
+    /* the last texture starts out as the displayed texture and is left
+     * unmapped, the rest are mapped ready for the frame thread */
+    tex->damageCount = -1;
+    if (i < TEXTURE_COUNT - 1)
+      gs_texture_map(tex->texture, &tex->data, &tex->linesize);
+  }
+
+  this->texCurrent = TEXTURE_COUNT - 1;
+  this->texWrite   = 0;
+  atomic_store(&this->texFree, 1);
+
+done:
+  this->texValid = ok;
+  obs_leave_graphics();
+  pthread_mutex_unlock(&this->texLock);
+  return ok;
+}
+
+#if LIBOBS_API_MAJOR_VER >= 27
+static int dmabufGetFd(LGPlugin * this, LGMPMessage * msg, KVMFRFrame * frame,
+    size_t dataSize);
+
+static bool ingestDMAFrame(LGPlugin * this, LGMPMessage * msg,
+    KVMFRFrame * frame)
+{
+  const int fd = dmabufGetFd(this, msg, frame, frame->height * frame->pitch);
+  if (fd < 0)
+    return false;
+
+  int index = 0;
+  while(this->dmaInfo[index].frame != frame)
+    ++index;
+
+  DMAFrameInfo * dma = this->dmaInfo + index;
+  if (!dma->texture)
+  {
+    pthread_mutex_lock(&this->texLock);
+    obs_enter_graphics();
+    dma->texture = gs_texture_create_from_dmabuf(frame->width, frame->height,
+      this->dmaDRMFormat, this->dmaFormat, 1, &fd,
+      &(uint32_t) { frame->pitch }, &(uint32_t) { 0 }, &(uint64_t) { 0 });
+    obs_leave_graphics();
+    pthread_mutex_unlock(&this->texLock);
+
+    if (!dma->texture)
+    {
+      puts("Failed to create dmabuf texture");
+      return false;
+    }
+  }
+
+  atomic_store(&this->texReady, index);
+  return true;
+}
+#endif
+
+/* apply the frame to the local copy that sparse frames are built on */
+static bool updateShadow(LGPlugin * this, KVMFRFrame * frame,
+    const FrameBuffer * fb)
+{
+  const size_t size = (size_t)frame->height * frame->pitch;
+  if (size > this->shadowSize)
+  {
+    free(this->shadow);
+    this->shadowValid = false;
+    if (!(this->shadow = malloc(FrameBufferStructSize + size)))
+    {
+      this->shadowSize = 0;
+      puts("Failed to allocate the frame buffer");
+      return false;
+    }
+    this->shadowSize = size;
+    framebuffer_prepare(this->shadow);
+  }
+
+  uint8_t * dst = framebuffer_get_data(this->shadow);
+  bool ok;
+  switch(frame->type)
+  {
+    /* there is nothing to apply a sparse frame to until a full one arrives */
+    case FRAME_TYPE_SPARSE:
+      ok = this->shadowValid && framebuffer_read_sparse(fb, dst, frame->pitch,
+          frame->width, frame->height, this->bpp);
+      break;
+
+    case FRAME_TYPE_LZ4:
+      ok = framebuffer_read_lz4(fb, dst, frame->pitch, frame->height,
+          frame->pitch, NULL);
+      break;
+
+    default:
+      ok = framebuffer_read(fb, dst, frame->pitch, frame->height,
+          frame->width, this->bpp, frame->pitch);
+      break;
+  }
+
+  /* a failed or partial read leaves the local copy corrupt, sparse frames are
+   * dropped until a full frame replaces it */
+  if (!ok)
+  {
+    this->shadowValid = false;
+    return false;
+  }
+
+  this->shadowValid = true;
+  framebuffer_set_write_ptr(this->shadow, size);
+  return true;
+}
+
+static bool ingestFrame(LGPlugin * this, KVMFRFrame * frame)
+{
+  LGTexture   * tex = this->textures + this->texWrite;
+  FrameBuffer * fb  = this->sparse ? this->shadow :
+    (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
+
+  /* damage rects are only usable if the frame carries them and there is room
+   * to accumulate them with those this texture has missed */
+  const bool useRects =
+    this->bpp == 4 &&
+    frame->damageRectsCount > 0 &&
+    tex->damageCount >= 0 &&
+    tex->damageCount + frame->damageRectsCount <= KVMFR_MAX_DAMAGE_RECTS;
+
+  bool ok;
+  if (this->compressed)
+    ok = framebuffer_read_lz4(fb, tex->data, tex->linesize, frame->height,
+        frame->pitch, NULL);
+  else if (useRects)
+  {
+    memcpy(tex->damage + tex->damageCount, frame->damageRects,
+        frame->damageRectsCount * sizeof(FrameDamageRect));
+    tex->damageCount += frame->damageRectsCount;
+    tex->damageCount  = rectsMergeOverlapping(tex->damage, tex->damageCount,
+        this->damageRegion);
+
+    rectsFramebufferToBuffer(tex->damage, tex->damageCount, tex->data,
+        tex->linesize, frame->height, fb, frame->pitch);
+    ok = true;
+  }
+  else
+    ok = framebuffer_read(
+        fb,
+        tex->data,        // dst
+        tex->linesize,    // dstpitch
+        frame->height,    // height
+        frame->width,     // width
+        this->bpp,        // bpp
+        frame->pitch      // linepitch
+    );
+
+  /* track what each of the other textures is now missing */
+  for(int i = 0; i < TEXTURE_COUNT; ++i)
+  {
+    LGTexture * other = this->textures + i;
+    if (other == tex)
+      continue;
+
+    if (frame->damageRectsCount == 0 || other->damageCount < 0 ||
+        other->damageCount + frame->damageRectsCount > KVMFR_MAX_DAMAGE_RECTS)
+      other->damageCount = -1;
+    else
+    {
+      memcpy(other->damage + other->damageCount, frame->damageRects,
+          frame->damageRectsCount * sizeof(FrameDamageRect));
+      other->damageCount += frame->damageRectsCount;
+    }
+  }
+
+  tex->damageCount = ok ? 0 : -1;
+  return ok;
+}
+
+/* hand the written texture to the video tick and take another to write to */
+static void publishTexture(LGPlugin * this)
+{
+  const int ready = atomic_exchange(&this->texReady, this->texWrite);
+  if (ready >= 0)
+  {
+    /* the previous frame was never displayed, write over it */
+    this->texWrite = ready;
+    return;
+  }
+
+  int texFree;
+  while((texFree = atomic_exchange(&this->texFree, -1)) < 0)
+  {
+    if (this->state != STATE_RUNNING)
+      break;
+    usleep(100);
+  }
+
+  this->texWrite = texFree;
+}
+
 static void * frameThread(void * data)
 {
   LGPlugin * this = (LGPlugin *)data;
@@ -226,27 +587,91 @@ static void * frameThread(void * data)
   }
 
   this->state = STATE_RUNNING;
-  os_sem_post(this->frameSem);
 
   while(this->state == STATE_RUNNING)
   {
     LGMP_STATUS status;
+    LGMPMessage msg;
 
-    os_sem_wait(this->frameSem);
-    if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
+    /* sparse frames only carry what changed since the frame before them so
+     * none of them can be skipped */
+    if (!this->sparse &&
+        (status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
     {
       if (status != LGMP_ERR_QUEUE_EMPTY)
       {
-        os_sem_post(this->frameSem);
         printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
         break;
       }
     }
-    os_sem_post(this->frameSem);
-    usleep(1000);
+
+    if ((status = lgmpClientProcess(this->frameQueue, &msg)) != LGMP_OK)
+    {
+      if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        usleep(1000);
+        continue;
+      }
+
+      printf("lgmpClientProcess: %s\n", lgmpStatusString(status));
+      break;
+    }
+
+    KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
+    if (!this->texValid || this->formatVer != frame->formatVer ||
+        this->compressed != (frame->type == FRAME_TYPE_LZ4 && !this->sparse) ||
+        this->transfer != frame->transfer)
+    {
+      if (!createTextures(this, frame))
+      {
+        lgmpClientMessageDone(this->frameQueue);
+        break;
+      }
+    }
+
+#if LIBOBS_API_MAJOR_VER >= 27
+    if (this->dmabuf)
+    {
+      if (!ingestDMAFrame(this, &msg, frame))
+      {
+        /* fall back to copying the frames */
+        pthread_mutex_lock(&this->texLock);
+        this->dmabuf   = false;
+        this->texValid = false;
+        atomic_store(&this->texReady, -1);
+        pthread_mutex_unlock(&this->texLock);
+      }
+      lgmpClientMessageDone(this->frameQueue);
+      continue;
+    }
+#endif
+
+    /* every frame must be applied to the local copy, even if there is no
+     * texture free to show it in */
+    if (this->sparse && !updateShadow(this, frame,
+          (FrameBuffer *)(((uint8_t*)frame) + frame->offset)))
+    {
+      lgmpClientMessageDone(this->frameQueue);
+      continue;
+    }
+
+    if (this->texWrite < 0)
+    {
+      lgmpClientMessageDone(this->frameQueue);
+      continue;
+    }
+
+    const bool ok = ingestFrame(this, frame);
+    lgmpClientMessageDone(this->frameQueue);
+
+    if (ok)
+      publishTexture(this);
   }
 
   lgmpClientUnsubscribe(&this->frameQueue);
+  free(this->shadow);
+  this->shadow     = NULL;
+  this->shadowSize = 0;
   this->state = STATE_STOPPING;
   return NULL;
 }
@@ -405,7 +830,8 @@ static void lgUpdate(void * data, obs_data_t * settings)
 
   if (udataSize < sizeof(KVMFR) ||
       memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
-      udata->version != KVMFR_VERSION)
+      udata->version != KVMFR_VERSION ||
+      udata->frameQueueLen > LGMP_Q_FRAME_LEN_MAX)
   {
     printf("The host application is not compatible with this client\n");
     printf("Expected KVMFR version %d\n", KVMFR_VERSION);
@@ -413,6 +839,9 @@ static void lgUpdate(void * data, obs_data_t * settings)
     return;
   }
 
+  this->sparse      = udata->features & KVMFR_FEATURE_SPARSE;
+  this->shadowValid = false;
+
   this->state = STATE_STARTING;
   pthread_create(&this->frameThread, NULL, frameThread, this);
   pthread_setname_np(this->frameThread, "LGFrameThread");
@@ -430,11 +859,24 @@ static int dmabufGetFd(LGPlugin * this, LGMPMessage * msg, KVMFRFrame * frame, s
     if (this->dmaInfo[i].frame == frame)
     {
       dma = this->dmaInfo + i;
-      /* if it's too small close it */
-      if (dma->dataSize < dataSize)
+      /* if it's too small or the host moved it close it, the texture imported
+       * from it has to go too as it still shows the old placement */
+      if (dma->dataSize < dataSize || dma->offset != frame->offset)
       {
         close(dma->fd);
         dma->fd = -1;
+
+        if (dma->texture)
+        {
+          pthread_mutex_lock(&this->texLock);
+          obs_enter_graphics();
+          if (this->texture == dma->texture)
+            this->texture = NULL;
+          gs_texture_destroy(dma->texture);
+          dma->texture = NULL;
+          obs_leave_graphics();
+          pthread_mutex_unlock(&this->texLock);
+        }
       }
       break;
     }
@@ -458,6 +900,7 @@ static int dmabufGetFd(LGPlugin * this, LGMPMessage * msg, KVMFRFrame * frame, s
     const uintptr_t pos    = (uintptr_t) msg->mem - (uintptr_t) this->shmDev.mem;
     const uintptr_t offset = (uintptr_t) frame->offset + FrameBufferStructSize;
 
+    dma->offset   = frame->offset;
     dma->dataSize = dataSize;
     dma->fd       = ivshmemGetDMABuf(&this->shmDev, pos + offset, dataSize);
     if (dma->fd < 0)
@@ -471,23 +914,48 @@ static int dmabufGetFd(LGPlugin * this, LGMPMessage * msg, KVMFRFrame * frame, s
 }
 #endif
 
-static void lgVideoTick(void * data, float seconds)
+/* display the most recent texture written by the frame thread */
+static void swapTextures(LGPlugin * this)
 {
-  LGPlugin * this = (LGPlugin *)data;
-
-  if (this->state != STATE_RUNNING)
+  if (atomic_load(&this->texReady) < 0)
     return;
 
-  LGMP_STATUS status;
-  LGMPMessage msg;
-  bool framebuffer = true;
+  pthread_mutex_lock(&this->texLock);
+  const int ready = atomic_exchange(&this->texReady, -1);
+  if (ready < 0)
+    goto done;
 
-  os_sem_wait(this->frameSem);
-  if (this->state != STATE_RUNNING)
+#if LIBOBS_API_MAJOR_VER >= 27
+  if (this->dmabuf)
   {
-    os_sem_post(this->frameSem);
-    return;
+    this->texture = this->dmaInfo[ready].texture;
+    goto done;
   }
+#endif
+
+  LGTexture * next = this->textures + ready;
+  LGTexture * prev = this->textures + this->texCurrent;
+
+  obs_enter_graphics();
+  gs_texture_unmap(next->texture);
+  next->data = NULL;
+  gs_texture_map(prev->texture, &prev->data, &prev->linesize);
+  obs_leave_graphics();
+
+  atomic_store(&this->texFree, this->texCurrent);
+  this->texCurrent = ready;
+  this->texture    = next->texture;
+
+done:
+  pthread_mutex_unlock(&this->texLock);
+}
+
+static void lgVideoTick(void * data, float seconds)
+{
+  LGPlugin * this = (LGPlugin *)data;
+
+  if (this->state != STATE_RUNNING)
+    return;
 
   this->cursorRect.x = this->cursor.x;
   this->cursorRect.y = this->cursor.y;
@@ -547,151 +1015,7 @@ static void lgVideoTick(void * data, float seconds)
     os_sem_post(this->cursorSem);
   }
 
-  if ((status = lgmpClientAdvanceToLast(this->frameQueue)) != LGMP_OK)
-  {
-    if (status != LGMP_ERR_QUEUE_EMPTY)
-    {
-      os_sem_post(this->frameSem);
-      printf("lgmpClientAdvanceToLast: %s\n", lgmpStatusString(status));
-      return;
-    }
-  }
-
-  if ((status = lgmpClientProcess(this->frameQueue, &msg)) != LGMP_OK)
-  {
-    if (status == LGMP_ERR_QUEUE_EMPTY)
-    {
-      os_sem_post(this->frameSem);
-      return;
-    }
-
-    printf("lgmpClientProcess: %s\n", lgmpStatusString(status));
-    this->state = STATE_STOPPING;
-    os_sem_post(this->frameSem);
-    return;
-  }
-
-  KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
-  if (!this->texture || this->formatVer != frame->formatVer)
-  {
-    this->formatVer = frame->formatVer;
-    this->width     = frame->width;
-    this->height    = frame->height;
-    this->type      = frame->type;
-
-    obs_enter_graphics();
-    if (this->texture)
-    {
-      gs_texture_unmap(this->texture);
-      gs_texture_destroy(this->texture);
-      this->texture = NULL;
-    }
-
-    enum gs_color_format format;
-    uint32_t drm_format;
-
-    this->bpp = 4;
-    switch(this->type)
-    {
-      case FRAME_TYPE_BGRA:
-        format     = GS_BGRA;
-        drm_format = DRM_FORMAT_ARGB8888;
-        break;
-
-      case FRAME_TYPE_RGBA:
-        format     = GS_RGBA;
-        drm_format = DRM_FORMAT_ARGB8888;
-        break;
-
-      case FRAME_TYPE_RGBA10:
-        format     = GS_R10G10B10A2;
-        drm_format = DRM_FORMAT_BGRA1010102;
-        break;
-
-      case FRAME_TYPE_RGBA16F:
-        this->bpp  = 8;
-        format     = GS_RGBA16F;
-        drm_format = DRM_FORMAT_ABGR16161616F;
-        break;
-
-      default:
-        printf("invalid type %d\n", this->type);
-        os_sem_post(this->frameSem);
-        obs_leave_graphics();
-        return;
-    }
-
-    this->texture = NULL;
-
-#if LIBOBS_API_MAJOR_VER >= 27
-    if (this->dmabuf)
-    {
-      int fd = dmabufGetFd(this, &msg, frame, frame->height * frame->pitch);
-
-      if (fd < 0)
-        goto dmabuf_fail;
-
-      this->texture = gs_texture_create_from_dmabuf(frame->width, frame->height,
-        drm_format, format, 1, &fd, &(uint32_t) { frame->pitch },
-        &(uint32_t) { 0 }, &(uint64_t) { 0 });
-
-      if (!this->texture)
-      {
-        puts("Failed to create dmabuf texture");
-        this->dmabuf = false;
-        goto dmabuf_fail;
-      }
-
-      framebuffer = false;
-    }
-
-  dmabuf_fail:
-#else
-    (void) drm_format;
-#endif
-
-    if (!this->texture)
-      this->texture = gs_texture_create(
-          this->width, this->height, format, 1, NULL, GS_DYNAMIC);
-
-    if (!this->texture)
-    {
-      printf("create texture failed\n");
-      os_sem_post(this->frameSem);
-      obs_leave_graphics();
-      return;
-    }
-
-    gs_texture_map(this->texture, &this->texData, &this->linesize);
-    obs_leave_graphics();
-  }
-
-  if (framebuffer && this->texture)
-  {
-    FrameBuffer * fb = (FrameBuffer *)(((uint8_t*)frame) + frame->offset);
-    framebuffer_read(
-        fb,
-        this->texData,    // dst
-        this->linesize,   // dstpitch
-        frame->height,    // height
-        frame->width,     // width
-        this->bpp,        // bpp
-        frame->pitch      // linepitch
-    );
-
-    lgmpClientMessageDone(this->frameQueue);
-    os_sem_post(this->frameSem);
-
-    obs_enter_graphics();
-    gs_texture_unmap(this->texture);
-    gs_texture_map(this->texture, &this->texData, &this->linesize);
-    obs_leave_graphics();
-  }
-  else
-  {
-    lgmpClientMessageDone(this->frameQueue);
-    os_sem_post(this->frameSem);
-  }
+  swapTextures(this);
 }
 
 static void lgVideoRender(void * data, gs_effect_t * effect)
@@ -25,27 +25,46 @@
 #include "common/locking.h"
 #include "common/stringutils.h"
 #include "common/ivshmem.h"
+#include "common/framebuffer.h"
+#include "common/rects.h"
+#include "common/time.h"
 #include "common/util.h"
 
+#include "stats.h"
+
 #include <stdlib.h>
 #include <unistd.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <pwd.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 
 #include <lgmp/client.h>
 
 struct state
 {
-  bool           running;
-  struct IVSHMEM shmDev;
+  volatile sig_atomic_t running;
+  struct IVSHMEM        shmDev;
 };
 
 struct state state;
 
+static bool optFormatValidate(struct Option * opt, const char ** error)
+{
+  const char * fmt = opt->value.x_string;
+  if (!strcasecmp(fmt, "text") ||
+      !strcasecmp(fmt, "csv" ) ||
+      !strcasecmp(fmt, "json"))
+    return true;
+
+  *error = "Must be one of text, csv or json";
+  return false;
+}
+
 static struct Option options[] =
 {
   {
@@ -56,6 +75,56 @@ static struct Option options[] =
     .type           = OPTION_TYPE_STRING,
     .value.x_string = NULL
   },
+  {
+    .module         = "app",
+    .name           = "duration",
+    .description    = "How long to run for in seconds (0 to run until interrupted)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 0
+  },
+  {
+    .module         = "app",
+    .name           = "interval",
+    .description    = "How often to report the statistics in seconds",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 1
+  },
+  {
+    .module         = "app",
+    .name           = "pollInterval",
+    .description    = "How long to sleep in microseconds when no frame is ready (0 to spin)",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 100
+  },
+  {
+    .module         = "app",
+    .name           = "format",
+    .description    = "The output format (text, csv or json)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "text",
+    .validator      = optFormatValidate
+  },
+  {
+    .module         = "app",
+    .name           = "output",
+    .description    = "The file to write the results to (default stdout)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "sharedClock",
+    .description    = "The host shares this machine's monotonic clock, report absolute latency",
+    .type           = OPTION_TYPE_BOOL,
+    .value.x_bool   = false
+  },
+  {
+    .module         = "app",
+    .name           = "damageTrace",
+    .description    = "A file to record the damage rects of each frame to for profiler-region",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
   {0}
 };
 
@@ -103,6 +172,27 @@ static bool config_load(int argc, char * argv[])
   return true;
 }
 
+enum Metric
+{
+  METRIC_INTERVAL,
+  METRIC_LATENCY,
+  METRIC_READ,
+  METRIC_READ_RATE,
+  METRIC_DAMAGE,
+
+  METRIC_MAX
+};
+
+static void printStats(Stats * stats, FILE * fp, StatsFormat format,
+    double time, bool total)
+{
+  for(int i = 0; i < METRIC_MAX; ++i)
+  {
+    stats_print(fp, format, time, total, stats[i]);
+    stats_endWindow(stats[i]);
+  }
+}
+
 static int run(void)
 {
   PLGMPClient      lgmp;
@@ -119,7 +209,7 @@ static int run(void)
     return -1;
   }
 
-  if (udataSize != sizeof(KVMFR) ||
+  if (udataSize < sizeof(KVMFR) ||
       memcmp(udata->magic, KVMFR_MAGIC, sizeof(udata->magic)) != 0 ||
       udata->version != KVMFR_VERSION)
   {
@@ -136,76 +226,224 @@ static int run(void)
     return -1;
   }
 
-  struct perf
+  const char * fmt  = option_get_string("app", "format");
+  StatsFormat format =
+    !strcasecmp(fmt, "csv" ) ? STATS_FORMAT_CSV  :
+    !strcasecmp(fmt, "json") ? STATS_FORMAT_JSON :
+    STATS_FORMAT_TEXT;
+
+  FILE * fp = stdout;
+  const char * output = option_get_string("app", "output");
+  if (output && !(fp = fopen(output, "w")))
+  {
+    DEBUG_ERROR("Failed to open %s for writing", output);
+    return -1;
+  }
+
+  FILE * trace = NULL;
+  const char * tracePath = option_get_string("app", "damageTrace");
+  if (tracePath && !(trace = fopen(tracePath, "w")))
+  {
+    DEBUG_ERROR("Failed to open %s for writing", tracePath);
+    if (fp != stdout)
+      fclose(fp);
+    return -1;
+  }
+
+  const uint64_t duration     = option_get_int ("app", "duration"    ) * 1000000000ULL;
+  const uint64_t interval     = option_get_int ("app", "interval"    ) * 1000000000ULL;
+  const int      pollInterval = option_get_int ("app", "pollInterval");
+  const bool     sharedClock  = option_get_bool("app", "sharedClock" );
+
+  int       ret        = -1;
+  uint8_t * buffer     = NULL;
+  size_t    bufferSize = 0;
+
+  Stats stats[METRIC_MAX] =
   {
-    uint64_t min, max, ttl;
-    unsigned int count;
+    [METRIC_INTERVAL ] = stats_new("interval" , "ms"  ),
+    [METRIC_LATENCY  ] = stats_new("latency"  , "ms"  ),
+    [METRIC_READ     ] = stats_new("read"     , "ms"  ),
+    [METRIC_READ_RATE] = stats_new("readRate" , "GB/s"),
+    [METRIC_DAMAGE   ] = stats_new("damage"   , "ms"  )
   };
 
-  unsigned int frameCount    = 0;
+  for(int i = 0; i < METRIC_MAX; ++i)
+    if (!stats[i])
+      goto out;
+
+  stats_printHeader(fp, format);
+
+  uint32_t     frameSerial   = 0;
+  bool         haveFrame     = false;
   uint64_t     lastFrameTime = 0;
-  struct perf  p1  = {};
-  struct perf  p5  = {};
-  struct perf  p10 = {};
-  struct perf  p30 = {};
+
+  /* without a shared clock the host and client timestamps can only be
+   * compared relative to the smallest difference seen, which gives the
+   * latency over the best case rather than the absolute latency */
+  int64_t      clockOffset   = INT64_MAX;
+
+  const uint64_t startTime  = nanotime();
+  uint64_t       reportTime = startTime;
 
   // start accepting frames
   while(state.running)
   {
+    const uint64_t now = nanotime();
+    if (duration && now - startTime >= duration)
+      break;
+
+    if (now - reportTime >= interval)
+    {
+      printStats(stats, fp, format, (now - startTime) * 1e-9, false);
+      reportTime = now;
+    }
+
     LGMPMessage msg;
     if ((status = lgmpClientProcess(frameQueue, &msg)) != LGMP_OK)
     {
       if (status == LGMP_ERR_QUEUE_EMPTY)
+      {
+        if (pollInterval)
+          nsleep(pollInterval * 1000ULL);
         continue;
+      }
 
       DEBUG_ERROR("lgmpClientProcess: %s", lgmpStatusString(status));
-      return -1;
+      goto out;
     }
 
-    lgmpClientMessageDone(frameQueue);
+    const uint64_t frameTime = nanotime();
+    KVMFRFrame * frame = (KVMFRFrame *)msg.mem;
 
-    uint64_t frameTime = nanotime();
-    uint64_t diff = frameTime - lastFrameTime;
+    // ignore repeated frames sent to new subscribers
+    if (haveFrame && frame->frameSerial == frameSerial)
+    {
+      lgmpClientMessageDone(frameQueue);
+      continue;
+    }
+    frameSerial = frame->frameSerial;
 
-    if (frameCount++ == 0)
+    if (haveFrame)
+      stats_add(stats[METRIC_INTERVAL], (frameTime - lastFrameTime) * 1e-6);
+    lastFrameTime = frameTime;
+    haveFrame     = true;
+
+    if (frame->postTime)
     {
-      lastFrameTime = frameTime;
-      p1.min = p5.min = p10.min = p30.min = diff;
+      int64_t delta = (int64_t)(frameTime - frame->postTime);
+      if (!sharedClock)
+      {
+        if (delta < clockOffset)
+          clockOffset = delta;
+        delta -= clockOffset;
+      }
+      stats_add(stats[METRIC_LATENCY], delta * 1e-6);
+    }
+
+    const FrameType type =
+      frame->type == FRAME_TYPE_LZ4 || frame->type == FRAME_TYPE_SPARSE ?
+      frame->dataType : frame->type;
+    const size_t bpp  = type == FRAME_TYPE_RGBA16F ? 8 : 4;
+    const size_t size = (size_t)frame->height * frame->pitch;
+    if (size > bufferSize)
+    {
+      free(buffer);
+      buffer = malloc(size);
+      if (!buffer)
+      {
+        DEBUG_ERROR("out of memory");
+        lgmpClientMessageDone(frameQueue);
+        goto out;
+      }
+      bufferSize = size;
+    }
+
+    const FrameBuffer * fb =
+      (const FrameBuffer *)(((uint8_t *)frame) + frame->offset);
+
+    uint64_t t = nanotime();
+    bool ok;
+    switch(frame->type)
+    {
+      case FRAME_TYPE_LZ4:
+        ok = framebuffer_read_lz4(fb, buffer, frame->pitch, frame->height,
+            frame->pitch, NULL);
+        break;
+
+      case FRAME_TYPE_SPARSE:
+        ok = framebuffer_read_sparse(fb, buffer, frame->pitch, frame->width,
+            frame->height, bpp);
+        break;
+
+      default:
+        ok = framebuffer_read(fb, buffer, frame->pitch, frame->height,
+            frame->width, bpp, frame->pitch);
+        break;
+    }
+
+    if (!ok)
+    {
+      DEBUG_WARN("Timed out reading frame %u", frame->frameSerial);
+      lgmpClientMessageDone(frameQueue);
       continue;
     }
+    const uint64_t readTime = nanotime() - t;
 
-    ++p1 .count;
-    ++p5 .count;
-    ++p10.count;
-    ++p30.count;
-
-#define UPDATE(p, interval) \
-    if (p.ttl + diff >= (1e9 * interval)) \
-    { \
-      fprintf(stdout, "%02d, min:%9lu ns (%5.2f ms) max:%9lu ns (%5.2f ms) avg:%9lu ns (%5.2f ms)\n", \
-          interval, \
-          p.min          , ((float)p.min / 1e6f), \
-          p.max          , ((float)p.max / 1e6f), \
-          p.ttl / p.count, (((float)p.ttl / p.count) / 1e6f)\
-      ); \
-      p.min = p.max = p.ttl = diff; p.count = 1; \
-    } \
-    else \
-    { \
-      p.min = min(p.min, diff); \
-      p.max = max(p.max, diff); \
-      p.ttl += diff; \
+    /* compressed frames only read the stream the host wrote which is usually
+     * far smaller than the decoded frame */
+    const size_t readSize = frame->type == FRAME_TYPE_LZ4 ||
+      frame->type == FRAME_TYPE_SPARSE ? framebuffer_get_write_ptr(fb) : size;
+
+    stats_add(stats[METRIC_READ     ], readTime * 1e-6);
+    stats_add(stats[METRIC_READ_RATE], (double)readSize / readTime);
+
+    // one line per frame: width height count followed by x y w h per rect
+    if (trace)
+    {
+      fprintf(trace, "%u %u %u", frame->width, frame->height,
+          frame->damageRectsCount);
+      for(int i = 0; i < frame->damageRectsCount; ++i)
+        fprintf(trace, " %u %u %u %u",
+            frame->damageRects[i].x    , frame->damageRects[i].y,
+            frame->damageRects[i].width, frame->damageRects[i].height);
+      fputc('\n', trace);
     }
 
-    UPDATE(p1 , 1 );
-    UPDATE(p5 , 5 );
-    UPDATE(p10, 10);
-    UPDATE(p30, 30);
+    /* the frame is now complete so this only measures the copy itself, which
+     * is only done from raw frames as the others are not laid out as one */
+    if (frame->damageRectsCount && frame->type != FRAME_TYPE_LZ4 &&
+        frame->type != FRAME_TYPE_SPARSE)
+    {
+      t = nanotime();
+      rectsFramebufferToBuffer(frame->damageRects, frame->damageRectsCount,
+          buffer, frame->pitch, frame->height, fb, frame->pitch);
+      stats_add(stats[METRIC_DAMAGE], (nanotime() - t) * 1e-6);
+    }
 
-    lastFrameTime = frameTime;
+    lgmpClientMessageDone(frameQueue);
   }
 
-  return 0;
+  printStats(stats, fp, format, (nanotime() - startTime) * 1e-9, true);
+  ret = 0;
+
+out:
+  free(buffer);
+  for(int i = 0; i < METRIC_MAX; ++i)
+    stats_free(&stats[i]);
+
+  if (fp != stdout)
+    fclose(fp);
+
+  if (trace)
+    fclose(trace);
+
+  return ret;
+}
+
+static void signalHandler(int signal)
+{
+  state.running = false;
 }
 
 int main(int argc, char * argv[])
@@ -217,6 +455,7 @@ int main(int argc, char * argv[])
 
   option_register(options);
   ivshmemOptionsInit();
+  framebuffer_options_init();
 
   if (!config_load(argc, argv))
   {
@@ -224,8 +463,12 @@ int main(int argc, char * argv[])
     return -1;
   }
 
+  framebuffer_init();
+
   // init the global state vars
   state.running = true;
+  signal(SIGINT , signalHandler);
+  signal(SIGTERM, signalHandler);
 
   int ret = -1;
   if (ivshmemOpen(&state.shmDev))
@@ -0,0 +1,189 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "stats.h"
+
+#include "common/debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+struct Stats
+{
+  const char * name;
+  const char * unit;
+
+  double     * samples;
+  unsigned int count;
+  unsigned int size;
+  unsigned int windowStart;
+
+  // scratch space for sorting
+  double     * sorted;
+  unsigned int sortedSize;
+};
+
+Stats stats_new(const char * name, const char * unit)
+{
+  struct Stats * stats = calloc(1, sizeof(*stats));
+  if (!stats)
+  {
+    DEBUG_ERROR("out of memory");
+    return NULL;
+  }
+
+  stats->name = name;
+  stats->unit = unit;
+  return stats;
+}
+
+void stats_free(Stats * stats)
+{
+  if (!*stats)
+    return;
+
+  free((*stats)->samples);
+  free((*stats)->sorted);
+  free(*stats);
+  *stats = NULL;
+}
+
+void stats_add(Stats stats, double value)
+{
+  if (stats->count == stats->size)
+  {
+    const unsigned int size = stats->size ? stats->size * 2 : 4096;
+    double * samples = realloc(stats->samples, size * sizeof(*samples));
+    if (!samples)
+    {
+      DEBUG_ERROR("out of memory, sample dropped");
+      return;
+    }
+    stats->samples = samples;
+    stats->size    = size;
+  }
+
+  stats->samples[stats->count++] = value;
+}
+
+static int compareDouble(const void * a_, const void * b_)
+{
+  const double a = *(const double *)a_;
+  const double b = *(const double *)b_;
+  return (a > b) - (a < b);
+}
+
+static inline double percentile(const double * sorted, unsigned int count,
+    double pct)
+{
+  // nearest rank
+  unsigned int rank = (unsigned int)ceil(pct * count);
+  if (rank < 1)
+    rank = 1;
+  return sorted[rank - 1];
+}
+
+bool stats_calc(Stats stats, bool total, StatsResult * result)
+{
+  memset(result, 0, sizeof(*result));
+
+  const unsigned int start = total ? 0 : stats->windowStart;
+  const unsigned int count = stats->count - start;
+  if (!count)
+    return false;
+
+  if (stats->sortedSize < count)
+  {
+    double * sorted = realloc(stats->sorted, count * sizeof(*sorted));
+    if (!sorted)
+    {
+      DEBUG_ERROR("out of memory");
+      return false;
+    }
+    stats->sorted     = sorted;
+    stats->sortedSize = count;
+  }
+
+  memcpy(stats->sorted, stats->samples + start, count * sizeof(*stats->sorted));
+  qsort(stats->sorted, count, sizeof(*stats->sorted), compareDouble);
+
+  double sum = 0.0;
+  for(unsigned int i = 0; i < count; ++i)
+    sum += stats->sorted[i];
+
+  result->count = count;
+  result->min   = stats->sorted[0];
+  result->max   = stats->sorted[count - 1];
+  result->avg   = sum / count;
+  result->p50   = percentile(stats->sorted, count, 0.500);
+  result->p90   = percentile(stats->sorted, count, 0.900);
+  result->p99   = percentile(stats->sorted, count, 0.990);
+  result->p999  = percentile(stats->sorted, count, 0.999);
+  return true;
+}
+
+void stats_endWindow(Stats stats)
+{
+  stats->windowStart = stats->count;
+}
+
+void stats_printHeader(FILE * fp, StatsFormat format)
+{
+  if (format == STATS_FORMAT_CSV)
+    fprintf(fp, "time,window,metric,unit,count,min,avg,p50,p90,p99,p99.9,max\n");
+}
+
+void stats_print(FILE * fp, StatsFormat format, double time, bool total,
+    Stats stats)
+{
+  StatsResult r;
+  if (!stats_calc(stats, total, &r))
+    return;
+
+  const char * window = total ? "total" : "interval";
+  switch(format)
+  {
+    case STATS_FORMAT_TEXT:
+      fprintf(fp,
+          "%8.2f %-8s %-10s n:%-6u min:%9.3f avg:%9.3f p50:%9.3f p90:%9.3f "
+          "p99:%9.3f p99.9:%9.3f max:%9.3f %s\n",
+          time, window, stats->name, r.count, r.min, r.avg, r.p50, r.p90,
+          r.p99, r.p999, r.max, stats->unit);
+      break;
+
+    case STATS_FORMAT_CSV:
+      fprintf(fp, "%.3f,%s,%s,%s,%u,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f\n",
+          time, window, stats->name, stats->unit, r.count, r.min, r.avg,
+          r.p50, r.p90, r.p99, r.p999, r.max);
+      break;
+
+    case STATS_FORMAT_JSON:
+      fprintf(fp,
+          "{\"time\":%.3f,\"window\":\"%s\",\"metric\":\"%s\",\"unit\":\"%s\","
+          "\"count\":%u,\"min\":%.6f,\"avg\":%.6f,\"p50\":%.6f,\"p90\":%.6f,"
+          "\"p99\":%.6f,\"p99.9\":%.6f,\"max\":%.6f}\n",
+          time, window, stats->name, stats->unit, r.count, r.min, r.avg,
+          r.p50, r.p90, r.p99, r.p999, r.max);
+      break;
+  }
+
+  fflush(fp);
+}
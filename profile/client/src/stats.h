@@ -0,0 +1,58 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#ifndef _H_PROFILE_STATS_
+#define _H_PROFILE_STATS_
+
+#include <stdbool.h>
+#include <stdio.h>
+
+typedef struct Stats * Stats;
+
+typedef enum StatsFormat
+{
+  STATS_FORMAT_TEXT,
+  STATS_FORMAT_CSV,
+  STATS_FORMAT_JSON
+}
+StatsFormat;
+
+typedef struct StatsResult
+{
+  unsigned int count;
+  double min, max, avg;
+  double p50, p90, p99, p999;
+}
+StatsResult;
+
+Stats stats_new(const char * name, const char * unit);
+void  stats_free(Stats * stats);
+void  stats_add(Stats stats, double value);
+
+// calculate the results over the samples added since the last call to
+// stats_endWindow, or over all samples if total is set
+bool stats_calc(Stats stats, bool total, StatsResult * result);
+void stats_endWindow(Stats stats);
+
+void stats_printHeader(FILE * fp, StatsFormat format);
+void stats_print(FILE * fp, StatsFormat format, double time, bool total,
+    Stats stats);
+
+#endif
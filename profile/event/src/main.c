@@ -0,0 +1,288 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/event.h"
+#include "common/time.h"
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <strings.h>
+
+/* the pthread mutex + condvar event that LGEvent used before it moved to
+ * futexes, kept here as the baseline to compare against */
+struct CondEvent
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  atomic_bool     signaled;
+};
+
+static void * condCreate(unsigned int msSpinTime)
+{
+  struct CondEvent * e = calloc(1, sizeof(*e));
+  pthread_condattr_t cattr;
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&e->mutex, NULL);
+  pthread_cond_init(&e->cond, &cattr);
+  return e;
+}
+
+static void condFree(void * opaque)
+{
+  struct CondEvent * e = opaque;
+  pthread_cond_destroy (&e->cond );
+  pthread_mutex_destroy(&e->mutex);
+  free(e);
+}
+
+static bool condWait(void * opaque)
+{
+  struct CondEvent * e = opaque;
+  pthread_mutex_lock(&e->mutex);
+  while(!atomic_load_explicit(&e->signaled, memory_order_acquire))
+    pthread_cond_wait(&e->cond, &e->mutex);
+  pthread_mutex_unlock(&e->mutex);
+  atomic_store_explicit(&e->signaled, false, memory_order_release);
+  return true;
+}
+
+static bool condSignal(void * opaque)
+{
+  struct CondEvent * e = opaque;
+  pthread_mutex_lock(&e->mutex);
+  if (!atomic_exchange_explicit(&e->signaled, true, memory_order_release))
+    pthread_cond_broadcast(&e->cond);
+  pthread_mutex_unlock(&e->mutex);
+  return true;
+}
+
+static bool condReset(void * opaque)
+{
+  struct CondEvent * e = opaque;
+  return atomic_exchange_explicit(&e->signaled, false, memory_order_release);
+}
+
+static void * lgCreate(unsigned int msSpinTime)
+{
+  return lgCreateEvent(true, msSpinTime);
+}
+
+static void lgFree(void * opaque)
+{
+  lgFreeEvent(opaque);
+}
+
+static bool lgWait(void * opaque)
+{
+  return lgWaitEvent(opaque, TIMEOUT_INFINITE);
+}
+
+static bool lgSignal(void * opaque)
+{
+  return lgSignalEvent(opaque);
+}
+
+static bool lgReset(void * opaque)
+{
+  return lgResetEvent(opaque);
+}
+
+struct EventOps
+{
+  const char * name;
+  bool         spin;
+  void * (*create)(unsigned int msSpinTime);
+  void   (*free  )(void * opaque);
+  bool   (*wait  )(void * opaque);
+  bool   (*signal)(void * opaque);
+  bool   (*reset )(void * opaque);
+};
+
+static const struct EventOps eventOps[] =
+{
+  { "condvar", false, condCreate, condFree, condWait, condSignal, condReset },
+  { "futex"  , false, lgCreate  , lgFree  , lgWait  , lgSignal  , lgReset   },
+  { "spin"   , true , lgCreate  , lgFree  , lgWait  , lgSignal  , lgReset   }
+};
+
+struct PingPong
+{
+  const struct EventOps * ops;
+  void                  * ping, * pong;
+  unsigned int            iterations;
+  atomic_uint_least64_t   sent;
+  Stats                   wake;
+};
+
+static void * pongThread(void * opaque)
+{
+  struct PingPong * pp = opaque;
+  for(unsigned int i = 0; i < pp->iterations; ++i)
+  {
+    pp->ops->wait(pp->ping);
+    const uint64_t now = nanotime();
+    stats_add(pp->wake,
+        (now - atomic_load_explicit(&pp->sent, memory_order_acquire)) * 1e-3);
+    pp->ops->signal(pp->pong);
+  }
+  return NULL;
+}
+
+static bool optFormatValidate(struct Option * opt, const char ** error)
+{
+  const char * fmt = opt->value.x_string;
+  if (!strcasecmp(fmt, "text") ||
+      !strcasecmp(fmt, "csv" ) ||
+      !strcasecmp(fmt, "json"))
+    return true;
+
+  *error = "Must be one of text, csv or json";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "iterations",
+    .description    = "The number of signal/wake round trips to time",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 20000
+  },
+  {
+    .module         = "app",
+    .name           = "gap",
+    .description    = "Microseconds to sleep between round trips, like a frame interval",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 100
+  },
+  {
+    .module         = "app",
+    .name           = "spinTime",
+    .description    = "The spin time in ms to use for the spinning LGEvent",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 1
+  },
+  {
+    .module         = "app",
+    .name           = "format",
+    .description    = "The output format (text, csv or json)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "text",
+    .validator      = optFormatValidate
+  },
+  {0}
+};
+
+static bool run(const struct EventOps * ops, StatsFormat format)
+{
+  const unsigned int iterations = option_get_int("app", "iterations");
+  const unsigned int gap        = option_get_int("app", "gap"       );
+  const unsigned int spinTime   = ops->spin ? option_get_int("app", "spinTime") : 0;
+
+  char wakeName[32], signalName[32];
+  snprintf(wakeName  , sizeof(wakeName  ), "%s.wake"  , ops->name);
+  snprintf(signalName, sizeof(signalName), "%s.signal", ops->name);
+
+  struct PingPong pp =
+  {
+    .ops        = ops,
+    .ping       = ops->create(spinTime),
+    .pong       = ops->create(spinTime),
+    .iterations = iterations,
+    .wake       = stats_new(wakeName, "us")
+  };
+  Stats signal = stats_new(signalName, "ns");
+
+  // the cost of signalling when nobody is waiting
+  for(unsigned int i = 0; i < iterations; ++i)
+  {
+    const uint64_t start = nanotime();
+    ops->signal(pp.ping);
+    stats_add(signal, nanotime() - start);
+    ops->reset(pp.ping);
+  }
+
+  // the latency from signal to the waiter running
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, pongThread, &pp) != 0)
+  {
+    DEBUG_ERROR("Failed to create the thread");
+    return false;
+  }
+
+  for(unsigned int i = 0; i < iterations; ++i)
+  {
+    if (gap)
+      usleep(gap);
+
+    atomic_store_explicit(&pp.sent, nanotime(), memory_order_release);
+    ops->signal(pp.ping);
+    ops->wait(pp.pong);
+  }
+  pthread_join(thread, NULL);
+
+  stats_print(stdout, format, 0.0, true, signal );
+  stats_print(stdout, format, 0.0, true, pp.wake);
+
+  stats_free(&signal );
+  stats_free(&pp.wake);
+  ops->free(pp.ping);
+  ops->free(pp.pong);
+  return true;
+}
+
+int main(int argc, char * argv[])
+{
+  option_register(options);
+  if (!option_parse(argc, argv) || !option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  const char * fmt = option_get_string("app", "format");
+  StatsFormat format = STATS_FORMAT_TEXT;
+  if (!strcasecmp(fmt, "csv"))
+    format = STATS_FORMAT_CSV;
+  else if (!strcasecmp(fmt, "json"))
+    format = STATS_FORMAT_JSON;
+
+  stats_printHeader(stdout, format);
+
+  int ret = 0;
+  for(int i = 0; i < sizeof(eventOps) / sizeof(*eventOps); ++i)
+    if (!run(&eventOps[i], format))
+    {
+      ret = -1;
+      break;
+    }
+
+  option_free();
+  return ret;
+}
@@ -0,0 +1,210 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/framebuffer.h"
+#include "common/hdr.h"
+#include "common/time.h"
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+static bool optFormatValidate(struct Option * opt, const char ** error)
+{
+  const char * fmt = opt->value.x_string;
+  if (!strcasecmp(fmt, "text") ||
+      !strcasecmp(fmt, "csv" ) ||
+      !strcasecmp(fmt, "json"))
+    return true;
+
+  *error = "Must be one of text, csv or json";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "width",
+    .description    = "The frame width",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 3840
+  },
+  {
+    .module         = "app",
+    .name           = "height",
+    .description    = "The frame height",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 2160
+  },
+  {
+    .module         = "app",
+    .name           = "frames",
+    .description    = "The number of frames to time each method over",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 100
+  },
+  {
+    .module         = "app",
+    .name           = "format",
+    .description    = "The output format (text, csv or json)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "text",
+    .validator      = optFormatValidate
+  },
+  {0}
+};
+
+static uint16_t floatToHalf(float f)
+{
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof(bits));
+  if (f < 6.103515625e-05f)
+    return (uint16_t)lrintf(f * 16777216.0f);
+  return ((bits + 0xFFF + ((bits >> 13) & 1)) >> 13) - (112 << 10);
+}
+
+/* an HDR desktop: SDR windows at up to 1.0 (80 nits) over a gradient that
+ * runs up to 1000 nits, with some wide gamut colour */
+static void genFrame(uint16_t * dst, int width, int height)
+{
+  for(int y = 0; y < height; ++y)
+    for(int x = 0; x < width; ++x, dst += 4)
+    {
+      float r, g, b;
+      if ((x / 512 + y / 512) & 1)
+      {
+        r = (float)x / width;
+        g = (float)y / height;
+        b = 0.5f;
+      }
+      else
+      {
+        r = 12.5f * x / width;
+        g = 12.5f * y / height;
+        b = fmaxf(12.5f - r - g, 0.0f);
+      }
+
+      dst[0] = floatToHalf(r);
+      dst[1] = floatToHalf(g);
+      dst[2] = floatToHalf(b);
+      dst[3] = floatToHalf(1.0f);
+    }
+}
+
+enum Method
+{
+  METHOD_COPY,
+  METHOD_SCALAR,
+  METHOD_AVX2,
+  METHOD_MAX
+};
+
+int main(int argc, char * argv[])
+{
+  debug_init();
+  option_register(options);
+  if (!option_parse(argc, argv) || !option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  const char * fmt = option_get_string("app", "format");
+  StatsFormat format =
+    !strcasecmp(fmt, "csv" ) ? STATS_FORMAT_CSV  :
+    !strcasecmp(fmt, "json") ? STATS_FORMAT_JSON :
+    STATS_FORMAT_TEXT;
+
+  const int width  = option_get_int("app", "width" );
+  const int height = option_get_int("app", "height");
+  const int frames = option_get_int("app", "frames");
+
+  const size_t srcPitch = (size_t)width * 8;
+  const size_t dstPitch = (size_t)width * 4;
+
+  int           ret = -1;
+  uint16_t    * src = malloc(srcPitch * height);
+  FrameBuffer * fb  = malloc(FrameBufferStructSize + srcPitch * height);
+  Stats stats[METHOD_MAX] =
+  {
+    [METHOD_COPY  ] = stats_new("copy"          , "ms"),
+    [METHOD_SCALAR] = stats_new("convert.scalar", "ms"),
+    [METHOD_AVX2  ] = stats_new("convert.avx2"  , "ms")
+  };
+
+  if (!src || !fb)
+  {
+    DEBUG_ERROR("out of memory");
+    goto out;
+  }
+
+  for(int i = 0; i < METHOD_MAX; ++i)
+    if (!stats[i])
+      goto out;
+
+  genFrame(src, width, height);
+
+  /* copy is what the host does without conversion, the conversions write half
+   * as much into the frame buffer and so half as much for the client to read */
+  for(int m = 0; m < METHOD_MAX; ++m)
+  {
+    if (m == METHOD_SCALAR && strcmp(hdr_init("scalar"), "scalar") != 0)
+      continue;
+    if (m == METHOD_AVX2 && strcmp(hdr_init("avx2"), "avx2") != 0)
+      continue;
+
+    for(int i = 0; i < frames; ++i)
+    {
+      framebuffer_prepare(fb);
+      const uint64_t t = nanotime();
+      if (m == METHOD_COPY)
+        framebuffer_write(fb, src, srcPitch * height);
+      else
+      {
+        uint8_t * dst = framebuffer_get_data(fb);
+        for(int y = 0; y < height; ++y)
+          hdr_convertPQ((uint32_t *)(dst + y * dstPitch),
+              src + y * width * 4, width);
+        framebuffer_set_write_ptr(fb, dstPitch * height);
+      }
+      stats_add(stats[m], (nanotime() - t) * 1e-6);
+    }
+  }
+
+  stats_printHeader(stdout, format);
+  for(int i = 0; i < METHOD_MAX; ++i)
+    stats_print(stdout, format, 0.0, true, stats[i]);
+
+  ret = 0;
+
+out:
+  for(int i = 0; i < METHOD_MAX; ++i)
+    stats_free(&stats[i]);
+  free(fb);
+  free(src);
+  option_free();
+  return ret;
+}
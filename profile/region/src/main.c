@@ -0,0 +1,405 @@
+/**
+ * Looking Glass
+ * Copyright © 2017-2022 The Looking Glass Authors
+ * https://looking-glass.io
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include "common/debug.h"
+#include "common/option.h"
+#include "common/region.h"
+#include "common/rects.h"
+#include "common/framebuffer.h"
+#include "common/KVMFR.h"
+#include "common/time.h"
+#include "common/util.h"
+
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+struct Frame
+{
+  int             width, height;
+  int             count;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+};
+
+/* the pairwise bounding box merge rectsMergeOverlapping used before it moved
+ * to the region engine, kept here as the baseline to compare against */
+static bool legacyIntersects(const FrameDamageRect * r1,
+    const FrameDamageRect * r2)
+{
+  return !(
+    r1->x > r2->x + r2->width  ||
+    r2->x > r1->x + r1->width  ||
+    r1->y > r2->y + r2->height ||
+    r2->y > r1->y + r1->height);
+}
+
+static int legacyMerge(FrameDamageRect * rects, int count)
+{
+  if (count == 0)
+    return 0;
+
+  bool removed[count];
+  bool changed;
+
+  memset(removed, 0, sizeof(removed));
+
+  do
+  {
+    changed = false;
+    for (int i = 0; i < count; ++i)
+    {
+      if (removed[i])
+        continue;
+
+      for (int j = i + 1; j < count; ++j)
+      {
+        if (removed[j] || !legacyIntersects(rects + i, rects + j))
+          continue;
+
+        const uint32_t x2 = max(rects[i].x + rects[i].width,
+            rects[j].x + rects[j].width);
+        const uint32_t y2 = max(rects[i].y + rects[i].height,
+            rects[j].y + rects[j].height);
+
+        rects[i].x      = min(rects[i].x, rects[j].x);
+        rects[i].y      = min(rects[i].y, rects[j].y);
+        rects[i].width  = x2 - rects[i].x;
+        rects[i].height = y2 - rects[i].y;
+
+        removed[j] = true;
+        changed    = true;
+      }
+    }
+  }
+  while (changed);
+
+  int o = 0;
+  for (int i = 0; i < count; ++i)
+    if (!removed[i])
+      rects[o++] = rects[i];
+
+  return o;
+}
+
+static bool readFrame(FILE * fp, struct Frame * frame)
+{
+  unsigned int width, height, count;
+  if (fscanf(fp, "%u %u %u", &width, &height, &count) != 3)
+    return false;
+
+  if (count > KVMFR_MAX_DAMAGE_RECTS)
+  {
+    DEBUG_ERROR("Invalid damage rect count: %u", count);
+    return false;
+  }
+
+  frame->width  = width;
+  frame->height = height;
+  frame->count  = count;
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    FrameDamageRect * rect = frame->rects + i;
+    if (fscanf(fp, "%u %u %u %u",
+          &rect->x, &rect->y, &rect->width, &rect->height) != 4)
+      return false;
+  }
+  return true;
+}
+
+static int randRange(int lo, int hi)
+{
+  return lo + rand() % (hi - lo + 1);
+}
+
+/* synthetic 4K frames for when there is no trace: text being typed, scattered
+ * small updates such as a clock and a cursor, and overlapping windows */
+static void genFrame(int index, struct Frame * frame)
+{
+  frame->width  = 3840;
+  frame->height = 2160;
+  frame->count  = 0;
+
+  switch(index % 3)
+  {
+    case 0:
+    {
+      const int y = randRange(0, 119) * 18;
+      int       x = randRange(0, 3600);
+      for(int i = randRange(1, 12); i > 0 && x < 3820; --i, x += 9)
+        frame->rects[frame->count++] = (FrameDamageRect)
+          { .x = x, .y = y, .width = 9, .height = 18 };
+      break;
+    }
+
+    case 1:
+      for(int i = randRange(2, 24); i > 0; --i)
+      {
+        const int w = randRange(8, 64);
+        const int h = randRange(8, 64);
+        frame->rects[frame->count++] = (FrameDamageRect)
+        {
+          .x      = randRange(0, frame->width  - w),
+          .y      = randRange(0, frame->height - h),
+          .width  = w,
+          .height = h
+        };
+      }
+      break;
+
+    case 2:
+      for(int i = randRange(1, 6); i > 0; --i)
+      {
+        const int w = randRange(400, 2400);
+        const int h = randRange(300, 1600);
+        frame->rects[frame->count++] = (FrameDamageRect)
+        {
+          .x      = randRange(0, frame->width  - w),
+          .y      = randRange(0, frame->height - h),
+          .width  = w,
+          .height = h
+        };
+      }
+      break;
+  }
+}
+
+static double rectsArea(const FrameDamageRect * rects, int count)
+{
+  double area = 0.0;
+  for(int i = 0; i < count; ++i)
+    area += (double)rects[i].width * rects[i].height;
+  return area;
+}
+
+static bool optFormatValidate(struct Option * opt, const char ** error)
+{
+  const char * fmt = opt->value.x_string;
+  if (!strcasecmp(fmt, "text") ||
+      !strcasecmp(fmt, "csv" ) ||
+      !strcasecmp(fmt, "json"))
+    return true;
+
+  *error = "Must be one of text, csv or json";
+  return false;
+}
+
+static struct Option options[] =
+{
+  {
+    .module         = "app",
+    .name           = "trace",
+    .description    = "A damage trace recorded with profiler-client app:damageTrace (default synthetic)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = NULL
+  },
+  {
+    .module         = "app",
+    .name           = "frames",
+    .description    = "The number of synthetic frames to generate when there is no trace",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 30000
+  },
+  {
+    .module         = "app",
+    .name           = "copyThreads",
+    .description    = "The number of threads to time the parallel damage copy with",
+    .type           = OPTION_TYPE_INT,
+    .value.x_int    = 4
+  },
+  {
+    .module         = "app",
+    .name           = "format",
+    .description    = "The output format (text, csv or json)",
+    .type           = OPTION_TYPE_STRING,
+    .value.x_string = "text",
+    .validator      = optFormatValidate
+  },
+  {0}
+};
+
+enum Metric
+{
+  METRIC_EXACT,
+  METRIC_LEGACY_TIME,
+  METRIC_LEGACY_RECTS,
+  METRIC_LEGACY_AREA,
+  METRIC_REGION_TIME,
+  METRIC_REGION_RECTS,
+  METRIC_REGION_AREA,
+  METRIC_COPY_SINGLE,
+  METRIC_COPY_PARALLEL,
+  METRIC_MAX
+};
+
+int main(int argc, char * argv[])
+{
+  debug_init();
+  option_register(options);
+  if (!option_parse(argc, argv) || !option_validate())
+  {
+    option_free();
+    return -1;
+  }
+
+  const char * fmt = option_get_string("app", "format");
+  StatsFormat format =
+    !strcasecmp(fmt, "csv" ) ? STATS_FORMAT_CSV  :
+    !strcasecmp(fmt, "json") ? STATS_FORMAT_JSON :
+    STATS_FORMAT_TEXT;
+
+  FILE * trace = NULL;
+  const char * tracePath = option_get_string("app", "trace");
+  if (tracePath && !(trace = fopen(tracePath, "r")))
+  {
+    DEBUG_ERROR("Failed to open %s for reading", tracePath);
+    option_free();
+    return -1;
+  }
+  const int frames = option_get_int("app", "frames");
+
+  int      ret    = -1;
+  LGRegion region = region_new();
+  Stats    stats[METRIC_MAX] =
+  {
+    [METRIC_EXACT       ] = stats_new("exact"       , "kpx"),
+    [METRIC_LEGACY_TIME ] = stats_new("legacy.time" , "us" ),
+    [METRIC_LEGACY_RECTS] = stats_new("legacy.rects", ""   ),
+    [METRIC_LEGACY_AREA ] = stats_new("legacy.area" , "kpx"),
+    [METRIC_REGION_TIME ] = stats_new("region.time" , "us" ),
+    [METRIC_REGION_RECTS] = stats_new("region.rects", ""   ),
+    [METRIC_REGION_AREA ] = stats_new("region.area" , "kpx"),
+    [METRIC_COPY_SINGLE  ] = stats_new("copy.single"  , "ms"),
+    [METRIC_COPY_PARALLEL] = stats_new("copy.parallel", "ms")
+  };
+
+  const int copyThreads = option_get_int("app", "copyThreads");
+  FrameBuffer * fb        = NULL;
+  uint8_t     * dst       = NULL;
+  size_t        frameSize = 0;
+
+  if (!region)
+    goto out;
+
+  for(int i = 0; i < METRIC_MAX; ++i)
+    if (!stats[i])
+      goto out;
+
+  struct Frame    frame;
+  FrameDamageRect rects[KVMFR_MAX_DAMAGE_RECTS];
+
+  // the second pass replays the same frames with the copy threads running
+  for(int pass = 0; pass < 2; ++pass)
+  {
+    if (pass == 1 && !rectsStartCopyThreads(copyThreads))
+      goto out;
+
+    srand(1);
+    if (trace)
+      rewind(trace);
+
+    for(int i = 0; trace || i < frames; ++i)
+    {
+      if (trace)
+      {
+        if (!readFrame(trace, &frame))
+          break;
+      }
+      else
+        genFrame(i, &frame);
+
+      // full frame damage has nothing to merge
+      if (frame.count == 0)
+        continue;
+
+      uint64_t t;
+      int      count;
+      if (pass == 0)
+      {
+        memcpy(rects, frame.rects, frame.count * sizeof(*rects));
+        t     = nanotime();
+        count = legacyMerge(rects, frame.count);
+        stats_add(stats[METRIC_LEGACY_TIME ], (nanotime() - t) * 1e-3);
+        stats_add(stats[METRIC_LEGACY_RECTS], count);
+        stats_add(stats[METRIC_LEGACY_AREA ], rectsArea(rects, count) * 1e-3);
+      }
+
+      t = nanotime();
+      region_clear(region);
+      region_addRects(region, frame.rects, frame.count);
+      count = region_toRects(region, rects, frame.count, &REGION_COST_COPY(4));
+
+      if (pass == 0)
+      {
+        stats_add(stats[METRIC_REGION_TIME ], (nanotime() - t) * 1e-3);
+        stats_add(stats[METRIC_REGION_RECTS], count);
+        stats_add(stats[METRIC_REGION_AREA ], rectsArea(rects, count) * 1e-3);
+        stats_add(stats[METRIC_EXACT       ], region_getArea(region) * 1e-3);
+      }
+
+      const size_t pitch = frame.width * 4;
+      const size_t size  = pitch * frame.height;
+      if (size > frameSize)
+      {
+        free(fb);
+        free(dst);
+        fb  = malloc(FrameBufferStructSize + size);
+        dst = malloc(size);
+        if (!fb || !dst)
+        {
+          DEBUG_ERROR("out of memory");
+          goto out;
+        }
+        frameSize = size;
+        framebuffer_prepare(fb);
+        memset(framebuffer_get_data(fb), 0x55, size);
+        memset(dst, 0, size);
+        framebuffer_set_write_ptr(fb, size);
+      }
+
+      /* copy the merged damage as the client receives it, the frame is complete
+       * so this only measures the copy itself */
+      t = nanotime();
+      rectsFramebufferToBuffer(rects, count, dst, pitch, frame.height, fb,
+          pitch);
+      stats_add(stats[pass ? METRIC_COPY_PARALLEL : METRIC_COPY_SINGLE],
+          (nanotime() - t) * 1e-6);
+    }
+  }
+
+  stats_printHeader(stdout, format);
+  for(int i = 0; i < METRIC_MAX; ++i)
+    stats_print(stdout, format, 0.0, true, stats[i]);
+
+  ret = 0;
+
+out:
+  rectsStopCopyThreads();
+  free(fb);
+  free(dst);
+  for(int i = 0; i < METRIC_MAX; ++i)
+    stats_free(&stats[i]);
+  region_free(&region);
+  if (trace)
+    fclose(trace);
+  option_free();
+  return ret;
+}